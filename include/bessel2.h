@@ -8,6 +8,33 @@
 #include "perturbations2.h"
 
 
+/**
+ * Number of r-values processed together in bessel2_convolution_matrix().
+ *
+ * The block of the output row (_BESSEL2_R_BLOCK_ doubles) should fit comfortably
+ * in the L1 cache.
+ */
+#define _BESSEL2_R_BLOCK_ 256
+
+
+/**
+ * The x-grid pbs2->xx is divided in blocks of 2^_BESSEL2_X_BLOCK_SHIFT_ points.
+ *
+ * Within each block, the j_l1(x) and J_Llm(x) tables are sampled with a stride
+ * 2^shift, with 0 <= shift <= _BESSEL2_X_BLOCK_SHIFT_, chosen according to the
+ * local interpolation error; see bessel2_x_sampling().
+ */
+#define _BESSEL2_X_BLOCK_SHIFT_ 5
+
+
+/**
+ * Number of multipoles below ppr2->l_flat_sky_song where the projection functions
+ * are computed both exactly and in the flat-sky limit, to estimate the accuracy
+ * of the latter.
+ */
+#define _BESSEL2_FLAT_SKY_OVERLAP_ 4
+
+
 /** What projection function to compute in the second-order Bessel module? */
 enum projection_function_types {
   J_TT, /**< Label for the temperature projection function at second order */
@@ -54,6 +81,26 @@ struct bessels2 {
   double xx_step;                /**< Linear step dx for sampling the J_Llm Bessel functions */
   int xx_size;                   /**< Size of xx. This is determined by pbs2->xx_max and pbs2->xx_step. */
   double xx_max;                 /**< Maximum value of xx (always multiple of xx-step).  Determined in input.c */
+  double xx_step_inverse;        /**< Inverse of pbs2->xx_step */
+
+  /* Adaptive sampling in x. The j_l1(x) and J_Llm(x) functions are computed on the uniform grid
+  pbs2->xx, and then only a subset of its points is retained, with a stride that is constant
+  within each block of 2^_BESSEL2_X_BLOCK_SHIFT_ points and that is as large as allowed by the
+  tolerance pbs2->x_tol. The position inside the table of the point preceding x is found as
+
+      index_block = index_x >> _BESSEL2_X_BLOCK_SHIFT_
+      index_node = x_offset[index_block] + (index_x >> x_shift[index_block])
+
+  where index_x is the position of x in pbs2->xx, that is (int)(x/xx_step); the next point in
+  the table is index_node+1 and the distance between the two is xx_step*2^x_shift[index_block]. */
+  double x_tol;                  /**< Maximum interpolation error allowed when skipping points, relative to the
+                                 maximum of the sampled function; if zero, all points in pbs2->xx are kept */
+  int x_block_size;              /**< Number of blocks in pbs2->xx, each with 2^_BESSEL2_X_BLOCK_SHIFT_ points */
+  double x_stride_inverse[_BESSEL2_X_BLOCK_SHIFT_+1]; /**< x_stride_inverse[shift] = 1/2^shift */
+  double x_spline_factor[_BESSEL2_X_BLOCK_SHIFT_+1];  /**< x_spline_factor[shift] = (2^shift*xx_step)^2/6, needed for
+                                                      cubic interpolation */
+  long int count_x_uniform;      /**< Number of points the Bessel tables would have with uniform sampling */
+  long int count_x_adaptive;     /**< Number of points actually stored in the Bessel tables */
 
   /* Arrays and variables related to the projection functions */
   int index_J_TT;           /**< do we need the temperature projection functions? */
@@ -68,8 +115,9 @@ struct bessels2 {
 
   int **** x_size_J;        /**< x_size_J[index_J][index_L][index_l][index_m] is the number of x values we
                             sample J_Llm(x) in; it corresponds to the number of points in pbs2->xx where J(x)
-                            is non-negligible. If for a given (L,l,m) configuration there are no such points,
-                            then x_size_J is equal to 1 for that configuration. */
+                            is non-negligible, minus those skipped by the adaptive sampling. If for a given
+                            (L,l,m) configuration there are no such points, then x_size_J is equal to 1 for
+                            that configuration. */
 
   double **** x_min_J;      /**< x_min_J[index_J][index_L][index_l][index_m] is the first point in pbs2->xx
                             where J(x) is non-negliglible. If for a given (L,l,m) configuration,
@@ -78,31 +126,58 @@ struct bessels2 {
 
   int x_size_max_J;         /**< maximum value of x_size_J[index_J][index_L][index_l][index_m] over L,l,m */
 
-  double ***** J_Llm_x;     /**< J_Llm_x[index_J][index_L][index_l][index_m][index_x - index_xmin_J] is the
+  double ***** J_Llm_x;     /**< J_Llm_x[index_J][index_L][index_l][index_m][index_node] is the
                             projection function J_Llm(x). It is sampled only for those values of pbs2->xx
-                            where J(x) is larger than pbs2->J_Llm_cut. The last level is addressed as 
-                            index_x - index_xmin_J, where index_x is the index of x inside pbs2->xx, and
-                            index_xmin_J is the index of the first point in pbs2->xx where J(x) is non-negligible
-                            (index_xmin_J = pbs2->index_xmin_J[index_J][index_L][index_l][index_m]). If the
-                            value of index_x-index_xmin_J is negative or zero for a given (L,l,m) configuration,
-                            then J(x) is negligible for all x in pbs2->xx, and pbs2->J_Llm_x will only have one
-                            value, which will be zero. */
+                            where J(x) is larger than pbs2->J_Llm_cut, and only in the subset of those
+                            points retained by the adaptive sampling. The last level should be addressed
+                            using pbs2->x_offset_J and pbs2->x_shift_J, as explained above; if the adaptive
+                            sampling is turned off, index_node = index_x - index_xmin_J, where index_x is
+                            the index of x inside pbs2->xx and index_xmin_J is the index of the first point in
+                            pbs2->xx where J(x) is non-negligible. If J(x) is negligible for all x in pbs2->xx,
+                            then pbs2->J_Llm_x will only have one value, which will be zero. */
     
   double ***** ddJ_Llm_x;   /**< Same indexing as J_Llm_x, used for spline interpolation */
 
+  int ***** x_offset_J;     /**< x_offset_J[index_J][index_L][index_l][index_m][index_block] is used to address
+                            the x-level of J_Llm_x, see above */
+  short ***** x_shift_J;    /**< x_shift_J[index_J][index_L][index_l][index_m][index_block] is the log2 of the
+                            stride with which J_Llm(x) is sampled in the considered block of pbs2->xx */
+
+  short has_J_moments;      /**< should we compute J_int_0 and J_int_1, needed by the Filon quadrature of the line of sight integral? */
+
+  double ***** J_int_0;     /**< J_int_0[index_J][index_L][index_l][index_m][index_node] is the integral of J_Llm(x) from
+                            x_min_J to the node; same indexing as J_Llm_x. Computed only if has_J_moments is true. */
+  double ***** J_int_1;     /**< Same as J_int_0, but for the integral of x*J_Llm(x) */
+
   short * has_allocated_J;  /**< was the memory for the index_J projection functions allocated? */
+
+  /* Flat-sky limit. For l >> L, the spherical Bessel functions j_l1(x) summed in J_Llm(x)
+  have |l1-l| <= L and can be approximated by j_l(x) near their peak, x ~ l, which dominates
+  the line of sight integral. In this limit, J_Llm(x) ~ C_Llm j_l(x), where the coefficient
+  C_Llm is the sum over l1 of the 3j-symbols in J_Llm(x). */
+  int l_size_J;             /**< The tables of J_Llm(x) are computed only for pbs->l[index_l] with index_l < l_size_J;
+                            for larger l, the flat-sky limit is used. Equal to pbs->l_size if the limit is turned off. */
+  int index_l_flat_sky_min; /**< J_flat_sky is computed for index_l >= index_l_flat_sky_min; the multipoles between
+                            index_l_flat_sky_min and l_size_J are computed both ways to check the accuracy of the limit */
+  double **** J_flat_sky;   /**< J_flat_sky[index_J][index_L][index_l][index_m] is the coefficient C_Llm such that
+                            J_Llm(x) ~ C_Llm j_l(x) in the flat-sky limit; NULL if the limit is turned off */
                                                                   
   /* Sampling of j_l1 */
   int * l1;                      /**< A multipole list that includes all points in pbs->l, plus more needed in the computation of J_Llm(x) */
   int * index_l1;                /**< pbs2->index_l1[l1] is the index of 'l' inside pbs2->l1. If 'l1' is not contained in pbs2->l1, then pbs2->index_l1[l1]=-1 */
   int l1_size;                   
-  double ** j_l1;                /**< Spherical Bessel function j_l(x), indexed as pbs->j_l1[index_l1][index_x].  
+  double ** j_l1;                /**< Spherical Bessel function j_l(x), indexed as pbs->j_l1[index_l1][index_node].  
                                  The l1 level of pbs->j_l1 should be addressed the same way as pbs->l1[index_l1], while
-                                 the x level should be addressed as 'index_x - pbs->index_xmin_l1[index_l1]', where index_x
+                                 the x level should be addressed using pbs2->x_offset_l1 and pbs2->x_shift_l1, as
+                                 explained above. Until the adaptive sampling is applied in bessel2_init(), and whenever
+                                 it is turned off, index_node = index_x - pbs->index_xmin_l1[index_l1], where index_x
                                  is the index of pbs->xx. */
   double ** ddj_l1;              /**< Same indexing as j_l1, used for spline interpolation */
   int * index_xmin_l1;           /**< index_xmin_l1[index_l1] is the index of pbs->xx where j_l1(x) starts to be non-negligible */
   int * x_size_l1;               /**< x_size_l1[index_l1] is the number of x values we sample j_l1(x) in */
+  int ** x_offset_l1;            /**< x_offset_l1[index_l1][index_block] is used to address the x-level of j_l1 */
+  short ** x_shift_l1;           /**< x_shift_l1[index_l1][index_block] is the log2 of the stride with which j_l1(x)
+                                 is sampled in the considered block of pbs2->xx */
   double * x_min_l1;             /**< x_min_l1[index_l1] is the first x where you have a non-negliglible value for j_l1(x) */
 
   /* Technical parameters */
@@ -201,6 +276,16 @@ extern "C" {
        int index_m
        );
 
+  int bessel2_J_flat_sky(
+       struct precision2 * ppr2,
+       struct bessels * pbs,
+       struct bessels2 * pbs2,
+       int index_J,
+       int index_L,
+       int index_l,
+       int index_m
+       );
+
   int bessel2_J_Llm(
          struct precision2 * ppr2,
          struct bessels * pbs,
@@ -244,6 +329,31 @@ extern "C" {
       struct bessels2 * pbs2
       );
 
+  int bessel2_x_sampling(
+      struct precision * ppr,
+      struct bessels2 * pbs2,
+      int index_x_min,
+      int * x_size,
+      double ** f,
+      double ** ddf,
+      int ** x_offset,
+      short ** x_shift,
+      int spline_method,
+      ErrorMsg error_message
+      );
+
+  int bessel2_x_sampling_j_l1(
+      struct precision * ppr,
+      struct bessels2 * pbs2
+      );
+
+  int bessel2_J_moments(
+      struct precision * ppr,
+      struct precision2 * ppr2,
+      struct bessels * pbs,
+      struct bessels2 * pbs2
+      );
+
     
   int bessel2_convolution(
       struct precision * ppr,
@@ -258,6 +368,45 @@ extern "C" {
       double * integral,
       ErrorMsg error_message
       );
+
+  int bessel2_convolution_multi_r(
+      struct precision * ppr,
+      struct bessels2 * pbs2,
+      double * kk,
+      double * delta_kk,
+      int k_size,
+      double * f,
+      double * g,
+      int index_l,
+      double * rr,
+      int r_size,
+      double * integral,
+      ErrorMsg error_message
+      );
+
+  int bessel2_j_matrix(
+      struct precision * ppr,
+      struct bessels2 * pbs2,
+      double * kk,
+      int k_size,
+      int index_l,
+      double * rr,
+      int r_size,
+      double * j_matrix,
+      ErrorMsg error_message
+      );
+
+  int bessel2_convolution_matrix(
+      double * kk,
+      double * delta_kk,
+      int k_size,
+      double * f,
+      int f_size,
+      double * j_matrix,
+      int r_size,
+      double * integral,
+      ErrorMsg error_message
+      );
     
 #ifdef __cplusplus
 }
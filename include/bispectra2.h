@@ -9,6 +9,17 @@
 #include "transfer2.h"
 
 
+/**
+ * Status of an (l1,l2,l3) configuration of the unsymmetrised intrinsic bispectrum when the
+ * l-sampling is adaptive (see bispectra2_intrinsic_sampling_init())
+ */
+enum intrinsic_sampling {
+  skipped_configuration,    /**< Not computed, to be interpolated */
+  pending_configuration,    /**< To be computed in the current pass of the integration */
+  computed_configuration    /**< Computed in a previous pass */
+};
+
+
 /**
  * Workspace that contains the intermediate results for the integration of an intrinsic
  * bispectrum.
@@ -22,6 +33,23 @@ struct bispectra_workspace_intrinsic {
   int Y;
   int Z;
 
+  /* Blocks of the symmetrised bispectrum read from disk by bispectra2_intrinsic_load_blocks(),
+  and blocks of the unsymmetrised one that need to be integrated to obtain the others; both are
+  indexed as [X][Y][Z]. Without ppr2->intrinsic_incremental, all blocks are integrated. */
+  short loaded_bispectrum[_MAX_NUM_FIELDS_][_MAX_NUM_FIELDS_][_MAX_NUM_FIELDS_];
+  short compute_unsymmetrised[_MAX_NUM_FIELDS_][_MAX_NUM_FIELDS_][_MAX_NUM_FIELDS_];
+
+  /* First and last (Y,Z) pair integrated for the current X, used to allocate and free the
+  intermediate integrals only once per l3 block */
+  int first_Y;
+  int first_Z;
+  int last_Y;
+  int last_Z;
+
+  /* Coefficient of the quadratic bispectrum added to the intrinsic one (see
+  bispectra2_quadratic_correction()) */
+  double quadratic_correction;
+
   /* Array that relates the bispectrum field indices (T,E,B) to the index of the second order
   transfer functions */
   int index_tt2_of_bf[_MAX_NUM_FIELDS_];
@@ -61,9 +89,32 @@ struct bispectra_workspace_intrinsic {
     The array is indexed as pbi->integral_over_k3[index_l3][index_r][index_k1][index_k2]  */
   double **** integral_over_k3;
                            
-  /* Integration grid in k3 for a given k1 and k3, one for each thread: k3_grid[thread][index_k3] */
+  /* Integration grid in k3 for a given k1 and k3, one for each thread: k3_grid[thread][index_k3].
+  Points to the grid precomputed in ptr2->k3_grid. */
   double ** k3_grid;
 
+  /* Temporary array to store INT_l3(r,k1,k2) for all values of r and a given (k1,k2) pair, as
+  computed by bessel2_convolution_multi_r(). It is indexed as integral_over_k3_r[thread][index_r]. */
+  double ** integral_over_k3_r;
+
+  /* Second-order transfer function T(k1,k2,k3) for a given (k1,k2) pair, widened to double
+  precision, one for each thread: transfer_k3[thread][index_k3]. Used only when SONG is compiled
+  with -DSONG_FLOAT_STORAGE (see common2.h); otherwise, the k3 convolution reads ptr2->transfer
+  directly. */
+  double ** transfer_k3;
+
+  /* Table of the spherical Bessel functions j_L(k3*r) sampled directly on the integration grids
+  in k3 and r, so that the k3 integral does not need to interpolate them for every field and l3.
+  It is indexed as bessel_k3_cache[index_L][index_k1][index_k2][index_k3*r_size + index_r],
+  where index_L refers to pbs2->l1. The tables are filled the first time they are needed, as long
+  as the total memory stays below ppr2->bessel_k3_cache_mb; a NULL pointer means that the table
+  was not computed. */
+  double **** bessel_k3_cache;
+  int bessel_k3_cache_L_size;            /* Number of L-values in the cache, equal to pbs2->l1_size */
+  long int bessel_k3_cache_max_size;     /* Maximum number of doubles that can be stored in the cache */
+  long int count_allocated_for_bessel_k3_cache; /* Number of doubles currently stored in the cache */
+  long int count_bessel_k3_cache_hits;   /* Number of (k1,k2,L) tables that were reused from the cache */
+
   /* Factor by which the second-order transfer function has to be rescaled in order to obtain the
   m!=0 contributions. It is indexed as pwb->T_rescaling_factor[thread][index_k3]. */
   double ** T_rescaling_factor;
@@ -79,6 +130,37 @@ struct bispectra_workspace_intrinsic {
     The array is indexed as pbi->integral_over_k2[index_l2][index_l3][index_r][index_k1] */
   double **** integral_over_k2;
 
+  /* Coefficients to interpolate INT_l3(r,k1,k2) from pwb->k_smooth_grid to ptr->q in k2. They do
+  not depend on r, l3 or k1, and are computed once by bispectra2_k2_spline_init(). The position of
+  each ptr->q point in the k2 grid and its four interpolation weights are in k2_index_left[index_q]
+  and k2_weight[4*index_q + i]. The tridiagonal system for the second derivatives of the cubic
+  spline is decomposed as in struct transfer2_k3_spline; these arrays are NULL for linear
+  interpolation. */
+  int * k2_index_left;
+  double * k2_weight;
+  double * k2_spline_alpha;
+  double * k2_spline_beta;
+  double * k2_spline_gamma;
+  double * k2_spline_factor;
+  double k2_spline_first[3];
+  double k2_spline_last[3];
+  double k2_spline_last_pivot_inverse;
+
+  /* Part of the integrand of the k2 integral that depends only on k2, that is the trapezoidal
+  measure k2^2*delta_k2/2, the primordial power spectrum and the inverse window function. It is
+  indexed as k2_measure[index_q], where index_q refers to ptr->q. */
+  double * k2_measure;
+
+  /* Buffers for the k2 integral of a given (r,l3), one per thread. INT_l3(r,k1,k2) times the window
+  function and its second derivative in k2 are indexed as k2_nodes[thread][index_k2*k_smooth_size + index_k1]
+  and k2_nodes_spline[thread][...]; their interpolation in ptr->q is indexed as
+  k2_interpolated[thread][index_q*k_smooth_size + index_k1]. The kernel T_l2(k2)*j_l2(k2*r) times
+  pwb->k2_measure is indexed as k2_kernel[thread][index_q]. */
+  double ** k2_nodes;
+  double ** k2_nodes_spline;
+  double ** k2_interpolated;
+  double ** k2_kernel;
+
 
 
   /* Array to contain the integral over k1:
@@ -102,6 +184,33 @@ struct bispectra_workspace_intrinsic {
   double *** integral_over_r;
 
 
+  /* The l3 values are processed in blocks, so that the four arrays above fit in the memory budget
+  ppr2->intrinsic_memory_mb (see bispectra2_intrinsic_memory_plan()). The b-th block goes from
+  index_l3_block[b] to index_l3_block[b+1]-1, and the arrays are allocated only for the l3 values
+  of the current block, from index_l3_min to index_l3_max. */
+  int l3_block_size;      /* Number of l3 blocks */
+  int * index_l3_block;   /* First l3 index of each block, plus pbi->l_size at the end */
+  int index_l3_min;       /* First l3 index of the current block */
+  int index_l3_max;       /* Last l3 index of the current block */
+
+
+  /* Cache of the 3j symbols in bispectra2_intrinsic_geometrical_factors() that do not depend on
+  both l2 and L3, so that they are computed once per l-grid rather than for each M3, L3, L1 and
+  bispectrum type (see bispectra2_geometrical_factors_cache_init()). The symbols (l1,l2,l3)(F,0,-F),
+  with F=0 for even bispectra and F=2 for odd ones, are indexed as
+  threej_l1_l2_l3[F/2][threej_l1_l2_l3_offset[index_l3][index_l2] + index_l1-index_l_triangular_min],
+  that is, with the same l-ordering as pwb->integral_over_r. The symbols (l,L,M)(0,0,0) and
+  (L,M,l)(0,-M,M) are indexed as threej_l_L_M[(index_M*l_size + index_l)*threej_L_size + L-|l-M|],
+  where index_M refers to ppr2->m. */
+  double * threej_l1_l2_l3[2];
+  long int ** threej_l1_l2_l3_offset;
+  long int threej_l1_l2_l3_size;  /* Number of (l1,l2,l3) configurations in threej_l1_l2_l3 */
+  double * threej_l_L_M;          /* Symbols (l,L,M)(0,0,0), used for (l1,L1,M3) */
+  double * threej_L_M_l;          /* Symbols (L,M,l)(0,-M,M), used for (l3,L3,M3) */
+  int threej_L_size;              /* Number of L values for each (M,l), equal to 2*m_max+1 */
+  long int threej_l_L_M_size;     /* Number of values in threej_l_L_M and threej_L_M_l */
+
+
   /* Array to contain the unsymmetrised bispectrum. This is basically the integral over r times messy
   geometrical factors summed over all M3,L3,L1 configurations. 
   Indexed as pbi->unsymmetrised_bispectrum[index_l1][index_l2][index_l3-index_l_triangular_min], 
@@ -110,7 +219,22 @@ struct bispectra_workspace_intrinsic {
   that is, the second-order transfer function always corresponds to the first field and to the
   the first multipole index of the unsymmetrised bispectrum array. */
   double ****** unsymmetrised_bispectrum;
-  
+
+
+  /* Sampling of the (l1,l2,l3) configurations of the unsymmetrised bispectrum, indexed as
+  l_sampling[index_l3][index_l2][index_l1-index_l_triangular_min] with the same ordering as
+  pwb->integral_over_r; the values are those of enum intrinsic_sampling. The integration computes
+  only the pending configurations. Without adaptive sampling, they are all pending in a single
+  pass; otherwise, a first pass computes one l1 every ppr2->intrinsic_adaptive_stride, and a second
+  pass computes the configurations where their interpolation in l1 is not accurate enough (see
+  bispectra2_intrinsic_sampling_refine()). */
+  short *** l_sampling;
+  short ** has_pending_l3_l2;  /* Is there any pending configuration for a given (l3,l2)? */
+  short * has_pending_l3;      /* Is there any pending configuration for a given l3? */
+  long int count_pending_configurations;
+  long int count_computed_configurations;
+  long int count_interpolated_configurations;
+
 
   /* Array that contains the interpolated values of the above integrals in ptr->k. Each thread has one.
   Indexed as integral_splines[thread][index_k] and interpolated_integral[thread][index_k], where
@@ -118,7 +242,7 @@ struct bispectra_workspace_intrinsic {
   double ** integral_splines;
   double ** interpolated_integral;
   
-  /* Same as above, but for the k3 integration grid (one per thread) */
+  /* Same as above, but for the k3 integration grid (one per thread); points to ptr2->delta_k3 */
   double ** delta_k3;
 
   /* Array that contains the pwb->r[i+1] - pwb->r[i-1] values needed for the trapezoidal rule by 
@@ -146,7 +270,79 @@ struct bispectra_workspace_intrinsic {
   long int count_memorised_for_integral_over_k3;
   long int count_memorised_for_integral_over_r;
 
+  /* The integral arrays are stored in contiguous slabs, one for the values and one for each level
+  of pointers, so that the multidimensional indexing is preserved. The slabs of values are aligned
+  to _SLAB_ALIGNMENT_ bytes. We keep track of the number of allocations and of the time spent
+  allocating and freeing them. The time does not include the first write to a slab, when the
+  operating system maps its pages. */
+  long int count_allocations_for_integral_arrays;
+  double time_for_integral_arrays;
+
+
+
+};
+
+
+
+/**
+ * Relative size of the Cholesky pivot below which a mode of the modal expansion is considered
+ * degenerate with the previous ones, and left out of the fit
+ */
+#define _MODES_PIVOT_TOLERANCE_ 1e-6
+
+/**
+ * Alignment in bytes of the slabs holding the integral arrays of the intrinsic bispectrum,
+ * equal to the size of a cache line on x86-64 (see bispectra2_slab_alloc())
+ */
+#define _SLAB_ALIGNMENT_ 64
+
+/**
+ * Separable modal expansion of the intrinsic bispectrum.
+ *
+ * The rescaled bispectrum S(l1,l2,l3) = (l1*l2*l3)^(4/3) * b(l1,l2,l3), which removes the
+ * overall l^-4 scaling of b, is expanded as
+ *
+ *   S(l1,l2,l3) = sum_n alpha_n * q_p(l1) * q_r(l2) * q_s(l3)
+ *
+ * where q_p is the Legendre polynomial of degree p in x = 2*log(l/l_min)/log(l_max/l_min) - 1, and
+ * n runs over the modes (p,r,s) with p+r+s <= ppr2->modal_max_order, ordered by total degree.
+ * The coefficients alpha_n are the least-squares fit to the (l1>=l2>=l3) configurations in
+ * pbi->bispectra, so the expansion is valid only on that ordering. Sums of the expanded
+ * bispectrum over l1>=l2>=l3 factorise in one-dimensional sums over l. The bispectrum can be
+ * evaluated in (l1,l2,l3) in [l_min,l_max] with bispectra2_modes_bispectrum(), which sorts the
+ * multipoles and permutes the fields (X,Y,Z) accordingly.
+ */
+
+struct bispectra_modes {
+
+  short has_modes;      /* Did we compute the modal expansion? */
+
+  int max_order;        /* Largest total degree p+r+s of the modes, equal to ppr2->modal_max_order */
+  int n_modes;          /* Number of modes (p,r,s) */
+  int * mode_p;         /* Degree in l1 of the n-th mode */
+  int * mode_r;         /* Degree in l2 of the n-th mode */
+  int * mode_s;         /* Degree in l3 of the n-th mode */
+  int n_dropped_modes;  /* Number of modes left out of the fit because degenerate with the previous ones on the l-grid */
+
+  int l_min;            /* Smallest multipole of the expansion, equal to pbi->l[0] */
+  int l_max;            /* Largest multipole of the expansion, equal to pbi->l[pbi->l_size-1] */
+  int bt_size;          /* Number of bispectrum types, equal to pbi->bt_size */
+  int bf_size;          /* Number of fields, equal to pbi->bf_size */
+
+  /* Legendre polynomials q_p(l) for all the integer l in [l_min,l_max], indexed as
+  q[p*(l_max-l_min+1) + l-l_min] */
+  double * q;
+
+  /* Coefficients of the expansion, indexed as coefficients[index_bt][((X*bf_size+Y)*bf_size+Z)*n_modes
+  + index_mode]. Only the intrinsic bispectra are expanded; for the other types the pointer is NULL. */
+  double ** coefficients;
 
+  /* Relative rms residual of the expansion truncated at total degree N, indexed as
+  residual[index_bt][((X*bf_size+Y)*bf_size+Z)*(max_order+1) + N] */
+  double ** residual;
+
+  int modes_verbose;    /* Flag regulating the amount of information sent to standard output (none if set to zero) */
+  ErrorMsg error_message; /* Zone for writing error messages */
 
 };
 
@@ -247,6 +443,18 @@ int bispectra2_indices (
       struct bispectra_workspace_intrinsic * pwb
       );
 
+  int bispectra2_intrinsic_adaptive_r_grid(
+      struct precision * ppr,
+      struct precision2 * ppr2,
+      struct background * pba,
+      struct thermo * pth,
+      struct perturbs * ppt,
+      struct bessels2 * pbs2,
+      struct transfers * ptr,
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
   int bispectra2_intrinsic_workspace_free(
       struct perturbs2 * ppt2,
       struct transfers2 * ptr2,
@@ -254,7 +462,80 @@ int bispectra2_indices (
       struct bispectra_workspace_intrinsic * pwb
       );
 
+  int bispectra2_intrinsic_memory_plan(
+      struct precision2 * ppr2,
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_intrinsic_sampling_init(
+      struct precision2 * ppr2,
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_intrinsic_sampling_pending(
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_intrinsic_sampling_interpolate_row(
+      struct bispectra * pbi,
+      int n_computed,
+      int * index_l1_computed,
+      double * b_computed,
+      int index_interval,
+      int index_l1,
+      double * b_interpolated,
+      double * b_lower
+      );
+
+  int bispectra2_intrinsic_sampling_refine(
+      struct precision2 * ppr2,
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_intrinsic_sampling_interpolate(
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_intrinsic_sampling_store(
+      struct precision * ppr,
+      struct precision2 * ppr2,
+      struct bispectra * pbi,
+      int index_bt,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_intrinsic_store_blocks(
+      struct precision * ppr,
+      struct precision2 * ppr2,
+      struct bispectra * pbi,
+      int index_bt,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_intrinsic_load_blocks(
+      struct precision * ppr,
+      struct precision2 * ppr2,
+      struct bispectra * pbi,
+      int index_bt,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
   
+  int bispectra2_slab_alloc(
+      long int size,
+      double ** slab,
+      ErrorMsg error_message
+      );
+
+  void bispectra2_slab_free(
+      double * slab
+      );
+
   int bispectra2_intrinsic_integrate_over_k3(
       struct precision * ppr,
       struct precision2 * ppr2,
@@ -272,6 +553,13 @@ int bispectra2_indices (
       struct bispectra_workspace_intrinsic * pwb
       );
 
+  int bispectra2_k2_spline_init(
+      struct precision * ppr,
+      struct transfers * ptr,
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
   int bispectra2_interpolate_over_k2(
       struct precision * ppr,
       struct precision2 * ppr2,
@@ -284,11 +572,11 @@ int bispectra2_indices (
       struct primordial * ppm,
       struct bispectra * pbi,
       int index_r,
-      int index_k1,
       int index_l3,
-      double * integral_splines,
-      double * interpolated_integral,
-      double * f,
+      double * k2_symmetry,
+      double * nodes,
+      double * nodes_spline,
+      double * interpolated,
       struct bispectra_workspace_intrinsic * pwb
       );
 
@@ -358,6 +646,31 @@ int bispectra2_indices (
       struct bispectra_workspace_intrinsic * pwb
       );
 
+  int bispectra2_geometrical_factors_cache_init(
+      struct precision * ppr,
+      struct precision2 * ppr2,
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_geometrical_factors_cache_free(
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_store_geometrical_factors(
+      struct precision2 * ppr2,
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_load_geometrical_factors(
+      struct precision2 * ppr2,
+      struct bispectra * pbi,
+      struct bispectra_workspace_intrinsic * pwb,
+      short * found
+      );
+
   int bispectra2_intrinsic_geometrical_factors(
       struct precision * ppr,
       struct precision2 * ppr2,
@@ -377,19 +690,46 @@ int bispectra2_indices (
       struct bispectra_workspace_intrinsic * pwb
       );
 
-  int bispectra2_add_quadratic_corrections (
+  int bispectra2_intrinsic_postprocess (
+      struct bispectra * pbi,
+      int index_bt,
+      struct bispectra_workspace_intrinsic * pwb
+      );
+
+  int bispectra2_quadratic_correction (
+      struct perturbs2 * ppt2,
+      struct bispectra * pbi,
+      double * coefficient
+      );
+
+  int bispectra2_modes_init (
       struct precision * ppr,
       struct precision2 * ppr2,
-      struct background * pba,
-      struct perturbs * ppt,
       struct perturbs2 * ppt2,
-      struct bessels * pbs,
-      struct bessels2 * pbs2,
-      struct transfers * ptr,
-      struct transfers2 * ptr2,
-      struct primordial * ppm,
-      struct spectra * psp,
-      struct bispectra * pbi
+      struct bispectra * pbi,
+      struct bispectra_modes * pmo
+      );
+
+  int bispectra2_modes_bispectrum (
+      struct bispectra_modes * pmo,
+      int index_bt,
+      int X,
+      int Y,
+      int Z,
+      int l1,
+      int l2,
+      int l3,
+      double * result
+      );
+
+  int bispectra2_modes_store (
+      struct precision * ppr,
+      struct bispectra * pbi,
+      struct bispectra_modes * pmo
+      );
+
+  int bispectra2_modes_free (
+      struct bispectra_modes * pmo
       );
 
   
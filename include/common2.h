@@ -18,6 +18,21 @@ needed in bispectra2.c */
 #define _MAX_NUM_AZIMUTHAL_ 14
 
 
+/** Floating point type used to store the largest arrays of SONG, the line of sight
+sources (ppt2->sources) and the second-order transfer functions (ptr2->transfer).
+Compile with -DSONG_FLOAT_STORAGE to store them in single precision and halve their
+memory footprint; all computations are still done in double precision, and the stored
+values are widened to double when they are read. The same type is used for the
+sources and transfer functions stored to disk. */
+#ifdef SONG_FLOAT_STORAGE
+typedef float song_storage;
+#define _SONG_STORAGE_TYPE_ "float"
+#else
+typedef double song_storage;
+#define _SONG_STORAGE_TYPE_ "double"
+#endif
+
+
 /**
  * All precision parameters for the second-order part of SONG. 
  */
@@ -111,6 +126,13 @@ struct precision2
   oscillations of the projection functions at late times. This parameter is ignored
   if the CMB is not asked. */
   double perturb_sampling_late_time_boost;
+
+  /** Threshold for the range compression of the line of sight sources. For each source
+  type and (k1,k2) pair, the leading and trailing rows in time where all the values are
+  smaller than sources_tau_cut_song times the largest value of the source are not stored
+  (see perturb2_compress_k1_level()). Set to zero to drop only the rows that vanish
+  exactly, for example before recombination, where exp(-kappa) underflows. */
+  double sources_tau_cut_song;
   
   /** Frequency of the time sampling for the line of sight integration. This parameter
   is used when the time-sampling of the sources, ppt2->tau_sampling, is not dense enough
@@ -197,6 +219,24 @@ struct precision2
   double bessel_j_cut_song;  /* Value of j_l1(x) below which it is approximated by zero (in the region x << l) */
 	double bessel_J_cut_song;	/* Value of J_Llm(x) below which it is approximated by zero (in the region x << l) */
   double bessel_x_step_song; /* Linear step dx for sampling spherical Bessel functions j_l1(x) and functions J_Llm(x) */
+  double bessel_x_tol_song;  /* Maximum interpolation error, relative to the peak of the function, allowed when skipping
+                             points of the x-grid in the tables of j_l1(x) and J_Llm(x); set to zero to keep all points */
+  int l_flat_sky_song;       /* Multipole above which the projection functions J_Llm(x) are approximated in the flat-sky
+                             limit by a single spherical Bessel function; set to zero to compute them exactly for all l */
+  double bessel_k3_cache_mb; /* Memory in MB that the intrinsic bispectrum can use to store j_L(k3*r) on the k3 and r
+                             integration grids, so that it is not interpolated again for every field and l3; set to
+                             zero to always interpolate */
+  double intrinsic_memory_mb; /* Memory in MB for the intermediate arrays of the intrinsic bispectrum integration; the l3
+                              values are processed in blocks that fit in this budget. Set to zero to process all l3 at once */
+  int intrinsic_adaptive_stride; /* If larger than one, the intrinsic bispectrum is first computed for one l1 every
+                                 intrinsic_adaptive_stride, and then only where the interpolation in l1 is not accurate */
+  double intrinsic_adaptive_tolerance; /* Relative interpolation error above which the adaptive sampling computes the
+                                       intermediate configurations of the intrinsic bispectrum */
+  double intrinsic_r_tolerance; /* Relative error allowed on the radial integral of local-shape probe triangles when keeping
+                                only part of the r-grid of the intrinsic bispectrum; it does not bound the error on the intrinsic
+                                bispectrum itself. Set to zero to use the full r-grid */
+  int modal_max_order;       /* Largest total degree of the separable modes used to expand the intrinsic bispectrum;
+                             set to zero to skip the modal expansion */
 
 
 
@@ -207,8 +247,16 @@ struct precision2
   ErrorMsg error_message;         /**< Zone for writing error messages */
   short store_transfers_to_disk;  /**< Should we store the transfer functions to disk? */
   short load_transfers_from_disk; /**< Should we load the transfer functions from disk? */
+  short extend_transfers_on_disk; /**< Should we compute only the transfer functions that are missing from disk,
+                                  and add them to those already stored by a run with a smaller l_max? */
   short store_sources_to_disk;    /**< Should we store the source functions to disk? */
   short load_sources_from_disk;   /**< Should we load the source functions from disk? */
+  short intrinsic_dry_run;        /**< Should we just print the memory plan of the intrinsic bispectrum, without computing it? */
+  short store_geometrical_factors; /**< Should we store to disk the 3j symbols of the intrinsic bispectrum, and reuse them
+                                   in later runs with the same l and m lists? */
+  char geometrical_factors_path[_FILENAMESIZE_]; /**< File with the 3j symbols of the intrinsic bispectrum */
+  short intrinsic_incremental; /**< Should we read the intrinsic bispectra already in the run directory, and
+                               compute only the missing field combinations? */
   short old_run; /**< set to _TRUE_ if the run was stored with a version of SONG smaller than 1.0 */
 
 };  /* end of struct precision2 declaration */
@@ -186,6 +186,15 @@ enum quadratic_source_computation {
  */
 #define _MIN_K3_RATIO_ 100
 
+/**
+ * Format tag written at the beginning of each sources file in the run directory (see
+ * perturb2_store_sources_to_disk()). It is followed by sizeof(song_storage), and is
+ * bumped whenever the layout of the files changes; files without the current tag are
+ * refused by perturb2_load_sources_from_disk(). Version 2 stores each (k3,tau) block
+ * preceded by its range of non-negligible time rows.
+ */
+#define _SOURCES_FILE_TAG_ "SONG_SOURCES_V2"
+
 
 
 // ======================================================================================
@@ -410,12 +419,38 @@ struct perturbs2
    * - index_k2 goes from 0 to ppt2->k_size-index_k1-1 due to symmetry reasons.
    * - index_k3 goes from 0 to ppt2->k3_size[index_k1][index_k2]-1.
    * - k3_size is short for ppt2->k3_size[index_k1][index_k2].
+   *
+   * The values are stored as song_storage, which is float if SONG was compiled with
+   * -DSONG_FLOAT_STORAGE and double otherwise (see common2.h).
    */
-  double **** sources;
+  song_storage **** sources;
   
   short * has_allocated_sources;  /**< If has_allocated_sources[index_k1]==_TRUE_,
                                   then ppt2->sources[index_k1] is fully allocated */
 
+  /**
+   * Range compression of ppt2->sources.
+   *
+   * Many source functions are negligible for most of the time sampling, either because
+   * they vanish identically (B-modes for m=0, high-l multipoles in tight coupling) or
+   * because they are suppressed by the visibility function. Once a k1 level has been
+   * computed, we keep only the rows of each (k3,tau) block between the first and the last
+   * non-negligible time; see perturb2_compress_k1_level(). The stored rows of
+   * ppt2->sources[index_tp2][index_k1][index_k2] are then
+   *
+   *    index_tau = sources_tau_min[index_tp2][index_k1][index_k2] + index_row
+   *
+   * with index_row < sources_tau_size[index_tp2][index_k1][index_k2], and the source
+   * vanishes for all the other times. A block with sources_tau_size=0 is NULL.
+   */
+  //@{
+  int *** sources_tau_min;
+  int *** sources_tau_size;
+  short compress_sources;           /**< Should we compress ppt2->sources? Turned off when the sources are
+                                    written to the k_out and tau_out binary files, which expect dense blocks */
+  long int count_compressed_sources;  /**< Number of values of ppt2->sources dropped by the compression */
+  //@}
+
   /**
    * Flags for internal use in the perturbations2.c module.
    */
@@ -2251,6 +2286,12 @@ struct perturb2_parameters_and_workspace {
          int index_k1
          );
 
+    int perturb2_compress_k1_level(
+         struct precision2 * ppr2,
+         struct perturbs2 * ppt2,
+         int index_k1
+         );
+
 
 #ifdef __cplusplus
   }
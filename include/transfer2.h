@@ -32,6 +32,47 @@ enum transfer2_tau_sampling {
 };
 
 
+/**
+ * Method to solve the line of sight integral for the second-order transfer functions.
+ */
+enum transfer2_los_method {
+  scalar_los_method,  /**< Solve the integral separately for each transfer type with transfer2_integrate() */
+  matrix_los_method,  /**< Solve the integrals for all transfer types at once as a product between a projection matrix
+                      and a source matrix, with transfer2_compute_matrix() */
+  filon_los_method    /**< Solve the integral on the time sampling of the sources, integrating exactly the product
+                      of the linearly interpolated sources and the projection functions, with transfer2_integrate_filon() */
+};
+
+
+/**
+ * Layout of the second-order transfer functions in memory and on disk.
+ */
+enum transfer2_layout {
+  type_transfers_layout,  /**< Each transfer type has its own k3 arrays, and its own file on disk */
+  tile_transfers_layout   /**< The transfer types with the same field and m are grouped in tiles, one for each (k1,k2)
+                          pair, where the k3 arrays of all the l's are contiguous; each group has its own file on disk */
+};
+
+/**
+ * Number of time steps in the blocks of the projection and source matrices used by
+ * the matrix method for the line of sight integral.
+ */
+#define _TRANSFER2_TAU_BLOCK_ 64
+
+/**
+ * Maximum difference between the matrix and scalar methods for the line of sight
+ * integral, relative to the largest transfer function in the k3 row. The check is
+ * performed on one (k1,k2) pair per run, see transfer2_check_matrix().
+ */
+#define _TRANSFER2_MATRIX_TOL_ 1e-6
+
+/**
+ * Maximum relative difference between the checksums of the k-sampling of the transfer
+ * functions stored on disk and of the current run for the former to be reused.
+ */
+#define _TRANSFER2_K_CHECKSUM_TOL_ 1e-10
+
+
 /** 
  * Macro used to index the first level ptr2->transfer.
  */
@@ -41,14 +82,16 @@ enum transfer2_tau_sampling {
 /**
  * In order to access the sources for the line of sight integration,
  * we define a preprocessor macro that takes as arguments the time and
- * k3 indices.
+ * k3 indices. Only the time rows stored in ppt2->sources can be accessed,
+ * that is, INDEX_TAU must be in [tau_min, tau_min+ppt2->sources_tau_size[..]);
+ * the variable tau_min must be defined in the calling scope.
  */
 #undef sources
 #define sources(INDEX_TAU,INDEX_K_TRIANGULAR) \
   ppt2->sources[index_tp2]\
                [index_k1]\
                [index_k2]\
-               [(INDEX_TAU)*k_pt_size + (INDEX_K_TRIANGULAR)]
+               [((INDEX_TAU)-tau_min)*k_pt_size + (INDEX_K_TRIANGULAR)]
 
 
 /**
@@ -95,9 +138,12 @@ struct transfers2 {
    * - index_k1 goes from 0 to ppt2->k_size-1.    
    * - index_k2 goes from 0 to ppt2->k_size-index_k1-1 due to symmetry reasons.
    * - index_k goes from 0 to ptr2->k_size_k1k2[index_k1][index_k2]-1.
+   *
+   * The values are stored as song_storage, which is float if SONG was compiled with
+   * -DSONG_FLOAT_STORAGE and double otherwise (see common2.h).
    */
 
-  double **** transfer; 
+  song_storage **** transfer; 
   
   int index_tt2_T;              /* Index for transfer type = temperature */
   int index_tt2_E;              /* Index for transfer type = E-polarization */
@@ -105,6 +151,19 @@ struct transfers2 {
 
   int tt2_size;                 /* Number of requested transfer types */
 
+  /* Layout of ptr2->transfer in memory and on disk */
+  enum transfer2_layout transfers_layout;
+
+  /* In the tiles layout, the transfer types with the same field X and the same m are
+  grouped together. For each (k1,k2), the k3 arrays of all the types in a group are
+  stored contiguously in a single tile, in the same order as ptr2->l, so that
+  ptr2->transfer[index_tt][index_k1][index_k2] points inside the tile. The group of
+  the field X and of the azimuthal number ptr2->m[index_m] has index
+  index_tile = (ptr2->index_tt2_X/ptr2->n_transfers)*ptr2->m_size + index_m. */
+  int tiles_size;               /* Number of groups of transfer types */
+  int * tile_tt_size;           /* Number of transfer types in each group, tile_tt_size[index_tile] */
+  int ** tile_tt;               /* Transfer types in each group, tile_tt[index_tile][index_tt_in_tile] */
+
   /* Array of strings that contain the labels of the various transfer types
   For example,  tt2_labels[index_tt2_T] is equal to "T_00" */
   char (*tt2_labels)[_MAX_LENGTH_LABEL_];
@@ -159,6 +218,9 @@ struct transfers2 {
   /* Which time-sampling should we use for the second-order transfer functions? */  
   enum transfer2_tau_sampling tau_sampling;
 
+  /* Which method should we use to solve the line of sight integral? */
+  enum transfer2_los_method los_method;
+
   /* For a given (k1,k2), number of considered k3 values. This number includes points outside the physical
   (i.e. triangular) regime when extrapolation is requested. */
   int ** k_size_k1k2;
@@ -176,6 +238,19 @@ struct transfers2 {
   
   /* Maximum extent of the k3 grid for all possible pairs of (k1,k2) */
   int k3_size_max;
+
+  /* For a given (k1,k2), grid in k3 where we compute the transfer functions, k3_grid[index_k1][index_k2][index_k3],
+  with index_k3 < k_size_k1k2[index_k1][index_k2]. It is computed once in transfer2_indices_of_transfers() with
+  transfer2_get_k3_list(), and then used read-only by this and the following modules. */
+  double *** k3_grid;
+
+  /* For a given (k1,k2), measure for the trapezoidal rule on the k3 grid, delta_k3[index_k1][index_k2][index_k3];
+  it is defined as k3(i+1)-k3(i-1) except for the first and last elements, which are, respectively, k3(1)-k3(0)
+  and k3(N)-k3(N-1). */
+  double *** delta_k3;
+
+  /* Memory block containing all the k3 grids and trapezoidal measures */
+  double * k3_grid_buffer;
   
 
 
@@ -193,6 +268,11 @@ struct transfers2 {
                                        is in ptr2->transfers_files[index_tt2]. */
 
 
+  int transfers_files_size; /**< Number of files on disk: ptr2->tt2_size for the types layout, ptr2->tiles_size for the
+                            tiles layout. In the latter case, transfers_paths and transfers_files are indexed by index_tile
+                            rather than by index_tt2, and each file contains the tiles of a group of transfer types in
+                            k1-major order. */
+
   char ** transfers_paths; /**< transfers_paths[index_tt2] is the path to the file with the transfer functions
                            for the transfer type indexed by index_tt2. Used only if ppr2->store_transfers_to_disk==_TRUE_ or
                            ppr2->load_transfers_from_disk==_TRUE_. */
@@ -201,8 +281,17 @@ struct transfers2 {
                            for the transfer type indexed by index_tt2. Used only if ppr2->store_transfers_to_disk==_TRUE_ or
                            ppr2->load_transfers_from_disk==_TRUE_. */
 
-  FILE * transfers_status_file;                      /**< NOT IMPLEMENTED YET */
-  char transfers_status_path[_FILENAMESIZE_];        /**< NOT IMPLEMENTED YET */
+  short * transfers_on_disk; /**< transfers_on_disk[index_tt2] is _TRUE_ if the transfer functions for index_tt2 were
+                             already stored in ptr2->transfers_dir by a previous run; in that case, they are neither
+                             computed nor stored again. Used only if ppr2->store_transfers_to_disk==_TRUE_ or
+                             ppr2->load_transfers_from_disk==_TRUE_. */
+
+  FILE * transfers_status_file;               /**< Stream of the status file, used only while writing it */
+  char transfers_status_path[_FILENAMESIZE_]; /**< Path of the status file of ptr2->transfers_dir. The file describes the
+                                              content of the directory: the layout, a checksum of the k-sampling, the largest
+                                              l and, for each file, the label of the transfer type (or group of types) it
+                                              contains. It is written by transfer2_write_status_file() and read by
+                                              transfer2_read_status_file(). */
 
 
 
@@ -244,6 +333,63 @@ struct transfers2 {
 
 
 
+/**
+ * Shortcuts to the projection function and to the source function that enter a
+ * single L-term of the line of sight integral, for a given (l,m) and a given
+ * projection function type. They are collected in transfer2_integrate() before
+ * the loop on time, so that the table look-ups in pbs2 are done only once.
+ */
+struct transfer2_los_term {
+
+  double * J;           /* Projection function J_Llm(x), pbs2->J_Llm_x[index_J][index_L][index_l][index_m] */
+  double * ddJ;         /* Its second derivative, or NULL for linear interpolation */
+  int * x_offset;       /* pbs2->x_offset_J for the same (J,L,l,m) */
+  short * x_shift;      /* pbs2->x_shift_J for the same (J,L,l,m) */
+  int index_x_min;      /* pbs2->index_xmin_J for the same (J,L,l,m) */
+  double * J_int_0;     /* pbs2->J_int_0 for the same (J,L,l,m), only for the Filon quadrature */
+  double * J_int_1;     /* pbs2->J_int_1 for the same (J,L,l,m), only for the Filon quadrature */
+  double * source;      /* Source function S_Lm(tau) interpolated on the time grid */
+  double coefficient;   /* Flat-sky coefficient C_Llm, pbs2->J_flat_sky for the same (J,L,l,m), only for transfer2_integrate_flat_sky() */
+  int index_integral;   /* Which integral this term contributes to: 0 for direct, 1 for mixing */
+
+};
+
+
+/**
+ * Coefficients of the interpolation in k3 of the sources for a given (k1,k2) pair.
+ *
+ * They depend only on the k3 sampling of the sources and on the k3 grid of the
+ * transfer functions, so they are computed once per (k1,k2) pair by
+ * transfer2_k3_spline_init() and then applied to all source types and times by
+ * transfer2_interpolate_sources_in_k().
+ */
+struct transfer2_k3_spline {
+
+  int k_pt_size;               /* Number of nodes, ppt2->k3_size[index_k1][index_k2] */
+  int first_physical_index;    /* First point of the transfer k3 grid where we interpolate */
+  int last_physical_index;     /* Last point of the transfer k3 grid where we interpolate */
+
+  /* Position of each point of the transfer k3 grid in the sources k3 sampling; the arrays
+  have size ptr2->k_size_k1k2[index_k1][index_k2] */
+  int * index_k_left;          /* Node to the left of k3 */
+  double * weight;             /* Weights of the two nodes and of their second derivatives, weight[index_k_tr*4 + i] */
+
+  /* Decomposition of the tridiagonal system for the second derivatives of the cubic spline,
+  with the edge derivatives estimated as in _SPLINE_EST_DERIV_. The forward sweep is
+  u[i] = alpha[i]*(y[i+1]-y[i]) - beta[i]*(y[i]-y[i-1]) - gamma[i]*u[i-1] and the back
+  substitution is ddy[i] = factor[i]*ddy[i+1] + u[i]. The arrays have size k_pt_size and
+  are NULL for linear interpolation. */
+  double * alpha;
+  double * beta;
+  double * gamma;
+  double * factor;
+  double first[3];             /* u[0] = first[0]*y[0] + first[1]*y[1] + first[2]*y[2] */
+  double last[3];              /* Same for the last node, using y[k_pt_size-3], y[k_pt_size-2], y[k_pt_size-1] */
+  double last_pivot_inverse;   /* ddy[k_pt_size-1] = (last*y - u[k_pt_size-2]/2)*last_pivot_inverse */
+
+};
+
+
 /**
  * Just a collection of often-used, temporary parameters that are passed through
  * various functions in the transfer2 module.  Each set of (l,m,k1,k2,k) for which
@@ -271,10 +417,55 @@ struct transfer2_workspace {
   double * tau_grid;
   double * tau0_minus_tau;        /* List of tau0-tau values, tau0_minus_tau[index_tau_grid] */
   double * delta_tau;             /* List of delta_tau values for trapezoidal rule, delta_tau[index_tau_grid] */
-
-  /* Sampling in k where we shall compute the transfer function */
+  short has_sources_tau_grid;     /* Do the above arrays contain the time sampling of the sources? In that case they
+                                  do not depend on k and are not recomputed by transfer2_get_time_grid() */
+
+  /* Position of x=k*(tau0-tau) in the sampling of the projection functions, pbs2->xx, for
+  each time in the integration grid. These arrays depend only on k and on the time grid;
+  they are filled once per k by transfer2_get_x_grid() and used for all transfer types. */
+  int * index_x;                  /* Index of the node of pbs2->xx to the left of x, index_x[index_tau_grid] */
+  int * index_x_block;            /* Block of pbs2->xx that contains index_x, index_x_block[index_tau_grid] */
+  double * a_x;                   /* Interpolation weight of the left node for each stride 2^shift of the projection
+                                  functions, a_x[index_tau_grid*(_BESSEL2_X_BLOCK_SHIFT_+1) + shift] */
+
+  /* List of the L-terms in the line of sight integral for the (l,m) being computed, with
+  room for both the direct and the mixing contributions; see transfer2_integrate() */
+  struct transfer2_los_term * los_terms;
+
+  /* Blocks of the projection matrix, of the source matrix and of their product, used only
+  by the matrix method for the line of sight integral; see transfer2_compute_matrix() */
+  double * los_projection;        /* los_projection[index_l*n_rows + index_row], with n_rows=_TRANSFER2_TAU_BLOCK_*(L_max+1) */
+  double * los_sources;           /* los_sources[index_row*2 + index_column] */
+  double * los_result;            /* los_result[(index_product*ptr2->l_size + index_l)*2 + index_column] */
+  double * los_check;             /* If not NULL, the matrix method also computes the transfer functions with the
+                                  scalar method and stores them in los_check[index_tt*k_size + index_k], where
+                                  k_size=ptr2->k_size_k1k2[index_k1][index_k2]; see transfer2_check_matrix() */
+
+  /* Largest error estimated by the Filon quadrature for the line of sight integral, relative to
+  the sum of the absolute values of the contributions of each time interval */
+  double los_error_max;
+
+  /* Accuracy and cost of the flat-sky limit (see transfer2_integrate_flat_sky()). On the overlap
+  range of multipoles, where the line of sight integral is computed both exactly and in the flat-sky
+  limit, we accumulate the squared difference between the two results and the squared exact result,
+  together with the time spent by each method. */
+  double flat_sky_diff2;
+  double flat_sky_norm2;
+  double flat_sky_time_exact;
+  double flat_sky_time_flat;
+  long int flat_sky_count_overlap;  /* Number of integrals computed both ways */
+  long int flat_sky_count;          /* Number of integrals computed only in the flat-sky limit */
+
+  /* Sampling in k where we shall compute the transfer function. Points to the k3 grid
+  of the (k1,k2) pair being processed, which is shared between the threads. */
   double * k_grid;
 
+  /* Array that will contain the sources of a given type with time as the fastest index,
+  sources_k[index_k3*ppt2->tau_size + index_tau], and their second derivative with
+  respect to k3, in view of spline interpolation; both are NULL for linear interpolation */
+  double * sources_k;
+  double * sources_k_spline;
+
   /* Arrays that will contain the second derivatives and the interpolated value of the sources, respectively, at
     the times contained in the integration grid. */
   double ** sources_time_spline;
@@ -406,11 +597,26 @@ extern "C" {
         int index_k1,
         int index_k2,
         int index_tp,
-        double * k_grid,
+        struct transfer2_k3_spline * k3_spline,
+        double * sources_k,
         double * splines,
         double * interpolated_sources
         );
 
+  int transfer2_k3_spline_init(
+        struct precision2 * ppr2,
+        struct perturbs2 * ppt2,
+        struct transfers2 * ptr2,
+        int index_k1,
+        int index_k2,
+        double * k_grid,
+        struct transfer2_k3_spline * k3_spline
+        );
+
+  int transfer2_k3_spline_free(
+        struct transfer2_k3_spline * k3_spline
+        );
+
 
   int transfer2_get_time_grid(
         struct precision * ppr,
@@ -426,6 +632,13 @@ extern "C" {
         struct transfer2_workspace * pw
         );
 
+  int transfer2_get_x_grid(
+        struct precision * ppr,
+        struct bessels2 * pbs2,
+        struct transfers2 * ptr2,
+        struct transfer2_workspace * pw
+        );
+
   int transfer2_interpolate_sources_in_time(
         struct precision * ppr,
         struct precision2 * ppr2,
@@ -498,10 +711,60 @@ extern "C" {
         double ** interpolated_sources_in_time,
         int index_J,
         int index_source_monopole,
+        int index_J_mixing,
+        int index_source_monopole_mixing,
+        struct transfer2_workspace * pw,
+        double * integral,
+        double * integral_mixing
+        );
+
+  int transfer2_integrate_filon (
+        struct bessels2 * pbs2,
+        struct transfers2 * ptr2,
+        int los_terms_size,
         struct transfer2_workspace * pw,
-        double * integral
+        double * result
         );
 
+  int transfer2_integrate_flat_sky (
+        struct precision * ppr,
+        struct bessels2 * pbs2,
+        struct transfers2 * ptr2,
+        int index_l,
+        int index_m,
+        double ** interpolated_sources_in_time,
+        int index_J,
+        int index_source_monopole,
+        int index_J_mixing,
+        int index_source_monopole_mixing,
+        struct transfer2_workspace * pw,
+        double * integral,
+        double * integral_mixing
+        );
+
+  int transfer2_compute_matrix (
+          struct precision * ppr,
+          struct precision2 * ppr2,
+          struct perturbs2 * ppt2,
+          struct bessels * pbs,
+          struct bessels2 * pbs2,
+          struct transfers2 * ptr2,
+          int index_k1,
+          int index_k2,
+          int index_k,
+          double ** interpolated_sources_in_time,
+          struct transfer2_workspace * pw
+          );
+
+  int transfer2_check_matrix (
+          struct transfers2 * ptr2,
+          int index_k1,
+          int index_k2,
+          double * los_check,
+          double * max_difference,
+          int * index_tt_max
+          );
+
 
   int transfer2_store_transfers_to_disk(
           struct perturbs2 * ppt2,
@@ -515,6 +778,43 @@ extern "C" {
           int index_tt
           );
 
+  int transfer2_load_tile_from_disk(
+          struct perturbs2 * ppt2,
+          struct transfers2 * ptr2,
+          int index_tile
+          );
+
+  int transfer2_get_k_checksum(
+          struct perturbs2 * ppt2,
+          struct transfers2 * ptr2,
+          long int * k3_size,
+          double * k_checksum,
+          double * k3_checksum
+          );
+
+  int transfer2_read_status_file(
+          struct precision2 * ppr2,
+          struct perturbs2 * ppt2,
+          struct transfers2 * ptr2
+          );
+
+  int transfer2_status_file_l_max(
+          FILE * status_file,
+          int * l_max
+          );
+
+  int transfer2_write_status_file(
+          struct precision2 * ppr2,
+          struct perturbs2 * ppt2,
+          struct transfers2 * ptr2
+          );
+
+  int transfer2_free_tile_level(
+          struct perturbs2 * ppt2,
+          struct transfers2 * ptr2,
+          int index_tile
+          );
+
 
   int transfer2_allocate_type_level(
        struct perturbs2 * ppt2,
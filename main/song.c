@@ -24,6 +24,7 @@ int main(int argc, char **argv) {
   struct nonlinear nl;        /* non-linear spectra */
   struct lensing le;          /* lensed spectra */
   struct bispectra bi;        /* bispectra */
+  struct bispectra_modes mo;  /* modal expansion of the intrinsic bispectrum */
   struct fisher fi;           /* fisher matrix */
   struct output op;           /* output files */
   ErrorMsg errmsg;            /* error messages */
@@ -119,6 +120,19 @@ int main(int argc, char **argv) {
     printf("\n\nError in bispectra2_init \n=>%s\n",bi.error_message);
     return _FAILURE_;
   }
+
+  /* A dry run of the intrinsic bispectrum only prints its memory plan. Stop here
+  rather than passing an empty bispectrum to the following modules. */
+  if (pr2.intrinsic_dry_run == _TRUE_) {
+    printf ("\nDry run of the intrinsic bispectrum completed, stopping here.\n");
+    return _SUCCESS_;
+  }
+
+  /* Expand the intrinsic bispectrum in separable modes */
+  if (bispectra2_modes_init(&pr,&pr2,&pt2,&bi,&mo) == _FAILURE_) {
+    printf("\n\nError in bispectra2_modes_init \n=>%s\n",mo.error_message);
+    return _FAILURE_;
+  }
   
   /* Compute the intrinsic C_l */
   if (spectra2_init(&pr,&pr2,&ba,&th,&pt,&pt2,&bs,&bs2,&tr,&tr2,&pm,&le,&bi,&sp) == _FAILURE_) {
@@ -148,6 +162,11 @@ int main(int argc, char **argv) {
     return _FAILURE_;
   }
 
+  if (bispectra2_modes_free(&mo) == _FAILURE_) {
+    printf("\n\nError in bispectra2_modes_free \n=>%s\n",mo.error_message);
+    return _FAILURE_;
+  }
+
   if (bispectra_free(&pr,&pt,&sp,&le,&bi) == _FAILURE_) {
     printf("\n\nError in bispectra_free \n=>%s\n",bi.error_message);
     return _FAILURE_;
@@ -22,6 +22,10 @@
  * -# bessel2_free() to free the memory allocated by the module.
  * -# bessel2_convolution() to convolve the projection functions computed
  *    in this module with arbitrary functions.
+ * -# bessel2_convolution_multi_r() to do the same for a whole grid of frequencies
+ *    at once.
+ * -# bessel2_j_matrix() and bessel2_convolution_matrix() to do the same as a
+ *    matrix product.
  *
  * Created by Guido W. Pettinari on 17.03.2013 based on bessel.c by the
  * CLASS team (http://class-code.net/).
@@ -55,12 +59,17 @@
  * -# For each multipole value in pbs->l, call bessel_j_for_l() to compute and store
  *    the spherical Bessel functions.
  *
+ * -# Thin out the x-sampling of J_Llm(x) and j_l1(x) where they vary slowly and compute
+ *    their spline coefficients, via bessel2_x_sampling().
+ *
  * The computation of the Bessel function is determined by the following parameters:
  *
  * -# pbs->l[index_l]: list of size pbs->l_size with the multipole values l where we shall
  *    compute the projection functions; it is determined in the transfer.c module.
  * -# pbs2->xx_step: step dx for sampling the projection functions J(x), given by the
  *    user via the parameter file.
+ * -# pbs2->x_tol: tolerance on the interpolation error used to skip points in pbs2->xx,
+ *    given by the user via the parameter file.
  * -# pbs2->xx_max: maximum value of x where to compute the projection functions; determined
  *    in the input2.c module
  * -# ppr2->bessel_J_cut_song: value of J_Llm(x) below which it is approximated by zero in the
@@ -125,6 +134,27 @@ int bessel2_init(
   for (int index_L=0; index_L<pbs2->L_size; ++index_L)
     pbs2->L[index_L] = index_L;
 
+  /* Find the multipoles where the projection functions are approximated in the flat-sky
+  limit (see bessel2_J_flat_sky()). For them, we do not compute the tables of J_Llm(x);
+  the last _BESSEL2_FLAT_SKY_OVERLAP_ multipoles before the threshold are computed both
+  ways, so that the transfer2 module can estimate the accuracy of the approximation. */
+  pbs2->l_size_J = pbs->l_size;
+  pbs2->index_l_flat_sky_min = pbs->l_size;
+
+  if (ppr2->l_flat_sky_song > 0) {
+
+    pbs2->l_size_J = 0;
+    while ((pbs2->l_size_J < pbs->l_size) && (pbs->l[pbs2->l_size_J] < ppr2->l_flat_sky_song))
+      pbs2->l_size_J++;
+
+    if (pbs2->l_size_J < pbs->l_size)
+      pbs2->index_l_flat_sky_min = MAX (0, pbs2->l_size_J - _BESSEL2_FLAT_SKY_OVERLAP_);
+
+    if ((pbs2->bessels2_verbose > 0) && (ppr2->load_transfers_from_disk == _FALSE_))
+      printf(" -> using the flat-sky limit for %d of %d multipoles, l >= %d\n",
+        pbs->l_size - pbs2->l_size_J, pbs->l_size, ppr2->l_flat_sky_song);
+  }
+
 
   
   // ====================================================================================
@@ -232,6 +262,11 @@ int bessel2_init(
     if (pbs2->bessels2_verbose > 0)
       printf (" -> No second-order projection functions needed.\n");
 
+    /* Thin out the sampling of j_l1(x) and compute its spline coefficients */
+    class_call (bessel2_x_sampling_j_l1 (ppr, pbs2),
+      pbs2->error_message,
+      pbs2->error_message);
+
     return _SUCCESS_;
   }
 
@@ -248,10 +283,12 @@ int bessel2_init(
      - pbs2->x_min_J
      - pbs2->J_Llm_x
      - pbs2->ddJ_Llm_x
+     - pbs2->x_offset_J
+     - pbs2->x_shift_J
   
-  We shall allocate the last level (x) of pbs2->J_Llm_x and pbs2->ddJ_Llm_x later,
-  in bessel2_J_for_Llm(), because only then we will know for each (J,L,l,m) the domain
-  where J_Llm(x) does not vanish. */
+  We shall allocate the last level (x) of pbs2->J_Llm_x later, in bessel2_J_for_Llm(),
+  because only then we will know for each (J,L,l,m) the domain where J_Llm(x) does not
+  vanish. The last level of the other arrays is allocated in bessel2_x_sampling(). */
 
   /* Level of the projection function type */
   class_alloc (pbs2->index_xmin_J,  pbs2->J_size*sizeof(int***), pbs2->error_message);
@@ -260,6 +297,8 @@ int bessel2_init(
   class_alloc (pbs2->J_Llm_x,  pbs2->J_size*sizeof(double****), pbs2->error_message);
   if (ppr->bessels_interpolation == cubic_interpolation)
     class_alloc (pbs2->ddJ_Llm_x,  pbs2->J_size*sizeof(double****), pbs2->error_message);
+  class_alloc (pbs2->x_offset_J,  pbs2->J_size*sizeof(int****), pbs2->error_message);
+  class_alloc (pbs2->x_shift_J,  pbs2->J_size*sizeof(short****), pbs2->error_message);
 
   for (int index_J = 0; index_J < pbs2->J_size; ++index_J) {
 
@@ -270,6 +309,8 @@ int bessel2_init(
     class_alloc (pbs2->J_Llm_x[index_J],  pbs2->L_size*sizeof(double***), pbs2->error_message);
     if (ppr->bessels_interpolation == cubic_interpolation)
       class_alloc (pbs2->ddJ_Llm_x[index_J],  pbs2->L_size*sizeof(double***), pbs2->error_message);
+    class_alloc (pbs2->x_offset_J[index_J],  pbs2->L_size*sizeof(int***), pbs2->error_message);
+    class_alloc (pbs2->x_shift_J[index_J],  pbs2->L_size*sizeof(short***), pbs2->error_message);
   
     /* l-level */
     for (int index_L=0; index_L<pbs2->L_size; ++index_L) {
@@ -280,9 +321,11 @@ int bessel2_init(
       class_alloc (pbs2->J_Llm_x[index_J][index_L], pbs->l_size*sizeof(double**), pbs2->error_message);
       if (ppr->bessels_interpolation == cubic_interpolation)
         class_alloc (pbs2->ddJ_Llm_x[index_J][index_L], pbs->l_size*sizeof(double**), pbs2->error_message);
+      class_alloc (pbs2->x_offset_J[index_J][index_L], pbs->l_size*sizeof(int**), pbs2->error_message);
+      class_alloc (pbs2->x_shift_J[index_J][index_L], pbs->l_size*sizeof(short**), pbs2->error_message);
   
       /* m-level */
-      for (int index_l=0; index_l<pbs->l_size; ++index_l) {
+      for (int index_l=0; index_l<pbs2->l_size_J; ++index_l) {
 
         /* Only allocate those m's that satisfy the condition m<=MIN(L,l) */
         int m_size = MIN (ppr2->index_m_max[pbs2->L[index_L]], ppr2->index_m_max[pbs->l[index_l]]) + 1;
@@ -293,6 +336,8 @@ int bessel2_init(
         class_alloc (pbs2->J_Llm_x[index_J][index_L][index_l], m_size*sizeof(double*), pbs2->error_message);
         if (ppr->bessels_interpolation == cubic_interpolation)
           class_alloc (pbs2->ddJ_Llm_x[index_J][index_L][index_l], m_size*sizeof(double*), pbs2->error_message);
+        class_alloc (pbs2->x_offset_J[index_J][index_L][index_l], m_size*sizeof(int*), pbs2->error_message);
+        class_alloc (pbs2->x_shift_J[index_J][index_L][index_l], m_size*sizeof(short*), pbs2->error_message);
 
       } // end of for(index_l)
     } // end of for(index_L)
@@ -323,7 +368,7 @@ int bessel2_init(
       /* Parallel loop on the multipole index l */
       abort = _FALSE_;
       #pragma omp parallel for schedule (dynamic)
-      for (int index_l = 0; index_l < pbs->l_size; ++index_l) {
+      for (int index_l = 0; index_l < pbs2->l_size_J; ++index_l) {
       
         /* There are two important consideration to take into account when dealing with
         the m!=0 case.  First, not all m-values are allowed: abs(m) should be smaller than
@@ -373,94 +418,136 @@ int bessel2_init(
     } // end of for(index_L)
   } // end of loop on type of projection functions
   
-  /* Determine the maximum size of the x-level in pbs2->J_Llm_x */
-  pbs2->x_size_max_J = 0;
-  for (int index_J = 0; index_J < pbs2->J_size; ++index_J)
-    for (int index_L = 0; index_L < pbs2->L_size; ++index_L)
-      for (int index_l = 0; index_l < pbs->l_size; ++index_l)
-        for (int index_m = 0; index_m < MIN(ppr2->index_m_max[pbs2->L[index_L]],ppr2->index_m_max[pbs->l[index_l]])+1; ++index_m)                 
-          pbs2->x_size_max_J = MAX (pbs2->x_size_max_J, pbs2->x_size_J[index_J][index_L][index_l][index_m]);
-  
-  /* Print information on the used memory */
-  if (pbs2->bessels2_verbose > 1)
-    printf (" -> memory in use to store the 2nd-order projection functions: ~ %3g MB\n",
-    8*pbs2->count_allocated_Js/1e6);
+  // ====================================================================================
+  // =                                 Flat-sky limit                                   =
+  // ====================================================================================
 
+  /* Compute the coefficients of the projection functions in the flat-sky limit, for the
+  multipoles beyond pbs2->l_size_J and for those in the overlap region */
+  pbs2->J_flat_sky = NULL;
 
+  if (pbs2->index_l_flat_sky_min < pbs->l_size) {
+
+    class_alloc (pbs2->J_flat_sky, pbs2->J_size*sizeof(double ***), pbs2->error_message);
 
-  // ====================================================================================
-  // =                               Spline interpolation                               =
-  // ====================================================================================
-  
-  if (ppr->bessels_interpolation == cubic_interpolation) {
-    
-    /* Compute second derivatives of the J_Llm in view of the spline interpolation. 
-    The J will be used in the second-order transfer module to solve the line of sight
-    integral. */
-    
     for (int index_J = 0; index_J < pbs2->J_size; ++index_J) {
 
+      class_alloc (pbs2->J_flat_sky[index_J], pbs2->L_size*sizeof(double **), pbs2->error_message);
+
       for (int index_L = 0; index_L < pbs2->L_size; ++index_L) {
 
-        /* Beginning of parallel region */
-        int abort = _FALSE_;    
+        class_calloc (pbs2->J_flat_sky[index_J][index_L], pbs->l_size, sizeof(double *), pbs2->error_message);
+
+        abort = _FALSE_;
         #pragma omp parallel for schedule (dynamic)
-        for (int index_l = 0; index_l < pbs->l_size; ++index_l) {
+        for (int index_l = pbs2->index_l_flat_sky_min; index_l < pbs->l_size; ++index_l) {
 
           int index_m_max = MIN (ppr2->index_m_max[pbs2->L[index_L]], ppr2->index_m_max[pbs->l[index_l]]);
-      
-          for (int index_m = 0; index_m <= index_m_max; ++index_m) {
 
-            /* TODO: Here I am doing a bit of free style, find a criterion */
-            int SPLINE_METHOD = (pbs->l[index_l]==2 ? _SPLINE_EST_DERIV_:_SPLINE_NATURAL_);
-
-            class_call_parallel (array_spline_table_one_column(
-                                   pbs2->xx + pbs2->index_xmin_J[index_J][index_L][index_l][index_m],
-                                   pbs2->x_size_J[index_J][index_L][index_l][index_m],
-                                   pbs2->J_Llm_x[index_J][index_L][index_l][index_m],
-                                   1,         /* Not used */    
-                                   0,         /* We need to spline just one function */   
-                                   pbs2->ddJ_Llm_x[index_J][index_L][index_l][index_m],
-                                   SPLINE_METHOD,
-                                   pbs2->error_message
-                                   ),
+          class_alloc_parallel (pbs2->J_flat_sky[index_J][index_L][index_l],
+            (index_m_max+1)*sizeof(double), pbs2->error_message);
+
+          for (int index_m = 0; index_m <= index_m_max; ++index_m)
+            class_call_parallel (bessel2_J_flat_sky (
+                                   ppr2,
+                                   pbs,
+                                   pbs2,
+                                   index_J,
+                                   index_L,
+                                   index_l,
+                                   index_m),
               pbs2->error_message,
               pbs2->error_message);
 
-          } // end of for(index_m)
-        #pragma omp flush(abort)
+          #pragma omp flush(abort)
         } // end of for(index_l)
         if (abort == _TRUE_) return _FAILURE_;
       } // end of for(index_L)
-    } // end of loop of projection function type
+    } // end of for(index_J)
+  }
 
 
-    /* Compute second derivatives of the j1_l in view of the spline interpolation. */
 
-    #pragma omp parallel for shared(pbs,abort)
-    for (int index_l1 = 0; index_l1 < pbs2->l1_size; ++index_l1) {
+  // ====================================================================================
+  // =                               Adaptive x-sampling                                =
+  // ====================================================================================
+
+  /* Retain only the points of pbs2->xx that are needed to interpolate the projection
+  functions J_Llm(x) and the spherical Bessel functions j_l1(x) within the tolerance
+  pbs2->x_tol, and compute the second derivatives needed for the spline interpolation.
+  The J will be used in the second-order transfer module to solve the line of sight
+  integral. */
 
-        int SPLINE_METHOD = _SPLINE_NATURAL_;
+  for (int index_J = 0; index_J < pbs2->J_size; ++index_J) {
 
-        class_call_parallel (array_spline_table_one_column(
-                               pbs2->xx + pbs2->index_xmin_l1[index_l1],
-                               pbs2->x_size_l1[index_l1],
-                               pbs2->j_l1[index_l1],
-                               1,                                                 /* Not used */    
-                               0,                                                 /* We need to spline just one function */   
-                               pbs2->ddj_l1[index_l1],
-                               SPLINE_METHOD,
-                               pbs2->error_message
-                               ),
-          pbs2->error_message,
-          pbs2->error_message);
+    for (int index_L = 0; index_L < pbs2->L_size; ++index_L) {
+
+      /* Beginning of parallel region */
+      abort = _FALSE_;
+      #pragma omp parallel for schedule (dynamic)
+      for (int index_l = 0; index_l < pbs2->l_size_J; ++index_l) {
 
+        int index_m_max = MIN (ppr2->index_m_max[pbs2->L[index_L]], ppr2->index_m_max[pbs->l[index_l]]);
+    
+        for (int index_m = 0; index_m <= index_m_max; ++index_m) {
+
+          /* TODO: Here I am doing a bit of free style, find a criterion */
+          int SPLINE_METHOD = (pbs->l[index_l]==2 ? _SPLINE_EST_DERIV_:_SPLINE_NATURAL_);
+
+          class_call_parallel (bessel2_x_sampling (
+                                 ppr,
+                                 pbs2,
+                                 pbs2->index_xmin_J[index_J][index_L][index_l][index_m],
+                                 &(pbs2->x_size_J[index_J][index_L][index_l][index_m]),
+                                 &(pbs2->J_Llm_x[index_J][index_L][index_l][index_m]),
+                                 (ppr->bessels_interpolation == cubic_interpolation ?
+                                   &(pbs2->ddJ_Llm_x[index_J][index_L][index_l][index_m]) : NULL),
+                                 &(pbs2->x_offset_J[index_J][index_L][index_l][index_m]),
+                                 &(pbs2->x_shift_J[index_J][index_L][index_l][index_m]),
+                                 SPLINE_METHOD,
+                                 pbs2->error_message
+                                 ),
+            pbs2->error_message,
+            pbs2->error_message);
+
+        } // end of for(index_m)
       #pragma omp flush(abort)
-    }
-    if (abort == _TRUE_) return _FAILURE_;
+      } // end of for(index_l)
+      if (abort == _TRUE_) return _FAILURE_;
+    } // end of for(index_L)
+  } // end of loop of projection function type
 
+  /* Same for j_l1(x), which is no longer needed on the full grid */
+  class_call (bessel2_x_sampling_j_l1 (ppr, pbs2),
+    pbs2->error_message,
+    pbs2->error_message);
 
-  } // end of spline calculation
+  /* Integrate the projection functions in x, if needed by the Filon quadrature of the
+  line of sight integral */
+  if (pbs2->has_J_moments == _TRUE_) {
+
+    class_call (bessel2_J_moments (ppr, ppr2, pbs, pbs2),
+      pbs2->error_message,
+      pbs2->error_message);
+
+  }
+
+  /* Determine the maximum size of the x-level in pbs2->J_Llm_x */
+  pbs2->x_size_max_J = 0;
+  for (int index_J = 0; index_J < pbs2->J_size; ++index_J)
+    for (int index_L = 0; index_L < pbs2->L_size; ++index_L)
+      for (int index_l = 0; index_l < pbs2->l_size_J; ++index_l)
+        for (int index_m = 0; index_m < MIN(ppr2->index_m_max[pbs2->L[index_L]],ppr2->index_m_max[pbs->l[index_l]])+1; ++index_m)                 
+          pbs2->x_size_max_J = MAX (pbs2->x_size_max_J, pbs2->x_size_J[index_J][index_L][index_l][index_m]);
+
+  /* Print information on the used memory */
+  if ((pbs2->bessels2_verbose > 1) && (pbs2->x_tol > 0))
+    printf (" -> adaptive x-sampling with tolerance %g: %ld points out of %ld are kept for j_l1(x) and J_Llm(x)\n",
+    pbs2->x_tol, pbs2->count_x_adaptive, pbs2->count_x_uniform);
+
+  if (pbs2->bessels2_verbose > 1)
+    printf (" -> memory in use to store the 2nd-order projection functions: ~ %3g MB\n",
+    8*pbs2->count_allocated_Js/1e6);
 
 
   return _SUCCESS_;
@@ -568,23 +655,30 @@ int bessel2_convolution (
     if (x < pbs2->x_min_l1[index_l])
       continue;
     
-    int index_x = (int)((x-pbs2->x_min_l1[index_l])/pbs2->xx_step);
-    double a = (pbs2->x_min_l1[index_l]+pbs2->xx_step*(index_x+1) - x)/pbs2->xx_step;
+    /* Find the position of x in pbs2->xx, and the point preceding it in the
+    adaptively sampled table (see documentation of the bessels2 structure) */
+    double u = (x-pbs2->x_min_l1[index_l])*pbs2->xx_step_inverse;
+    int index_x = pbs2->index_xmin_l1[index_l] + (int)u;
+    int index_block = index_x >> _BESSEL2_X_BLOCK_SHIFT_;
+    int shift = pbs2->x_shift_l1[index_l][index_block];
+    int index_node = pbs2->x_offset_l1[index_l][index_block] + (index_x >> shift);
+    double a = ((((index_x >> shift) + 1) << shift) - pbs2->index_xmin_l1[index_l] - u)
+               * pbs2->x_stride_inverse[shift];
 
     /* Store in 'j' the value of j_l(r*k) */
     if (ppr->bessels_interpolation == linear_interpolation) {
       
-      j = a * pbs2->j_l1[index_l][index_x] 
-          + (1.-a) * pbs2->j_l1[index_l][index_x+1];
+      j = a * pbs2->j_l1[index_l][index_node] 
+          + (1.-a) * pbs2->j_l1[index_l][index_node+1];
 
     }
     else if (ppr->bessels_interpolation == cubic_interpolation) {
 
-      j = a * pbs2->j_l1[index_l][index_x] 
-          + (1.-a) * ( pbs2->j_l1[index_l][index_x+1]
-            - a * ((a+1.) * pbs2->ddj_l1[index_l][index_x]
-            +(2.-a) * pbs2->ddj_l1[index_l][index_x+1]) 
-            * pbs2->xx_step * pbs2->xx_step / 6.0);
+      j = a * pbs2->j_l1[index_l][index_node] 
+          + (1.-a) * ( pbs2->j_l1[index_l][index_node+1]
+            - a * ((a+1.) * pbs2->ddj_l1[index_l][index_node]
+            +(2.-a) * pbs2->ddj_l1[index_l][index_node+1]) 
+            * pbs2->x_spline_factor[shift]);
     }
 
 
@@ -599,13 +693,302 @@ int bessel2_convolution (
    
   /* Divide the integral by a factor 1/2 to account for the trapezoidal rule */
   (*integral) *= 0.5;
-   
+
   return _SUCCESS_;
-  
+
 } // end of bessel_convolution
 
 
 
+
+/**
+ * Compute the convolution integral between a spherical Bessel function and up to
+ * two arrays, for all the frequencies in a grid.
+ *
+ * This is a batched version of bessel2_convolution(). Given the integration domain
+ * kk, the arrays f[index_kk] and g[index_kk] and the frequency grid rr[index_r],
+ * compute for each r in rr the following integral using the trapezoidal rule:
+ *
+ *     /
+ *    |  dk k^2 f[k] * g[k] * j_l1[k*r]
+ *    /
+ *
+ * and store it in integral[index_r].
+ *
+ * The result is the same as calling bessel2_convolution() in a loop over rr, but the
+ * integration grid is traversed only once. The r-independent part of the integrand,
+ * k^2*f[k]*g[k]*delta_kk[k], is computed once per k, the interpolation method is
+ * chosen outside the loops, and the inner loop over r only involves the table
+ * look-up of j_l1(k*r).
+ *
+ * The output array integral must have at least r_size elements. If you give a NULL
+ * pointer for the g function, then it is not used at all.
+ */
+
+int bessel2_convolution_multi_r (
+    struct precision * ppr, /**< pointer to precision structure */
+    struct bessels2 * pbs2, /**< pointer to Bessel2 structure, should be already initiated
+                            with bessel2_init() */
+    double * kk, /**< array with the integration grid in k */
+    double * delta_kk, /**< trapezoidal measure, compute as delta_k[i]=k[i+1]-k[i-1],
+                       and delta_k[0]=k[1]-k[0], delta_k[k_size-1]=k[k_size-1]-k[k_size-2] */
+    int k_size, /**< size of the integration grid in k */
+    double * f, /**< array with the integrand function f, of size k_size */
+    double * g, /**< array with the integrand function g, of size k_size; pass NULL
+                to automatically set it to unity */
+    int index_l, /**< order of the Bessel function, taken from the multipole array pbs2->l1 */
+    double * rr, /**< array with the frequencies of the Bessel function */
+    int r_size, /**< size of the rr array */
+    double * integral, /**< output, estimate of the integral for each value in rr; must be
+                       preallocated with r_size elements */
+    ErrorMsg error_message /**< string to write error message */
+    )
+{
+
+#ifdef DEBUG
+  /* Test that the Bessel functions have been computed for the requested
+  multipole index (index_l) and argument (x=k*r) */
+  class_test ((index_l<0) || (index_l>=pbs2->l1_size),
+    error_message,
+    "index_l=%d out of bounds (l1_size=%d)", index_l, pbs2->l1_size);
+
+  for (int index_r=0; index_r < r_size; ++index_r)
+    class_test ((kk[k_size-1]*rr[index_r])>pbs2->xx[pbs2->xx_size-1],
+      error_message,
+      "r*k_max=%g is larger than x_max=%g (index_l1=%d,r=%g,k_max=%g)",
+      kk[k_size-1]*rr[index_r], pbs2->xx[pbs2->xx_size-1], index_l, rr[index_r], kk[k_size-1]);
+#endif // DEBUG
+
+  /* Initialize the integrals */
+  for (int index_r=0; index_r < r_size; ++index_r)
+    integral[index_r] = 0;
+
+  /* Shortcuts to the Bessel table for the considered multipole. These do not
+  depend on k nor on r, so we extract them once and for all. */
+  double * j = pbs2->j_l1[index_l];
+  double * ddj = (ppr->bessels_interpolation == cubic_interpolation ? pbs2->ddj_l1[index_l] : NULL);
+  int * x_offset = pbs2->x_offset_l1[index_l];
+  short * x_shift = pbs2->x_shift_l1[index_l];
+  int index_x_min = pbs2->index_xmin_l1[index_l];
+  double x_min = pbs2->x_min_l1[index_l];
+  double x_step_inverse = pbs2->xx_step_inverse;
+  double * x_stride_inverse = pbs2->x_stride_inverse;
+  double * spline_factor = pbs2->x_spline_factor;
+
+  /* Loop over the integration grid */
+  for (int index_k = 0; index_k < k_size; ++index_k) {
+
+    /* If the function f or g vanish, do not bother computing the Bessel function,
+    and jump to the next iteration without incrementing the integral. See comment
+    in bessel2_convolution(). */
+    if (f[index_k] == 0.)
+      continue;
+
+    if ((g != NULL) && (g[index_k] == 0.))
+      continue;
+
+    /* Value of the considered k */
+    double k = kk[index_k];
+
+    /* Weight of the integrand at this k, which does not depend on r */
+    double weight = k * k * f[index_k] * delta_kk[index_k];
+
+    if (g != NULL)
+      weight *= g[index_k];
+
+    /* Interpolate j_l(k*r) and increment the integral for each r. As in
+    bessel2_convolution(), j_l(x) vanishes for x < x_min(l). */
+    if (ppr->bessels_interpolation == linear_interpolation) {
+
+      for (int index_r = 0; index_r < r_size; ++index_r) {
+        double x = k*rr[index_r];
+        if (x < x_min)
+          continue;
+        double u = (x-x_min)*x_step_inverse;
+        int index_x = index_x_min + (int)u;
+        int index_block = index_x >> _BESSEL2_X_BLOCK_SHIFT_;
+        int shift = x_shift[index_block];
+        int n = x_offset[index_block] + (index_x >> shift);
+        double a = ((((index_x >> shift) + 1) << shift) - index_x_min - u) * x_stride_inverse[shift];
+        integral[index_r] += weight * (a*j[n] + (1.-a)*j[n+1]);
+      }
+    }
+
+    else if (ppr->bessels_interpolation == cubic_interpolation) {
+
+      for (int index_r = 0; index_r < r_size; ++index_r) {
+        double x = k*rr[index_r];
+        if (x < x_min)
+          continue;
+        double u = (x-x_min)*x_step_inverse;
+        int index_x = index_x_min + (int)u;
+        int index_block = index_x >> _BESSEL2_X_BLOCK_SHIFT_;
+        int shift = x_shift[index_block];
+        int n = x_offset[index_block] + (index_x >> shift);
+        double a = ((((index_x >> shift) + 1) << shift) - index_x_min - u) * x_stride_inverse[shift];
+        integral[index_r] += weight * (a*j[n] + (1.-a)*(j[n+1]
+          - a*((a+1.)*ddj[n] + (2.-a)*ddj[n+1])*spline_factor[shift]));
+      }
+    }
+
+  } // end of for(index_k)
+
+  /* Divide the integral by a factor 1/2 to account for the trapezoidal rule */
+  for (int index_r=0; index_r < r_size; ++index_r)
+    integral[index_r] *= 0.5;
+
+  return _SUCCESS_;
+
+} // end of bessel2_convolution_multi_r
+
+
+
+
+/**
+ * Tabulate the spherical Bessel function j_l1(k*r) on a (k,r) grid.
+ *
+ * The result is stored in the preallocated matrix j_matrix, with k_size rows
+ * and r_size columns, addressed as j_matrix[index_k*r_size + index_r]. The matrix
+ * can be fed to bessel2_convolution_matrix() to compute the convolution integral
+ * of bessel2_convolution_multi_r() as a matrix product.
+ *
+ * The Bessel function is interpolated from the pbs2->j_l1 table, using the same
+ * method as in bessel2_convolution(). The entries where j_l1(k*r) is negligible
+ * are set to zero.
+ */
+
+int bessel2_j_matrix (
+    struct precision * ppr, /**< pointer to precision structure */
+    struct bessels2 * pbs2, /**< pointer to Bessel2 structure, should be already initiated
+                            with bessel2_init() */
+    double * kk, /**< array with the k-grid */
+    int k_size, /**< size of the k-grid */
+    int index_l, /**< order of the Bessel function, taken from the multipole array pbs2->l1 */
+    double * rr, /**< array with the r-grid */
+    int r_size, /**< size of the r-grid */
+    double * j_matrix, /**< output, matrix with j_l1(k*r), must be preallocated with
+                       k_size*r_size elements */
+    ErrorMsg error_message /**< string to write error message */
+    )
+{
+
+  double * j = pbs2->j_l1[index_l];
+  double * ddj = (ppr->bessels_interpolation == cubic_interpolation ? pbs2->ddj_l1[index_l] : NULL);
+  int * x_offset = pbs2->x_offset_l1[index_l];
+  short * x_shift = pbs2->x_shift_l1[index_l];
+  int index_x_min = pbs2->index_xmin_l1[index_l];
+  double x_min = pbs2->x_min_l1[index_l];
+  double x_step_inverse = pbs2->xx_step_inverse;
+
+  for (int index_k = 0; index_k < k_size; ++index_k) {
+
+    double * row = j_matrix + (long int)index_k*r_size;
+
+    for (int index_r = 0; index_r < r_size; ++index_r) {
+
+      double x = kk[index_k]*rr[index_r];
+
+      if (x < x_min) {
+        row[index_r] = 0;
+        continue;
+      }
+
+      class_test (x > pbs2->xx_max,
+        error_message,
+        "x=%g is larger than xx_max=%g (index_l1=%d)", x, pbs2->xx_max, index_l);
+
+      double u = (x-x_min)*x_step_inverse;
+      int index_x = index_x_min + (int)u;
+      int index_block = index_x >> _BESSEL2_X_BLOCK_SHIFT_;
+      int shift = x_shift[index_block];
+      int n = x_offset[index_block] + (index_x >> shift);
+      double a = ((((index_x >> shift) + 1) << shift) - index_x_min - u) * pbs2->x_stride_inverse[shift];
+
+      if (ppr->bessels_interpolation == linear_interpolation)
+        row[index_r] = a*j[n] + (1.-a)*j[n+1];
+
+      else if (ppr->bessels_interpolation == cubic_interpolation)
+        row[index_r] = a*j[n] + (1.-a)*(j[n+1]
+          - a*((a+1.)*ddj[n] + (2.-a)*ddj[n+1])*pbs2->x_spline_factor[shift]);
+
+    }
+  }
+
+  return _SUCCESS_;
+
+}
+
+
+
+
+/**
+ * Compute the convolution integral of several arrays with a spherical Bessel
+ * function tabulated on a (k,r) grid, as a matrix product.
+ *
+ * Given the matrix j_matrix[index_k*r_size + index_r] = j_l1(k*r) computed with
+ * bessel2_j_matrix(), and f_size integrand arrays stored contiguously in
+ * f[index_f*k_size + index_k], compute
+ *
+ *                         /
+ *    integral[f][r]  =   |  dk k^2 f[k] * j_l1[k*r]
+ *                        /
+ *
+ * using the trapezoidal rule. The result is stored in integral[index_f*r_size + index_r].
+ * For f_size=1, the result is equivalent to that of bessel2_convolution_multi_r().
+ *
+ * The integral is the product between the (f_size x k_size) matrix of the weighted
+ * integrands, k^2*f[k]*delta_kk[k]/2, and the (k_size x r_size) Bessel matrix. We
+ * compute the product in blocks of _BESSEL2_R_BLOCK_ columns, so that a block of the
+ * output row stays in cache while the Bessel matrix is streamed row by row.
+ */
+
+int bessel2_convolution_matrix (
+    double * kk, /**< array with the integration grid in k */
+    double * delta_kk, /**< trapezoidal measure, see bessel2_convolution() */
+    int k_size, /**< size of the integration grid in k */
+    double * f, /**< matrix with the integrand functions, of size f_size*k_size */
+    int f_size, /**< number of integrand functions in f */
+    double * j_matrix, /**< matrix with j_l1(k*r), of size k_size*r_size, as computed
+                       by bessel2_j_matrix() */
+    int r_size, /**< number of columns in j_matrix */
+    double * integral, /**< output, matrix of size f_size*r_size with the integrals */
+    ErrorMsg error_message /**< string to write error message */
+    )
+{
+
+  for (int index_f = 0; index_f < f_size; ++index_f) {
+
+    double * f_row = f + (long int)index_f*k_size;
+    double * out = integral + (long int)index_f*r_size;
+
+    for (int index_r=0; index_r < r_size; ++index_r)
+      out[index_r] = 0;
+
+    for (int index_r_block = 0; index_r_block < r_size; index_r_block += _BESSEL2_R_BLOCK_) {
+
+      int index_r_end = MIN (index_r_block + _BESSEL2_R_BLOCK_, r_size);
+
+      for (int index_k = 0; index_k < k_size; ++index_k) {
+
+        if (f_row[index_k] == 0.)
+          continue;
+
+        double weight = 0.5 * kk[index_k] * kk[index_k] * f_row[index_k] * delta_kk[index_k];
+        double * j_row = j_matrix + (long int)index_k*r_size;
+
+        for (int index_r = index_r_block; index_r < index_r_end; ++index_r)
+          out[index_r] += weight * j_row[index_r];
+
+      }
+    }
+  }
+
+  return _SUCCESS_;
+
+}
+
+
+
 /** 
  * Compute the spherical Bessel function j_l1(x) using spline interpolation.
  *
@@ -644,19 +1027,26 @@ int bessel2_l1_at_x(
       pbs2->error_message,
       "x=%e>xx_max=%e in bessel structure",x,pbs2->xx_max);
 
-    /* Find index_x, i.e. the position of x in the table; no complicated algorithm needed,
-    since values are linearly spaced with a known step and known first value. */
+    /* Find index_x, i.e. the position of x in pbs2->xx; no complicated algorithm needed,
+    since values are linearly spaced with a known step and known first value. Then find
+    the position in the table of the preceding point, using the block structure of the
+    adaptive sampling. */
 
-    int index_x = (int)((x-pbs2->x_min_l1[index_l1])/pbs2->xx_step);
-    double a = (pbs2->x_min_l1[index_l1]+pbs2->xx_step*(index_x+1) - x)/pbs2->xx_step;
+    double u = (x-pbs2->x_min_l1[index_l1])*pbs2->xx_step_inverse;
+    int index_x = pbs2->index_xmin_l1[index_l1] + (int)u;
+    int index_block = index_x >> _BESSEL2_X_BLOCK_SHIFT_;
+    int shift = pbs2->x_shift_l1[index_l1][index_block];
+    int index_node = pbs2->x_offset_l1[index_l1][index_block] + (index_x >> shift);
+    double a = ((((index_x >> shift) + 1) << shift) - pbs2->index_xmin_l1[index_l1] - u)
+               * pbs2->x_stride_inverse[shift];
 
     /* Find result with spline interpolation */
 
-    *j_l1 = a * pbs2->j_l1[index_l1][index_x] 
-      + (1.-a) * ( pbs2->j_l1[index_l1][index_x+1]
-          - a * ((a+1.) * pbs2->ddj_l1[index_l1][index_x]
-           +(2.-a) * pbs2->ddj_l1[index_l1][index_x+1]) 
-          * pbs2->xx_step * pbs2->xx_step / 6.0);
+    *j_l1 = a * pbs2->j_l1[index_l1][index_node] 
+      + (1.-a) * ( pbs2->j_l1[index_l1][index_node+1]
+          - a * ((a+1.) * pbs2->ddj_l1[index_l1][index_node]
+           +(2.-a) * pbs2->ddj_l1[index_l1][index_node+1]) 
+          * pbs2->x_spline_factor[shift]);
 
   }
   
@@ -706,17 +1096,22 @@ int bessel2_l1_at_x_linear(
       pbs2->error_message,
       "x=%e>xx_max=%e in bessel structure",x,pbs2->xx_max);
 
-    /* Find index_x, i.e. the position of x in the table; no complicated algorithm needed,
-    since values are linearly spaced with a known step and known first value. */
+    /* Find index_x, i.e. the position of x in pbs2->xx, and the position in the table
+    of the preceding point, as in bessel2_l1_at_x() */
 
-    int index_x = (int)((x-pbs2->x_min_l1[index_l1])/pbs2->xx_step);
-    double a = (pbs2->x_min_l1[index_l1]+pbs2->xx_step*(index_x+1) - x)/pbs2->xx_step;
+    double u = (x-pbs2->x_min_l1[index_l1])*pbs2->xx_step_inverse;
+    int index_x = pbs2->index_xmin_l1[index_l1] + (int)u;
+    int index_block = index_x >> _BESSEL2_X_BLOCK_SHIFT_;
+    int shift = pbs2->x_shift_l1[index_l1][index_block];
+    int index_node = pbs2->x_offset_l1[index_l1][index_block] + (index_x >> shift);
+    double a = ((((index_x >> shift) + 1) << shift) - pbs2->index_xmin_l1[index_l1] - u)
+               * pbs2->x_stride_inverse[shift];
 
     /* Find result with linear interpolation (same as spline, but keep only
     the terms linear in a) */
 
-    *j_l1 = a * pbs2->j_l1[index_l1][index_x] 
-          + (1.-a) * pbs2->j_l1[index_l1][index_x+1];
+    *j_l1 = a * pbs2->j_l1[index_l1][index_node] 
+          + (1.-a) * pbs2->j_l1[index_l1][index_node+1];
 
   }
   
@@ -746,7 +1141,7 @@ int bessel2_free(
   
       for (int index_L = 0; index_L < pbs2->L_size; index_L++) {
   
-        for (int index_l = 0; index_l < pbs->l_size; index_l++) {
+        for (int index_l = 0; index_l < pbs2->l_size_J; index_l++) {
   
           int index_m_max = MIN (ppr2->index_m_max[pbs2->L[index_L]], ppr2->index_m_max[pbs->l[index_l]]);
   
@@ -755,6 +1150,12 @@ int bessel2_free(
             free(pbs2->J_Llm_x[index_J][index_L][index_l][index_m]);
             if (ppr->bessels_interpolation == cubic_interpolation)
               free(pbs2->ddJ_Llm_x[index_J][index_L][index_l][index_m]);
+            free(pbs2->x_offset_J[index_J][index_L][index_l][index_m]);
+            free(pbs2->x_shift_J[index_J][index_L][index_l][index_m]);
+            if (pbs2->has_J_moments == _TRUE_) {
+              free(pbs2->J_int_0[index_J][index_L][index_l][index_m]);
+              free(pbs2->J_int_1[index_J][index_L][index_l][index_m]);
+            }
         
           }  // end of for(index_m)
       
@@ -764,6 +1165,12 @@ int bessel2_free(
           free(pbs2->J_Llm_x[index_J][index_L][index_l]);
           if (ppr->bessels_interpolation == cubic_interpolation)
             free(pbs2->ddJ_Llm_x[index_J][index_L][index_l]);
+          free(pbs2->x_offset_J[index_J][index_L][index_l]);
+          free(pbs2->x_shift_J[index_J][index_L][index_l]);
+          if (pbs2->has_J_moments == _TRUE_) {
+            free(pbs2->J_int_0[index_J][index_L][index_l]);
+            free(pbs2->J_int_1[index_J][index_L][index_l]);
+          }
       
         }  // end of for(index_l)
     
@@ -773,6 +1180,12 @@ int bessel2_free(
         free(pbs2->J_Llm_x[index_J][index_L]);
         if (ppr->bessels_interpolation == cubic_interpolation)
           free(pbs2->ddJ_Llm_x[index_J][index_L]);
+        free(pbs2->x_offset_J[index_J][index_L]);
+        free(pbs2->x_shift_J[index_J][index_L]);
+        if (pbs2->has_J_moments == _TRUE_) {
+          free(pbs2->J_int_0[index_J][index_L]);
+          free(pbs2->J_int_1[index_J][index_L]);
+        }
     
       }  // end of for(index_L)
   
@@ -782,6 +1195,12 @@ int bessel2_free(
       free(pbs2->J_Llm_x[index_J]);
       if (ppr->bessels_interpolation == cubic_interpolation)
         free(pbs2->ddJ_Llm_x[index_J]);
+      free(pbs2->x_offset_J[index_J]);
+      free(pbs2->x_shift_J[index_J]);
+      if (pbs2->has_J_moments == _TRUE_) {
+        free(pbs2->J_int_0[index_J]);
+        free(pbs2->J_int_1[index_J]);
+      }
   
     } // end of for(index_J)
   
@@ -791,6 +1210,24 @@ int bessel2_free(
     free(pbs2->J_Llm_x);
     if (ppr->bessels_interpolation == cubic_interpolation)
       free(pbs2->ddJ_Llm_x);
+    free(pbs2->x_offset_J);
+    free(pbs2->x_shift_J);
+    if (pbs2->has_J_moments == _TRUE_) {
+      free(pbs2->J_int_0);
+      free(pbs2->J_int_1);
+    }
+
+    if (pbs2->J_flat_sky != NULL) {
+      for (int index_J = 0; index_J < pbs2->J_size; ++index_J) {
+        for (int index_L = 0; index_L < pbs2->L_size; index_L++) {
+          for (int index_l = 0; index_l < pbs->l_size; index_l++)
+            free(pbs2->J_flat_sky[index_J][index_L][index_l]);
+          free(pbs2->J_flat_sky[index_J][index_L]);
+        }
+        free(pbs2->J_flat_sky[index_J]);
+      }
+      free(pbs2->J_flat_sky);
+    }
 
   }
   
@@ -799,9 +1236,14 @@ int bessel2_free(
   
   free(pbs2->x_size_l1);
   free(pbs2->x_min_l1);
-  for (int index_l1=0; index_l1<pbs2->l1_size; ++index_l1)
+  for (int index_l1=0; index_l1<pbs2->l1_size; ++index_l1) {
     free(pbs2->j_l1[index_l1]);
+    free(pbs2->x_offset_l1[index_l1]);
+    free(pbs2->x_shift_l1[index_l1]);
+  }
   free(pbs2->j_l1);
+  free(pbs2->x_offset_l1);
+  free(pbs2->x_shift_l1);
   if (ppr->bessels_interpolation == cubic_interpolation) {
     for (int index_l1=0; index_l1<pbs2->l1_size; ++index_l1)
       free(pbs2->ddj_l1[index_l1]);
@@ -979,6 +1421,20 @@ int bessel2_get_xx_list(
   pbs2->xx_size = pbs2->xx_max/pbs2->xx_step + 1;
   class_alloc (pbs2->xx, pbs2->xx_size*sizeof(double), pbs2->error_message);
   lin_space (pbs2->xx, 0, pbs2->xx_max, pbs2->xx_size);
+  pbs2->xx_step_inverse = 1/pbs2->xx_step;
+
+  /* Divide xx in blocks for the adaptive sampling of the Bessel tables, and precompute the
+  factors needed to interpolate them for all the allowed strides */
+  pbs2->x_block_size = ((pbs2->xx_size-1) >> _BESSEL2_X_BLOCK_SHIFT_) + 1;
+
+  for (int shift=0; shift <= _BESSEL2_X_BLOCK_SHIFT_; ++shift) {
+    double stride = 1 << shift;
+    pbs2->x_stride_inverse[shift] = 1/stride;
+    pbs2->x_spline_factor[shift] = stride*pbs2->xx_step * stride*pbs2->xx_step / 6.0;
+  }
+
+  pbs2->count_x_uniform = 0;
+  pbs2->count_x_adaptive = 0;
   
   return _SUCCESS_;
 
@@ -988,6 +1444,370 @@ int bessel2_get_xx_list(
 
 
 
+/**
+ * Thin out the x-sampling of a Bessel table computed on the uniform grid pbs2->xx, and
+ * compute its spline coefficients.
+ *
+ * The input table f contains the function at the points of pbs2->xx starting from
+ * index_x_min, and has x_size elements. The grid is divided in blocks of
+ * 2^_BESSEL2_X_BLOCK_SHIFT_ points; for each block, we keep one point every 2^shift,
+ * where shift is the largest value such that the estimated interpolation error within
+ * the block stays below pbs2->x_tol times the maximum of |f|. For linear interpolation,
+ * the error is computed exactly on the skipped points; for cubic interpolation, it is
+ * estimated as 5/384*h^4*max|f''''|, with h=2^shift*xx_step and the fourth derivative
+ * computed with finite differences on the original grid.
+ *
+ * The points in the region where j_l1(x) or J_Llm(x) are exponentially small, and
+ * in the regions where they vary slowly, are thus sampled more sparsely than in the
+ * oscillating region, where the stride is limited by the period of the oscillations.
+ * The block that contains index_x_min and the last block of pbs2->xx are always fully
+ * sampled. If pbs2->x_tol is zero, all points are kept.
+ *
+ * On output, f is replaced by the thinned table and x_size by its new size; the arrays
+ * x_offset and x_shift, which are needed to address f (see documentation of the bessels2
+ * structure), are allocated and filled. If ppr->bessels_interpolation is cubic, the
+ * second derivatives of f are computed with the given spline method and stored in ddf,
+ * which is allocated here.
+ */
+
+int bessel2_x_sampling (
+       struct precision * ppr,
+       struct bessels2 * pbs2,
+       int index_x_min, /**< input, index in pbs2->xx of the first point in f */
+       int * x_size, /**< input/output, number of points in f */
+       double ** f, /**< input/output, table to be thinned out */
+       double ** ddf, /**< output, second derivatives of the thinned table (only for cubic interpolation) */
+       int ** x_offset, /**< output, offset of each block of pbs2->xx in the thinned table */
+       short ** x_shift, /**< output, log2 of the stride used in each block of pbs2->xx */
+       int spline_method, /**< input, spline method for the second derivatives */
+       ErrorMsg error_message /**< output, error message */
+       )
+{
+
+  int block_points = 1 << _BESSEL2_X_BLOCK_SHIFT_;
+  int size = *x_size;
+  double * y = *f;
+
+  class_alloc (*x_offset, pbs2->x_block_size*sizeof(int), error_message);
+  class_alloc (*x_shift, pbs2->x_block_size*sizeof(short), error_message);
+
+  /* Reference scale for the interpolation error */
+  double y_max = 0;
+  for (int index_x=0; index_x < size; ++index_x)
+    y_max = MAX (y_max, fabs(y[index_x]));
+
+  double tolerance = pbs2->x_tol * y_max;
+
+  /* Position of the grid points that we shall keep, needed for the splines */
+  double * x_nodes;
+  class_alloc (x_nodes, size*sizeof(double), error_message);
+
+  /* Number of points kept so far */
+  int index_node = 0;
+
+  for (int index_block=0; index_block < pbs2->x_block_size; ++index_block) {
+
+    int index_x_first = index_block << _BESSEL2_X_BLOCK_SHIFT_;
+    int index_x_end = MIN (index_x_first + block_points, pbs2->xx_size);
+
+    /* Blocks that precede the table are never accessed; we set them as if they were sampled
+    with unit stride, so that index_x-index_x_min is still a valid index for them */
+    if (index_x_end <= index_x_min) {
+      (*x_offset)[index_block] = -index_x_min;
+      (*x_shift)[index_block] = 0;
+      continue;
+    }
+
+    /* Find the largest stride allowed by the tolerance. We can skip points only if the block
+    is entirely contained in the table, including its last point, which is the first point of
+    the next block */
+    int shift = 0;
+
+    if ((tolerance > 0) && (size > 1) && (index_x_first >= index_x_min)
+    && (index_x_first + block_points <= pbs2->xx_size-1)) {
+
+      /* Position of the block in the table */
+      int first = index_x_first - index_x_min;
+      int last = first + block_points;
+
+      /* Fourth-order differences on the original grid, used to estimate the spline error */
+      double d4_max = 0;
+      if (ppr->bessels_interpolation == cubic_interpolation) {
+        for (int i=first; i <= last; ++i) {
+          int c = MIN (MAX (i, 2), size-3);
+          if (c < 2) break;
+          d4_max = MAX (d4_max, fabs(y[c-2] - 4*y[c-1] + 6*y[c] - 4*y[c+1] + y[c+2]));
+        }
+      }
+
+      for (int trial_shift=_BESSEL2_X_BLOCK_SHIFT_; trial_shift > 0; --trial_shift) {
+
+        int stride = 1 << trial_shift;
+        double error = 0;
+
+        if (ppr->bessels_interpolation == linear_interpolation) {
+          for (int i=first; i < last; i += stride)
+            for (int j=1; j < stride; ++j)
+              error = MAX (error, fabs(y[i+j] - y[i] - (y[i+stride]-y[i])*j/(double)stride));
+        }
+        else if (ppr->bessels_interpolation == cubic_interpolation) {
+          error = 5/384. * pow(stride,4) * d4_max;
+        }
+
+        if (error <= tolerance) {
+          shift = trial_shift;
+          break;
+        }
+      }
+    }
+
+    /* Store the points of this block, and the offset needed to find them */
+    int index_x_start = MAX (index_x_first, index_x_min);
+    (*x_offset)[index_block] = index_node - (index_x_start >> shift);
+    (*x_shift)[index_block] = shift;
+
+    for (int index_x=index_x_start; index_x < index_x_end; index_x += 1 << shift) {
+      x_nodes[index_node] = pbs2->xx[index_x];
+      y[index_node++] = y[index_x - index_x_min];
+    }
+  }
+
+  class_test (index_node > size,
+    error_message,
+    "stopping to prevent segmentation fault");
+
+  /* Shrink the table to the retained points */
+  if (index_node < size) {
+    double * y_thin;
+    class_alloc (y_thin, index_node*sizeof(double), error_message);
+    for (int i=0; i < index_node; ++i)
+      y_thin[i] = y[i];
+    free (y);
+    *f = y_thin;
+  }
+
+  #pragma omp atomic
+  pbs2->count_allocated_Js -= size - index_node;
+
+  #pragma omp atomic
+  pbs2->count_x_uniform += size;
+
+  #pragma omp atomic
+  pbs2->count_x_adaptive += index_node;
+
+  *x_size = index_node;
+
+  /* Compute the second derivatives for the spline interpolation on the new grid */
+  if (ppr->bessels_interpolation == cubic_interpolation) {
+
+    class_calloc (*ddf, index_node, sizeof(double), error_message);
+
+    #pragma omp atomic
+    pbs2->count_allocated_Js += index_node;
+
+    if (index_node > 2) {
+      class_call (array_spline_table_one_column(
+                    x_nodes,
+                    index_node,
+                    *f,
+                    1,         /* Not used */
+                    0,         /* We need to spline just one function */
+                    *ddf,
+                    spline_method,
+                    error_message
+                    ),
+        error_message,
+        error_message);
+    }
+  }
+
+  free (x_nodes);
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Compute the cumulative integrals of the projection functions J_Llm(x) needed by
+ * the Filon quadrature of the line of sight integral (see transfer2_integrate_filon()).
+ *
+ * For each (J,L,l,m), we compute on the same nodes as pbs2->J_Llm_x the integrals
+ *
+ *   J_int_0(x) = int_{x_min_J}^x dx' J_Llm(x'),
+ *   J_int_1(x) = int_{x_min_J}^x dx' x' J_Llm(x'),
+ *
+ * treating J_Llm(x) as linear between two nodes. This is consistent with the linear
+ * interpolation of J in transfer2_integrate_filon(), which adds the contribution of
+ * the partial interval between the node and x.
+ *
+ * Must be called after the adaptive x-sampling, because the integrals are stored
+ * on the thinned nodes. The arrays pbs2->J_int_0 and pbs2->J_int_1 are allocated
+ * and filled here.
+ */
+
+int bessel2_J_moments (
+       struct precision * ppr,
+       struct precision2 * ppr2,
+       struct bessels * pbs,
+       struct bessels2 * pbs2
+       )
+{
+
+  /* Allocate the (J,L,l,m) levels */
+  class_alloc (pbs2->J_int_0, pbs2->J_size*sizeof(double****), pbs2->error_message);
+  class_alloc (pbs2->J_int_1, pbs2->J_size*sizeof(double****), pbs2->error_message);
+
+  for (int index_J = 0; index_J < pbs2->J_size; ++index_J) {
+
+    class_alloc (pbs2->J_int_0[index_J], pbs2->L_size*sizeof(double***), pbs2->error_message);
+    class_alloc (pbs2->J_int_1[index_J], pbs2->L_size*sizeof(double***), pbs2->error_message);
+
+    for (int index_L=0; index_L<pbs2->L_size; ++index_L) {
+
+      class_alloc (pbs2->J_int_0[index_J][index_L], pbs->l_size*sizeof(double**), pbs2->error_message);
+      class_alloc (pbs2->J_int_1[index_J][index_L], pbs->l_size*sizeof(double**), pbs2->error_message);
+
+      for (int index_l=0; index_l<pbs2->l_size_J; ++index_l) {
+
+        int m_size = MIN (ppr2->index_m_max[pbs2->L[index_L]], ppr2->index_m_max[pbs->l[index_l]]) + 1;
+        class_alloc (pbs2->J_int_0[index_J][index_L][index_l], m_size*sizeof(double*), pbs2->error_message);
+        class_alloc (pbs2->J_int_1[index_J][index_L][index_l], m_size*sizeof(double*), pbs2->error_message);
+
+      }
+    }
+  }
+
+  /* Fill the integrals */
+  for (int index_J = 0; index_J < pbs2->J_size; ++index_J) {
+
+    for (int index_L = 0; index_L < pbs2->L_size; ++index_L) {
+
+      /* Beginning of parallel region */
+      int abort = _FALSE_;
+      #pragma omp parallel for schedule (dynamic)
+      for (int index_l = 0; index_l < pbs2->l_size_J; ++index_l) {
+
+        int index_m_max = MIN (ppr2->index_m_max[pbs2->L[index_L]], ppr2->index_m_max[pbs->l[index_l]]);
+
+        for (int index_m = 0; index_m <= index_m_max; ++index_m) {
+
+          int index_x_min = pbs2->index_xmin_J[index_J][index_L][index_l][index_m];
+          int x_size = pbs2->x_size_J[index_J][index_L][index_l][index_m];
+          int * x_offset = pbs2->x_offset_J[index_J][index_L][index_l][index_m];
+          short * x_shift = pbs2->x_shift_J[index_J][index_L][index_l][index_m];
+          double * J = pbs2->J_Llm_x[index_J][index_L][index_l][index_m];
+
+          class_alloc_parallel (pbs2->J_int_0[index_J][index_L][index_l][index_m], x_size*sizeof(double), pbs2->error_message);
+          class_alloc_parallel (pbs2->J_int_1[index_J][index_L][index_l][index_m], x_size*sizeof(double), pbs2->error_message);
+          double * J_int_0 = pbs2->J_int_0[index_J][index_L][index_l][index_m];
+          double * J_int_1 = pbs2->J_int_1[index_J][index_L][index_l][index_m];
+
+          #pragma omp atomic
+          pbs2->count_allocated_Js += 2*x_size;
+
+          /* Walk through the nodes in the same order as they are stored, that is, block
+          by block starting from index_x_min */
+          int index_node = 0;
+          double x_node = 0;
+
+          for (int index_block = index_x_min >> _BESSEL2_X_BLOCK_SHIFT_;
+               (index_block < pbs2->x_block_size) && (index_node < x_size); ++index_block) {
+
+            int index_x_first = MAX (index_block << _BESSEL2_X_BLOCK_SHIFT_, index_x_min);
+            int index_x_end = MIN ((index_block+1) << _BESSEL2_X_BLOCK_SHIFT_, pbs2->xx_size);
+            int stride = 1 << x_shift[index_block];
+
+            for (int index_x=index_x_first; (index_x < index_x_end) && (index_node < x_size); index_x += stride) {
+
+              class_test_parallel (x_offset[index_block] + (index_x >> x_shift[index_block]) != index_node,
+                pbs2->error_message,
+                "inconsistent adaptive sampling for J_Llm(x), bug in the code");
+
+              /* Position of the node, consistent with the look-up of J(x) via pbs2->xx_step_inverse */
+              double x = index_x * pbs2->xx_step;
+
+              if (index_node == 0) {
+                J_int_0[0] = 0;
+                J_int_1[0] = 0;
+              }
+              else {
+                double h = x - x_node;
+                J_int_0[index_node] = J_int_0[index_node-1] + h/2 * (J[index_node-1] + J[index_node]);
+                J_int_1[index_node] = J_int_1[index_node-1] + h/6 * (J[index_node-1]*(2*x_node + x) + J[index_node]*(x_node + 2*x));
+              }
+
+              x_node = x;
+              index_node++;
+            }
+          }
+
+          class_test_parallel (index_node != x_size,
+            pbs2->error_message,
+            "found %d nodes instead of %d for J_Llm(x), bug in the code", index_node, x_size);
+
+        } // end of for(index_m)
+      #pragma omp flush(abort)
+      } // end of for(index_l)
+      if (abort == _TRUE_) return _FAILURE_;
+    } // end of for(index_L)
+  } // end of for(index_J)
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Apply the adaptive x-sampling of bessel2_x_sampling() to the spherical Bessel
+ * functions j_l1(x) in pbs2->j_l1, and compute their spline coefficients.
+ *
+ * This must be called after the projection functions J_Llm(x) have been computed,
+ * because bessel2_J_Llm() needs j_l1(x) on the full grid pbs2->xx.
+ */
+
+int bessel2_x_sampling_j_l1 (
+       struct precision * ppr,
+       struct bessels2 * pbs2
+       )
+{
+
+  class_alloc (pbs2->x_offset_l1, pbs2->l1_size*sizeof(int*), pbs2->error_message);
+  class_alloc (pbs2->x_shift_l1, pbs2->l1_size*sizeof(short*), pbs2->error_message);
+
+  int abort = _FALSE_;
+  #pragma omp parallel for schedule (dynamic)
+  for (int index_l1 = 0; index_l1 < pbs2->l1_size; ++index_l1) {
+
+    class_call_parallel (bessel2_x_sampling (
+                           ppr,
+                           pbs2,
+                           pbs2->index_xmin_l1[index_l1],
+                           &(pbs2->x_size_l1[index_l1]),
+                           &(pbs2->j_l1[index_l1]),
+                           (ppr->bessels_interpolation == cubic_interpolation ? &(pbs2->ddj_l1[index_l1]) : NULL),
+                           &(pbs2->x_offset_l1[index_l1]),
+                           &(pbs2->x_shift_l1[index_l1]),
+                           _SPLINE_NATURAL_,
+                           pbs2->error_message
+                           ),
+      pbs2->error_message,
+      pbs2->error_message);
+
+    #pragma omp flush(abort)
+  }
+  if (abort == _TRUE_) return _FAILURE_;
+
+  return _SUCCESS_;
+
+}
+
+
+
+
+
 /**
  * Compute the projection function J_Llm(x) for all values of x where it is
  * non-negligible, given the source index L, the multipole index l and the
@@ -1362,12 +2182,8 @@ int bessel2_J_for_Llm (
   class_calloc (pbs2->J_Llm_x[index_J][index_L][index_l][index_m], x_size_J, sizeof(double), pbs2->error_message);
   #pragma omp atomic
   pbs2->count_allocated_Js += x_size_J;
-  
-  if (ppr->bessels_interpolation == cubic_interpolation) {
-    class_calloc (pbs2->ddJ_Llm_x[index_J][index_L][index_l][index_m], x_size_J, sizeof(double), pbs2->error_message);
-    #pragma omp atomic
-    pbs2->count_allocated_Js += x_size_J;
-  }
+
+  /* The memory for the spline coefficients pbs2->ddJ_Llm_x will be allocated in bessel2_x_sampling() */
   
   /* Define a shorthand for J_Llm_x */
   double * J_Llm_x = pbs2->J_Llm_x[index_J][index_L][index_l][index_m];
@@ -1589,6 +2405,139 @@ int bessel2_J_Llm (
 
 
 
+/**
+ * Compute the coefficient C_Llm of the projection function J_Llm(x) in the flat-sky
+ * limit, and store it in pbs2->J_flat_sky[index_J][index_L][index_l][index_m].
+ *
+ * The projection function is a sum of spherical Bessel functions j_l1(x) with
+ * |l-L| <= l1 <= l+L, weighted by 3j-symbols (see bessel2_J_Llm()). For l >> L, the
+ * j_l1(x) are all close to j_l(x) around x ~ l, where they peak and where the line of
+ * sight integral gets most of its contribution. Replacing them with j_l(x) yields
+ * J_Llm(x) ~ C_Llm j_l(x), where C_Llm is the sum of the weights. This corresponds
+ * to the flat-sky limit, where the line of sight is perpendicular to the wavevector.
+ *
+ * The accuracy of the approximation is checked in the transfer2.c module against the
+ * exact projection functions, for the multipoles just below ppr2->l_flat_sky_song.
+ */
+
+int bessel2_J_flat_sky (
+       struct precision2 * ppr2,
+       struct bessels * pbs,
+       struct bessels2 * pbs2,
+       int index_J,
+       int index_L,
+       int index_l,
+       int index_m
+       )
+{
+
+  /* Shortcuts */
+  int L = pbs2->L[index_L];
+  int l = pbs->l[index_l];
+  int m = pbs2->m[index_m];
+  double * C = &(pbs2->J_flat_sky[index_J][index_L][index_l][index_m]);
+
+  *C = 0;
+
+  /* Determine the projection function and its spin, as in bessel2_J_for_Llm() */
+  enum projection_function_types projection_function;
+  int S;
+
+  if ((pbs2->has_J_TT==_TRUE_) && (index_J==pbs2->index_J_TT)) {
+    projection_function = J_TT;
+    S = 0;
+  }
+  else if ((pbs2->has_J_EE==_TRUE_) && (index_J==pbs2->index_J_EE)) {
+    projection_function = J_EE;
+    S = 2;
+  }
+  else if ((pbs2->has_J_EB==_TRUE_) && (index_J==pbs2->index_J_EB)) {
+    projection_function = J_EB;
+    S = 2;
+  }
+
+  /* The projection function vanishes if the spin is larger than l or L, and the mixing
+  one vanishes for m=0 */
+  if ((abs(S)>l) || (abs(S)>L) || ((projection_function==J_EB) && (m==0)))
+    return _SUCCESS_;
+
+  /* Compute the 3j symbols (l1 L l)(0 S -S) and (l1 L l)(0 -m m) for all allowed l1 */
+  double * first_3j;
+  double * second_3j;
+  class_alloc (first_3j, (2*pbs2->L_max+1)*sizeof(double), pbs2->error_message);
+  class_alloc (second_3j, (2*pbs2->L_max+1)*sizeof(double), pbs2->error_message);
+  double l1_min_D, l1_max_D;
+
+  class_call (drc3jj(
+                L, l, S, -S,
+                &l1_min_D, &l1_max_D,
+                first_3j,
+                (2*pbs2->L_max+1),
+                pbs2->error_message
+                ),
+    pbs2->error_message,
+    pbs2->error_message);
+
+  int l1_min = (int)(l1_min_D + _EPS_);
+  int l1_size = (int)(l1_max_D + _EPS_) - l1_min + 1;
+
+  if ((S!=0) || (m!=0)) {
+    class_call (drc3jj(
+                  L, l, -m, m,
+                  &l1_min_D, &l1_max_D,
+                  second_3j,
+                  (2*pbs2->L_max+1),
+                  pbs2->error_message
+                  ),
+      pbs2->error_message,
+      pbs2->error_message);
+  }
+  else {
+    for(int index_l1=0; index_l1<l1_size; ++index_l1)
+      second_3j[index_l1] = first_3j[index_l1];
+  }
+
+  /* Sum the weights of the j_l1(x) in J_Llm(x), with the same parity rules and
+  prefactors as in bessel2_J_Llm() */
+  for(int index_l1=0; index_l1<l1_size; ++index_l1) {
+
+    if (first_3j[index_l1]==0)
+      continue;
+
+    int l1 = l1_min + index_l1;
+    short is_even = ((l-l1-L)%2==0);
+    double i_prefactor;
+
+    if ((projection_function==J_TT)||(projection_function==J_EE)) {
+      if (is_even)
+        i_prefactor = ALTERNATING_SIGN((l-l1-L)/2);
+      else
+        continue;
+    }
+    else if (projection_function==J_EB) {
+      if (!is_even)
+        i_prefactor = ALTERNATING_SIGN((l-l1-L-1)/2);
+      else
+        continue;
+    }
+
+    *C += i_prefactor * (2*l1+1) * first_3j[index_l1] * second_3j[index_l1];
+
+  } // end of for(index_l1)
+
+  /* Apply l1-independent factors */
+  *C *= ALTERNATING_SIGN(m) * (2*l+1);
+
+  free (first_3j);
+  free (second_3j);
+
+  return _SUCCESS_;
+
+}
+
+
+
+
 /**
  * Compute the projection function J_Llm(x) without relying on the precomputed
  * spherical Bessel in pbs2->j_l1.
@@ -1772,11 +2721,7 @@ int bessel2_j_for_l1(
   #pragma omp atomic
   pbs2->count_allocated_Js += pbs2->x_size_l1[index_l1];
 
-  if (ppr->bessels_interpolation == cubic_interpolation) {
-    class_alloc (pbs2->ddj_l1[index_l1], sizeof(double)*pbs2->x_size_l1[index_l1], pbs2->error_message);
-    #pragma omp atomic
-    pbs2->count_allocated_Js += pbs2->x_size_l1[index_l1];
-  }  
+  /* The memory for the spline coefficients pbs2->ddj_l1 will be allocated in bessel2_x_sampling() */
 
 
   // ====================================================================================
@@ -8,6 +8,7 @@
  */
 
 #include "bispectra2.h"
+#include <stdint.h>
 
 
 /**
@@ -78,6 +79,11 @@ int bispectra2_init (
 
 
 
+  /* A dry run only prints the memory plan; there is no bispectrum to store */
+  if (ppr2->intrinsic_dry_run == _TRUE_)
+    return _SUCCESS_;
+
+
   // ====================================================================================
   // =                              Save bispectra to disk                              =
   // ====================================================================================
@@ -189,7 +195,42 @@ int bispectra2_harmonic (
       pbi->error_message,
       pbi->error_message);
 
-    /* Perform the bispectrum integration */
+    /* Divide the l3 range in blocks that fit in the memory budget */
+    class_call (bispectra2_intrinsic_memory_plan(
+                  ppr2,
+                  pbi,
+                  pwb),
+      pbi->error_message,
+      pbi->error_message);
+
+    /* If we only wanted to see the memory plan, stop here. The bispectra array was
+    not filled, so we return before checking it; the caller is expected to stop
+    the run after bispectra2_init (see song.c). */
+    if (ppr2->intrinsic_dry_run == _TRUE_) {
+
+      if (pbi->bispectra_verbose > 0)
+        printf(" -> dry run: memory plan printed, the intrinsic bispectrum was not computed\n");
+
+      class_call (bispectra2_intrinsic_workspace_free(
+                    ppt2,
+                    ptr2,
+                    pbi,
+                    pwb),
+        pbi->error_message,
+        pbi->error_message);
+
+      return _SUCCESS_;
+    }
+
+    /* Compute or load the 3j symbols that enter the geometrical factors */
+    class_call (bispectra2_geometrical_factors_cache_init(
+                  ppr,
+                  ppr2,
+                  pbi,
+                  pwb),
+      pbi->error_message,
+      pbi->error_message);
+
     class_call (bispectra2_intrinsic_init(
                   ppr,
                   ppr2,
@@ -204,6 +245,12 @@ int bispectra2_harmonic (
                   pwb),
       pbi->error_message,
       pbi->error_message);
+
+    class_call (bispectra2_geometrical_factors_cache_free(
+                  pbi,
+                  pwb),
+      pbi->error_message,
+      pbi->error_message);
   
     /* Free the 'pwb' workspace */
     class_call (bispectra2_intrinsic_workspace_free(
@@ -216,20 +263,6 @@ int bispectra2_harmonic (
   
   }
 
-  
-    
-  // ================================================================================
-  // =                           Add four-point corrections                         =
-  // ================================================================================
-
-  /* Add to the intrinsic bispectrum with the quadratic correction intended to turn
-  the brightness temperature to the bolometric one (Sec. 3.2 of
-  http://arxiv.org/abs/1401.3296), and absorb the redshift term of Boltzmann equation
-  (Sec. 3.1 of http://arxiv.org/abs/1401.3296). */
-  class_call (bispectra2_add_quadratic_corrections (ppr,ppr2,pba,ppt,ppt2,pbs,pbs2,ptr,ptr2,ppm,psp,pbi),
-    pbi->error_message,
-    pbi->error_message);
-
   /* Check that we correctly filled the bispectra array */
   class_test (pbi->count_allocated_for_bispectra != pbi->count_memorised_for_bispectra,
     pbi->error_message,
@@ -241,53 +274,6 @@ int bispectra2_harmonic (
     printf(" -> memorised ~ %.3g MB (%ld doubles) in the bispectra array\n",
       pbi->count_memorised_for_bispectra*sizeof(double)/1e6, pbi->count_memorised_for_bispectra);
 
-  
-  
-  // ================================================================================
-  // =                                 Check for nans                               =
-  // ================================================================================
-
-  for (int index_bt = 0; index_bt < pbi->bt_size; ++index_bt) {
-
-    /* We have not computed the intrinsic bispectra yet, so we skip them */
-    if (pbi->bispectrum_type[index_bt] != intrinsic_bispectrum)
-      continue;
-
-    for (int X = 0; X < pbi->bf_size; ++X) {
-      for (int Y = 0; Y < pbi->bf_size; ++Y) {
-        for (int Z = 0; Z < pbi->bf_size; ++Z) {
-    
-          #pragma omp parallel for
-          for (int index_l1 = 0; index_l1 < pbi->l_size; ++index_l1) {
-            for (int index_l2 = 0; index_l2 <= index_l1; ++index_l2) {
-     
-              /* Determine the limits for l3, which come from the triangular inequality
-              |l1-l2| <= l3 <= l1+l2 */
-              int index_l3_min = pbi->index_l_triangular_min[index_l1][index_l2];
-              int index_l3_max = MIN (index_l2, pbi->index_l_triangular_max[index_l1][index_l2]);
-     
-              for (int index_l3=index_l3_min; index_l3<=index_l3_max; ++index_l3) {
-
-                /* Index of the current (l1,l2,l3) configuration */
-                long int index_l1_l2_l3 = pbi->index_l1_l2_l3[index_l1][index_l1-index_l2][index_l3_max-index_l3];
-          
-                double bispectrum = pbi->bispectra[index_bt][X][Y][Z][index_l1_l2_l3];
-   
-                /* Check for nan's and crazy values. A value is crazy when it is much larger than
-                the characteristic scale for a bispectrum, A_s*A_s~1e-20 */   
-                if ((isnan(bispectrum)) || (fabs(bispectrum)>1))
-                  printf ("@@@ WARNING: b(%d,%d,%d) = %g for bispectrum '%s_%s'.\n",
-                  pbi->l[index_l1], pbi->l[index_l2], pbi->l[index_l3], bispectrum,
-                  pbi->bt_labels[index_bt], pbi->bfff_labels[X][Y][Z]);
-
-              } // end of for(index_l3)
-            } // end of for(index_l2)
-          } // end of for(index_l1)
-        } // end of for(X)
-      } // end of for(Y)
-    } // end of for(Z)
-  } // end of for(index_bt)  
-  
   return _SUCCESS_;
 
 }
@@ -421,148 +407,228 @@ int bispectra2_intrinsic_init (
     if (pbi->bispectrum_type[index_bt] != intrinsic_bispectrum)
       continue;        
 
-    /* The XYZ indices refer to the considered field (T,E...). The first, X, refers to the
-    second order perturbation, X=T^(2),E^(2)..., while Y and Z refer to the first-order ones:
-    X -> second-order, Y -> first-order, Z -> first-order. This association ceases to be valid
-    after we add the two extra bispectrum permutations, which effectively symmetrise the 
-    bispectrum with respect to the position of the second-order field. 
-    Nota also that, in this function, each field has a fixed wavemode and multipole associated:
-    X -> (l3,k3), Y -> (l2,k2), Z -> (l1,k1). */
+    /* Choose the configurations to compute in the first pass of the integration */
+    class_call (bispectra2_intrinsic_sampling_init (ppr2, pbi, pwb),
+      pbi->error_message,
+      pbi->error_message);
+
+    /* Coefficient of the quadratic correction, added in bispectra2_intrinsic_postprocess() */
+    class_call (bispectra2_quadratic_correction (ppt2, pbi, &pwb->quadratic_correction),
+      pbi->error_message,
+      pbi->error_message);
+
+    /* Read the field combinations (XYZ) of the bispectrum that were computed in a previous run */
+    for (int X=0; X < pbi->bf_size; ++X)
+      for (int Y=0; Y < pbi->bf_size; ++Y)
+        for (int Z=0; Z < pbi->bf_size; ++Z)
+          pwb->loaded_bispectrum[X][Y][Z] = _FALSE_;
+
+    if (ppr2->intrinsic_incremental == _TRUE_)
+      class_call (bispectra2_intrinsic_load_blocks (ppr, ppr2, pbi, index_bt, pwb),
+        pbi->error_message,
+        pbi->error_message);
+
+    /* The symmetrised bispectrum XYZ is the sum of the unsymmetrised ones XYZ, YXZ and ZYX
+    (see the end of this function), so these are the only ones we need to integrate for
+    the missing field combinations */
+    for (int X=0; X < pbi->bf_size; ++X)
+      for (int Y=0; Y < pbi->bf_size; ++Y)
+        for (int Z=0; Z < pbi->bf_size; ++Z)
+          pwb->compute_unsymmetrised[X][Y][Z] = _FALSE_;
 
     for (int X=0; X < pbi->bf_size; ++X) {
+      for (int Y=0; Y < pbi->bf_size; ++Y) {
+        for (int Z=0; Z < pbi->bf_size; ++Z) {
+          if (pwb->loaded_bispectrum[X][Y][Z] == _FALSE_) {
+            pwb->compute_unsymmetrised[X][Y][Z] = _TRUE_;
+            pwb->compute_unsymmetrised[Y][X][Z] = _TRUE_;
+            pwb->compute_unsymmetrised[Z][Y][X] = _TRUE_;
+          }
+        }
+      }
+    }
 
-      pwb->X = X;
+    /* With an adaptive l-sampling, we integrate twice: first on a coarse set of configurations,
+    then on those where the interpolation of the first pass is not accurate enough (see
+    bispectra2_intrinsic_sampling_refine()). The other configurations are interpolated below. */
+    int n_passes = ((ppr2->intrinsic_adaptive_stride > 1) ? 2 : 1);
 
-      if (pbi->bispectra_verbose > 0)
-        printf(" -> computing intrinsic bispectrum with %s^(2), r sampled %d times in [%g,%g]\n",
-        pbi->bf_labels[X], pwb->r_size, pwb->r_min, pwb->r_max);
+    for (int index_pass=0; index_pass < n_passes; ++index_pass) {
+
+      if (index_pass > 0) {
+
+        class_call (bispectra2_intrinsic_sampling_refine (ppr2, pbi, pwb),
+          pbi->error_message,
+          pbi->error_message);
+
+        if (pbi->bispectra_verbose > 0)
+          printf(" -> adaptive l-sampling: refining %ld configurations, after computing %ld\n",
+            pwb->count_pending_configurations, pwb->count_computed_configurations);
+
+        if (pwb->count_pending_configurations == 0)
+          break;
+      }
+      else if ((pbi->bispectra_verbose > 0) && (n_passes > 1)) {
+        printf(" -> adaptive l-sampling: computing %ld configurations in the first pass\n",
+          pwb->count_pending_configurations);
+      }
+
+      /* The XYZ indices refer to the considered field (T,E...). The first, X, refers to the
+      second order perturbation, X=T^(2),E^(2)..., while Y and Z refer to the first-order ones:
+      X -> second-order, Y -> first-order, Z -> first-order. This association ceases to be valid
+      after we add the two extra bispectrum permutations, which effectively symmetrise the 
+      bispectrum with respect to the position of the second-order field. 
+      Nota also that, in this function, each field has a fixed wavemode and multipole associated:
+      X -> (l3,k3), Y -> (l2,k2), Z -> (l1,k1). */
+
+      for (int X=0; X < pbi->bf_size; ++X) {
+
+        pwb->X = X;
+
+        /* Find the first and last (Y,Z) pair to integrate for this X. If there is none, all the
+        bispectra involving X^(2) were read from disk and we can skip also the integral over k3 */
+        pwb->first_Y = pwb->first_Z = pwb->last_Y = pwb->last_Z = -1;
+
+        for (int Y=0; Y < pbi->bf_size; ++Y) {
+          for (int Z=0; Z < pbi->bf_size; ++Z) {
+            if (pwb->compute_unsymmetrised[X][Y][Z] == _TRUE_) {
+              if (pwb->first_Y < 0) {
+                pwb->first_Y = Y;
+                pwb->first_Z = Z;
+              }
+              pwb->last_Y = Y;
+              pwb->last_Z = Z;
+            }
+          }
+        }
+
+        if (pwb->first_Y < 0) {
+          if ((pbi->bispectra_verbose > 0) && (index_pass == 0))
+            printf(" -> skipping intrinsic bispectrum with %s^(2), read from disk\n", pbi->bf_labels[X]);
+          continue;
+        }
+
+        if (pbi->bispectra_verbose > 0)
+          printf(" -> computing intrinsic bispectrum with %s^(2), r sampled %d times in [%g,%g]\n",
+          pbi->bf_labels[X], pwb->r_size, pwb->r_min, pwb->r_max);
 
-      // -------------------------------------------------------------------------------------
-      // -                              Cycle over M3, L3, L1                                -
-      // -------------------------------------------------------------------------------------
+        // -------------------------------------------------------------------------------------
+        // -                              Cycle over M3, L3, L1                                -
+        // -------------------------------------------------------------------------------------
     
-      for (int index_M3=0; index_M3 < ppr2->m_size; ++index_M3) {
+        for (int index_M3=0; index_M3 < ppr2->m_size; ++index_M3) {
+
+          /* Update the structure with the current value of M3 */
+          pwb->M3 = ppr2->m[index_M3];
+          pwb->abs_M3 = abs(ppr2->m[index_M3]);
+
+          /* In the tiles layout, the transfer functions for all the l3 values of the current
+          (X,M3) are stored together on disk. Load them in one pass, and keep them for all
+          values of offset_L3. */
+          short load_tile = ((ppr2->load_transfers_from_disk == _TRUE_) || (ppr2->store_transfers_to_disk == _TRUE_))
+                            && (ptr2->transfers_layout == tile_transfers_layout);
 
-        /* Update the structure with the current value of M3 */
-        pwb->M3 = ppr2->m[index_M3];
-        pwb->abs_M3 = abs(ppr2->m[index_M3]);
+          int index_tile = (pwb->index_tt2_of_bf[X]/ptr2->n_transfers)*ptr2->m_size + index_M3;
 
-        /* Cycle on offset_L3, which is related to L3 by L3 = |l3-|M3|| + offset_L3 */
-        for (int offset_L3=0; offset_L3 < (2*pwb->abs_M3+1); ++offset_L3) {
+          if (load_tile == _TRUE_)
+            class_call (transfer2_load_tile_from_disk (ppt2, ptr2, index_tile),
+              ptr2->error_message,
+              pbi->error_message);
+
+          /* Cycle on offset_L3, which is related to L3 by L3 = |l3-|M3|| + offset_L3 */
+          for (int offset_L3=0; offset_L3 < (2*pwb->abs_M3+1); ++offset_L3) {
 
-          pwb->offset_L3 = offset_L3;
+            pwb->offset_L3 = offset_L3;
         
-          if (pbi->bispectra_verbose > 2)
-            printf ("   \\ computing (M3=%d, offset_L3=%d) contribution to the bispectrum\n",
-              pwb->M3, offset_L3);
+            if (pbi->bispectra_verbose > 2)
+              printf ("   \\ computing (M3=%d, offset_L3=%d) contribution to the bispectrum\n",
+                pwb->M3, offset_L3);
 
-          /* The geometrical factors in the bispectrum formula include the 3j symbol (l3,L3,|M3|)(M3,0,-M3).
-          By itself, this 3j does not constrain offset_L3. However, for a given M3 we have a sum
-          over |M3| and -|M3|. The only quantities that depend on the sign of M3 are:
+            /* The geometrical factors in the bispectrum formula include the 3j symbol (l3,L3,|M3|)(M3,0,-M3).
+            By itself, this 3j does not constrain offset_L3. However, for a given M3 we have a sum
+            over |M3| and -|M3|. The only quantities that depend on the sign of M3 are:
 
-          (l3,L3,|M3|)(M3,0,-M3) * \bar{T}_l3_M3
+            (l3,L3,|M3|)(M3,0,-M3) * \bar{T}_l3_M3
         
-          For intensity and E-mode polarisation, \bar{T}_l3_-|M3| = \bar{T}_l3_|M3| which means that the bispectrum
-          is proportional to (l3,L3,|M3|)(|M3|,0,-|M3|) + (l3,L3,|M3|)(-|M3|,0,|M3|). Switching the sign of the
-          second line of a 3j introduces a factor (-1)^(l3+L3+|M3|) which is equal to (-1)^offset_L3. Hence,
-          for intensity offset_L3 has to be even.
+            For intensity and E-mode polarisation, \bar{T}_l3_-|M3| = \bar{T}_l3_|M3| which means that the bispectrum
+            is proportional to (l3,L3,|M3|)(|M3|,0,-|M3|) + (l3,L3,|M3|)(-|M3|,0,|M3|). Switching the sign of the
+            second line of a 3j introduces a factor (-1)^(l3+L3+|M3|) which is equal to (-1)^offset_L3. Hence,
+            for intensity offset_L3 has to be even.
         
-          For B-modes, \bar{T}_l3_-|M3| = - \bar{T}_l3_|M3| which means that the bispectrum is
-          proportional to (l3,L3,|M3|)(|M3|,0,-|M3|) - (l3,L3,|M3|)(-|M3|,0,|M3|). Hence,
-          for B-modes, offset_L3 has to be odd. */
-          short skip_condition;
+            For B-modes, \bar{T}_l3_-|M3| = - \bar{T}_l3_|M3| which means that the bispectrum is
+            proportional to (l3,L3,|M3|)(|M3|,0,-|M3|) - (l3,L3,|M3|)(-|M3|,0,|M3|). Hence,
+            for B-modes, offset_L3 has to be odd. */
+            short skip_condition;
+
+            if (pwb->bispectrum_parity == _EVEN_)
+              skip_condition = (offset_L3%2!=0);
+            else
+              skip_condition = (offset_L3%2==0);
+
+            if (skip_condition) {
+              if (pbi->bispectra_verbose > 2)
+                printf ("      \\ skipping offset_L3=%d for symmetry reasons\n", offset_L3);
+              continue;
+            }
 
-          if (pwb->bispectrum_parity == _EVEN_)
-            skip_condition = (offset_L3%2!=0);
-          else
-            skip_condition = (offset_L3%2==0);
+            // -------------------------------------------------------------------
+            // -                        Compute 4D integral                      -
+            // -------------------------------------------------------------------
 
-          if (skip_condition) {
-            if (pbi->bispectra_verbose > 2)
-              printf ("      \\ skipping offset_L3=%d for symmetry reasons\n", offset_L3);
-            continue;
-          }
+            /* Process the l3 values in the blocks planned by bispectra2_intrinsic_memory_plan(),
+            so that the intermediate arrays fit in memory */
+            for (int index_block=0; index_block < pwb->l3_block_size; ++index_block) {
 
-          // -------------------------------------------------------------------
-          // -                        Compute 4D integral                      -
-          // -------------------------------------------------------------------
-
-          /* Compute fist integral over k3 */
-          class_call (bispectra2_intrinsic_integrate_over_k3(
-                        ppr,
-                        ppr2,
-                        ppt,
-                        ppt2,
-                        pbs,
-                        pbs2,
-                        ptr,
-                        ptr2,
-                        ppm,
-                        pbi,
-                        pwb->index_tt2_of_bf[X],
-                        index_M3,
-                        offset_L3,
-                        pwb),
-            pbi->error_message,
-            pbi->error_message);
+              pwb->index_l3_min = pwb->index_l3_block[index_block];
+              pwb->index_l3_max = pwb->index_l3_block[index_block+1] - 1;
 
+              /* Skip the blocks without configurations to compute in this pass */
+              short has_pending_l3 = _FALSE_;
+              for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3)
+                has_pending_l3 = has_pending_l3 || pwb->has_pending_l3[index_l3];
 
-          for (int Y=0; Y < pbi->bf_size; ++Y) {
+              if (has_pending_l3 == _FALSE_)
+                continue;
 
-            pwb->Y = Y;
-        
-            /* Compute second integral over k2 */
-            class_call (bispectra2_intrinsic_integrate_over_k2(
-                          ppr,
-                          ppr2,
-                          ppt,
-                          ppt2,
-                          pbs,
-                          pbs2,
-                          ptr,
-                          ptr2,
-                          ppm,
-                          pbi,
-                          pbi->index_tt_of_bf[Y],
-                          pwb),
-              pbi->error_message,
-              pbi->error_message);
+              if ((pbi->bispectra_verbose > 2) && (pwb->l3_block_size > 1))
+                printf ("    * processing l3 block %d of %d, l3=%d to %d\n", index_block+1, pwb->l3_block_size,
+                  pbi->l[pwb->index_l3_min], pbi->l[pwb->index_l3_max]);
+
+              /* Compute fist integral over k3 */
+              class_call (bispectra2_intrinsic_integrate_over_k3(
+                            ppr,
+                            ppr2,
+                            ppt,
+                            ppt2,
+                            pbs,
+                            pbs2,
+                            ptr,
+                            ptr2,
+                            ppm,
+                            pbi,
+                            pwb->index_tt2_of_bf[X],
+                            index_M3,
+                            offset_L3,
+                            pwb),
+                pbi->error_message,
+                pbi->error_message);
 
-            /* Cycle on offset_L1, which is related to L1 by L1 = |l1-|M1|| + offset_L1 */
-            for (int offset_L1=0; offset_L1 < (2*pwb->abs_M3+1); ++offset_L1) {
-            
-              pwb->offset_L1 = offset_L1;
-            
-              if (pbi->bispectra_verbose > 3)
-                printf ("     * computing (M3=%d, offset_L3=%d, offset_L1=%d) contribution to the bispectrum\n",
-                  pwb->M3, offset_L3, offset_L1);
-            
-              /* The geometrical factors involve a 3j symbol (l1,L1,|M3|)(0,0,0) which enforces
-              that l1+L1+M3 is even. Hence offset_L1 =L1-|l1-|M3|| has to be even. This
-              is valid for the B-modes bispectrum, too. */
-              if (offset_L1%2!=0) { 
-                if (pbi->bispectra_verbose > 2)
-                  printf ("      \\ skipping offset_L1=%d for symmetry reasons\n", offset_L1);
-                continue;
-              }  
-            
-              /* Loop on the last first-order perturbation, k=T,E,... */
-              for (int Z=0; Z < pbi->bf_size; ++Z) {
 
-                pwb->Z = Z;
-                          
-                if ((pbi->bispectra_verbose > 1) && (ppr2->m_max_song==0))
-                  printf("   \\ computing bispectrum %s_%s%s%s for m=%d\n",
-                  pbi->bt_labels[index_bt], pbi->bf_labels[X], pbi->bf_labels[Y], pbi->bf_labels[Z], pwb->M3);
+              for (int Y=0; Y < pbi->bf_size; ++Y) {
 
-                else if ((pbi->bispectra_verbose > 1) && (ppr2->m_max_song>0))
-                  printf("   \\ computing bispectrum %s_%s%s%s for (m,offset_l3,offset_l1)=(%d,%d,%d)\n",
-                  pbi->bt_labels[index_bt], pbi->bf_labels[X], pbi->bf_labels[Y], pbi->bf_labels[Z],
-                  pwb->M3, offset_L3, offset_L1);
+                pwb->Y = Y;
 
-                          
-                /* Compute the third integral over k1 */
-                class_call (bispectra2_intrinsic_integrate_over_k1 (
+                /* Skip the first-order fields whose bispectra were all read from disk; the integral
+                over k3 is shared by the remaining ones */
+                short compute_Y = _FALSE_;
+                for (int Z=0; Z < pbi->bf_size; ++Z)
+                  compute_Y = compute_Y || pwb->compute_unsymmetrised[X][Y][Z];
+
+                if (compute_Y == _FALSE_)
+                  continue;
+        
+                /* Compute second integral over k2 */
+                class_call (bispectra2_intrinsic_integrate_over_k2(
                               ppr,
                               ppr2,
                               ppt,
@@ -573,62 +639,141 @@ int bispectra2_intrinsic_init (
                               ptr2,
                               ppm,
                               pbi,
-                              pbi->index_tt_of_bf[Z],
-                              offset_L1,
+                              pbi->index_tt_of_bf[Y],
                               pwb),
                   pbi->error_message,
                   pbi->error_message);
+
+                /* Cycle on offset_L1, which is related to L1 by L1 = |l1-|M1|| + offset_L1 */
+                for (int offset_L1=0; offset_L1 < (2*pwb->abs_M3+1); ++offset_L1) {
+            
+                  pwb->offset_L1 = offset_L1;
+            
+                  if (pbi->bispectra_verbose > 3)
+                    printf ("     * computing (M3=%d, offset_L3=%d, offset_L1=%d) contribution to the bispectrum\n",
+                      pwb->M3, offset_L3, offset_L1);
+            
+                  /* The geometrical factors involve a 3j symbol (l1,L1,|M3|)(0,0,0) which enforces
+                  that l1+L1+M3 is even. Hence offset_L1 =L1-|l1-|M3|| has to be even. This
+                  is valid for the B-modes bispectrum, too. */
+                  if (offset_L1%2!=0) { 
+                    if (pbi->bispectra_verbose > 2)
+                      printf ("      \\ skipping offset_L1=%d for symmetry reasons\n", offset_L1);
+                    continue;
+                  }  
+            
+                  /* Loop on the last first-order perturbation, k=T,E,... */
+                  for (int Z=0; Z < pbi->bf_size; ++Z) {
+
+                    if (pwb->compute_unsymmetrised[X][Y][Z] == _FALSE_)
+                      continue;
+
+                    pwb->Z = Z;
+                          
+                    if ((pbi->bispectra_verbose > 1) && (ppr2->m_max_song==0))
+                      printf("   \\ computing bispectrum %s_%s%s%s for m=%d\n",
+                      pbi->bt_labels[index_bt], pbi->bf_labels[X], pbi->bf_labels[Y], pbi->bf_labels[Z], pwb->M3);
+
+                    else if ((pbi->bispectra_verbose > 1) && (ppr2->m_max_song>0))
+                      printf("   \\ computing bispectrum %s_%s%s%s for (m,offset_l3,offset_l1)=(%d,%d,%d)\n",
+                      pbi->bt_labels[index_bt], pbi->bf_labels[X], pbi->bf_labels[Y], pbi->bf_labels[Z],
+                      pwb->M3, offset_L3, offset_L1);
+
+                          
+                    /* Compute the third integral over k1 */
+                    class_call (bispectra2_intrinsic_integrate_over_k1 (
+                                  ppr,
+                                  ppr2,
+                                  ppt,
+                                  ppt2,
+                                  pbs,
+                                  pbs2,
+                                  ptr,
+                                  ptr2,
+                                  ppm,
+                                  pbi,
+                                  pbi->index_tt_of_bf[Z],
+                                  offset_L1,
+                                  pwb),
+                      pbi->error_message,
+                      pbi->error_message);
                       
                       
-                /* Compute the fourth and last integral over r */
-                class_call (bispectra2_intrinsic_integrate_over_r (
-                              ppr,
-                              ppr2,
-                              ppt,
-                              ppt2,
-                              pbs,
-                              pbs2,
-                              ptr,
-                              ptr2,
-                              ppm,
-                              pbi,
-                              pwb),
-                  pbi->error_message,
-                  pbi->error_message);
+                    /* Compute the fourth and last integral over r */
+                    class_call (bispectra2_intrinsic_integrate_over_r (
+                                  ppr,
+                                  ppr2,
+                                  ppt,
+                                  ppt2,
+                                  pbs,
+                                  pbs2,
+                                  ptr,
+                                  ptr2,
+                                  ppm,
+                                  pbi,
+                                  pwb),
+                      pbi->error_message,
+                      pbi->error_message);
                       
-                // ===========================================================================
-                // =                           Deal with geometry                            =
-                // ===========================================================================
+                    // ===========================================================================
+                    // =                           Deal with geometry                            =
+                    // ===========================================================================
                           
-                /* Compute the geometrical factors (3j's and a 6j) appearing outside of the integral.
-                Store the result in pwb->unsymmetrised_bispectrum[X][Y][Z][index_l1][index_l2][index_l3] */
-                class_call (bispectra2_intrinsic_geometrical_factors (
-                              ppr,
-                              ppr2,
-                              ppt,
-                              ppt2,
-                              pbs,
-                              pbs2,
-                              ptr,
-                              ptr2,
-                              ppm,
-                              pbi,
-                              index_bt,
-                              index_M3,
-                              offset_L3,
-                              offset_L1,
-                              pwb->unsymmetrised_bispectrum[X][Y][Z], /* out */
-                              pwb),
-                  pbi->error_message,
-                  pbi->error_message);
+                    /* Compute the geometrical factors (3j's and a 6j) appearing outside of the integral.
+                    Store the result in pwb->unsymmetrised_bispectrum[X][Y][Z][index_l1][index_l2][index_l3] */
+                    class_call (bispectra2_intrinsic_geometrical_factors (
+                                  ppr,
+                                  ppr2,
+                                  ppt,
+                                  ppt2,
+                                  pbs,
+                                  pbs2,
+                                  ptr,
+                                  ptr2,
+                                  ppm,
+                                  pbi,
+                                  index_bt,
+                                  index_M3,
+                                  offset_L3,
+                                  offset_L1,
+                                  pwb->unsymmetrised_bispectrum[X][Y][Z], /* out */
+                                  pwb),
+                      pbi->error_message,
+                      pbi->error_message);
                           
-              } // end of loop on field 'Z'
-            } // end of loop on L1
+                  } // end of loop on field 'Z'
+                } // end of loop on L1
               
-          } // end of loop on field 'Y'
-        } // end of loop on L3
-      } // end of loop on M3  
-    } // end of loop on field 'X'
+              } // end of loop on field 'Y'
+            } // end of loop on l3 blocks
+          } // end of loop on L3
+
+          if (load_tile == _TRUE_)
+            class_call (transfer2_free_tile_level (ppt2, ptr2, index_tile),
+              ptr2->error_message,
+              pbi->error_message);
+
+        } // end of loop on M3  
+      } // end of loop on field 'X'
+    } // end of loop on passes
+
+    /* Fill the configurations that were not computed by interpolation */
+    class_call (bispectra2_intrinsic_sampling_interpolate (pbi, pwb),
+      pbi->error_message,
+      pbi->error_message);
+
+    if (n_passes > 1) {
+
+      if (pbi->bispectra_verbose > 0)
+        printf(" -> adaptive l-sampling: computed %ld configurations and interpolated %ld (%.3g%%)\n",
+          pwb->count_computed_configurations, pwb->count_interpolated_configurations,
+          100.*pwb->count_interpolated_configurations/(pwb->count_computed_configurations+pwb->count_interpolated_configurations));
+
+      if (ppr->store_bispectra_to_disk == _TRUE_)
+        class_call (bispectra2_intrinsic_sampling_store (ppr, ppr2, pbi, index_bt, pwb),
+          pbi->error_message,
+          pbi->error_message);
+    }
 
     // ====================================================================================
     // =                               Consistency checks                                 =
@@ -653,6 +798,9 @@ int bispectra2_intrinsic_init (
           for (int X=0; X < pbi->bf_size; ++X) {
             for (int Y=0; Y < pbi->bf_size; ++Y) {
               for (int Z=0; Z < pbi->bf_size; ++Z) {
+
+                if (pwb->compute_unsymmetrised[X][Y][Z] == _FALSE_)
+                  continue;
           
                 // -------------------------------------------------------------------
                 // -                           Parity check                          -
@@ -742,55 +890,21 @@ wrong/non_negl=%g, <diff> of matches=%g, <diff> of wrongs=%g\n",
     // =                                 Add bispectrum permutations                                  =
     // ================================================================================================
 
-    /* At second-order, the bispectrum < X_l1 Y_l2 Z_l3 > is approximated by:
-      < X^(2)_l1 Y^(1)_l2 Z^(1)_l3 >
-    + < X^(1)_l1 Y^(2)_l2 Z^(1)_l3 >
-    + < X^(1)_l1 Y^(1)_l2 Z^(2)_l3 >. 
-    Here, we build this object from pwb->unsymmetrised_bispectrum. The ordering of its 6 levels is
-    such that:
-    < X^(2)_l1 Y^(1)_l2 Z^(1)_l3 > = pwb->unsymmetrised_bispectrum[X][Y][Z][l1][l2][l3]
-    that is, the second-order transfer function always corresponds to the first field and to the
-    the first multipole index of the unsymmetrised bispectrum array.
-    We store the bispectrum for each combination of XYZ and only for those configurations where
-    l1>=l2>=l3 and the triangular condition is satisfied. */
-
-    for (int index_l1 = 0; index_l1 < pbi->l_size; ++index_l1) {
-    
-      for (int index_l2 = 0; index_l2 <= index_l1; ++index_l2) {
-    
-        int index_l3_min = pbi->index_l_triangular_min[index_l1][index_l2];
-        int index_l3_max = MIN (index_l2, pbi->index_l_triangular_max[index_l1][index_l2]);
-    
-        for (int index_l3=index_l3_min; index_l3<=index_l3_max; ++index_l3) {
-    
-          all_counter++;
-    
-          /* Index of the current (l1,l2,l3) configuration */
-          long int index_l1_l2_l3 = pbi->index_l1_l2_l3[index_l1][index_l1-index_l2][index_l3_max-index_l3];
-
-          int index_l1_min = pbi->index_l_triangular_min[index_l2][index_l3];          
-          int index_l2_min = pbi->index_l_triangular_min[index_l1][index_l3];
-          
-          for (int X=0; X < pbi->bf_size; ++X) {
-            for (int Y=0; Y < pbi->bf_size; ++Y) {
-              for (int Z=0; Z < pbi->bf_size; ++Z) {
-
-                pbi->bispectra[index_bt][X][Y][Z][index_l1_l2_l3] =
-                  pwb->unsymmetrised_bispectrum[X][Y][Z][index_l1][index_l2][index_l3-index_l3_min]
-                + pwb->unsymmetrised_bispectrum[Y][X][Z][index_l2][index_l1][index_l3-index_l3_min]
-                + pwb->unsymmetrised_bispectrum[Z][Y][X][index_l3][index_l2][index_l1-index_l1_min];
-
-                /* Update the counter */
-                #pragma omp atomic
-                pbi->count_memorised_for_bispectra++;
-
-              } // end of for(Z)
-            } // end of for(Y)
-          } // end of for(X)
+    /* Symmetrise the bispectrum with respect to the position of the second-order field, add the
+    quadratic corrections and check the result, in a single sweep over the configurations */
+    class_call (bispectra2_intrinsic_postprocess (
+                  pbi,
+                  index_bt,
+                  pwb),
+      pbi->error_message,
+      pbi->error_message);
 
-        } // end of for(index_l3)
-      } // end of for(index_l2)
-    } // end of for(index_l1)
+    /* Store all the field combinations, including those read from disk, so that later runs can
+    extend them */
+    if (ppr2->intrinsic_incremental == _TRUE_)
+      class_call (bispectra2_intrinsic_store_blocks (ppr, ppr2, pbi, index_bt, pwb),
+        pbi->error_message,
+        pbi->error_message);
 
   } // end of loop on index_bt
   
@@ -848,6 +962,23 @@ int bispectra2_intrinsic_workspace_init (
   //   fprintf (stderr, "%12d %16g\n", index_r, pwb->r[index_r]);
   // }
 
+  /* Keep only the nodes of the r-grid needed to reach the required accuracy */
+  if (ppr2->intrinsic_r_tolerance > 0) {
+
+    class_call (bispectra2_intrinsic_adaptive_r_grid (
+                  ppr,
+                  ppr2,
+                  pba,
+                  pth,
+                  ppt,
+                  pbs2,
+                  ptr,
+                  pbi,
+                  pwb),
+      pbi->error_message,
+      pbi->error_message);
+  }
+
 
   // -----------------------------------------------------------------------
   // -                           Grid in k1 and k2                         -
@@ -890,6 +1021,15 @@ int bispectra2_intrinsic_workspace_init (
     pwb->k_window_inverse[index_k] = pow(k,2);
   }
 
+  /* Interpolation coefficients in k2, which are the same for all r, l3 and k1 */
+  class_call (bispectra2_k2_spline_init (
+                ppr,
+                ptr,
+                pbi,
+                pwb),
+    pbi->error_message,
+    pbi->error_message);
+
   
   
   
@@ -907,12 +1047,27 @@ int bispectra2_intrinsic_workspace_init (
   number_of_threads = omp_get_num_threads();
   #endif
   
-  /* We need a k3_grid per thread because it varies with k1 and k2 due to the triangular condition */
+  /* We need a k3_grid per thread because it varies with k1 and k2 due to the triangular condition.
+  Each thread will point it to the grids precomputed in the transfer2 module (ptr2->k3_grid). */
   class_alloc (pwb->k3_grid, number_of_threads*sizeof(double*), pbi->error_message);
   class_alloc (pwb->delta_k3, number_of_threads*sizeof(double*), pbi->error_message);
+  class_alloc (pwb->integral_over_k3_r, number_of_threads*sizeof(double*), pbi->error_message);
   class_alloc (pwb->integral_splines, number_of_threads*sizeof(double*), pbi->error_message);
   class_alloc (pwb->interpolated_integral, number_of_threads*sizeof(double*), pbi->error_message);
   class_alloc (pwb->f, number_of_threads*sizeof(double*), pbi->error_message);
+  class_alloc (pwb->k2_nodes, number_of_threads*sizeof(double*), pbi->error_message);
+  class_alloc (pwb->k2_nodes_spline, number_of_threads*sizeof(double*), pbi->error_message);
+  class_alloc (pwb->k2_interpolated, number_of_threads*sizeof(double*), pbi->error_message);
+  class_alloc (pwb->k2_kernel, number_of_threads*sizeof(double*), pbi->error_message);
+  class_calloc (pwb->transfer_k3, number_of_threads, sizeof(double*), pbi->error_message);
+
+#ifdef SONG_FLOAT_STORAGE
+  /* Largest k3-grid, needed to widen the single-precision transfer functions */
+  int k3_size_max = 0;
+  for (int index_k1=0; index_k1 < pwb->k_smooth_size; ++index_k1)
+    for (int index_k2=0; index_k2 <= index_k1; ++index_k2)
+      k3_size_max = MAX (k3_size_max, ptr2->k_size_k1k2[index_k1][index_k2]);
+#endif
     
   /* Beginning of parallel region */
   abort = _FALSE_;
@@ -923,20 +1078,40 @@ int bispectra2_intrinsic_workspace_init (
     thread = omp_get_thread_num();
     #endif
 
-    /* Allocate the integration grid in k3 with the maximum possible number of k3-values. This is given by the
-      number of k-values for the best sampled (k1,k2) wavemode in the transfer2 module */
-    class_calloc_parallel(pwb->k3_grid[thread], ptr2->k3_size_max, sizeof(double), pbi->error_message);
-    class_calloc_parallel(pwb->delta_k3[thread], ptr2->k3_size_max, sizeof(double), pbi->error_message);
+    /* Allocate the buffer for the k3 integral as a function of r */
+    class_calloc_parallel(pwb->integral_over_k3_r[thread], pwb->r_size, sizeof(double), pbi->error_message);
   
   
-    /* Allocate memory for the interpolation arrays (used only for the k2 and k3 integrations) */
+    /* Allocate memory for the interpolation arrays (used only for the k1 integration) */
     class_calloc_parallel (pwb->integral_splines[thread], ptr->q_size, sizeof(double), pbi->error_message);
     class_calloc_parallel (pwb->interpolated_integral[thread], ptr->q_size, sizeof(double), pbi->error_message);
     class_calloc_parallel (pwb->f[thread], pwb->k_smooth_size, sizeof(double), pbi->error_message);
+
+    /* Allocate memory for the k2 integration of a whole (r,l3) pair */
+    int k_size = pwb->k_smooth_size;
+    class_alloc_parallel (pwb->k2_nodes[thread], k_size*k_size*sizeof(double), pbi->error_message);
+    class_alloc_parallel (pwb->k2_nodes_spline[thread], k_size*k_size*sizeof(double), pbi->error_message);
+    class_alloc_parallel (pwb->k2_interpolated[thread], (long int)ptr->q_size*k_size*sizeof(double), pbi->error_message);
+    class_alloc_parallel (pwb->k2_kernel[thread], ptr->q_size*sizeof(double), pbi->error_message);
+
+#ifdef SONG_FLOAT_STORAGE
+    class_alloc_parallel (pwb->transfer_k3[thread], k3_size_max*sizeof(double), pbi->error_message);
+#endif
   
   } // end of parallel region
   
   if (abort == _TRUE_) return _FAILURE_;
+
+
+  /* Allocate the L-level of the table of Bessel functions j_L(k3*r) on the integration grid. The
+  lower levels are allocated in bispectra2_intrinsic_integrate_over_k3() only when needed. */
+  pwb->bessel_k3_cache_L_size = pbs2->l1_size;
+  pwb->bessel_k3_cache_max_size = ppr2->bessel_k3_cache_mb*1e6/sizeof(double);
+  pwb->count_allocated_for_bessel_k3_cache = 0;
+  pwb->count_bessel_k3_cache_hits = 0;
+  pwb->count_allocations_for_integral_arrays = 0;
+  pwb->time_for_integral_arrays = 0;
+  class_calloc (pwb->bessel_k3_cache, pwb->bessel_k3_cache_L_size, sizeof(double ***), pbi->error_message);
   
   
   
@@ -981,6 +1156,35 @@ int bispectra2_intrinsic_workspace_init (
   if (pbi->bispectra_verbose > 2)
     printf(" -> allocated ~ %.3g MB (%ld doubles) for the unsymmetrised bispectrum array\n",
       pwb->count_allocated_for_unsymmetrised_bispectrum*sizeof(double)/1e6, pwb->count_allocated_for_unsymmetrised_bispectrum);
+
+  /* Allocate the array with the sampling of the (l3,l2,l1) configurations, which has the same
+  layout as the unsymmetrised bispectrum for a given XYZ; it is filled by
+  bispectra2_intrinsic_sampling_init() */
+  long int l1_size_total = 0;
+  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3)
+    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2)
+      l1_size_total += pbi->l_triangular_size[index_l3][index_l2];
+
+  short * sampling_slab;
+  short ** sampling_l2_level;
+  short * pending_slab;
+  class_calloc (sampling_slab, l1_size_total+1, sizeof(short), pbi->error_message);
+  class_alloc (sampling_l2_level, pbi->l_size*pbi->l_size*sizeof(short *), pbi->error_message);
+  class_alloc (pwb->l_sampling, pbi->l_size*sizeof(short **), pbi->error_message);
+  class_calloc (pending_slab, pbi->l_size*pbi->l_size, sizeof(short), pbi->error_message);
+  class_alloc (pwb->has_pending_l3_l2, pbi->l_size*sizeof(short *), pbi->error_message);
+  class_calloc (pwb->has_pending_l3, pbi->l_size, sizeof(short), pbi->error_message);
+
+  long int index_l3_l2_l1 = 0;
+
+  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3) {
+    pwb->l_sampling[index_l3] = sampling_l2_level + index_l3*pbi->l_size;
+    pwb->has_pending_l3_l2[index_l3] = pending_slab + index_l3*pbi->l_size;
+    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2) {
+      pwb->l_sampling[index_l3][index_l2] = sampling_slab + index_l3_l2_l1;
+      index_l3_l2_l1 += pbi->l_triangular_size[index_l3][index_l2];
+    }
+  }
     
 
 
@@ -1038,16 +1242,366 @@ int bispectra2_intrinsic_workspace_init (
   
 
   
-int bispectra2_intrinsic_workspace_free(
-    struct perturbs2 * ppt2,
-    struct transfers2 * ptr2,
-    struct bispectra * pbi,
-    struct bispectra_workspace_intrinsic * pwb
-    )
-{
+/**
+ * Reduce the r-grid of the intrinsic bispectrum to the nodes needed to compute the
+ * radial integral of a set of probe triangles with relative accuracy
+ * ppr2->intrinsic_r_tolerance.
+ *
+ * The grid built by bispectra_get_r_grid() is fixed, while the cost of every stage of
+ * the intrinsic bispectrum grows linearly with its size. Most of the integral comes
+ * from a narrow shell around r = tau0 - tau_rec, and elsewhere the integrand is smooth.
+ * Here we take the grid from bispectra_get_r_grid() as the reference, and keep a
+ * subset of its nodes:
+ *
+ * -# We start from the two ends of the grid plus a few nodes placed at equal steps in
+ *    the cumulative visibility function g(tau0-r).
+ * -# We estimate the error of the trapezoidal rule on a set of probe triangles (l1,l2,l3),
+ *    equilateral and squeezed, using as integrand the radial part of the local bispectrum,
+ *    r^2 * (alpha_l1 * beta_l2 * beta_l3 + 2 perms), where
+ *      alpha_l(r) = int dk k^2 T_l(k) j_l(k*r)
+ *      beta_l(r) = int dk k^2 P(k) T_l(k) j_l(k*r).
+ *    These involve the same transfer and Bessel functions as the intrinsic bispectrum, but
+ *    are cheap to compute for all r.
+ * -# We add the reference node at the centre of the interval with the largest error,
+ *    until the sum of the interval errors is below the tolerance for all probes.
+ *
+ * The errors are relative to the reference-grid integral of each probe, or to 1% of the
+ * integral of its absolute value if larger, so that a probe with a strong cancellation
+ * does not drive the refinement. Since the kept nodes belong to the reference grid, the
+ * reference grid remains the accuracy benchmark: the tolerance measures the departure of
+ * the probe integrals from their reference-grid values. The probes only share the radial
+ * structure of the intrinsic integrand, which also involves the second-order transfer
+ * functions, so the tolerance does not bound the error on the intrinsic bispectrum or on
+ * its Fisher matrix.
+ *
+ * This function overwrites pwb->r, pwb->r_size and pwb->delta_r.
+ */
 
-  free (pwb->r);
+int bispectra2_intrinsic_adaptive_r_grid (
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct background * pba,
+    struct thermo * pth,
+    struct perturbs * ppt,
+    struct bessels2 * pbs2,
+    struct transfers * ptr,
+    struct bispectra * pbi,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  /* Shortcuts */
+  int r_size = pwb->r_size;
+  double * r = pwb->r;
+  int k_size = ptr->q_size;
+
+  if (r_size < 3)
+    return _SUCCESS_;
+
+
+  // ====================================================================================
+  // =                                  Probe integrands                                =
+  // ====================================================================================
+
+  /* Probe multipoles, spread along the l-grid; the first one is l_min. The probe triangles
+  are (l,l,l) and (l_min,l,l) for each of them. */
+  int l_probe_size = 4;
+  int probe_size = 2*l_probe_size;
+  int index_l_probe[4];
+  for (int i=0; i < l_probe_size; ++i)
+    index_l_probe[i] = (i*(pbi->l_size-1))/(l_probe_size-1);
+
+  /* Compute alpha_l(r) and beta_l(r) for the probe multipoles, using the transfer function
+  of the first field. We use the abort flag of the parallel macros so that the probe
+  arrays can be freed before returning on failure. */
+  double * alpha[4] = {NULL};
+  double * beta[4] = {NULL};
+  int abort = _FALSE_;
+
+  for (int i=0; (i < l_probe_size) && (abort == _FALSE_); ++i) {
+
+    int index_l = index_l_probe[i];
+
+    class_alloc_parallel (alpha[i], r_size*sizeof(double), pbi->error_message);
+    class_alloc_parallel (beta[i], r_size*sizeof(double), pbi->error_message);
+
+    if (abort == _TRUE_)
+      break;
+
+    double * transfer = &(ptr->transfer [ppt->index_md_scalars]
+                                        [((ppt->index_ic_ad * ptr->tt_size[ppt->index_md_scalars] + pbi->index_tt_of_bf[0])
+                                        * ptr->l_size[ppt->index_md_scalars] + index_l) * k_size]);
+
+    class_call_parallel (bessel2_convolution_multi_r (
+                           ppr,
+                           pbs2,
+                           ptr->q,
+                           pbi->delta_k,
+                           k_size,
+                           transfer,
+                           NULL,
+                           pbs2->index_l1[pbi->l[index_l]],
+                           r,
+                           r_size,
+                           alpha[i],
+                           pbi->error_message),
+      pbi->error_message,
+      pbi->error_message);
+
+    class_call_parallel (bessel2_convolution_multi_r (
+                           ppr,
+                           pbs2,
+                           ptr->q,
+                           pbi->delta_k,
+                           k_size,
+                           transfer,
+                           pbi->pk,
+                           pbs2->index_l1[pbi->l[index_l]],
+                           r,
+                           r_size,
+                           beta[i],
+                           pbi->error_message),
+      pbi->error_message,
+      pbi->error_message);
+  }
+
+  /* Cumulative trapezoidal integral of each probe on the reference grid, so that the
+  integral between two nodes is the difference of two values. The probe integrand
+  itself is stored in integrand[index_probe*r_size + index_r]. */
+  double * integrand = NULL, * cumulative = NULL;
+  double scale[8];
+
+  if (abort == _FALSE_) {
+    class_alloc_parallel (integrand, probe_size*r_size*sizeof(double), pbi->error_message);
+    class_alloc_parallel (cumulative, probe_size*r_size*sizeof(double), pbi->error_message);
+  }
+
+  if (abort == _TRUE_) {
+    for (int i=0; i < l_probe_size; ++i) {
+      free (alpha[i]);
+      free (beta[i]);
+    }
+    free (integrand);
+    free (cumulative);
+    return _FAILURE_;
+  }
+
+  for (int index_probe=0; index_probe < probe_size; ++index_probe) {
+
+    /* Position of the three multipoles of the probe in index_l_probe */
+    int i1 = (index_probe%2 == 0 ? index_probe/2 : 0);
+    int i2 = index_probe/2;
+    int i3 = index_probe/2;
+
+    double * I = integrand + index_probe*r_size;
+    double * F = cumulative + index_probe*r_size;
+    double abs_integral = 0;
+
+    for (int index_r=0; index_r < r_size; ++index_r)
+      I[index_r] = r[index_r]*r[index_r] * (
+          alpha[i1][index_r] * beta[i2][index_r] * beta[i3][index_r]
+        + beta[i1][index_r] * alpha[i2][index_r] * beta[i3][index_r]
+        + beta[i1][index_r] * beta[i2][index_r] * alpha[i3][index_r]);
+
+    F[0] = 0;
+    for (int index_r=1; index_r < r_size; ++index_r) {
+      double dr = r[index_r] - r[index_r-1];
+      F[index_r] = F[index_r-1] + 0.5*dr*(I[index_r-1] + I[index_r]);
+      abs_integral += 0.5*dr*(fabs(I[index_r-1]) + fabs(I[index_r]));
+    }
+
+    scale[index_probe] = MAX (fabs(F[r_size-1]), 0.01*abs_integral);
+
+    /* A vanishing probe has no error */
+    if (scale[index_probe] == 0)
+      scale[index_probe] = 1;
+  }
+
+  for (int i=0; i < l_probe_size; ++i) {
+    free (alpha[i]);
+    free (beta[i]);
+  }
+
+
+  // ====================================================================================
+  // =                                 Initial nodes                                    =
+  // ====================================================================================
+
+  /* Keep the first and last nodes, and a few nodes at equal steps in the cumulative
+  visibility function, which cluster around recombination */
+  short * keep;
+  class_calloc (keep, r_size, sizeof(short), pbi->error_message);
+  keep[0] = keep[r_size-1] = _TRUE_;
+
+  double * pvecback, * pvecthermo;
+  class_alloc (pvecback, pba->bg_size*sizeof(double), pbi->error_message);
+  class_alloc (pvecthermo, pth->th_size*sizeof(double), pbi->error_message);
+  int dump;
+
+  double * visibility;
+  class_alloc (visibility, r_size*sizeof(double), pbi->error_message);
+
+  for (int index_r=0; index_r < r_size; ++index_r) {
+
+    /* The visibility function vanishes before the thermodynamics module starts */
+    double tau = pba->conformal_age - r[index_r];
+    visibility[index_r] = 0;
+
+    if ((tau <= pth->tau_ini) || (tau >= pba->conformal_age))
+      continue;
+
+    class_call (background_at_tau(pba,
+                  tau,
+                  pba->short_info,
+                  pba->inter_normal,
+                  &dump,
+                  pvecback),
+      pba->error_message,
+      pbi->error_message);
+
+    class_call (thermodynamics_at_z(pba,
+                  pth,
+                  1./pvecback[pba->index_bg_a]-1.,
+                  pth->inter_normal,
+                  &dump,
+                  pvecback,
+                  pvecthermo),
+      pth->error_message,
+      pbi->error_message);
+
+    visibility[index_r] = pvecthermo[pth->index_th_g];
+  }
+
+  /* Overwrite the visibility with its cumulative integral */
+  double visibility_left = visibility[0];
+  visibility[0] = 0;
+  for (int index_r=1; index_r < r_size; ++index_r) {
+    double g = visibility[index_r];
+    visibility[index_r] = visibility[index_r-1] + 0.5*(r[index_r]-r[index_r-1])*(visibility_left + g);
+    visibility_left = g;
+  }
+
+  int n_initial = 8;
+  int index_r_node = 0;
+  if (visibility[r_size-1] > 0) {
+    for (int i=1; i < n_initial; ++i) {
+      while ((index_r_node < r_size-1) && (visibility[index_r_node] < i*visibility[r_size-1]/n_initial))
+        index_r_node++;
+      keep[index_r_node] = _TRUE_;
+    }
+  }
+
+  free (visibility);
+  free (pvecback);
+  free (pvecthermo);
+
+
+  // ====================================================================================
+  // =                                   Refinement                                     =
+  // ====================================================================================
+
+  double error;
+
+  while (_TRUE_) {
+
+    /* Find the interval with the largest error, and the total error of each probe */
+    double total_error[8] = {0};
+    double max_error = 0;
+    int index_r_left = -1, index_r_right = -1;
+    int left = 0;
+
+    for (int right=1; right < r_size; ++right) {
+
+      if (keep[right] == _FALSE_)
+        continue;
+
+      double interval_error = 0;
+
+      for (int index_probe=0; index_probe < probe_size; ++index_probe) {
+        double * I = integrand + index_probe*r_size;
+        double * F = cumulative + index_probe*r_size;
+        double coarse = 0.5*(r[right]-r[left])*(I[left] + I[right]);
+        double e = fabs(coarse - (F[right] - F[left]))/scale[index_probe];
+        total_error[index_probe] += e;
+        interval_error = MAX (interval_error, e);
+      }
+
+      if ((right - left > 1) && (interval_error > max_error)) {
+        max_error = interval_error;
+        index_r_left = left;
+        index_r_right = right;
+      }
+
+      left = right;
+    }
+
+    error = 0;
+    for (int index_probe=0; index_probe < probe_size; ++index_probe)
+      error = MAX (error, total_error[index_probe]);
+
+    if ((error <= ppr2->intrinsic_r_tolerance) || (index_r_left < 0))
+      break;
+
+    /* Add the reference node closest to the centre of the interval */
+    double r_mid = 0.5*(r[index_r_left] + r[index_r_right]);
+    int index_r_mid = index_r_left + 1;
+    while ((index_r_mid+1 < index_r_right) && (r[index_r_mid+1] <= r_mid))
+      index_r_mid++;
+    if ((index_r_mid+1 < index_r_right) && (r[index_r_mid+1]-r_mid < r_mid-r[index_r_mid]))
+      index_r_mid++;
+
+    keep[index_r_mid] = _TRUE_;
+  }
+
+  free (integrand);
+  free (cumulative);
+
+
+  // ====================================================================================
+  // =                                  Update the grid                                 =
+  // ====================================================================================
+
+  int r_size_adaptive = 0;
+  for (int index_r=0; index_r < r_size; ++index_r)
+    if (keep[index_r] == _TRUE_)
+      r[r_size_adaptive++] = r[index_r];
+
+  free (keep);
+
+  if (pbi->bispectra_verbose > 0)
+    printf(" -> adaptive r-grid: using %d of %d nodes (%.0f%% fewer), probe error %.2g for tolerance %g\n",
+      r_size_adaptive, r_size, 100.*(r_size-r_size_adaptive)/r_size, error, ppr2->intrinsic_r_tolerance);
+
+  pwb->r_size = r_size_adaptive;
+
+  /* Trapezoidal measure, as in bispectra_get_r_grid() */
+  pwb->delta_r[0] = r[1] - r[0];
+  for (int index_r=1; index_r < r_size_adaptive-1; ++index_r)
+    pwb->delta_r[index_r] = r[index_r+1] - r[index_r-1];
+  pwb->delta_r[r_size_adaptive-1] = r[r_size_adaptive-1] - r[r_size_adaptive-2];
+
+  return _SUCCESS_;
+
+}
+
+
+
+
+int bispectra2_intrinsic_workspace_free(
+    struct perturbs2 * ppt2,
+    struct transfers2 * ptr2,
+    struct bispectra * pbi,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  if (pbi->bispectra_verbose > 1)
+    printf (" -> allocated the integral arrays of the intrinsic bispectrum %ld times, spending %g s in allocations and frees\n",
+      pwb->count_allocations_for_integral_arrays, pwb->time_for_integral_arrays);
+
+  free (pwb->r);
   free (pwb->delta_r);
+  free (pwb->index_l3_block);
 
   /* Parallelization variables */
   int thread = 0;
@@ -1060,20 +1614,52 @@ int bispectra2_intrinsic_workspace_free(
     thread = omp_get_thread_num();
     #endif
   
-    free(pwb->k3_grid[thread]);
-    free(pwb->delta_k3[thread]);
+    free(pwb->integral_over_k3_r[thread]);
     free(pwb->integral_splines[thread]);
     free(pwb->interpolated_integral[thread]);
     free(pwb->f[thread]);
+    free(pwb->k2_nodes[thread]);
+    free(pwb->k2_nodes_spline[thread]);
+    free(pwb->k2_interpolated[thread]);
+    free(pwb->k2_kernel[thread]);
+    free(pwb->transfer_k3[thread]);
     
   }  if (abort == _TRUE_) return _FAILURE_;
   
   free(pwb->k3_grid);
   free(pwb->delta_k3);
+  free(pwb->integral_over_k3_r);
+  free(pwb->transfer_k3);
   free(pwb->integral_splines);
   free(pwb->interpolated_integral);
   free(pwb->f);
+  free(pwb->k2_nodes);
+  free(pwb->k2_nodes_spline);
+  free(pwb->k2_interpolated);
+  free(pwb->k2_kernel);
   free(pwb->k_window_inverse);
+
+  /* Free the interpolation coefficients in k2 */
+  free(pwb->k2_index_left);
+  free(pwb->k2_weight);
+  free(pwb->k2_measure);
+  free(pwb->k2_spline_alpha);
+  free(pwb->k2_spline_beta);
+  free(pwb->k2_spline_gamma);
+  free(pwb->k2_spline_factor);
+
+  /* Free the table of Bessel functions on the integration grid */
+  for (int index_L=0; index_L < pwb->bessel_k3_cache_L_size; ++index_L) {
+    if (pwb->bessel_k3_cache[index_L] == NULL)
+      continue;
+    for (int index_k1=0; index_k1 < pwb->k_smooth_size; ++index_k1) {
+      for (int index_k2=0; index_k2 <= index_k1; ++index_k2)
+        free (pwb->bessel_k3_cache[index_L][index_k1][index_k2]);
+      free (pwb->bessel_k3_cache[index_L][index_k1]);
+    }
+    free (pwb->bessel_k3_cache[index_L]);
+  }
+  free (pwb->bessel_k3_cache);
  
   /* Free pwb->unsymmetrised bispectrum */
   for (int X=0; X < pbi->bf_size; ++X) {
@@ -1092,6 +1678,14 @@ int bispectra2_intrinsic_workspace_free(
    free (pwb->unsymmetrised_bispectrum[X]);
   } // end of for(i)
   free (pwb->unsymmetrised_bispectrum);
+
+  /* Free the sampling of the configurations */
+  free (pwb->l_sampling[0][0]);
+  free (pwb->l_sampling[0]);
+  free (pwb->l_sampling);
+  free (pwb->has_pending_l3_l2[0]);
+  free (pwb->has_pending_l3_l2);
+  free (pwb->has_pending_l3);
  
   free (pwb);
  
@@ -1104,878 +1698,509 @@ int bispectra2_intrinsic_workspace_free(
 
 
 
-int bispectra2_intrinsic_integrate_over_k3 (
-    struct precision * ppr,
+/**
+ * Divide the l3 range of the intrinsic bispectrum in blocks, so that the intermediate arrays of
+ * the integration fit in the memory budget ppr2->intrinsic_memory_mb.
+ *
+ * The four arrays pwb->integral_over_k3, integral_over_k2, integral_over_k1 and integral_over_r
+ * are alive at the same time, and for a single l3 they contain
+ *
+ *   k3 integral:  r_size * k_size*(k_size+1)/2
+ *   k2 integral:  r_size * k_size * l_size
+ *   k1 integral:  r_size * N(l3)
+ *   r integral:   N(l3)
+ *
+ * values, where N(l3) is the number of (l2,l1) pairs that form a triangle with l3; to these
+ * we add the pointers used to index them. Since the integrals for different l3 values are
+ * independent, we group consecutive l3 values in blocks whose peak memory stays below the
+ * budget, and process one block at a time in bispectra2_intrinsic_init(). The blocks are
+ * stored in pwb->index_l3_block; if the budget is zero, there is only one block.
+ *
+ * The plan is printed for pbi->bispectra_verbose > 1, or if ppr2->intrinsic_dry_run is true.
+ * It does not include the memory that is not affected by the blocking, that is the
+ * unsymmetrised bispectrum, the table of Bessel functions (at most ppr2->bessel_k3_cache_mb)
+ * and the transfer functions.
+ */
+int bispectra2_intrinsic_memory_plan (
     struct precision2 * ppr2,
-    struct perturbs * ppt,
-    struct perturbs2 * ppt2,
-    struct bessels * pbs,
-    struct bessels2 * pbs2,
-    struct transfers * ptr,
-    struct transfers2 * ptr2,
-    struct primordial * ppm,
     struct bispectra * pbi,
-    int index_tt2_k3,
-    int index_M3,
-    int offset_L3,
     struct bispectra_workspace_intrinsic * pwb
     )
 {
 
-  /* Parallelization variables */
-  int thread = 0;
-  int abort = _FALSE_;
-  
-  // =========================================================================================
-  // =                             Allocate memory for I_l3(r,k1,k2)                         =
-  // =========================================================================================
-    
-  /* Initialize counter */
-  pwb->count_allocated_for_integral_over_k3 = 0;
-  
-  /* Allocate l3-level.  Note that, even if l3 must satisfy the triangular
-  inequality, we allocate this level for all the possible l3 values.  We do so because this
-  array is going to be used by all (l1,l2) computations that follow, which means that l3 will
-  eventually cover all the allowed range. */
-  class_alloc (pwb->integral_over_k3, pbi->l_size*sizeof(double ***), pbi->error_message);
-  
-  for (int index_l3=0; index_l3<pbi->l_size; ++index_l3) {
-    
-    /* Allocate r-level */
-    class_alloc (pwb->integral_over_k3[index_l3], pwb->r_size*sizeof(double **), pbi->error_message);
-  
-    /* Allocate 'k1' level */
-    for (int index_r=0; index_r < pwb->r_size; ++index_r) {
-  
-      int k1_size = pwb->k_smooth_size;
-      class_alloc (pwb->integral_over_k3[index_l3][index_r], k1_size*sizeof(double *), pbi->error_message);
+  int l_size = pbi->l_size;
+  int r_size = pwb->r_size;
+  int k_size = pwb->k_smooth_size;
 
-      /* Allocate 'k2' level. Make sure to use calloc. */
-      for (int index_k1=0; index_k1<k1_size; ++index_k1) {
-  
-        int k2_size = index_k1 + 1;
-        class_calloc (pwb->integral_over_k3[index_l3][index_r][index_k1], k2_size, sizeof(double), pbi->error_message);
-        
-        /* Increase memory counter, excluding non-physical configurations where |M3|>l3 */
-        if (pwb->abs_M3 <= pbi->l[index_l3])
-          pwb->count_allocated_for_integral_over_k3 += k2_size;
-  
-      } // end of for(index_k1)
-    } // end of for(index_r)
-  } // end of for(index_l3)
-    
-  if (pbi->bispectra_verbose > 2)
-    printf("     * allocated ~ %.3g MB (%ld doubles) for the k3-integral array (k_size=%d)\n",
-      pwb->count_allocated_for_integral_over_k3*sizeof(double)/1e6, pwb->count_allocated_for_integral_over_k3, pwb->k_smooth_size);
+  /* Memory in bytes needed by each array for a given l3, including the pointers */
+  enum {k3_stage, k2_stage, k1_stage, r_stage, stage_size};
+  double (*memory)[stage_size];
+  class_alloc (memory, l_size*sizeof(*memory), pbi->error_message);
 
+  for (int index_l3=0; index_l3 < l_size; ++index_l3) {
 
-  // ===================================================================================================
-  // =                               Compute the INT_l3(r, k1, k2)  integral                           =
-  // ===================================================================================================  
-  
-  /* Initialize counter for the number of integrals computed */
-  pwb->count_memorised_for_integral_over_k3 = 0;
-  
-  /* We shall keep track of the average size of the integration grid in k3, which is (k1,k2) dependent */
-  double average_k3_grid_size = 0;
-  
-  /* We compute the integral over k3 for all possible l-values */
-  for (int index_l3 = 0; index_l3 < pbi->l_size; ++index_l3) {
+    long int l1_size = 0;
+    for (int index_l2=0; index_l2 < l_size; ++index_l2)
+      l1_size += pbi->l_triangular_size[index_l3][index_l2];
 
-    int l3 = pbi->l[index_l3];
-    int L3 = abs(l3-pwb->abs_M3) + offset_L3;
+    memory[index_l3][k3_stage] = r_size*(0.5*k_size*(k_size+1)*sizeof(double) + k_size*sizeof(double *) + sizeof(double **));
+    memory[index_l3][k2_stage] = l_size*(r_size*(k_size*sizeof(double) + sizeof(double *)) + sizeof(double **));
+    memory[index_l3][k1_stage] = l1_size*(r_size*sizeof(double) + sizeof(double *)) + l_size*sizeof(double **);
+    memory[index_l3][r_stage] = l1_size*sizeof(double) + l_size*sizeof(double *);
+  }
 
-    /* The configurations with |M3|>l3 do not contribute to the bispectrum because
-    they would violate the 3j-symbol properties */
-    if (pwb->abs_M3 > pbi->l[index_l3])
-      continue;
+  /* Budget in bytes; the top-level pointers are allocated for all l3 values in every block */
+  double budget = ppr2->intrinsic_memory_mb*1e6;
+  double memory_top = 4*l_size*sizeof(double *);
 
-    /* Skip the (L3,l3,M3) configurations forbidden by the triangular condition */
-    if (L3 > (l3+pwb->abs_M3)) {
-      pwb->count_memorised_for_integral_over_k3 += 0.5*pwb->k_smooth_size*(pwb->k_smooth_size+1)*pwb->r_size;
-      continue;
-    }
-    
-    /* Find L3 inside pbs2->l1, the list of l's where we computed the Bessel functions */
-    int index_L3 = pbs2->index_l1[L3];
+  /* Group consecutive l3 values in blocks, starting a new block when the budget is exceeded */
+  class_alloc (pwb->index_l3_block, (l_size+1)*sizeof(int), pbi->error_message);
 
-    /* Paranoid android */
-    class_test ((ppr2->m_max_song==0) && (l3!=L3),
-      pbi->error_message,
-      "inconsistency! for scalar modes, L3 must be equal to l3");
+  pwb->l3_block_size = 0;
+  pwb->index_l3_block[0] = 0;
+  double memory_block = memory_top;
+  double memory_peak = 0;
 
-    class_test (pbs2->l1[index_L3]!=L3,
-      pbi->error_message,
-      "error in the indexing of pbs2->l1. Is the pbs2->extend_l1_using_m parameter true?");
+  for (int index_l3=0; index_l3 < l_size; ++index_l3) {
 
-    /* Load the transfer functions from disk */
-    if ((ppr2->load_transfers_from_disk == _TRUE_) || (ppr2->store_transfers_to_disk == _TRUE_)) {
-      class_call (transfer2_load_transfers_from_disk (
-                    ppt2,
-                    ptr2,
-                    index_tt2_k3 + ptr2->lm_array[index_l3][index_M3]),
-        ptr2->error_message,
-        pbi->error_message);
+    double memory_l3 = 0;
+    for (int stage=0; stage < stage_size; ++stage)
+      memory_l3 += memory[index_l3][stage];
+
+    if ((budget > 0) && (index_l3 > pwb->index_l3_block[pwb->l3_block_size]) && (memory_block + memory_l3 > budget)) {
+      pwb->index_l3_block[++pwb->l3_block_size] = index_l3;
+      memory_block = memory_top;
     }
-  
-    if (pbi->bispectra_verbose > 2)
-      printf("     * computing the k3 integral for l3=%d, index_l3=%d, L3=%d, index_L3=%d\n",
-        l3, index_l3, pbs2->l1[index_L3], index_L3);
 
-    abort = _FALSE_;
-    #pragma omp parallel shared (abort) private (thread)
-    {
-  
-      #ifdef _OPENMP
-      thread = omp_get_thread_num();
-      #endif
-  
-      #pragma omp for schedule (dynamic)
-      for (int index_k1 = 0; index_k1 < pwb->k_smooth_size; ++index_k1) {
-  
-        double k1 = pwb->k_smooth_grid[index_k1];
+    memory_block += memory_l3;
+    memory_peak = MAX (memory_peak, memory_block);
+  }
 
-        /* We only need to consider those k2's that are equal or smaller than k1,
-        as the quadratic sources were symmetrised  in the perturbation2 module */
-        for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
+  pwb->index_l3_block[++pwb->l3_block_size] = l_size;
 
-          double k2 = pwb->k_smooth_grid[index_k2]; 
+  /* A single l3 value might not fit in the budget */
+  if ((budget > 0) && (memory_peak > budget))
+    printf("\nWARNING: the intermediate arrays of the intrinsic bispectrum need %.3g MB for a single l3,\
+ more than intrinsic_memory_mb=%g\n\n", memory_peak/1e6, ppr2->intrinsic_memory_mb);
 
-          if (pbi->bispectra_verbose > 4)
-            printf ("      \\ computing (index_k1,index_k2)=(%4d,%4d), (k1,k2)=(%g,%g)\n",
-              index_k1, index_k2, k1, k2);
-  
-          // ===================================================
-          // =            Fix the integration domain           =
-          // ===================================================
+  /* Print the plan */
+  if ((pbi->bispectra_verbose > 1) || (ppr2->intrinsic_dry_run == _TRUE_)) {
 
-          int dump;
-
-          /* Compute the integration grid in the k3 variable */
-          class_call_parallel (transfer2_get_k3_list (
-                                 ppr,
-                                 ppr2,
-                                 ppt2,
-                                 pbs,
-                                 pbs2,
-                                 ptr2,
-                                 index_k1,
-                                 index_k2,
-                                 pwb->k3_grid[thread],  /* output */
-                                 &dump   
-                                 ),
-            ptr2->error_message,
-            pbi->error_message);
+    printf(" -> memory plan for the intrinsic bispectrum: %d block(s) of l3 for a budget of ",
+      pwb->l3_block_size);
+    if (budget > 0)
+      printf("%g MB\n", ppr2->intrinsic_memory_mb);
+    else
+      printf("unlimited memory\n");
 
-          /* Get the size of the integration grid. Note that when extrapolation is turned on, the k3-grid will
-          also include values that do not satisfty the triangular condition k1 + k2 = k3. */
-          int k3_size = ptr2->k_size_k1k2[index_k1][index_k2];
-          
-          class_test_parallel (k3_size < 2,
-            pbi->error_message,
-            "integration grid has less than two elements, cannot use trapezoidal integration");
-          
-          /* Determine the measure for the trapezoidal rule for k3 */  
-          pwb->delta_k3[thread][0] = pwb->k3_grid[thread][1] - pwb->k3_grid[thread][0];
-            
-          for (int index_k3=1; index_k3<(k3_size-1); ++index_k3)
-            pwb->delta_k3[thread][index_k3] = pwb->k3_grid[thread][index_k3+1] - pwb->k3_grid[thread][index_k3-1];
-            
-          pwb->delta_k3[thread][k3_size-1] = pwb->k3_grid[thread][k3_size-1] - pwb->k3_grid[thread][k3_size-2];
+    printf("    (r_size=%d, k_size=%d, l_size=%d; unsymmetrised bispectrum = %g MB, Bessel table <= %g MB)\n",
+      r_size, k_size, l_size, pwb->count_allocated_for_unsymmetrised_bispectrum*sizeof(double)/1e6,
+      ppr2->bessel_k3_cache_mb);
 
-#ifdef DEBUG
-          /* Let's be super cautious */
-          for (int index_k3=0; index_k3<k3_size; ++index_k3)
-            class_test_parallel (pwb->delta_k3[thread][index_k3] < 0,
-              pbi->error_message,
-              "something went terribly wrong, negative trapezoidal measure for index_k1=%d, index_k2=%d :-/",
-              index_k1, index_k2);
-#endif // DEBUG
+    for (int index_block=0; index_block < pwb->l3_block_size; ++index_block) {
 
-          /* Define the pointer to the second-order transfer function as a function of k3.
-          Note that this transfer function has already been rescaled according to eq. 6.26
-          of http://arxiv.org/abs/1405.2280 in the perturbations.c module.  */
-          double * transfer = ptr2->transfer[index_tt2_k3 + ptr2->lm_array[index_l3][index_M3]]
-                              [index_k1]
-                              [index_k2];
-          
-#ifdef DEBUG
-          /* We expect the second-order transfer function to be order unity for scalar modes */
-          if (pwb->abs_M3 == 0) {
-            double expected_scale = 1;
-            for (int index_k3=0; index_k3 < k3_size; ++index_k3) {
-              class_test_permissive (fabs(transfer[index_k3]) > (expected_scale*1000),
-                pbi->error_message,
-                "found extremely large value for second-order transfer function: T_l3_m3(k1,k2,k3_tr)=%g\
- for l3=%d[%d], m3=%d[%d], k1=%g[%d], k2=%g[%d], k3_tr=%g[%d]\n",
-                transfer[index_k3], pbi->l[index_l3], index_l3, pwb->abs_M3, ppr2->index_m[pwb->abs_M3],
-                ppt2->k[index_k1], index_k1, ppt2->k[index_k2], index_k2, 
-                pwb->k3_grid[thread][index_k3], index_k3);
-            }
-          }
-#endif // DEBUG
+      int index_l3_min = pwb->index_l3_block[index_block];
+      int index_l3_max = pwb->index_l3_block[index_block+1] - 1;
 
+      double memory_stage[stage_size] = {0};
+      memory_block = memory_top;
+      for (int index_l3=index_l3_min; index_l3 <= index_l3_max; ++index_l3) {
+        for (int stage=0; stage < stage_size; ++stage) {
+          memory_stage[stage] += memory[index_l3][stage];
+          memory_block += memory[index_l3][stage];
+        }
+      }
 
-          // ===================================================
-          // =                     Integrate                   =
-          // ===================================================
-  
-          for (int index_r = 0; index_r < pwb->r_size; ++index_r) {
-          
-            /* It is important to note that the used Bessel here has order L3 rather than l3 */
-            class_call_parallel (bessel2_convolution (
-                ppr,
-                pbs2,
-                pwb->k3_grid[thread],
-                pwb->delta_k3[thread],
-                k3_size,
-                transfer,
-                NULL,
-                index_L3,
-                pwb->r[index_r],
-                &(pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2]),
-                pbi->error_message
-                ),
-              pbi->error_message,
-              pbi->error_message);
+      printf("    * block %d: l3=%d to %d (%d values), k3: %.3g MB, k2: %.3g MB, k1: %.3g MB, r: %.3g MB, peak: %.3g MB\n",
+        index_block, pbi->l[index_l3_min], pbi->l[index_l3_max], index_l3_max-index_l3_min+1,
+        memory_stage[k3_stage]/1e6, memory_stage[k2_stage]/1e6, memory_stage[k1_stage]/1e6,
+        memory_stage[r_stage]/1e6, memory_block/1e6);
+    }
 
-#ifdef DEBUG
-            /* Check that when m is odd and k1=k2, then T(k1,k2,k3) is small with respect to 1.
-            This should be the case because the odd-m quadratic sources always vanish for k1==k2
-            (see comment for vector Q_SS in perturb2_quadratic_sources()), unless non-vanishing
-            initial conditions are given */
-            /* TODO: Include this check in perturb2_quadratic_sources(), which is the quantity
-            that we know should vanish. The bispectrum could still be non-vanishing for non-zero
-            initial conditions.  */
-            if ((index_k1==index_k2) && (pwb->abs_M3%2!=0)) {
-              double expected_scale = ppm->A_s*ppm->A_s;
-              double epsilon = 1e-4*expected_scale;
-              class_test_permissive (
-                fabs (pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2]) > epsilon,
-                ppt2->error_message,
-                "k1=k2, m odd, but bispectrum=%20.12g is larger than the characteristic scale (%20.12g). Problem?",
-                pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2], epsilon);
-            }
-#endif // DEBUG
+    printf("    * peak memory for the intermediate arrays: %.3g MB\n", memory_peak/1e6);
+  }
 
-            /* Include the M3-dependent coefficient coming from the rescaling of the transfer
-            function. Note that this is always equal to 1 for m=0. */
-            if (pwb->abs_M3!=0)
-              pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2] *= pwb->M3_coefficient[index_M3];
+  free (memory);
 
-            /* Multiply the result by the factor 2 coming from the fact that in the bispectrum
-            formula the second-order transfer functions appears as
-            T(\vec{k1},\vec{k2},\vec{3}) + T(\vec{k2},\vec{k1},\vec{3}) */
-            pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2] *= 2;
+  return _SUCCESS_;
 
-            /* Update the counters */
-            #pragma omp atomic
-            average_k3_grid_size += k3_size; 
+}
 
-            #pragma omp atomic
-            ++pwb->count_memorised_for_integral_over_k3;
-              
-            #pragma omp flush(abort)
 
-            /* Debug - print the second-order transfer function as a function of k3 */
-            // if ((l3==170) && (pwb->abs_M3 == 2))
-            //   for (int index_k3=0; index_k3<k3_size; ++index_k3)
-            //     printf ("%14.7g %22.16g\n", pwb->k3_grid[thread][index_k3], transfer[index_k3]);
 
-            /* Print the integral as a function of r */
-            // if ((pwb->abs_M3==1) && (offset_L3==0))
-            //   if (l3==200)
-            //     /* For bks run they correspond to 0.03728321 and 0.01724184, which are Christian's 13 and 6 */
-            //     if ((index_k1==85) && (index_k2==63))
-            //     // if ((index_k1==1) && (index_k2==0))
-            //       fprintf (stderr, "%17.7g %17.7g\n",
-            //         pwb->r[index_r], pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2]);
+/**
+ * Choose the (l1,l2,l3) configurations of the unsymmetrised intrinsic bispectrum that are
+ * computed in the first pass of the integration.
+ *
+ * Most of the cost of the intrinsic bispectrum comes from the integrals that are repeated
+ * for each configuration, while the bispectrum is usually smooth enough in l1 to be
+ * interpolated. With ppr2->intrinsic_adaptive_stride=N>1, the first pass computes, for each
+ * (l3,l2) pair, only one l1 every N points of the l-grid, plus the largest l1 allowed by the
+ * triangular condition; bispectra2_intrinsic_sampling_refine() then decides where more points
+ * are needed. With N=1 all configurations are computed in a single pass.
+ *
+ * Here, l3 refers to the second-order field, as in the integration functions.
+ */
+int bispectra2_intrinsic_sampling_init (
+    struct precision2 * ppr2,
+    struct bispectra * pbi,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
 
-            /* Print the integral as a function of k2 */
-            // if (offset_L3==0)
-            //  if (index_k1==13) /* To be used when you have the same grid as Christian */
-            //   // if (index_k1==160) /* for bks runs it corresponds to 0.1912861 */
-            //   if (index_k1==85) /* for bks runs it corresponds to 0.03728321, which is Christian's 13 */
-            //   // if (index_k1==118) /* For bks runs, corresponds to 0.1 */
-            //   // if (index_k1==95) /* For ref k-sampling, corresponds to 0.1 */
-            //     // if (index_r==83) /* 14000 for 250r13to16 */
-            //     if (index_r==49) /* 14000 for 99r135to145 */
-            //       if ((l3==200) && (pwb->abs_M3==1))
-            //         fprintf (stderr, "%17.7g %17.7g\n",
-            //           k2, pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2]);
+  int stride = MAX (1, ppr2->intrinsic_adaptive_stride);
 
-          } // end of for(index_r)          
-        } // end of for(index_k2)
-      } // end of for(index_k1)
-    } if (abort == _TRUE_) return _FAILURE_; /* end of parallel region */
+  pwb->count_interpolated_configurations = 0;
 
-  
-    /* Free the memory associated with the second order transfer function for this (l,m) */
-    if ((ppr2->load_transfers_from_disk == _TRUE_)
-      || (ppr2->store_transfers_to_disk == _TRUE_)) {
-      class_call (transfer2_free_type_level (
-                    ppt2,
-                    ptr2,
-                    index_tt2_k3 + ptr2->lm_array[index_l3][index_M3]),
-        ptr2->error_message,
-        pbi->error_message);
+  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3) {
+    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2) {
+
+      int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
+      int index_l1_max = pbi->index_l_triangular_max[index_l3][index_l2];
+
+      for (int index_l1=index_l1_min; index_l1<=index_l1_max; ++index_l1) {
+
+        short is_coarse = (((index_l1-index_l1_min)%stride == 0) || (index_l1 == index_l1_max));
+
+        pwb->l_sampling[index_l3][index_l2][index_l1-index_l1_min] =
+          (is_coarse ? pending_configuration : skipped_configuration);
+      }
     }
-  
-  } // end of for(index_l3);
-    
-  if (pbi->bispectra_verbose > 2)
-    printf("     * memorised ~ %.3g MB (%ld doubles) for the k3-integral array (<k3_size>=%g)\n",
-      pwb->count_memorised_for_integral_over_k3*sizeof(double)/1e6,
-      pwb->count_memorised_for_integral_over_k3,
-      average_k3_grid_size/pwb->count_memorised_for_integral_over_k3);
+  }
 
-  /* Check that we correctly filled the array */
-  class_test (
-    pwb->count_memorised_for_integral_over_k3 != pwb->count_allocated_for_integral_over_k3,
+  class_call (bispectra2_intrinsic_sampling_pending (pbi, pwb),
     pbi->error_message,
-    "there is a mismatch between allocated (%ld) and used (%ld) space!",
-    pwb->count_allocated_for_integral_over_k3, pwb->count_memorised_for_integral_over_k3);
-
-  return _SUCCESS_; 
-  
-} // end of bispectra2_intrinsic_integrate_over_k3
-  
+    pbi->error_message);
 
+  return _SUCCESS_;
 
+}
 
 
 
-int bispectra2_interpolate_over_k2 (
-    struct precision * ppr,
-    struct precision2 * ppr2,
-    struct perturbs * ppt,
-    struct perturbs2 * ppt2,
-    struct bessels * pbs,
-    struct bessels2 * pbs2,
-    struct transfers * ptr,
-    struct transfers2 * ptr2,
-    struct primordial * ppm,
+/**
+ * Update the flags that tell the integration functions which l3 values and (l3,l2) pairs
+ * have at least one pending configuration, and count the pending and computed configurations.
+ */
+int bispectra2_intrinsic_sampling_pending (
     struct bispectra * pbi,
-    int index_r,
-    int index_k1,
-    int index_l3,
-    double * integral_splines,
-    double * interpolated_integral,
-    double * f,
     struct bispectra_workspace_intrinsic * pwb
     )
 {
 
-  /* Shortcuts */
-  int k_pt_size = pwb->k_smooth_size;
-  double * k_pt = pwb->k_smooth_grid;
-  int k_tr_size = ptr->q_size;
-  double * k_tr = ptr->q;
+  pwb->count_pending_configurations = 0;
+  pwb->count_computed_configurations = 0;
 
-  /* So far, we always assumed that k1>=k2 because the transfer function has the
-  following symmetry:
-      T (\vec{k1},\vec{k_2},\vec{k_3}) = (-1)^m * T (\vec{k_2},\vec{k_1},\vec{k_3}).
-  The (-1)^m factor comes from the fact that one can exchange \vec{k_1} and \vec{k_2} by
-  performing a rotation around \vec{k} of pi radians. This is equivalent to a factor of
-  exp(i*pi*m) = (-1)^m, and also implies that T_lm (\vec{k_1},\vec{k_2},\vec{k_3})=0 when
-  m is odd and \vec{k_1}=\vec{k_2}.
-    
-  Now we need to interpolate the k2 dependence of the transfer function, hence we build a
-  temporary array where
-      f(index_k1, index_k2) = (-1)^m * integral_over_k3(index_k2, index_k1)
-  when index_k1 < index_k2.
-  
-  We also include a (k1/k2)^m factor that mimicks the rescaling of the transfer function
-  under the exchange \vec{k_1}<->\vec{k_2}. This follows from the fact that
-      k1*sin(theta_1) = k2*sin(theta_2),
-  which implies that
-      T_rescaled(\vec{k2},\vec{k1},\vec{k3})
-      = T_rescaled(\vec{k1},\vec{k2},\vec{k3})*(k1/k2)^m */
+  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3) {
 
-  for (int index_k2=0; index_k2 < k_pt_size; ++index_k2) {
+    pwb->has_pending_l3[index_l3] = _FALSE_;
 
-    if (index_k1 > index_k2)
-      f[index_k2] = pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2];
-    else 
-      f[index_k2] = pwb->integral_over_k3[index_l3][index_r][index_k2][index_k1]
-                  * pow (-k_pt[index_k1]/k_pt[index_k2], pwb->abs_M3);
-    
-    /* Multiply by window function */
-    f[index_k2] *= pwb->k_window[index_k2];
-                                        
-  }
-  
-  if (ppr->transfers_k2_interpolation == cubic_interpolation) {
-    
-    class_call (array_spline_table_columns (
-                  k_pt,
-                  k_pt_size,
-                  f,
-                  1,  /* how many columns to consider */
-                  integral_splines,
-                  _SPLINE_EST_DERIV_,
-                  pbi->error_message),
-         pbi->error_message,
-         pbi->error_message);
-  }
+    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2) {
 
+      pwb->has_pending_l3_l2[index_l3][index_l2] = _FALSE_;
 
-  /* Interpolate at each k value using the usual spline interpolation algorithm */
-  int index_k = 0;
-  double h = k_pt[index_k+1] - k_pt[index_k];
-    
-  for (int index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr) {
-    
-    while (((index_k+1) < k_pt_size) && (k_pt[index_k+1] < k_tr[index_k_tr])) {
-      index_k++;
-      h = k_pt[index_k+1] - k_pt[index_k];
-    }
-    
-    class_test(h==0., pbi->error_message, "stop to avoid division by zero");
-    class_test((index_k+1) >= k_pt_size, pbi->error_message,
-      "some of the elements in k_tr are larger than the largest k_pt. Stop to avoid seg fault.");
-    
-    double b = (k_tr[index_k_tr] - k_pt[index_k])/h;
-    double a = 1.-b;
+      for (int index_l1=0; index_l1 < pbi->l_triangular_size[index_l3][index_l2]; ++index_l1) {
 
-    /* Interpolate for each value of l3, r, k1 */
-    if (ppr->transfers_k2_interpolation == linear_interpolation) {
-      interpolated_integral[index_k_tr] = a * f[index_k] + b * f[index_k+1];
-    }
-    else if (ppr->transfers_k2_interpolation == cubic_interpolation) {
-      interpolated_integral[index_k_tr] =  
-        a * f[index_k] + b * f[index_k+1] +
-        ((a*a*a-a) * integral_splines[index_k] +(b*b*b-b) * integral_splines[index_k+1])*h*h/6.0;
+        short sampling = pwb->l_sampling[index_l3][index_l2][index_l1];
+
+        if (sampling == pending_configuration) {
+          pwb->has_pending_l3_l2[index_l3][index_l2] = _TRUE_;
+          pwb->has_pending_l3[index_l3] = _TRUE_;
+          pwb->count_pending_configurations++;
+        }
+        else if (sampling == computed_configuration) {
+          pwb->count_computed_configurations++;
+        }
+      }
     }
+  }
 
-    /* Revert the effect of the window function */
-    interpolated_integral[index_k_tr] *= pwb->k_window_inverse[index_k_tr];
+  return _SUCCESS_;
 
-#ifdef DEBUG
-    /* We expect the integral over k3 that we are interpolating to be order unity,
-    because it is obtained as a convolution of the second-order transfer functions
-    and a Bessel function */
-    double expected_scale = 1;
-    class_test_permissive (fabs(interpolated_integral[index_k_tr]) > (expected_scale*1000),
-      pbi->error_message,
-      "found extremely large value for integral over k3 (m=%d): I_l3(k1_pt,k2_tr,r)=%g,\
- for l3=%d[%d], k1_pt=%g[%d], k2_tr=%g[%d], r=%g[%d]\n",
-      pwb->abs_M3, interpolated_integral[index_k_tr], pbi->l[index_l3], index_l3,
-      k_pt[index_k1], index_k1, k_tr[index_k_tr], index_k_tr, pwb->r[index_r], index_r);
-#endif // DEBUG
+}
 
-    /* Further convolve with the primordial power spectrum */
-    interpolated_integral[index_k_tr] *= pbi->pk[index_k_tr];
 
-    /* Test for nans */
-    class_test (isnan(interpolated_integral[index_k_tr]),
-      pbi->error_message,
-      "k2 interpolation yielded a nan for index_r=%d, index_k1=%d, index_l3=%d",
-      index_r, index_k1, index_l3);
 
-  } // end of for (index_k_tr)
+/**
+ * Interpolate the unsymmetrised bispectrum in l1 for a given (l3,l2) pair, at a multipole
+ * pbi->l[index_l1] that lies between the computed configurations index_interval and
+ * index_interval+1.
+ *
+ * The interpolating polynomial goes through the two computed configurations around l1 and
+ * their neighbours: it is cubic in the bulk of the l1 range, quadratic at its edges, and linear
+ * if only two configurations were computed. The interpolation of one degree less, obtained by
+ * dropping the neighbour farthest from l1, is returned in b_lower; the difference between the
+ * two estimates the error of the lower-degree interpolation, and therefore it is a conservative
+ * estimate of the error of b_interpolated.
+ */
+int bispectra2_intrinsic_sampling_interpolate_row (
+    struct bispectra * pbi,
+    int n_computed,          /**< Number of computed configurations for the (l3,l2) pair */
+    int * index_l1_computed, /**< l1 indices of the computed configurations, in increasing order */
+    double * b_computed,     /**< Bispectrum in the computed configurations */
+    int index_interval,      /**< Position in index_l1_computed of the computed configuration just below l1 */
+    int index_l1,            /**< l1 index where to interpolate */
+    double * b_interpolated, /**< Output, polynomial interpolation in l1 */
+    double * b_lower         /**< Output, polynomial interpolation in l1 of one degree less */
+    )
+{
 
+  int i = index_interval;
+  double l = pbi->l[index_l1];
 
-  /* Some debug - print the original array and the interpolation */
-  // if ((index_k1==1) && (index_l3==0) && (index_r==0)) {
-  // 
-  //   fprintf (stderr, "\n\n");
-  // 
-  //   /* Node points before window */
-  //   for (index_k=0; index_k < k_pt_size; ++index_k)
-  //     fprintf (stderr, "%17.7g %17.7g\n", k_pt[index_k], f[index_k]/pwb->k_window[index_k]);
-  // 
-  //   fprintf (stderr, "\n");
-  //   
-  //   /* Node points after window */
-  //   for (index_k=0; index_k < k_pt_size; ++index_k)
-  //     fprintf (stderr, "%17.7g %17.7g\n", k_pt[index_k], f[index_k]);
-  // 
-  //   fprintf (stderr, "\n");
-  // 
-  //   /* Interpolation after inverse window */  
-  //   for (index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr)
-  //     fprintf (stderr, "%17.7g %17.7g\n", k_tr[index_k_tr], interpolated_integral[index_k_tr]/pbi->pk[index_k_tr]);
-  // 
-  //   fprintf (stderr, "\n\n");
-  //   
-  // }
+  /* Stencils of the two polynomials, which differ by the neighbour farthest from l */
+  int first = MAX (0, i-1);
+  int last = MIN (n_computed-1, i+2);
+  int first_lower = first;
+  int last_lower = last;
 
+  if (last-first > 1) {
+    if ((l-pbi->l[index_l1_computed[first]]) > (pbi->l[index_l1_computed[last]]-l))
+      first_lower = first+1;
+    else
+      last_lower = last-1;
+  }
 
-  return _SUCCESS_;
+  /* Lagrange formula on the points from 'first' to 'last' */
+  for (int lower=0; lower < 2; ++lower) {
 
-}
+    int j_min = (lower ? first_lower : first);
+    int j_max = (lower ? last_lower : last);
+    double result = 0;
 
+    for (int j=j_min; j <= j_max; ++j) {
 
+      double l_j = pbi->l[index_l1_computed[j]];
+      double weight = 1;
 
+      for (int k=j_min; k <= j_max; ++k)
+        if (k != j)
+          weight *= (l - pbi->l[index_l1_computed[k]]) / (l_j - pbi->l[index_l1_computed[k]]);
 
+      result += weight * b_computed[j];
+    }
 
-int bispectra2_intrinsic_integrate_over_k2 (
-    struct precision * ppr,
+    if (lower)
+      *b_lower = result;
+    else
+      *b_interpolated = result;
+  }
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Mark for the second pass of the integration the configurations of the unsymmetrised
+ * intrinsic bispectrum where the interpolation of the first pass is not accurate enough.
+ *
+ * For each (l3,l2) pair and each interval between two computed values of l1, we estimate the
+ * interpolation error as the largest difference between the two interpolations of
+ * bispectra2_intrinsic_sampling_interpolate_row(), relative to the largest
+ * computed value of the bispectrum for the same (l3,l2) pair. The estimate is maximised over the
+ * fields (X,Y,Z); if it exceeds ppr2->intrinsic_adaptive_tolerance, all the configurations inside
+ * the interval become pending. When only two configurations were computed for an (l3,l2) pair,
+ * the error cannot be estimated and the whole pair is refined.
+ */
+int bispectra2_intrinsic_sampling_refine (
     struct precision2 * ppr2,
-    struct perturbs * ppt,
-    struct perturbs2 * ppt2,
-    struct bessels * pbs,
-    struct bessels2 * pbs2,
-    struct transfers * ptr,
-    struct transfers2 * ptr2,
-    struct primordial * ppm,
     struct bispectra * pbi,
-    int index_tt_k2,
     struct bispectra_workspace_intrinsic * pwb
     )
 {
 
-  /* Integration grid */
-  int k_tr_size = ptr->q_size;
-  double * k_tr = ptr->q;
-
-  /* Parallelization variables */
-  int thread = 0;
+  int bf_size = pbi->bf_size;
   int abort = _FALSE_;
 
-  // ======================================================================================================
-  // =                                   Allocate memory for INT_l2_l3(r,k1)                              =
-  // ======================================================================================================
-  
-  /* Because we shall recycle the array for more than one fields (T,E...) we make sure we allocate it
-  only once. This is achieved by performing the allocation only at the beginning of the loop over
-  the field (that is, when pwb->Y==0) */
+  #pragma omp parallel for schedule (dynamic) collapse (2)
+  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3) {
+    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2) {
 
-  if (pwb->Y == 0) {
+      int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
+      int l1_size = pbi->l_triangular_size[index_l3][index_l2];
 
-    /* Initialize counter */
-    pwb->count_allocated_for_integral_over_k2 = 0;
-  
-    /* Allocate l2-level */
-    class_alloc (pwb->integral_over_k2, pbi->l_size*sizeof(double ***), pbi->error_message);
-  
-    for (int index_l3=0; index_l3<pbi->l_size; ++index_l3) {
-  
-      /* Allocate l3-level */
-      class_alloc (pwb->integral_over_k2[index_l3], pbi->l_size*sizeof(double **), pbi->error_message);
-  
-      for (int index_l2=0; index_l2<pbi->l_size; ++index_l2) {
-    
-        /* Allocate r-level */
-        class_alloc (pwb->integral_over_k2[index_l3][index_l2], pwb->r_size*sizeof(double *), pbi->error_message);
-  
-        /* Allocate 'k1' level. Make sure to use calloc. */
-        for (int index_r=0; index_r < pwb->r_size; ++index_r) {
-  
-          int k1_size = pwb->k_smooth_size;
-          class_calloc (pwb->integral_over_k2[index_l3][index_l2][index_r], k1_size, sizeof(double), pbi->error_message);
-  
-        /* Increase memory counter, excluding non-physical configurations where |M3|>l3 */
-        if (pwb->abs_M3 <= pbi->l[index_l3])
-          pwb->count_allocated_for_integral_over_k2 += k1_size;
-  
-        } // end of for(index_r)
-      } // end of for(index_l2)
-    } // end of for(index_l3)
-    
-    if (pbi->bispectra_verbose > 2)
-      printf("     * allocated ~ %.3g MB (%ld doubles) for the k2-integral array (l_size=%d)\n",
-        pwb->count_allocated_for_integral_over_k2*sizeof(double)/1e6, pwb->count_allocated_for_integral_over_k2, pbi->l_size);
+      if (l1_size < 1)
+        continue;
 
-  } // end of if pwb->Y==0
-  
-  
-  // ==============================================================================================================
-  // =                                   Compute the INT_l2_l3(r, k1) integral                                    =
-  // ==============================================================================================================
-  
-  /* Initialize counter for the number of integrals computed */
-  pwb->count_memorised_for_integral_over_k2 = 0;
-  
-  /* As for the k3_integral, we parallelize the loop over 'r'.  Here, we set it as the outermost loop
-  as we do not need to load the second-order transfer functions from disk. */
-  abort = _FALSE_;
-  #pragma omp parallel shared (abort) private (thread)
-  {
-  
-    #ifdef _OPENMP
-    thread = omp_get_thread_num();
-    #endif
-  
-    #pragma omp for schedule (dynamic)
-    for (int index_r = 0; index_r < pwb->r_size; ++index_r) {
-  
-      if (pbi->bispectra_verbose > 2)
-        printf("     * computing the k2 integral for r=%g, index_r=%d\n", pwb->r[index_r], index_r);
-  
-      for (int index_l3 = 0; index_l3 < pbi->l_size; ++index_l3) {
-        
-        /* The configurations with |M3|>l3 do not contribute to the bispectrum because
-        they would violate the 3j-symbol properties */
-        if (pwb->abs_M3 > pbi->l[index_l3])
+      short * sampling = pwb->l_sampling[index_l3][index_l2];
+
+      /* The configurations computed in the first pass are final */
+      int n_computed = 0;
+      int index_l1_computed[l1_size];
+
+      for (int index_l1=index_l1_min; index_l1 < index_l1_min+l1_size; ++index_l1) {
+        if (sampling[index_l1-index_l1_min] == pending_configuration)
+          sampling[index_l1-index_l1_min] = computed_configuration;
+        if (sampling[index_l1-index_l1_min] == computed_configuration)
+          index_l1_computed[n_computed++] = index_l1;
+      }
+
+      if (n_computed == l1_size)
+        continue;
+
+      for (int i=0; i < n_computed-1; ++i) {
+
+        if (index_l1_computed[i+1]-index_l1_computed[i] < 2)
           continue;
-        
-        for (int index_k1 = 0; index_k1 < pwb->k_smooth_size; ++index_k1) {
-    
-          /* Interpolate the integral I_l3(k1,k2,r) that we computed above in the integration grid of k2.
-          Note that we pass the integral_splines and interpolated_integral arrays separately rather
-          than accessing them from pwb, because they are thread dependent (while pwb isn't). */
-          class_call_parallel (bispectra2_interpolate_over_k2 (
-                                 ppr,
-                                 ppr2,
-                                 ppt,
-                                 ppt2,
-                                 pbs,
-                                 pbs2,
-                                 ptr,
-                                 ptr2,
-                                 ppm,
-                                 pbi,
-                                 index_r,
-                                 index_k1,
-                                 index_l3,
-                                 pwb->integral_splines[thread],
-                                 pwb->interpolated_integral[thread],
-                                 pwb->f[thread],
-                                 pwb),
-            pbi->error_message,
-            pbi->error_message);            
-            
-          /* Some debug - show the function that was interpolated as a function of r */
-          // if ((pbi->l[index_l3]==205) && (pwb->abs_M3==1))
-          //   if (pwb->offset_L3==1)
-          //     if (index_k1==46) {
-          //       index_k2 = 37;
-          //       fprintf (stderr, "%17.7g %17.7g\n", pwb->r[index_r], pwb->f[thread][index_k2]);
-          //     }
-            
-          /* Some debug - show the function that was interpolated as a function of k2 */
-          // if (pwb->offset_L3==-1)
-          //   if (index_k1==46)
-          //     if (index_k2==37)
-          //     // if (index_r==49) /* 14000 for 99r135to145 */
-          //       // if ((pbi->l[index_l3]==205) && (pwb->abs_M3==1))
-          //       //   for (index_k2=0; index_k2 < pwb->k_smooth_size; ++index_k2)
-          //           fprintf (stderr, "%17.7g %17.7g\n",
-          //             pwb->k_smooth_grid[index_k2], pwb->f[thread][index_k2]);
-
-          /* Some debug - show the function after interpolation as a function of k2 */
-          // if (pwb->offset_L3==0)
-          //   if (index_k1==85) /* for ref runs with l_max=200 and kmax=6 it corresponds to 0.03728321, which is Christian's 13 */
-          //   // if (index_k1==118) /* For better k-sampling, corresponds to 0.1 */
-          //   // if (index_k1==95) /* For ref k-sampling, corresponds to 0.1 */
-          //     // if (index_r==83) /* 14000 for 250r13to16 */
-          //     if (index_r==49) /* 14005.1 for 100r135to145 */
-          //       if ((pbi->l[index_l3]==200) && (pwb->abs_M3==1))
-          //         for (index_k2=0; index_k2 < ptr->q_size; ++index_k2)
-          //           fprintf (stderr, "%17.7g %17.7g\n",
-          //             ptr->q[index_k2],
-          //             pwb->interpolated_integral[thread][index_k2]/pbi->pk[index_k2]);
-
-          for (int index_l2 = 0; index_l2 < pbi->l_size; ++index_l2) {  
-  
-            /* Define the pointer to the first-order transfer functions as a function of k */
-            double * transfer = &(ptr->transfer [ppt->index_md_scalars]
-                                                [((ppt->index_ic_ad * ptr->tt_size[ppt->index_md_scalars] + index_tt_k2)
-                                                * ptr->l_size[ppt->index_md_scalars] + index_l2) * k_tr_size]);
-  
-            class_call_parallel (bessel_convolution (
-                                   ppr,
-                                   pbs,
-                                   k_tr,
-                                   pbi->delta_k,
-                                   k_tr_size,
-                                   pwb->interpolated_integral[thread],
-                                   transfer,
-                                   index_l2,
-                                   pwb->r[index_r],
-                                   &(pwb->integral_over_k2[index_l3][index_l2][index_r][index_k1]),
-                                   pbi->error_message
-                                   ),
-              pbi->error_message,
-              pbi->error_message);
 
-            /* Some debug - Print the integral as a function of r */
-            // if ((pwb->abs_M3==1) && (pwb->offset_L3==0))
-            //   if ((pbi->l[index_l2]==200) && (pbi->l[index_l3]==200))
-            //     /* for l_max=200 and kmax=6 it corresponds to 0.03728321, which is Christian's 13 */
-            //     if (index_k1==85)
-            //     // if ((index_k1==1) && (index_k2==0))
-            //       fprintf (stderr, "%17.7g %17.7g\n",
-            //         pwb->r[index_r], pwb->integral_over_k2[index_l3][index_l2][index_r][index_k1]);
+        short refine = (n_computed < 3);
 
-            /* Update the counter */
-            #pragma omp atomic
-            ++pwb->count_memorised_for_integral_over_k2;
-  
-            #pragma omp flush(abort)
-  
-          } // end of for(index_l2)
-        } // end of for(index_k1)
-      } // end of for(index_l3)
-    } // end of for(index_r)
-  } if (abort == _TRUE_) return _FAILURE_;  // end of parallel region
-  
-  if (pbi->bispectra_verbose > 2)
-    printf("     * memorised ~ %.3g MB (%ld doubles) for the k2-integral array (k2_size=%d)\n",
-      pwb->count_memorised_for_integral_over_k2*sizeof(double)/1e6, pwb->count_memorised_for_integral_over_k2,
-      k_tr_size);
-  
-  /* Check that we correctly filled the array */
-  class_test (pwb->count_memorised_for_integral_over_k2 != pwb->count_allocated_for_integral_over_k2,
-    pbi->error_message,
-    "there is a mismatch between allocated (%ld) and used (%ld) space!",
-    pwb->count_allocated_for_integral_over_k2, pwb->count_memorised_for_integral_over_k2);
-  
-  /* Free the memory that was allocated for the I_l3 integral, but only if we have already computed it
-  for all the required probes */
-  if (pwb->Y == (pbi->bf_size-1)) {
-    for (int index_l3=0; index_l3<pbi->l_size; ++index_l3) {
-      for (int index_r=0; index_r < pwb->r_size; ++index_r) {
-        for (int index_k1=0; index_k1<pwb->k_smooth_size; ++index_k1) {
-          free (pwb->integral_over_k3[index_l3][index_r][index_k1]);
-        } // end of for(index_k1)
-        free (pwb->integral_over_k3[index_l3][index_r]);
-      } // end of for(index_r)
-      free (pwb->integral_over_k3[index_l3]);
-    } // end of for(index_l3)
-    free (pwb->integral_over_k3);
-  } 
+        for (int X=0; (X < bf_size) && (refine == _FALSE_); ++X) {
+          for (int Y=0; (Y < bf_size) && (refine == _FALSE_); ++Y) {
+            for (int Z=0; (Z < bf_size) && (refine == _FALSE_); ++Z) {
 
-  return _SUCCESS_; 
+              double * b = pwb->unsymmetrised_bispectrum[X][Y][Z][index_l3][index_l2];
+              double b_computed[n_computed];
+              double scale = 0;
 
-}
+              for (int j=0; j < n_computed; ++j) {
+                b_computed[j] = b[index_l1_computed[j]-index_l1_min];
+                scale = MAX (scale, fabs(b_computed[j]));
+              }
 
-        
+              for (int index_l1=index_l1_computed[i]+1; index_l1 < index_l1_computed[i+1]; ++index_l1) {
+
+                double b_interpolated, b_lower;
+
+                class_call_parallel (bispectra2_intrinsic_sampling_interpolate_row (
+                                       pbi,
+                                       n_computed,
+                                       index_l1_computed,
+                                       b_computed,
+                                       i,
+                                       index_l1,
+                                       &b_interpolated,
+                                       &b_lower),
+                  pbi->error_message,
+                  pbi->error_message);
+
+                if (fabs(b_interpolated-b_lower) > ppr2->intrinsic_adaptive_tolerance*scale) {
+                  refine = _TRUE_;
+                  break;
+                }
+              }
+            }
+          }
+        }
 
+        if (refine == _TRUE_)
+          for (int index_l1=index_l1_computed[i]+1; index_l1 < index_l1_computed[i+1]; ++index_l1)
+            sampling[index_l1-index_l1_min] = pending_configuration;
 
+      } // end of for(i)
 
+      #pragma omp flush(abort)
 
-int bispectra2_interpolate_over_k1 (
-    struct precision * ppr,
-    struct precision2 * ppr2,
-    struct perturbs * ppt,
-    struct perturbs2 * ppt2,
-    struct bessels * pbs,
-    struct bessels2 * pbs2,
-    struct transfers * ptr,
-    struct transfers2 * ptr2,
-    struct primordial * ppm,
+    } // end of for(index_l2)
+  } // end of for(index_l3)
+
+  if (abort == _TRUE_) return _FAILURE_;
+
+  class_call (bispectra2_intrinsic_sampling_pending (pbi, pwb),
+    pbi->error_message,
+    pbi->error_message);
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Fill the configurations of the unsymmetrised intrinsic bispectrum that were not computed by
+ * interpolating in l1 the computed ones, using bispectra2_intrinsic_sampling_interpolate_row().
+ */
+int bispectra2_intrinsic_sampling_interpolate (
     struct bispectra * pbi,
-    int index_r,
-    int index_l3,
-    int index_l2,
-    double * integral_splines,
-    double * interpolated_integral,
-    double * f,
     struct bispectra_workspace_intrinsic * pwb
     )
 {
 
-  /* Shortcuts */
-  int k_pt_size = pwb->k_smooth_size;
-  double * k_pt = pwb->k_smooth_grid;
-  int k_tr_size = ptr->q_size;
-  double * k_tr = ptr->q;
-  
-  /* Define the function to be interpolated, and multiply it by a window function */
-  for (int index_k1=0; index_k1 < k_pt_size; ++index_k1) {
-    
-    f[index_k1] = pwb->integral_over_k2[index_l3][index_l2][index_r][index_k1];
-    f[index_k1] *= pwb->k_window[index_k1];
-  }
- 
-  if (ppr->transfers_k1_interpolation == cubic_interpolation) {
-    
-    class_call (array_spline_table_columns (
-                  k_pt,
-                  k_pt_size,
-                  f,
-                  1,  /* How many columns to consider */
-                  integral_splines,
-                  _SPLINE_EST_DERIV_,
-                  pbi->error_message),
-         pbi->error_message,
-         pbi->error_message);
-  }
+  int bf_size = pbi->bf_size;
+  long int count_interpolated = 0;
+  int abort = _FALSE_;
 
+  #pragma omp parallel for schedule (dynamic) collapse (2) reduction (+:count_interpolated)
+  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3) {
+    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2) {
 
-  /* Interpolate at each k value using the usual spline interpolation algorithm */
-  int index_k = 0;
-  double h = k_pt[index_k+1] - k_pt[index_k];
-    
-  for (int index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr) {
-    
-    while (((index_k+1) < k_pt_size) && (k_pt[index_k+1] < k_tr[index_k_tr])) {
-      index_k++;
-      h = k_pt[index_k+1] - k_pt[index_k];
-    }
-    
-    class_test(h==0., pbi->error_message, "stop to avoid division by zero");
-    class_test((index_k+1) >= k_pt_size, pbi->error_message,
-      "some of the elements in k_tr are larger than the largest k_pt. Stop to avoid seg fault.");
-    
-    double b = (k_tr[index_k_tr] - k_pt[index_k])/h;
-    double a = 1.-b;
-      
-    /* Interpolate for each value of l2, l3, r */
-    if (ppr->transfers_k1_interpolation == linear_interpolation) {
-      interpolated_integral[index_k_tr] = a * f[index_k] + b * f[index_k+1];
-    }
-    else if (ppr->transfers_k1_interpolation == cubic_interpolation) {
-      interpolated_integral[index_k_tr] =  
-        a * f[index_k] + b * f[index_k+1]
-        + ((a*a*a-a) * integral_splines[index_k] +(b*b*b-b) * integral_splines[index_k+1])*h*h/6.0;
-    }
+      int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
+      int l1_size = pbi->l_triangular_size[index_l3][index_l2];
 
-    /* Revert the effect of the window function */
-    interpolated_integral[index_k_tr] *= pwb->k_window_inverse[index_k_tr];
+      if (l1_size < 1)
+        continue;
 
-#ifdef DEBUG
-    /* We expect the integral over k2 that we are interpolating to be order A_s~1e-10,
-    because it is obtained as a convolution of two O(1) function (the integral over k3
-    and a Bessel function) and the primordial power spectrum (of oder A_s) */
-    double expected_scale = 1e-10;
-    class_test_permissive (fabs(interpolated_integral[index_k_tr]) > (expected_scale*1000),
-      pbi->error_message,
-      "found extremely large value for integral over k2 (m=%d): I_l2_l3(k1_tr,r)=%g,\
- for l2=%d[%d], l3=%d[%d], k1_tr=%g[%d], r=%g[%d]\n",
-      pwb->abs_M3, interpolated_integral[index_k_tr], pbi->l[index_l2], index_l2, pbi->l[index_l3], index_l3,
-      k_tr[index_k_tr], index_k_tr, pwb->r[index_r], index_r);
-#endif // DEBUG
+      short * sampling = pwb->l_sampling[index_l3][index_l2];
 
-    /* Further convolve with the primordial power spectrum */
-    interpolated_integral[index_k_tr] *= pbi->pk[index_k_tr];
+      int n_computed = 0;
+      int index_l1_computed[l1_size];
 
-    /* Test for nans */
-    class_test (isnan(interpolated_integral[index_k_tr]),
-      pbi->error_message,
-      "k1 interpolation yielded a nan for index_r=%d, index_l3=%d, index_l2=%d",
-      index_r, index_l3, index_l2);
+      for (int index_l1=index_l1_min; index_l1 < index_l1_min+l1_size; ++index_l1) {
+        if (sampling[index_l1-index_l1_min] == pending_configuration)
+          sampling[index_l1-index_l1_min] = computed_configuration;
+        if (sampling[index_l1-index_l1_min] == computed_configuration)
+          index_l1_computed[n_computed++] = index_l1;
+      }
 
-  } // end of for (index_k_tr)
+      if (n_computed == l1_size)
+        continue;
 
+      for (int X=0; X < bf_size; ++X) {
+        for (int Y=0; Y < bf_size; ++Y) {
+          for (int Z=0; Z < bf_size; ++Z) {
 
-  /* Some debug - print the original array and the interpolation */
-  // if ((index_l2==10) && (index_l3==11) && (index_r==49)) {
-  // 
-  //   fprintf (stderr, "\n\n");
-  // 
-  //   /* Node points before window */
-  //   for (index_k=0; index_k < k_pt_size; ++index_k)
-  //     fprintf (stderr, "%17.7g %17.7g\n", k_pt[index_k], f[index_k]/pwb->k_window[index_k]);
-  // 
-  //   fprintf (stderr, "\n");
-  //   
-  //   /* Node points after window */
-  //   for (index_k=0; index_k < k_pt_size; ++index_k)
-  //     fprintf (stderr, "%17.7g %17.7g\n", k_pt[index_k], f[index_k]);
-  // 
-  //   fprintf (stderr, "\n");
-  // 
-  //   /* Interpolation after inverse window */  
-  //   for (index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr)
-  //     fprintf (stderr, "%17.7g %17.7g\n", k_tr[index_k_tr], interpolated_integral[index_k_tr]/pbi->pk[index_k_tr]);
-  // 
-  //   fprintf (stderr, "\n\n");
-  //   
-  // }
+            double * b = pwb->unsymmetrised_bispectrum[X][Y][Z][index_l3][index_l2];
+            double b_computed[n_computed];
+
+            for (int j=0; j < n_computed; ++j)
+              b_computed[j] = b[index_l1_computed[j]-index_l1_min];
+
+            /* Computed configuration just below l1 */
+            int i = 0;
+
+            for (int index_l1=index_l1_min; index_l1 < index_l1_min+l1_size; ++index_l1) {
+
+              if (sampling[index_l1-index_l1_min] == computed_configuration)
+                continue;
+
+              while (index_l1_computed[i+1] < index_l1)
+                ++i;
+
+              double b_lower;
+
+              class_call_parallel (bispectra2_intrinsic_sampling_interpolate_row (
+                                     pbi,
+                                     n_computed,
+                                     index_l1_computed,
+                                     b_computed,
+                                     i,
+                                     index_l1,
+                                     &b[index_l1-index_l1_min],
+                                     &b_lower),
+                pbi->error_message,
+                pbi->error_message);
+
+              if ((X==0) && (Y==0) && (Z==0))
+                count_interpolated++;
+            }
+          }
+        }
+      }
+
+      #pragma omp flush(abort)
+
+    } // end of for(index_l2)
+  } // end of for(index_l3)
+
+  if (abort == _TRUE_) return _FAILURE_;
+
+  pwb->count_interpolated_configurations = count_interpolated;
+
+  class_call (bispectra2_intrinsic_sampling_pending (pbi, pwb),
+    pbi->error_message,
+    pbi->error_message);
 
   return _SUCCESS_;
 
@@ -1983,471 +2208,2556 @@ int bispectra2_interpolate_over_k1 (
 
 
 
+/**
+ * Write to a text file in the run directory the (l1,l2,l3) configurations of the unsymmetrised
+ * intrinsic bispectrum that were computed by the full integration; the other ones were
+ * interpolated by bispectra2_intrinsic_sampling_interpolate().
+ */
+int bispectra2_intrinsic_sampling_store (
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct bispectra * pbi,
+    int index_bt,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  char sampling_path[_FILENAMESIZE_];
+  sprintf (sampling_path, "%s/sampling_%s.txt", ppr->data_dir, pbi->bt_labels[index_bt]);
+
+  FILE * sampling_file;
+  class_open (sampling_file, sampling_path, "w", pbi->error_message);
+
+  fprintf (sampling_file, "# Configurations of the unsymmetrised %s bispectrum computed by the full integration,\n",
+    pbi->bt_labels[index_bt]);
+  fprintf (sampling_file, "# where l_X is the multipole of the second-order field. The other configurations were\n");
+  fprintf (sampling_file, "# interpolated in l_Z (intrinsic_adaptive_stride = %d, intrinsic_adaptive_tolerance = %g).\n",
+    ppr2->intrinsic_adaptive_stride, ppr2->intrinsic_adaptive_tolerance);
+  fprintf (sampling_file, "# computed = %ld, interpolated = %ld\n",
+    pwb->count_computed_configurations, pwb->count_interpolated_configurations);
+  fprintf (sampling_file, "# %6s %8s %8s\n", "l_X", "l_Y", "l_Z");
+
+  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3) {
+    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2) {
+
+      int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
 
+      for (int index_l1=index_l1_min; index_l1 < index_l1_min+pbi->l_triangular_size[index_l3][index_l2]; ++index_l1)
+        if (pwb->l_sampling[index_l3][index_l2][index_l1-index_l1_min] == computed_configuration)
+          fprintf (sampling_file, "%8d %8d %8d\n", pbi->l[index_l3], pbi->l[index_l2], pbi->l[index_l1]);
+    }
+  }
 
+  fclose (sampling_file);
 
+  if (pbi->bispectra_verbose > 1)
+    printf (" -> wrote the sampling of the intrinsic bispectrum to '%s'\n", sampling_path);
 
+  return _SUCCESS_;
 
+}
 
-    
-        
-        
-int bispectra2_intrinsic_integrate_over_k1 (
+
+
+/**
+ * Store the symmetrised intrinsic bispectrum pbi->bispectra[index_bt] to a binary file in the
+ * run directory, one block for each field combination XYZ labelled with pbi->bfff_labels[X][Y][Z].
+ * Later runs read the file with bispectra2_intrinsic_load_blocks() and integrate only the field
+ * combinations that are not in it (ppr2->intrinsic_incremental).
+ *
+ * The header contains the l and m lists, the coefficient of the quadratic correction included
+ * in the stored bispectra, and the number of (l1,l2,l3) configurations in each block, which are
+ * stored with l1>=l2>=l3 in the order of the loops below.
+ */
+int bispectra2_intrinsic_store_blocks (
     struct precision * ppr,
     struct precision2 * ppr2,
-    struct perturbs * ppt,
-    struct perturbs2 * ppt2,
-    struct bessels * pbs,
-    struct bessels2 * pbs2,
-    struct transfers * ptr,
-    struct transfers2 * ptr2,
-    struct primordial * ppm,
     struct bispectra * pbi,
-    int index_tt_k1,
-    int offset_L1,
+    int index_bt,
     struct bispectra_workspace_intrinsic * pwb
     )
 {
 
-  /* Integration grid */
-  int k_tr_size = ptr->q_size;
-  double * k_tr = ptr->q;
+  char blocks_path[_FILENAMESIZE_];
+  sprintf (blocks_path, "%s/intrinsic_blocks_%s.dat", ppr->data_dir, pbi->bt_labels[index_bt]);
 
-  /* Parallelization variables */
-  int thread = 0;
-  int abort = _FALSE_;
-  
-  // ======================================================================================================
-  // =                                   Allocate memory for INT_l2_l3(r,k1)                              =
-  // ======================================================================================================
-  
-  /* We shall allocate the array pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min][index_r]
-  so that the l1 level is the one satisfying the triangular inequality (|l2-l3| <= l1 <= l2+l3). 
-  pwb->integral_over_k1 is recycled by the different iterations in the L1 loop and Z-field loop, hence we allocate
-  it only at the first iteration (offset_L1==, pwb->Y==0 and pwb->Z==0) */
-  
-  if ((offset_L1 == 0) && (pwb->Y==0) && (pwb->Z==0)) {
+  /* Count the (l1,l2,l3) configurations with l1>=l2>=l3 */
+  long int n_configurations = 0;
 
-    /* Initialize counter */
-    pwb->count_allocated_for_integral_over_k1 = 0;
-  
-    /* Allocate l2-level */
-    class_alloc (pwb->integral_over_k1, pbi->l_size*sizeof(double ***), pbi->error_message);
-  
-    for (int index_l3=0; index_l3<pbi->l_size; ++index_l3) {
-  
-      /* Allocate l2-level */
-      class_alloc (pwb->integral_over_k1[index_l3], pbi->l_size*sizeof(double **), pbi->error_message);
-  
-      for (int index_l2=0; index_l2<pbi->l_size; ++index_l2) {
-  
-        /* Determine the limits for l1, which come from the triangular inequality |l3-l2| <= l1 <= l3+l2 */
-        int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
-        int l1_size = pbi->l_triangular_size[index_l3][index_l2];
-  
-        /* Allocate l1-level */
-        class_alloc (pwb->integral_over_k1[index_l3][index_l2], l1_size*sizeof(double *), pbi->error_message);
-      
-        /* Allocate r-level. Make sure to use calloc. */
-        for (int index_l1=index_l1_min; index_l1<(index_l1_min + l1_size); ++index_l1) {
-  
-          class_calloc (pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min],
-                        pwb->r_size,
-                        sizeof(double),
-                        pbi->error_message);
-        
-        /* Increase memory counter, excluding non-physical configurations where |M3|>l3 */
-        if (pwb->abs_M3 <= pbi->l[index_l3])
-          pwb->count_allocated_for_integral_over_k1 += pwb->r_size;
-      
-        } // end of for(index_l1)
-      } // end of for(index_l2)
-    } // end of for(index_l3)
-    
-    if (pbi->bispectra_verbose > 2)
-      printf("     * allocated ~ %.3g MB (%ld doubles) for the k1-integral array (l_size=%d)\n",
-        pwb->count_allocated_for_integral_over_k1*sizeof(double)/1e6, pwb->count_allocated_for_integral_over_k1, pbi->l_size);
-  
-  } // end of if(offset_L1==0 and pwb->Z==0)
-  
-  
-  // ==============================================================================================================
-  // =                                   Compute the INT_l2_l3(r, k1) integral                                    =
-  // ==============================================================================================================
-  
-  /* Initialize counter for the number of integrals computed */
-  pwb->count_memorised_for_integral_over_k1 = 0;
+  for (int index_l1 = 0; index_l1 < pbi->l_size; ++index_l1)
+    for (int index_l2 = 0; index_l2 <= index_l1; ++index_l2)
+      n_configurations += MAX (0, MIN (index_l2, pbi->index_l_triangular_max[index_l1][index_l2])
+        - pbi->index_l_triangular_min[index_l1][index_l2] + 1);
 
-  /* We parallelize the loop over 'r'. */
-  abort = _FALSE_;
-  #pragma omp parallel              \
-    shared (ppt,ppt2,pbs,ptr,ptr2,ppm,pbi,pwb,abort)       \
-    private (thread)
-  {
-  
-    #ifdef _OPENMP
-    thread = omp_get_thread_num();
-    #endif
-  
-    #pragma omp for schedule (dynamic)
-    for (int index_r = 0; index_r < pwb->r_size; ++index_r) {
-  
-      if (pbi->bispectra_verbose > 2)
-        printf("     * computing the k1 integral for r=%g, index_r=%d\n", pwb->r[index_r], index_r);
+  FILE * blocks_file;
+  class_open (blocks_file, blocks_path, "wb", pbi->error_message);
 
-      /* We compute the integral over k1 for all possible l2-values */
-      for (int index_l3 = 0; index_l3 < pbi->l_size; ++index_l3) {
+  double * block;
+  class_alloc (block, n_configurations*sizeof(double), pbi->error_message);
 
-        int l3 = pbi->l[index_l3];
+  long int n_written = 0;
 
-        /* The configurations with |M3|>l3 do not contribute to the bispectrum because
-        they would violate the 3j-symbol properties */
-        if (pwb->abs_M3 > pbi->l[index_l3])
-          continue;
+  /* Header with the l and m lists */
+  int n_blocks = pbi->bf_size*pbi->bf_size*pbi->bf_size;
+  n_written += fwrite (&pbi->l_size, sizeof(int), 1, blocks_file);
+  n_written += fwrite (pbi->l, sizeof(int), pbi->l_size, blocks_file);
+  n_written += fwrite (&ppr2->m_size, sizeof(int), 1, blocks_file);
+  n_written += fwrite (ppr2->m, sizeof(int), ppr2->m_size, blocks_file);
+  n_written += fwrite (&pwb->quadratic_correction, sizeof(double), 1, blocks_file);
+  n_written += fwrite (&n_configurations, sizeof(long int), 1, blocks_file);
+  n_written += fwrite (&n_blocks, sizeof(int), 1, blocks_file);
 
-        if (pbi->bispectra_verbose > 3)
-          printf("      \\ computing the k1 integral for l3=%d, index_l3=%d, L1=%d, offset_L1=%d\n",
-            pbi->l[index_l3], index_l3, pbs2->l1[offset_L1], offset_L1);
-  
-        /* We compute the integral over k1 for all possible l3-values */
-        for (int index_l2 = 0; index_l2 < pbi->l_size; ++index_l2) {  
+  for (int X = 0; X < pbi->bf_size; ++X) {
+    for (int Y = 0; Y < pbi->bf_size; ++Y) {
+      for (int Z = 0; Z < pbi->bf_size; ++Z) {
 
-          /* Determine the limits for l1, which come from the triangular inequality |l2-l2| <= l1 <= l2+l2 */
-          int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
-          int index_l1_max = pbi->index_l_triangular_max[index_l3][index_l2];
-          
-          /* DISABLED: see comment outside the outside the outermost loop. */
-          /* We compute only those l1's whereby l1 >= l2. The reason is that the k1<->k2 symmetry of the
-          second-order transfer functions enforces the l2<->l1 symmetry of I_l2_l3_l1(r). Note that
-          this is a different symmetry than the full (l2,l3,l1) symmetry of the bispectrum, which we shall
-          enforce later. If you comment out the following line together with the next one outside the
-          outermost loop, the result should not change. */
-          // index_l1_min = MAX (index_l2, index_l1_min);
+        char label[_MAX_LENGTH_LABEL_];
+        memset (label, 0, _MAX_LENGTH_LABEL_);
+        strncpy (label, pbi->bfff_labels[X][Y][Z], _MAX_LENGTH_LABEL_-1);
 
-          /* Interpolate the integral I_l2_l3(k1,r) that we computed above in the integration grid of k1 */
-          if (index_l1_max >= index_l1_min) {
-            
-            class_call_parallel (bispectra2_interpolate_over_k1 (
-                          ppr,
-                          ppr2,
-                          ppt,
-                          ppt2,
-                          pbs,
-                          pbs2,
-                          ptr,
-                          ptr2,
-                          ppm,
-                          pbi,
-                          index_r,
-                          index_l3,
-                          index_l2,
-                          pwb->integral_splines[thread],
-                          pwb->interpolated_integral[thread],
-                          pwb->f[thread],
-                          pwb),
-              pbi->error_message,
-              pbi->error_message);
-              
-          }
-          else {
-            continue;
+        long int index_block = 0;
+
+        for (int index_l1 = 0; index_l1 < pbi->l_size; ++index_l1) {
+          for (int index_l2 = 0; index_l2 <= index_l1; ++index_l2) {
+
+            int index_l3_min = pbi->index_l_triangular_min[index_l1][index_l2];
+            int index_l3_max = MIN (index_l2, pbi->index_l_triangular_max[index_l1][index_l2]);
+
+            for (int index_l3=index_l3_min; index_l3<=index_l3_max; ++index_l3)
+              block[index_block++] = pbi->bispectra[index_bt][X][Y][Z]
+                [pbi->index_l1_l2_l3[index_l1][index_l1-index_l2][index_l3_max-index_l3]];
           }
+        }
 
+        n_written += fwrite (label, sizeof(char), _MAX_LENGTH_LABEL_, blocks_file);
+        n_written += fwrite (block, sizeof(double), n_configurations, blocks_file);
 
-          /* l1 is the index of the first transfer function that we are going to integrate,
-          while L1 is the order of the Bessel function */
-          for (int index_l1=index_l1_min; index_l1<=index_l1_max; ++index_l1) {
-            
-            int l1 = pbi->l[index_l1];
-            int L1 = abs(l1-pwb->abs_M3) + offset_L1;
+      }
+    }
+  }
 
-            /* Skip the (L3,l3,M3) configurations forbidden by the triangular condition */
-            if (L1 > (l1+pwb->abs_M3)) {
-              #pragma omp atomic
-              ++pwb->count_memorised_for_integral_over_k1;
-              continue;
-            }  
-      
-            /* Find L1 inside pbs2->l1, the list of l's where we have computed the Bessel functions 
-            for the extended l-range that is necessary to compute the m!=0 bispectra. */
-            int index_L1 = pbs2->index_l1[L1];
+  free (block);
 
-#ifdef DEBUG
-            /* Paranoid android */
-            class_test_parallel ((ppr2->m_max_song==0) && (l1!=L1),
-              pbi->error_message,
-              "inconsistency! for scalar modes, L1 must be equal to l1");
-              
-            class_test_parallel (pbs2->l1[index_L1]!=L1,
-              pbi->error_message,
-              "error in the indexing of pbs2->l1. Is the pbs2->extend_l1_using_m parameter true?");
-#endif // DEBUG
+  long int n_expected = 5 + pbi->l_size + ppr2->m_size
+    + n_blocks*(_MAX_LENGTH_LABEL_ + n_configurations);
 
-            /* Define the pointer to the first-order transfer functions as a function of k */
-            double * transfer = &(ptr->transfer [ppt->index_md_scalars]
-                                                [((ppt->index_ic_ad * ptr->tt_size[ppt->index_md_scalars] + index_tt_k1)
-                                                * ptr->l_size[ppt->index_md_scalars] + index_l1) * k_tr_size]);
+  /* As for the geometrical factors, remove a partially written file, whose header could
+  still match in a later run */
+  short failed = (fclose (blocks_file) != 0) || (n_written != n_expected);
+
+  if (failed == _TRUE_)
+    remove (blocks_path);
+
+  class_test (failed == _TRUE_,
+    pbi->error_message,
+    "could not write the %s bispectrum to '%s', wrote %ld values but expected %ld",
+    pbi->bt_labels[index_bt], blocks_path, n_written, n_expected);
+
+  if (pbi->bispectra_verbose > 1)
+    printf (" -> stored the field combinations of the %s bispectrum to '%s'\n",
+      pbi->bt_labels[index_bt], blocks_path);
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Read the field combinations of the symmetrised intrinsic bispectrum stored by
+ * bispectra2_intrinsic_store_blocks() in the run directory, if the file exists and if it
+ * was written for the current l and m lists and quadratic correction.
+ *
+ * The blocks whose label matches one of the current pbi->bfff_labels are copied into
+ * pbi->bispectra[index_bt] and flagged in pwb->loaded_bispectrum, so that bispectra2_intrinsic_init()
+ * integrates only the missing ones. Blocks of fields that are not requested are ignored.
+ * If the file is truncated, no block is used and all field combinations are computed again.
+ */
+int bispectra2_intrinsic_load_blocks (
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct bispectra * pbi,
+    int index_bt,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  char blocks_path[_FILENAMESIZE_];
+  sprintf (blocks_path, "%s/intrinsic_blocks_%s.dat", ppr->data_dir, pbi->bt_labels[index_bt]);
+
+  FILE * blocks_file = fopen (blocks_path, "rb");
+
+  if (blocks_file == NULL) {
+    if (pbi->bispectra_verbose > 0)
+      printf (" -> no stored intrinsic bispectrum in '%s', will compute all field combinations\n",
+        blocks_path);
+    return _SUCCESS_;
+  }
+
+  /* Compare the header with the current l and m lists */
+  short match = _TRUE_;
+  int size;
+
+  if ((fread (&size, sizeof(int), 1, blocks_file) != 1) || (size != pbi->l_size))
+    match = _FALSE_;
+
+  for (int index_l=0; (index_l < pbi->l_size) && (match == _TRUE_); ++index_l)
+    if ((fread (&size, sizeof(int), 1, blocks_file) != 1) || (size != pbi->l[index_l]))
+      match = _FALSE_;
+
+  if ((match == _TRUE_) && ((fread (&size, sizeof(int), 1, blocks_file) != 1) || (size != ppr2->m_size)))
+    match = _FALSE_;
+
+  for (int index_M=0; (index_M < ppr2->m_size) && (match == _TRUE_); ++index_M)
+    if ((fread (&size, sizeof(int), 1, blocks_file) != 1) || (size != ppr2->m[index_M]))
+      match = _FALSE_;
+
+  double quadratic_correction;
+
+  if ((match == _TRUE_) && ((fread (&quadratic_correction, sizeof(double), 1, blocks_file) != 1)
+    || (quadratic_correction != pwb->quadratic_correction)))
+    match = _FALSE_;
+
+  long int n_configurations = 0;
+  int n_blocks = 0;
+
+  if ((match == _TRUE_) && ((fread (&n_configurations, sizeof(long int), 1, blocks_file) != 1)
+    || (fread (&n_blocks, sizeof(int), 1, blocks_file) != 1)))
+    match = _FALSE_;
+
+  if (match == _FALSE_) {
+    if (pbi->bispectra_verbose > 0)
+      printf (" -> the bispectra in '%s' were computed for different l or m lists or quadratic corrections, will compute them again\n",
+        blocks_path);
+    fclose (blocks_file);
+    return _SUCCESS_;
+  }
+
+  double * block;
+  class_alloc (block, n_configurations*sizeof(double), pbi->error_message);
+
+  int n_loaded = 0;
+
+  for (int index_block=0; index_block < n_blocks; ++index_block) {
+
+    char label[_MAX_LENGTH_LABEL_];
+    long int n_read = fread (label, sizeof(char), _MAX_LENGTH_LABEL_, blocks_file);
+    n_read += fread (block, sizeof(double), n_configurations, blocks_file);
+
+    /* A truncated file is treated like a header mismatch: forget the blocks read so
+    far and compute all the field combinations again */
+    if (n_read != _MAX_LENGTH_LABEL_ + n_configurations) {
+
+      if (pbi->bispectra_verbose > 0)
+        printf (" -> could not read block %d from '%s', will compute all field combinations\n",
+          index_block, blocks_path);
+
+      for (int X=0; X < pbi->bf_size; ++X)
+        for (int Y=0; Y < pbi->bf_size; ++Y)
+          for (int Z=0; Z < pbi->bf_size; ++Z)
+            pwb->loaded_bispectrum[X][Y][Z] = _FALSE_;
+
+      fclose (blocks_file);
+      free (block);
+      return _SUCCESS_;
+    }
+
+    label[_MAX_LENGTH_LABEL_-1] = '\0';
+
+    for (int X = 0; X < pbi->bf_size; ++X) {
+      for (int Y = 0; Y < pbi->bf_size; ++Y) {
+        for (int Z = 0; Z < pbi->bf_size; ++Z) {
+
+          if ((strcmp (label, pbi->bfff_labels[X][Y][Z]) != 0) || (pwb->loaded_bispectrum[X][Y][Z] == _TRUE_))
+            continue;
+
+          long int index_config = 0;
+
+          for (int index_l1 = 0; index_l1 < pbi->l_size; ++index_l1) {
+            for (int index_l2 = 0; index_l2 <= index_l1; ++index_l2) {
+
+              int index_l3_min = pbi->index_l_triangular_min[index_l1][index_l2];
+              int index_l3_max = MIN (index_l2, pbi->index_l_triangular_max[index_l1][index_l2]);
+
+              for (int index_l3=index_l3_min; index_l3<=index_l3_max; ++index_l3)
+                pbi->bispectra[index_bt][X][Y][Z]
+                  [pbi->index_l1_l2_l3[index_l1][index_l1-index_l2][index_l3_max-index_l3]] = block[index_config++];
+            }
+          }
+
+          pwb->loaded_bispectrum[X][Y][Z] = _TRUE_;
+          n_loaded++;
+
+          if (pbi->bispectra_verbose > 1)
+            printf ("   \\ read bispectrum %s_%s from disk\n", pbi->bt_labels[index_bt], label);
+        }
+      }
+    }
+  }
+
+  fclose (blocks_file);
+  free (block);
+
+  if (pbi->bispectra_verbose > 0)
+    printf (" -> read %d of %d field combinations of the %s bispectrum from '%s'\n",
+      n_loaded, pbi->bf_size*pbi->bf_size*pbi->bf_size, pbi->bt_labels[index_bt], blocks_path);
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Allocate a zero-initialised slab of 'size' doubles, starting at an address aligned to
+ * _SLAB_ALIGNMENT_ bytes, for the integral arrays of the intrinsic bispectrum.
+ *
+ * We over-allocate with calloc and store the address returned by calloc just before the
+ * aligned slab, so that bispectra2_slab_free() can recover it. This avoids posix_memalign()
+ * and aligned_alloc(), which are not part of C99.
+ */
+int bispectra2_slab_alloc (
+    long int size,
+    double ** slab,
+    ErrorMsg error_message
+    )
+{
+
+  char * block = calloc (size*sizeof(double) + _SLAB_ALIGNMENT_ + sizeof(void *), 1);
+
+  class_test (block == NULL,
+    error_message,
+    "could not allocate a slab of %ld doubles", size);
+
+  uintptr_t start = ((uintptr_t)(block + sizeof(void *)) + _SLAB_ALIGNMENT_ - 1)
+    & ~((uintptr_t)_SLAB_ALIGNMENT_ - 1);
+
+  ((void **)start)[-1] = block;
+  *slab = (double *)start;
+
+  return _SUCCESS_;
+
+}
+
+
+/**
+ * Free a slab allocated with bispectra2_slab_alloc().
+ */
+void bispectra2_slab_free (
+    double * slab
+    )
+{
+
+  if (slab != NULL)
+    free (((void **)slab)[-1]);
+
+}
+
+
+
+int bispectra2_intrinsic_integrate_over_k3 (
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct perturbs * ppt,
+    struct perturbs2 * ppt2,
+    struct bessels * pbs,
+    struct bessels2 * pbs2,
+    struct transfers * ptr,
+    struct transfers2 * ptr2,
+    struct primordial * ppm,
+    struct bispectra * pbi,
+    int index_tt2_k3,
+    int index_M3,
+    int offset_L3,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  /* Parallelization variables */
+  int thread = 0;
+  int abort = _FALSE_;
   
-            /* It is important to note that the used Bessel here has order L1 rather than l1 */
-            class_call_parallel (bessel2_convolution (
-                                   ppr,
-                                   pbs2,
-                                   k_tr,
-                                   pbi->delta_k,
-                                   k_tr_size,
-                                   pwb->interpolated_integral[thread],
-                                   transfer,
-                                   index_L1,
-                                   pwb->r[index_r],
-                                   &(pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min][index_r]),
-                                   pbi->error_message
-                                   ),
-              pbi->error_message,
-              pbi->error_message);
+  // =========================================================================================
+  // =                             Allocate memory for I_l3(r,k1,k2)                         =
+  // =========================================================================================
+    
+  /* Initialize counter */
+  pwb->count_allocated_for_integral_over_k3 = 0;
+
+#ifdef _OPENMP
+  double alloc_start = omp_get_wtime();
+#endif
   
+  /* Allocate l3-level.  Note that, even if l3 must satisfy the triangular
+  inequality, we allocate this level for all the possible l3 values in the current block
+  (see bispectra2_intrinsic_memory_plan()).  We do so because this array is going to be
+  used by all (l1,l2) computations that follow, which means that l3 will eventually cover
+  all the allowed range. The l3 values outside the block are set to NULL. */
+
+  /* The values are stored in a single slab, where each (l3,r) pair has a triangle of
+  k1_size*(k1_size+1)/2 values in the (k1,k2) plane. The pointer levels are also contiguous,
+  and point to the slab so that the array can be indexed as [index_l3][index_r][index_k1][index_k2]. */
+  int k1_size = pwb->k_smooth_size;
+  long int triangle_size = (long int)k1_size*(k1_size+1)/2;
+  int l3_block_size = pwb->index_l3_max - pwb->index_l3_min + 1;
+
+  double * slab;
+  double ** k1_level;
+  double *** r_level;
+  class_call (bispectra2_slab_alloc (l3_block_size*pwb->r_size*triangle_size, &slab, pbi->error_message),
+    pbi->error_message,
+    pbi->error_message);
+  class_alloc (k1_level, l3_block_size*pwb->r_size*k1_size*sizeof(double *), pbi->error_message);
+  class_alloc (r_level, l3_block_size*pwb->r_size*sizeof(double **), pbi->error_message);
+  class_calloc (pwb->integral_over_k3, pbi->l_size, sizeof(double ***), pbi->error_message);
+  pwb->count_allocations_for_integral_arrays += 4;
   
-            /* Update the counter */
-            #pragma omp atomic
-            ++pwb->count_memorised_for_integral_over_k1;
+  for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3) {
+    
+    pwb->integral_over_k3[index_l3] = r_level + (index_l3-pwb->index_l3_min)*pwb->r_size;
+  
+    for (int index_r=0; index_r < pwb->r_size; ++index_r) {
+  
+      long int index_l3_r = (long int)(index_l3-pwb->index_l3_min)*pwb->r_size + index_r;
+      pwb->integral_over_k3[index_l3][index_r] = k1_level + index_l3_r*k1_size;
 
-            /* Print the integral as a function of r */
-            // if ((pwb->abs_M3==0) && (pwb->offset_L3==0) && (offset_L1==0))
-            //   if ((pwb->X==pbi->index_bf_t) && (pwb->Y==pbi->index_bf_t) && (pwb->Z==pbi->index_bf_t))
-            //     if ((pbi->l[index_l1]==2) && (pbi->l[index_l2]==2) && (pbi->l[index_l3]==2))
-            //         fprintf (stderr, "%17.7g %17.7g\n",
-            //           pwb->r[index_r], pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min][index_r]);
+      for (int index_k1=0; index_k1<k1_size; ++index_k1)
+        pwb->integral_over_k3[index_l3][index_r][index_k1] = slab + index_l3_r*triangle_size + index_k1*(index_k1+1)/2;
 
-            #pragma omp flush(abort)
-  
-          } // end of for(index_l1)
-        } // end of for(index_l2)
-      } // end of for(index_l3)
     } // end of for(index_r)
-  } if (abort == _TRUE_) return _FAILURE_;  // end of parallel region
 
-  /* DISABLED:  While the optimization makes sense, the way we implement it below leads to nan's. Investigate. */
-  /* Take care of the case when l1 < l2 */
-  // for (index_r = 0; index_r < pwb->r_size; ++index_r) {
-  //   for (index_l2=0; index_l2<pbi->l_size; ++index_l2) {
-  //     for (index_l3=0; index_l3<pbi->l_size; ++index_l3) {
-  //
-  //       if (pwb->abs_M3 > pbi->l[index_l3])
-  //        continue;
-  // 
-  //       int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
-  //       int index_l1_max = pbi->index_l_triangular_max[index_l3][index_l2];
-  // 
-  //       /* The following is equivalent to restrict the loop to l1<l2 */
-  //       index_l1_max = MIN (index_l2-1, index_l1_max);
-  // 
-  //       for (index_l1=index_l1_min; index_l1<=index_l1_max; ++index_l1) {
-  // 
-  //           int index_l2_min = pbi->index_l_triangular_min[index_l3][index_l1];
-  //         
-  //           pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min][index_r]
-  //             = pwb->integral_over_k1[index_l1][index_l3][index_l2-index_l2_min][index_r];
-  //         
-  //           /* Update the counter */
-  //           #pragma omp atomic
-  //           ++pwb->count_memorised_for_integral_over_k1;
-  //         
-  //       }
-  //     }
-  //   }
-  // }
+    /* Increase memory counter, excluding non-physical configurations where |M3|>l3 */
+    if (pwb->abs_M3 <= pbi->l[index_l3])
+      pwb->count_allocated_for_integral_over_k3 += pwb->r_size*triangle_size;
 
+  } // end of for(index_l3)
+
+#ifdef _OPENMP
+  pwb->time_for_integral_arrays += omp_get_wtime() - alloc_start;
+#endif
+    
   if (pbi->bispectra_verbose > 2)
-    printf("     * memorised ~ %.3g MB (%ld doubles) for the k1-integral array (k1_size=%d)\n",
-      pwb->count_memorised_for_integral_over_k1*sizeof(double)/1e6, pwb->count_memorised_for_integral_over_k1,
-      k_tr_size);
+    printf("     * allocated ~ %.3g MB (%ld doubles) for the k3-integral array (k_size=%d)\n",
+      pwb->count_allocated_for_integral_over_k3*sizeof(double)/1e6, pwb->count_allocated_for_integral_over_k3, pwb->k_smooth_size);
+
+
+  // ===================================================================================================
+  // =                               Compute the INT_l3(r, k1, k2)  integral                           =
+  // ===================================================================================================  
   
-  /* Check that we correctly filled the array */
-  class_test (pwb->count_memorised_for_integral_over_k1 != pwb->count_allocated_for_integral_over_k1,
-    pbi->error_message,
-    "there is a mismatch between allocated (%ld) and used (%ld) space!",
-    pwb->count_allocated_for_integral_over_k1, pwb->count_memorised_for_integral_over_k1);
+  /* Initialize counter for the number of integrals computed */
+  pwb->count_memorised_for_integral_over_k3 = 0;
+  
+  /* We shall keep track of the average size of the integration grid in k3, which is (k1,k2) dependent */
+  double average_k3_grid_size = 0;
 
-  /* Free the memory that was allocated for the integral over k2, but do that only when we are at
-  the last iteration of the loops on offset_L1 (which is always performed since 2*abs_M3 is always
-  even), Z and Y. */
-  if ((offset_L1 == (2*pwb->abs_M3)) && (pwb->Y == (pbi->bf_size-1)) && (pwb->Z == (pbi->bf_size-1))) {
-    for (int index_l3=0; index_l3<pbi->l_size; ++index_l3) {
-      for (int index_l2=0; index_l2<pbi->l_size; ++index_l2) {
-        for (int index_r=0; index_r < pwb->r_size; ++index_r) {      
-          free (pwb->integral_over_k2[index_l3][index_l2][index_r]);
-        } // end of for(index_r)
-        free (pwb->integral_over_k2[index_l3][index_l2]);
-      } // end of for(index_l2)
-      free (pwb->integral_over_k2[index_l3]);
-    } // end of for(index_l3)
-    free (pwb->integral_over_k2);
-  } // end of if last term in the L1, Y, Z sums
+  /* Keep track of the time spent in the k3 integration, and in the Bessel convolution alone */
+  double time_in_convolution = 0;
+#ifdef _OPENMP
+  double integration_start = omp_get_wtime();
+#endif
   
-  return _SUCCESS_;
-}
+  /* We compute the integral over k3 for all possible l-values */
+  for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3) {
+
+    int l3 = pbi->l[index_l3];
+    int L3 = abs(l3-pwb->abs_M3) + offset_L3;
+
+    /* The configurations with |M3|>l3 do not contribute to the bispectrum because
+    they would violate the 3j-symbol properties */
+    if (pwb->abs_M3 > pbi->l[index_l3])
+      continue;
+
+    /* Skip the (L3,l3,M3) configurations forbidden by the triangular condition */
+    if (L3 > (l3+pwb->abs_M3)) {
+      pwb->count_memorised_for_integral_over_k3 += 0.5*pwb->k_smooth_size*(pwb->k_smooth_size+1)*pwb->r_size;
+      continue;
+    }
+
+    /* Skip the l3 values without configurations to compute in this pass */
+    if (pwb->has_pending_l3[index_l3] == _FALSE_) {
+      pwb->count_memorised_for_integral_over_k3 += 0.5*pwb->k_smooth_size*(pwb->k_smooth_size+1)*pwb->r_size;
+      continue;
+    }
+    
+    /* Find L3 inside pbs2->l1, the list of l's where we computed the Bessel functions */
+    int index_L3 = pbs2->index_l1[L3];
+
+    /* Paranoid android */
+    class_test ((ppr2->m_max_song==0) && (l3!=L3),
+      pbi->error_message,
+      "inconsistency! for scalar modes, L3 must be equal to l3");
+
+    class_test (pbs2->l1[index_L3]!=L3,
+      pbi->error_message,
+      "error in the indexing of pbs2->l1. Is the pbs2->extend_l1_using_m parameter true?");
+
+    /* Load the transfer functions from disk. In the tiles layout, they were already loaded
+    for all l3 by bispectra2_intrinsic_init() */
+    if (((ppr2->load_transfers_from_disk == _TRUE_) || (ppr2->store_transfers_to_disk == _TRUE_))
+      && (ptr2->transfers_layout == type_transfers_layout)) {
+      class_call (transfer2_load_transfers_from_disk (
+                    ppt2,
+                    ptr2,
+                    index_tt2_k3 + ptr2->lm_array[index_l3][index_M3]),
+        ptr2->error_message,
+        pbi->error_message);
+    }
+  
+    if (pbi->bispectra_verbose > 2)
+      printf("     * computing the k3 integral for l3=%d, index_l3=%d, L3=%d, index_L3=%d\n",
+        l3, index_l3, pbs2->l1[index_L3], index_L3);
+
+    /* Allocate the (k1,k2) levels of the Bessel table for L3, unless the table is disabled or full.
+    The pointers to the actual tables are set to NULL by calloc. */
+    if ((pwb->bessel_k3_cache[index_L3] == NULL)
+    && (pwb->count_allocated_for_bessel_k3_cache < pwb->bessel_k3_cache_max_size)) {
+      class_alloc (pwb->bessel_k3_cache[index_L3], pwb->k_smooth_size*sizeof(double **), pbi->error_message);
+      for (int index_k1=0; index_k1 < pwb->k_smooth_size; ++index_k1)
+        class_calloc (pwb->bessel_k3_cache[index_L3][index_k1], index_k1+1, sizeof(double *), pbi->error_message);
+    }
+
+    abort = _FALSE_;
+    #pragma omp parallel shared (abort) private (thread)
+    {
+  
+      #ifdef _OPENMP
+      thread = omp_get_thread_num();
+      #endif
+  
+      #pragma omp for schedule (dynamic)
+      for (int index_k1 = 0; index_k1 < pwb->k_smooth_size; ++index_k1) {
+  
+        double k1 = pwb->k_smooth_grid[index_k1];
+
+        /* We only need to consider those k2's that are equal or smaller than k1,
+        as the quadratic sources were symmetrised  in the perturbation2 module */
+        for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
+
+          double k2 = pwb->k_smooth_grid[index_k2]; 
+
+          if (pbi->bispectra_verbose > 4)
+            printf ("      \\ computing (index_k1,index_k2)=(%4d,%4d), (k1,k2)=(%g,%g)\n",
+              index_k1, index_k2, k1, k2);
+  
+          // ===================================================
+          // =            Fix the integration domain           =
+          // ===================================================
+
+          /* Integration grid in the k3 variable and its trapezoidal measure, precomputed in
+          the transfer2 module */
+          pwb->k3_grid[thread] = ptr2->k3_grid[index_k1][index_k2];
+          pwb->delta_k3[thread] = ptr2->delta_k3[index_k1][index_k2];
+
+          /* Get the size of the integration grid. Note that when extrapolation is turned on, the k3-grid will
+          also include values that do not satisfty the triangular condition k1 + k2 = k3. */
+          int k3_size = ptr2->k_size_k1k2[index_k1][index_k2];
+          
+          class_test_parallel (k3_size < 2,
+            pbi->error_message,
+            "integration grid has less than two elements, cannot use trapezoidal integration");
+
+#ifdef DEBUG
+          /* Let's be super cautious */
+          for (int index_k3=0; index_k3<k3_size; ++index_k3)
+            class_test_parallel (pwb->delta_k3[thread][index_k3] < 0,
+              pbi->error_message,
+              "something went terribly wrong, negative trapezoidal measure for index_k1=%d, index_k2=%d :-/",
+              index_k1, index_k2);
+#endif // DEBUG
+
+          /* Define the pointer to the second-order transfer function as a function of k3.
+          Note that this transfer function has already been rescaled according to eq. 6.26
+          of http://arxiv.org/abs/1405.2280 in the perturbations.c module.  */
+#ifdef SONG_FLOAT_STORAGE
+          /* The transfer function is stored in single precision, while the convolution
+          works in double precision; widen it to the thread buffer first. This is a plain
+          conversion loop, which the compiler vectorises. */
+          song_storage * transfer_stored = ptr2->transfer[index_tt2_k3 + ptr2->lm_array[index_l3][index_M3]]
+                                                         [index_k1]
+                                                         [index_k2];
+          double * transfer = pwb->transfer_k3[thread];
+          for (int index_k3=0; index_k3 < k3_size; ++index_k3)
+            transfer[index_k3] = transfer_stored[index_k3];
+#else
+          double * transfer = ptr2->transfer[index_tt2_k3 + ptr2->lm_array[index_l3][index_M3]]
+                              [index_k1]
+                              [index_k2];
+#endif
+          
+#ifdef DEBUG
+          /* We expect the second-order transfer function to be order unity for scalar modes */
+          if (pwb->abs_M3 == 0) {
+            double expected_scale = 1;
+            for (int index_k3=0; index_k3 < k3_size; ++index_k3) {
+              class_test_permissive (fabs(transfer[index_k3]) > (expected_scale*1000),
+                pbi->error_message,
+                "found extremely large value for second-order transfer function: T_l3_m3(k1,k2,k3_tr)=%g\
+ for l3=%d[%d], m3=%d[%d], k1=%g[%d], k2=%g[%d], k3_tr=%g[%d]\n",
+                transfer[index_k3], pbi->l[index_l3], index_l3, pwb->abs_M3, ppr2->index_m[pwb->abs_M3],
+                ppt2->k[index_k1], index_k1, ppt2->k[index_k2], index_k2, 
+                pwb->k3_grid[thread][index_k3], index_k3);
+            }
+          }
+#endif // DEBUG
+
+
+          // ===================================================
+          // =                     Integrate                   =
+          // ===================================================
+  
+#ifdef _OPENMP
+          double kernel_start = omp_get_wtime();
+#endif
+
+          /* If there is still room in the cache, tabulate j_L3(k3*r) on the (k3,r) grid for this
+          (k1,k2) pair. The table is the same for all fields, azimuthal modes and l3 values sharing
+          the same L3, hence it is computed only once. */
+          double * bessel_table = NULL;
+
+          if (pwb->bessel_k3_cache[index_L3] != NULL) {
+
+            bessel_table = pwb->bessel_k3_cache[index_L3][index_k1][index_k2];
+
+            if (bessel_table != NULL) {
+              #pragma omp atomic
+              ++pwb->count_bessel_k3_cache_hits;
+            }
+            else {
+
+              /* Reserve the memory for the table, if allowed by the budget */
+              long int table_size = (long int)k3_size*pwb->r_size;
+              int has_room = _FALSE_;
+              #pragma omp critical (bessel_k3_cache)
+              {
+                if (pwb->count_allocated_for_bessel_k3_cache + table_size <= pwb->bessel_k3_cache_max_size) {
+                  pwb->count_allocated_for_bessel_k3_cache += table_size;
+                  has_room = _TRUE_;
+                }
+              }
+
+              if (has_room == _TRUE_) {
+
+                class_alloc_parallel (bessel_table, table_size*sizeof(double), pbi->error_message);
+
+                class_call_parallel (bessel2_j_matrix (
+                    ppr,
+                    pbs2,
+                    pwb->k3_grid[thread],
+                    k3_size,
+                    index_L3,
+                    pwb->r,
+                    pwb->r_size,
+                    bessel_table,
+                    pbi->error_message
+                    ),
+                  pbi->error_message,
+                  pbi->error_message);
+
+                pwb->bessel_k3_cache[index_L3][index_k1][index_k2] = bessel_table;
+              }
+            }
+          }
+
+          /* With the Bessel functions already on the grid, the integral is a plain vector-matrix
+          product */
+          if (bessel_table != NULL) {
+
+            class_call_parallel (bessel2_convolution_matrix (
+                pwb->k3_grid[thread],
+                pwb->delta_k3[thread],
+                k3_size,
+                transfer,
+                1,
+                bessel_table,
+                pwb->r_size,
+                pwb->integral_over_k3_r[thread],
+                pbi->error_message
+                ),
+              pbi->error_message,
+              pbi->error_message);
+          }
+
+          /* Otherwise, compute the integral for all the values of r in a single pass over the k3-grid,
+          interpolating the Bessel functions. It is important to note that the used Bessel here has
+          order L3 rather than l3 */
+          else {
+
+            class_call_parallel (bessel2_convolution_multi_r (
+                ppr,
+                pbs2,
+                pwb->k3_grid[thread],
+                pwb->delta_k3[thread],
+                k3_size,
+                transfer,
+                NULL,
+                index_L3,
+                pwb->r,
+                pwb->r_size,
+                pwb->integral_over_k3_r[thread],
+                pbi->error_message
+                ),
+              pbi->error_message,
+              pbi->error_message);
+          }
+
+#ifdef _OPENMP
+          #pragma omp atomic
+          time_in_convolution += omp_get_wtime() - kernel_start;
+#endif
+
+#ifdef DEBUG
+          /* Check the batched convolution against the r-by-r one for the last (k1,k2) pair,
+          which has the largest k3-range */
+          if ((index_k1 == pwb->k_smooth_size-1) && (index_k2 == index_k1)) {
+            for (int index_r = 0; index_r < pwb->r_size; ++index_r) {
+              double check;
+              class_call_parallel (bessel2_convolution (
+                  ppr,
+                  pbs2,
+                  pwb->k3_grid[thread],
+                  pwb->delta_k3[thread],
+                  k3_size,
+                  transfer,
+                  NULL,
+                  index_L3,
+                  pwb->r[index_r],
+                  &check,
+                  pbi->error_message
+                  ),
+                pbi->error_message,
+                pbi->error_message);
+              class_test_parallel (fabs(check-pwb->integral_over_k3_r[thread][index_r]) > _SMALL_*fabs(check) + _MINUSCULE_,
+                pbi->error_message,
+                "batched and r-by-r k3 convolutions differ (%g vs %g) for l3=%d, r=%g",
+                pwb->integral_over_k3_r[thread][index_r], check, l3, pwb->r[index_r]);
+            }
+          }
+#endif // DEBUG
+
+          for (int index_r = 0; index_r < pwb->r_size; ++index_r) {
+
+            pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2] = pwb->integral_over_k3_r[thread][index_r];
+
+#ifdef DEBUG
+            /* Check that when m is odd and k1=k2, then T(k1,k2,k3) is small with respect to 1.
+            This should be the case because the odd-m quadratic sources always vanish for k1==k2
+            (see comment for vector Q_SS in perturb2_quadratic_sources()), unless non-vanishing
+            initial conditions are given */
+            /* TODO: Include this check in perturb2_quadratic_sources(), which is the quantity
+            that we know should vanish. The bispectrum could still be non-vanishing for non-zero
+            initial conditions.  */
+            if ((index_k1==index_k2) && (pwb->abs_M3%2!=0)) {
+              double expected_scale = ppm->A_s*ppm->A_s;
+              double epsilon = 1e-4*expected_scale;
+              class_test_permissive (
+                fabs (pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2]) > epsilon,
+                ppt2->error_message,
+                "k1=k2, m odd, but bispectrum=%20.12g is larger than the characteristic scale (%20.12g). Problem?",
+                pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2], epsilon);
+            }
+#endif // DEBUG
+
+            /* Include the M3-dependent coefficient coming from the rescaling of the transfer
+            function. Note that this is always equal to 1 for m=0. */
+            if (pwb->abs_M3!=0)
+              pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2] *= pwb->M3_coefficient[index_M3];
+
+            /* Multiply the result by the factor 2 coming from the fact that in the bispectrum
+            formula the second-order transfer functions appears as
+            T(\vec{k1},\vec{k2},\vec{3}) + T(\vec{k2},\vec{k1},\vec{3}) */
+            pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2] *= 2;
+
+            /* Update the counters */
+            #pragma omp atomic
+            average_k3_grid_size += k3_size; 
+
+            #pragma omp atomic
+            ++pwb->count_memorised_for_integral_over_k3;
+              
+            #pragma omp flush(abort)
+
+            /* Debug - print the second-order transfer function as a function of k3 */
+            // if ((l3==170) && (pwb->abs_M3 == 2))
+            //   for (int index_k3=0; index_k3<k3_size; ++index_k3)
+            //     printf ("%14.7g %22.16g\n", pwb->k3_grid[thread][index_k3], transfer[index_k3]);
+
+            /* Print the integral as a function of r */
+            // if ((pwb->abs_M3==1) && (offset_L3==0))
+            //   if (l3==200)
+            //     /* For bks run they correspond to 0.03728321 and 0.01724184, which are Christian's 13 and 6 */
+            //     if ((index_k1==85) && (index_k2==63))
+            //     // if ((index_k1==1) && (index_k2==0))
+            //       fprintf (stderr, "%17.7g %17.7g\n",
+            //         pwb->r[index_r], pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2]);
+
+            /* Print the integral as a function of k2 */
+            // if (offset_L3==0)
+            //  if (index_k1==13) /* To be used when you have the same grid as Christian */
+            //   // if (index_k1==160) /* for bks runs it corresponds to 0.1912861 */
+            //   if (index_k1==85) /* for bks runs it corresponds to 0.03728321, which is Christian's 13 */
+            //   // if (index_k1==118) /* For bks runs, corresponds to 0.1 */
+            //   // if (index_k1==95) /* For ref k-sampling, corresponds to 0.1 */
+            //     // if (index_r==83) /* 14000 for 250r13to16 */
+            //     if (index_r==49) /* 14000 for 99r135to145 */
+            //       if ((l3==200) && (pwb->abs_M3==1))
+            //         fprintf (stderr, "%17.7g %17.7g\n",
+            //           k2, pwb->integral_over_k3[index_l3][index_r][index_k1][index_k2]);
+
+          } // end of for(index_r)          
+        } // end of for(index_k2)
+      } // end of for(index_k1)
+    } if (abort == _TRUE_) return _FAILURE_; /* end of parallel region */
+
+  
+    /* Free the memory associated with the second order transfer function for this (l,m) */
+    if (((ppr2->load_transfers_from_disk == _TRUE_)
+      || (ppr2->store_transfers_to_disk == _TRUE_))
+      && (ptr2->transfers_layout == type_transfers_layout)) {
+      class_call (transfer2_free_type_level (
+                    ppt2,
+                    ptr2,
+                    index_tt2_k3 + ptr2->lm_array[index_l3][index_M3]),
+        ptr2->error_message,
+        pbi->error_message);
+    }
+  
+  } // end of for(index_l3);
+    
+  if (pbi->bispectra_verbose > 2)
+    printf("     * memorised ~ %.3g MB (%ld doubles) for the k3-integral array (<k3_size>=%g)\n",
+      pwb->count_memorised_for_integral_over_k3*sizeof(double)/1e6,
+      pwb->count_memorised_for_integral_over_k3,
+      average_k3_grid_size/pwb->count_memorised_for_integral_over_k3);
+
+#ifdef _OPENMP
+  /* The convolution time is summed over threads, hence we divide it by their number */
+  if (pbi->bispectra_verbose > 2)
+    printf("     * k3 integral took %g s, of which ~ %g s spent in the Bessel convolution\n",
+      omp_get_wtime()-integration_start, time_in_convolution/omp_get_max_threads());
+#endif
+
+  if (pbi->bispectra_verbose > 2)
+    printf("     * Bessel table on the (k3,r) grid uses ~ %.3g MB (%ld doubles), reused %ld times so far\n",
+      pwb->count_allocated_for_bessel_k3_cache*sizeof(double)/1e6,
+      pwb->count_allocated_for_bessel_k3_cache,
+      pwb->count_bessel_k3_cache_hits);
+
+  /* Check that we correctly filled the array */
+  class_test (
+    pwb->count_memorised_for_integral_over_k3 != pwb->count_allocated_for_integral_over_k3,
+    pbi->error_message,
+    "there is a mismatch between allocated (%ld) and used (%ld) space!",
+    pwb->count_allocated_for_integral_over_k3, pwb->count_memorised_for_integral_over_k3);
+
+  return _SUCCESS_; 
+  
+} // end of bispectra2_intrinsic_integrate_over_k3
+  
+
+
+
+
+
+/**
+ * Compute the coefficients needed to interpolate INT_l3(r,k1,k2) in k2.
+ *
+ * The integral over k3 is sampled in k2 on pwb->k_smooth_grid, and needs to be
+ * interpolated on the integration grid ptr->q. Neither grid depends on r, l3 or
+ * k1, hence the position of each ptr->q point in the k2 sampling, its interpolation
+ * weights and the decomposition of the tridiagonal system that gives the second
+ * derivatives of the cubic spline are computed here once and for all. This is the
+ * same procedure as in transfer2_k3_spline_init(), and the spline has the same
+ * boundary conditions as the one built by CLASS with array_spline_table_columns()
+ * in the _SPLINE_EST_DERIV_ mode.
+ *
+ * We also store in pwb->k2_measure the factors of the k2 integrand that depend only
+ * on k2, so that bispectra2_intrinsic_integrate_over_k2() needs to multiply them by
+ * the transfer and Bessel functions only.
+ *
+ * The arrays are freed in bispectra2_intrinsic_workspace_free().
+ */
+
+int bispectra2_k2_spline_init (
+    struct precision * ppr,
+    struct transfers * ptr,
+    struct bispectra * pbi,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  /* Shortcuts */
+  int k_pt_size = pwb->k_smooth_size;
+  double * k_pt = pwb->k_smooth_grid;
+  int k_tr_size = ptr->q_size;
+  double * k_tr = ptr->q;
+
+
+  // ====================================================================================
+  // =                               Interpolation weights                              =
+  // ====================================================================================
+
+  class_alloc (pwb->k2_index_left, k_tr_size*sizeof(int), pbi->error_message);
+  class_alloc (pwb->k2_weight, 4*k_tr_size*sizeof(double), pbi->error_message);
+  class_alloc (pwb->k2_measure, k_tr_size*sizeof(double), pbi->error_message);
+
+  /* Find the node to the left of each k value in ptr->q, using the usual spline
+  interpolation algorithm */
+  int index_k = 0;
+
+  for (int index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr) {
+
+    while (((index_k+1) < k_pt_size) && (k_pt[index_k+1] < k_tr[index_k_tr]))
+      index_k++;
+
+    class_test((index_k+1) >= k_pt_size, pbi->error_message,
+      "some of the elements in k_tr are larger than the largest k_pt. Stop to avoid seg fault.");
+
+    double h = k_pt[index_k+1] - k_pt[index_k];
+
+    class_test(h==0., pbi->error_message, "stop to avoid division by zero");
+
+    double b = (k_tr[index_k_tr] - k_pt[index_k])/h;
+    double a = 1.-b;
+
+    pwb->k2_index_left[index_k_tr] = index_k;
+    pwb->k2_weight[4*index_k_tr + 0] = a;
+    pwb->k2_weight[4*index_k_tr + 1] = b;
+    pwb->k2_weight[4*index_k_tr + 2] = (a*a*a-a)*h*h/6.0;
+    pwb->k2_weight[4*index_k_tr + 3] = (b*b*b-b)*h*h/6.0;
+
+    /* Trapezoidal measure, primordial power spectrum and inverse window function */
+    pwb->k2_measure[index_k_tr] = 0.5 * k_tr[index_k_tr] * k_tr[index_k_tr] * pbi->delta_k[index_k_tr]
+                                * pbi->pk[index_k_tr] * pwb->k_window_inverse[index_k_tr];
+
+  }
+
+
+  // ====================================================================================
+  // =                            Decompose the spline system                           =
+  // ====================================================================================
+
+  pwb->k2_spline_alpha = NULL;
+  pwb->k2_spline_beta = NULL;
+  pwb->k2_spline_gamma = NULL;
+  pwb->k2_spline_factor = NULL;
+
+  if (ppr->transfers_k2_interpolation == cubic_interpolation) {
+
+    class_test (k_pt_size < 3,
+      pbi->error_message,
+      "need at least 3 values of k2 to estimate the derivatives at the edges of the spline, found %d",
+      k_pt_size);
+
+    class_alloc (pwb->k2_spline_alpha, k_pt_size*sizeof(double), pbi->error_message);
+    class_alloc (pwb->k2_spline_beta, k_pt_size*sizeof(double), pbi->error_message);
+    class_alloc (pwb->k2_spline_gamma, k_pt_size*sizeof(double), pbi->error_message);
+    class_alloc (pwb->k2_spline_factor, k_pt_size*sizeof(double), pbi->error_message);
+
+    double * x = k_pt;
+    int n = k_pt_size;
+
+    /* First node. The first derivative is estimated with the parabola through the
+    first three nodes, dy = c[0]*y[0] + c[1]*y[1] + c[2]*y[2] */
+    double h = x[1] - x[0];
+    double c[3];
+    c[1] = (x[2]-x[0])*(x[2]-x[0]) / ((x[2]-x[0])*(x[1]-x[0])*(x[2]-x[1]));
+    c[2] = -(x[1]-x[0])*(x[1]-x[0]) / ((x[2]-x[0])*(x[1]-x[0])*(x[2]-x[1]));
+    c[0] = -c[1] - c[2];
+
+    pwb->k2_spline_first[0] = -3/(h*h) - 3*c[0]/h;
+    pwb->k2_spline_first[1] = 3/(h*h) - 3*c[1]/h;
+    pwb->k2_spline_first[2] = -3*c[2]/h;
+    pwb->k2_spline_factor[0] = -0.5;
+
+    /* Intermediate nodes */
+    for (int i=1; i < n-1; ++i) {
+      double sig = (x[i]-x[i-1])/(x[i+1]-x[i-1]);
+      double p = sig*pwb->k2_spline_factor[i-1] + 2;
+      pwb->k2_spline_factor[i] = (sig-1)/p;
+      pwb->k2_spline_alpha[i] = 6/((x[i+1]-x[i])*(x[i+1]-x[i-1])*p);
+      pwb->k2_spline_beta[i] = 6/((x[i]-x[i-1])*(x[i+1]-x[i-1])*p);
+      pwb->k2_spline_gamma[i] = sig/p;
+    }
+
+    /* Last node. Same as for the first node, using the last three nodes */
+    h = x[n-1] - x[n-2];
+    c[1] = (x[n-3]-x[n-1])*(x[n-3]-x[n-1]) / ((x[n-3]-x[n-1])*(x[n-2]-x[n-1])*(x[n-3]-x[n-2]));
+    c[0] = -(x[n-2]-x[n-1])*(x[n-2]-x[n-1]) / ((x[n-3]-x[n-1])*(x[n-2]-x[n-1])*(x[n-3]-x[n-2]));
+    c[2] = -c[0] - c[1];
+
+    pwb->k2_spline_last[0] = 3*c[0]/h;
+    pwb->k2_spline_last[1] = 3*c[1]/h + 3/(h*h);
+    pwb->k2_spline_last[2] = 3*c[2]/h - 3/(h*h);
+    pwb->k2_spline_last_pivot_inverse = 1/(0.5*pwb->k2_spline_factor[n-2] + 1);
+    pwb->k2_spline_factor[n-1] = 0;
+
+  }
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Interpolate the integral over k3, INT_l3(r,k1,k2), in the integration grid
+ * of k2 for all values of k1 at once.
+ *
+ * The function is first multiplied by the window function and arranged as a
+ * matrix with k1 as the fastest index, so that the spline is built and evaluated
+ * on all the k1 columns at once, using the coefficients precomputed by
+ * bispectra2_k2_spline_init(). In all the loops below, the inner loop runs on
+ * contiguous k1 values, which the compiler can vectorise.
+ *
+ * The result is stored in interpolated[index_q*k_smooth_size + index_k1]. It
+ * still includes the window function, which is reverted in the kernel of the
+ * k2 integral together with the primordial power spectrum (see pwb->k2_measure).
+ */
+
+int bispectra2_interpolate_over_k2 (
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct perturbs * ppt,
+    struct perturbs2 * ppt2,
+    struct bessels * pbs,
+    struct bessels2 * pbs2,
+    struct transfers * ptr,
+    struct transfers2 * ptr2,
+    struct primordial * ppm,
+    struct bispectra * pbi,
+    int index_r,
+    int index_l3,
+    double * k2_symmetry, /**< input, symmetry factor and window function, indexed as [index_k2*k_smooth_size + index_k1] */
+    double * nodes, /**< output, function to interpolate, indexed as [index_k2*k_smooth_size + index_k1] */
+    double * nodes_spline, /**< output, its second derivative in k2; not used for linear interpolation */
+    double * interpolated, /**< output, interpolated function, indexed as [index_q*k_smooth_size + index_k1] */
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  /* Shortcuts */
+  int k_pt_size = pwb->k_smooth_size;
+  int k_tr_size = ptr->q_size;
+  double ** integral_over_k3 = pwb->integral_over_k3[index_l3][index_r];
+
+  /* So far, we always assumed that k1>=k2 because the transfer function has the
+  following symmetry:
+      T (\vec{k1},\vec{k_2},\vec{k_3}) = (-1)^m * T (\vec{k_2},\vec{k_1},\vec{k_3}).
+  The (-1)^m factor comes from the fact that one can exchange \vec{k_1} and \vec{k_2} by
+  performing a rotation around \vec{k} of pi radians. This is equivalent to a factor of
+  exp(i*pi*m) = (-1)^m, and also implies that T_lm (\vec{k_1},\vec{k_2},\vec{k_3})=0 when
+  m is odd and \vec{k_1}=\vec{k_2}.
+    
+  Now we need to interpolate the k2 dependence of the transfer function, hence we build a
+  temporary array where
+      f(index_k1, index_k2) = (-1)^m * integral_over_k3(index_k2, index_k1)
+  when index_k1 < index_k2.
+  
+  We also include a (k1/k2)^m factor that mimicks the rescaling of the transfer function
+  under the exchange \vec{k_1}<->\vec{k_2}. This follows from the fact that
+      k1*sin(theta_1) = k2*sin(theta_2),
+  which implies that
+      T_rescaled(\vec{k2},\vec{k1},\vec{k3})
+      = T_rescaled(\vec{k1},\vec{k2},\vec{k3})*(k1/k2)^m
+
+  Both factors, together with the window function, are in k2_symmetry. */
+
+  for (int index_k2=0; index_k2 < k_pt_size; ++index_k2) {
+
+    double * y = nodes + index_k2*k_pt_size;
+    double * symmetry = k2_symmetry + index_k2*k_pt_size;
+
+    for (int index_k1=0; index_k1 <= index_k2; ++index_k1)
+      y[index_k1] = integral_over_k3[index_k2][index_k1] * symmetry[index_k1];
+
+    for (int index_k1=index_k2+1; index_k1 < k_pt_size; ++index_k1)
+      y[index_k1] = integral_over_k3[index_k1][index_k2] * symmetry[index_k1];
+
+  }
+
+
+  /* Second derivative of the function with respect to k2, for all the k1 columns */
+  if (ppr->transfers_k2_interpolation == cubic_interpolation) {
+
+    double * y = nodes;
+    double * ddy = nodes_spline;
+    int n = k_pt_size;
+    int size = k_pt_size;
+
+    /* Forward sweep; the intermediate results are stored in ddy */
+    for (int index_k1=0; index_k1 < size; ++index_k1)
+      ddy[index_k1] = pwb->k2_spline_first[0] * y[index_k1]
+                    + pwb->k2_spline_first[1] * y[size + index_k1]
+                    + pwb->k2_spline_first[2] * y[2*size + index_k1];
+
+    for (int i=1; i < n-1; ++i) {
+
+      double alpha = pwb->k2_spline_alpha[i];
+      double beta = pwb->k2_spline_beta[i];
+      double gamma = pwb->k2_spline_gamma[i];
+      double * y_i = y + i*size;
+      double * u_i = ddy + i*size;
+
+      for (int index_k1=0; index_k1 < size; ++index_k1)
+        u_i[index_k1] = alpha * (y_i[size + index_k1] - y_i[index_k1])
+                      - beta * (y_i[index_k1] - y_i[index_k1 - size])
+                      - gamma * u_i[index_k1 - size];
+    }
+
+    /* Last node */
+    for (int index_k1=0; index_k1 < size; ++index_k1)
+      ddy[(n-1)*size + index_k1] = (pwb->k2_spline_last[0] * y[(n-3)*size + index_k1]
+                                  + pwb->k2_spline_last[1] * y[(n-2)*size + index_k1]
+                                  + pwb->k2_spline_last[2] * y[(n-1)*size + index_k1]
+                                  - 0.5 * ddy[(n-2)*size + index_k1]) * pwb->k2_spline_last_pivot_inverse;
+
+    /* Back substitution */
+    for (int i=n-2; i >= 0; --i) {
+
+      double factor = pwb->k2_spline_factor[i];
+      double * ddy_i = ddy + i*size;
+
+      for (int index_k1=0; index_k1 < size; ++index_k1)
+        ddy_i[index_k1] = factor * ddy_i[size + index_k1] + ddy_i[index_k1];
+    }
+  }
+
+
+  /* Interpolate at each k value using the precomputed weights */
+  for (int index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr) {
+
+    int index_k = pwb->k2_index_left[index_k_tr];
+    double * w = pwb->k2_weight + 4*index_k_tr;
+    double * y_left = nodes + index_k*k_pt_size;
+    double * y_right = y_left + k_pt_size;
+    double * result = interpolated + (long int)index_k_tr*k_pt_size;
+
+    if (ppr->transfers_k2_interpolation == linear_interpolation) {
+      for (int index_k1=0; index_k1 < k_pt_size; ++index_k1)
+        result[index_k1] = w[0] * y_left[index_k1] + w[1] * y_right[index_k1];
+    }
+    else if (ppr->transfers_k2_interpolation == cubic_interpolation) {
+      double * ddy_left = nodes_spline + index_k*k_pt_size;
+      double * ddy_right = ddy_left + k_pt_size;
+      for (int index_k1=0; index_k1 < k_pt_size; ++index_k1)
+        result[index_k1] = w[0] * y_left[index_k1] + w[1] * y_right[index_k1]
+                         + w[2] * ddy_left[index_k1] + w[3] * ddy_right[index_k1];
+    }
+
+    for (int index_k1=0; index_k1 < k_pt_size; ++index_k1) {
+
+#ifdef DEBUG
+      /* We expect the integral over k3 that we are interpolating to be order unity,
+      because it is obtained as a convolution of the second-order transfer functions
+      and a Bessel function */
+      double expected_scale = 1;
+      class_test_permissive (fabs(result[index_k1]*pwb->k_window_inverse[index_k_tr]) > (expected_scale*1000),
+        pbi->error_message,
+        "found extremely large value for integral over k3 (m=%d): I_l3(k1_pt,k2_tr,r)=%g,\
+ for l3=%d[%d], k1_pt=%g[%d], k2_tr=%g[%d], r=%g[%d]\n",
+        pwb->abs_M3, result[index_k1]*pwb->k_window_inverse[index_k_tr], pbi->l[index_l3], index_l3,
+        pwb->k_smooth_grid[index_k1], index_k1, ptr->q[index_k_tr], index_k_tr, pwb->r[index_r], index_r);
+#endif // DEBUG
+
+      /* Test for nans */
+      class_test (isnan(result[index_k1]),
+        pbi->error_message,
+        "k2 interpolation yielded a nan for index_r=%d, index_k1=%d, index_l3=%d",
+        index_r, index_k1, index_l3);
+    }
+
+  } // end of for (index_k_tr)
+
+
+  /* Some debug - print the original array and the interpolation */
+  // int index_k1 = 1;
+  // if ((index_l3==0) && (index_r==0)) {
+  // 
+  //   fprintf (stderr, "\n\n");
+  // 
+  //   /* Node points after window */
+  //   for (int index_k=0; index_k < k_pt_size; ++index_k)
+  //     fprintf (stderr, "%17.7g %17.7g\n", pwb->k_smooth_grid[index_k], nodes[index_k*k_pt_size + index_k1]);
+  // 
+  //   fprintf (stderr, "\n");
+  // 
+  //   /* Interpolation after inverse window */  
+  //   for (int index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr)
+  //     fprintf (stderr, "%17.7g %17.7g\n", ptr->q[index_k_tr],
+  //       interpolated[index_k_tr*k_pt_size + index_k1]*pwb->k_window_inverse[index_k_tr]);
+  // 
+  //   fprintf (stderr, "\n\n");
+  //   
+  // }
+
+
+  return _SUCCESS_;
+
+}
+
+
+
+
+
+int bispectra2_intrinsic_integrate_over_k2 (
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct perturbs * ppt,
+    struct perturbs2 * ppt2,
+    struct bessels * pbs,
+    struct bessels2 * pbs2,
+    struct transfers * ptr,
+    struct transfers2 * ptr2,
+    struct primordial * ppm,
+    struct bispectra * pbi,
+    int index_tt_k2,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  /* Integration grid */
+  int k_tr_size = ptr->q_size;
+  double * k_tr = ptr->q;
+
+  /* Parallelization variables */
+  int thread = 0;
+  int abort = _FALSE_;
+
+  // ======================================================================================================
+  // =                                   Allocate memory for INT_l2_l3(r,k1)                              =
+  // ======================================================================================================
+  
+  /* Because we shall recycle the array for more than one fields (T,E...) we make sure we allocate it
+  only once. This is achieved by performing the allocation only at the beginning of the loop over
+  the field (that is, when pwb->Y==pwb->first_Y) */
+
+  if (pwb->Y == pwb->first_Y) {
+
+    /* Initialize counter */
+    pwb->count_allocated_for_integral_over_k2 = 0;
+
+#ifdef _OPENMP
+    double alloc_start = omp_get_wtime();
+#endif
+
+    /* The values are stored in a single slab, with k1 as the fastest index. The pointer levels
+    are also contiguous, and point to the slab so that the array can be indexed as
+    [index_l3][index_l2][index_r][index_k1]. Make sure to use calloc. */
+    int k1_size = pwb->k_smooth_size;
+    long int l_size_2 = (long int)(pwb->index_l3_max - pwb->index_l3_min + 1)*pbi->l_size;
+
+    double * slab;
+    double ** r_level;
+    double *** l2_level;
+    class_call (bispectra2_slab_alloc (l_size_2*pwb->r_size*k1_size, &slab, pbi->error_message),
+      pbi->error_message,
+      pbi->error_message);
+    class_alloc (r_level, l_size_2*pwb->r_size*sizeof(double *), pbi->error_message);
+    class_alloc (l2_level, l_size_2*sizeof(double **), pbi->error_message);
+    class_calloc (pwb->integral_over_k2, pbi->l_size, sizeof(double ***), pbi->error_message);
+    pwb->count_allocations_for_integral_arrays += 4;
+  
+    for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3) {
+  
+      pwb->integral_over_k2[index_l3] = l2_level + (index_l3-pwb->index_l3_min)*pbi->l_size;
+  
+      for (int index_l2=0; index_l2<pbi->l_size; ++index_l2) {
+    
+        long int index_l3_l2 = (long int)(index_l3-pwb->index_l3_min)*pbi->l_size + index_l2;
+        pwb->integral_over_k2[index_l3][index_l2] = r_level + index_l3_l2*pwb->r_size;
+  
+        for (int index_r=0; index_r < pwb->r_size; ++index_r)
+          pwb->integral_over_k2[index_l3][index_l2][index_r] = slab + (index_l3_l2*pwb->r_size + index_r)*k1_size;
+  
+        /* Increase memory counter, excluding non-physical configurations where |M3|>l3 */
+        if (pwb->abs_M3 <= pbi->l[index_l3])
+          pwb->count_allocated_for_integral_over_k2 += pwb->r_size*k1_size;
+  
+      } // end of for(index_l2)
+    } // end of for(index_l3)
+
+#ifdef _OPENMP
+    pwb->time_for_integral_arrays += omp_get_wtime() - alloc_start;
+#endif
+    
+    if (pbi->bispectra_verbose > 2)
+      printf("     * allocated ~ %.3g MB (%ld doubles) for the k2-integral array (l_size=%d)\n",
+        pwb->count_allocated_for_integral_over_k2*sizeof(double)/1e6, pwb->count_allocated_for_integral_over_k2, pbi->l_size);
+
+  } // end of if pwb->Y==pwb->first_Y
+  
+  
+  // ==============================================================================================================
+  // =                                   Compute the INT_l2_l3(r, k1) integral                                    =
+  // ==============================================================================================================
+  
+  /* Symmetry factor and window function of INT_l3(r,k1,k2), which depend on k1 and k2 but not on
+  r or l3 (see bispectra2_interpolate_over_k2()). We compute them once here rather than for each
+  (r,l3) pair. */
+  int k_pt_size = pwb->k_smooth_size;
+  double * k2_symmetry;
+  class_alloc (k2_symmetry, k_pt_size*k_pt_size*sizeof(double), pbi->error_message);
+
+  for (int index_k2=0; index_k2 < k_pt_size; ++index_k2) {
+    for (int index_k1=0; index_k1 < k_pt_size; ++index_k1) {
+      double symmetry = 1;
+      if (index_k1 <= index_k2)
+        symmetry = pow (-pwb->k_smooth_grid[index_k1]/pwb->k_smooth_grid[index_k2], pwb->abs_M3);
+      k2_symmetry[index_k2*k_pt_size + index_k1] = symmetry * pwb->k_window[index_k2];
+    }
+  }
+
+  /* Initialize counter for the number of integrals computed */
+  pwb->count_memorised_for_integral_over_k2 = 0;
+  
+  /* We parallelize the loops over 'r' and 'l3', which we can set as the outermost loops because
+  we do not need to load the second-order transfer functions from disk. The two loops are
+  collapsed, so that there are enough work items to keep all threads busy even when r_size
+  is comparable to the number of threads.
+
+  For a given (r,l3) pair, we first interpolate INT_l3(r,k1,k2) in k2 for all values of k1 at once.
+  Then, for each l2, the integral over k2 is the product between the (k1 x k2) matrix of the
+  interpolated values and the vector T_l2(k2)*j_l2(k2*r), which is computed only once rather than
+  for each k1. */
+  abort = _FALSE_;
+  #pragma omp parallel shared (abort) private (thread)
+  {
+  
+    #ifdef _OPENMP
+    thread = omp_get_thread_num();
+    #endif
+  
+    #pragma omp for schedule (dynamic) collapse (2)
+    for (int index_r = 0; index_r < pwb->r_size; ++index_r) {
+      for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3) {
+        
+        if ((pbi->bispectra_verbose > 2) && (index_l3 == pwb->index_l3_min))
+          printf("     * computing the k2 integral for r=%g, index_r=%d\n", pwb->r[index_r], index_r);
+  
+        /* The configurations with |M3|>l3 do not contribute to the bispectrum because
+        they would violate the 3j-symbol properties */
+        if (pwb->abs_M3 > pbi->l[index_l3])
+          continue;
+
+        /* Skip the l3 values without configurations to compute in this pass */
+        if (pwb->has_pending_l3[index_l3] == _FALSE_) {
+          #pragma omp atomic
+          pwb->count_memorised_for_integral_over_k2 += pwb->k_smooth_size*pbi->l_size;
+          continue;
+        }
+        
+        /* Interpolate the integral I_l3(k1,k2,r) that we computed above in the integration grid of k2,
+        for all values of k1. Note that we pass the buffers separately rather than accessing them from
+        pwb, because they are thread dependent (while pwb isn't). */
+        class_call_parallel (bispectra2_interpolate_over_k2 (
+                               ppr,
+                               ppr2,
+                               ppt,
+                               ppt2,
+                               pbs,
+                               pbs2,
+                               ptr,
+                               ptr2,
+                               ppm,
+                               pbi,
+                               index_r,
+                               index_l3,
+                               k2_symmetry,
+                               pwb->k2_nodes[thread],
+                               pwb->k2_nodes_spline[thread],
+                               pwb->k2_interpolated[thread],
+                               pwb),
+          pbi->error_message,
+          pbi->error_message);
+
+        double * interpolated = pwb->k2_interpolated[thread];
+        double * kernel = pwb->k2_kernel[thread];
+
+        for (int index_l2 = 0; index_l2 < pbi->l_size; ++index_l2) {  
+
+          /* Skip the (l3,l2) pairs without configurations to compute in this pass */
+          if (pwb->has_pending_l3_l2[index_l3][index_l2] == _FALSE_) {
+            #pragma omp atomic
+            pwb->count_memorised_for_integral_over_k2 += pwb->k_smooth_size;
+            continue;
+          }
+  
+          /* Define the pointer to the first-order transfer functions as a function of k */
+          double * transfer = &(ptr->transfer [ppt->index_md_scalars]
+                                              [((ppt->index_ic_ad * ptr->tt_size[ppt->index_md_scalars] + index_tt_k2)
+                                              * ptr->l_size[ppt->index_md_scalars] + index_l2) * k_tr_size]);
+
+          /* Kernel of the integral, j_l2(k2*r)*T_l2(k2) times the factors in pwb->k2_measure. The Bessel
+          function is interpolated from the table in the bessel2 module, which includes all the
+          multipoles in pbi->l; its accuracy is set by bessel_x_step_song, bessel_j_cut_song and
+          bessel_x_tol_song, rather than by the first-order bessel_x_step and bessel_j_cut. */
+          class_call_parallel (bessel2_j_matrix (
+              ppr,
+              pbs2,
+              k_tr,
+              k_tr_size,
+              pbs2->index_l1[pbi->l[index_l2]],
+              &(pwb->r[index_r]),
+              1,
+              kernel,
+              pbi->error_message
+              ),
+            pbi->error_message,
+            pbi->error_message);
+
+          for (int index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr)
+            kernel[index_k_tr] *= transfer[index_k_tr] * pwb->k2_measure[index_k_tr];
+
+          /* Integrate over k2 for all values of k1, skipping the k2 values where the kernel
+          vanishes, as in bessel_convolution() */
+          double * integral = pwb->integral_over_k2[index_l3][index_l2][index_r];
+
+          for (int index_k1 = 0; index_k1 < k_pt_size; ++index_k1)
+            integral[index_k1] = 0;
+
+          for (int index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr) {
+
+            double weight = kernel[index_k_tr];
+
+            if (weight == 0.)
+              continue;
+
+            double * row = interpolated + (long int)index_k_tr*k_pt_size;
+
+            for (int index_k1 = 0; index_k1 < k_pt_size; ++index_k1)
+              integral[index_k1] += weight * row[index_k1];
+          }
+
+          /* Some debug - Print the integral as a function of r */
+          // if ((pwb->abs_M3==1) && (pwb->offset_L3==0))
+          //   if ((pbi->l[index_l2]==200) && (pbi->l[index_l3]==200))
+          //     /* for l_max=200 and kmax=6 it corresponds to 0.03728321, which is Christian's 13 */
+          //     fprintf (stderr, "%17.7g %17.7g\n", pwb->r[index_r], integral[85]);
+
+          /* Update the counter */
+          #pragma omp atomic
+          pwb->count_memorised_for_integral_over_k2 += pwb->k_smooth_size;
+  
+          #pragma omp flush(abort)
+  
+        } // end of for(index_l2)
+      } // end of for(index_l3)
+    } // end of for(index_r)
+  } // end of parallel region
+
+  free (k2_symmetry);
+
+  if (abort == _TRUE_)
+    return _FAILURE_;
+  
+  if (pbi->bispectra_verbose > 2)
+    printf("     * memorised ~ %.3g MB (%ld doubles) for the k2-integral array (k2_size=%d)\n",
+      pwb->count_memorised_for_integral_over_k2*sizeof(double)/1e6, pwb->count_memorised_for_integral_over_k2,
+      k_tr_size);
+  
+  /* Check that we correctly filled the array */
+  class_test (pwb->count_memorised_for_integral_over_k2 != pwb->count_allocated_for_integral_over_k2,
+    pbi->error_message,
+    "there is a mismatch between allocated (%ld) and used (%ld) space!",
+    pwb->count_allocated_for_integral_over_k2, pwb->count_memorised_for_integral_over_k2);
+  
+  /* Free the memory that was allocated for the I_l3 integral, but only if we have already computed it
+  for all the required probes */
+  if (pwb->Y == pwb->last_Y) {
+#ifdef _OPENMP
+    double free_start = omp_get_wtime();
+#endif
+    /* The first element of each level in the l3 block is the start of the corresponding slab */
+    bispectra2_slab_free (pwb->integral_over_k3[pwb->index_l3_min][0][0]);
+    free (pwb->integral_over_k3[pwb->index_l3_min][0]);
+    free (pwb->integral_over_k3[pwb->index_l3_min]);
+    free (pwb->integral_over_k3);
+#ifdef _OPENMP
+    pwb->time_for_integral_arrays += omp_get_wtime() - free_start;
+#endif
+  } 
+
+  return _SUCCESS_; 
+
+}
+
+        
+
+
+
+
+int bispectra2_interpolate_over_k1 (
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct perturbs * ppt,
+    struct perturbs2 * ppt2,
+    struct bessels * pbs,
+    struct bessels2 * pbs2,
+    struct transfers * ptr,
+    struct transfers2 * ptr2,
+    struct primordial * ppm,
+    struct bispectra * pbi,
+    int index_r,
+    int index_l3,
+    int index_l2,
+    double * integral_splines,
+    double * interpolated_integral,
+    double * f,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  /* Shortcuts */
+  int k_pt_size = pwb->k_smooth_size;
+  double * k_pt = pwb->k_smooth_grid;
+  int k_tr_size = ptr->q_size;
+  double * k_tr = ptr->q;
+  
+  /* Define the function to be interpolated, and multiply it by a window function */
+  for (int index_k1=0; index_k1 < k_pt_size; ++index_k1) {
+    
+    f[index_k1] = pwb->integral_over_k2[index_l3][index_l2][index_r][index_k1];
+    f[index_k1] *= pwb->k_window[index_k1];
+  }
+ 
+  if (ppr->transfers_k1_interpolation == cubic_interpolation) {
+    
+    class_call (array_spline_table_columns (
+                  k_pt,
+                  k_pt_size,
+                  f,
+                  1,  /* How many columns to consider */
+                  integral_splines,
+                  _SPLINE_EST_DERIV_,
+                  pbi->error_message),
+         pbi->error_message,
+         pbi->error_message);
+  }
+
+
+  /* Interpolate at each k value using the usual spline interpolation algorithm */
+  int index_k = 0;
+  double h = k_pt[index_k+1] - k_pt[index_k];
+    
+  for (int index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr) {
+    
+    while (((index_k+1) < k_pt_size) && (k_pt[index_k+1] < k_tr[index_k_tr])) {
+      index_k++;
+      h = k_pt[index_k+1] - k_pt[index_k];
+    }
+    
+    class_test(h==0., pbi->error_message, "stop to avoid division by zero");
+    class_test((index_k+1) >= k_pt_size, pbi->error_message,
+      "some of the elements in k_tr are larger than the largest k_pt. Stop to avoid seg fault.");
+    
+    double b = (k_tr[index_k_tr] - k_pt[index_k])/h;
+    double a = 1.-b;
+      
+    /* Interpolate for each value of l2, l3, r */
+    if (ppr->transfers_k1_interpolation == linear_interpolation) {
+      interpolated_integral[index_k_tr] = a * f[index_k] + b * f[index_k+1];
+    }
+    else if (ppr->transfers_k1_interpolation == cubic_interpolation) {
+      interpolated_integral[index_k_tr] =  
+        a * f[index_k] + b * f[index_k+1]
+        + ((a*a*a-a) * integral_splines[index_k] +(b*b*b-b) * integral_splines[index_k+1])*h*h/6.0;
+    }
+
+    /* Revert the effect of the window function */
+    interpolated_integral[index_k_tr] *= pwb->k_window_inverse[index_k_tr];
+
+#ifdef DEBUG
+    /* We expect the integral over k2 that we are interpolating to be order A_s~1e-10,
+    because it is obtained as a convolution of two O(1) function (the integral over k3
+    and a Bessel function) and the primordial power spectrum (of oder A_s) */
+    double expected_scale = 1e-10;
+    class_test_permissive (fabs(interpolated_integral[index_k_tr]) > (expected_scale*1000),
+      pbi->error_message,
+      "found extremely large value for integral over k2 (m=%d): I_l2_l3(k1_tr,r)=%g,\
+ for l2=%d[%d], l3=%d[%d], k1_tr=%g[%d], r=%g[%d]\n",
+      pwb->abs_M3, interpolated_integral[index_k_tr], pbi->l[index_l2], index_l2, pbi->l[index_l3], index_l3,
+      k_tr[index_k_tr], index_k_tr, pwb->r[index_r], index_r);
+#endif // DEBUG
+
+    /* Further convolve with the primordial power spectrum */
+    interpolated_integral[index_k_tr] *= pbi->pk[index_k_tr];
+
+    /* Test for nans */
+    class_test (isnan(interpolated_integral[index_k_tr]),
+      pbi->error_message,
+      "k1 interpolation yielded a nan for index_r=%d, index_l3=%d, index_l2=%d",
+      index_r, index_l3, index_l2);
+
+  } // end of for (index_k_tr)
+
+
+  /* Some debug - print the original array and the interpolation */
+  // if ((index_l2==10) && (index_l3==11) && (index_r==49)) {
+  // 
+  //   fprintf (stderr, "\n\n");
+  // 
+  //   /* Node points before window */
+  //   for (index_k=0; index_k < k_pt_size; ++index_k)
+  //     fprintf (stderr, "%17.7g %17.7g\n", k_pt[index_k], f[index_k]/pwb->k_window[index_k]);
+  // 
+  //   fprintf (stderr, "\n");
+  //   
+  //   /* Node points after window */
+  //   for (index_k=0; index_k < k_pt_size; ++index_k)
+  //     fprintf (stderr, "%17.7g %17.7g\n", k_pt[index_k], f[index_k]);
+  // 
+  //   fprintf (stderr, "\n");
+  // 
+  //   /* Interpolation after inverse window */  
+  //   for (index_k_tr = 0; index_k_tr < k_tr_size; ++index_k_tr)
+  //     fprintf (stderr, "%17.7g %17.7g\n", k_tr[index_k_tr], interpolated_integral[index_k_tr]/pbi->pk[index_k_tr]);
+  // 
+  //   fprintf (stderr, "\n\n");
+  //   
+  // }
+
+  return _SUCCESS_;
+
+}
+
+
+
+
+
+
+
+
+
+    
+        
+        
+int bispectra2_intrinsic_integrate_over_k1 (
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct perturbs * ppt,
+    struct perturbs2 * ppt2,
+    struct bessels * pbs,
+    struct bessels2 * pbs2,
+    struct transfers * ptr,
+    struct transfers2 * ptr2,
+    struct primordial * ppm,
+    struct bispectra * pbi,
+    int index_tt_k1,
+    int offset_L1,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  /* Integration grid */
+  int k_tr_size = ptr->q_size;
+  double * k_tr = ptr->q;
+
+  /* Parallelization variables */
+  int thread = 0;
+  int abort = _FALSE_;
+  
+  // ======================================================================================================
+  // =                                   Allocate memory for INT_l2_l3(r,k1)                              =
+  // ======================================================================================================
+  
+  /* We shall allocate the array pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min][index_r]
+  so that the l1 level is the one satisfying the triangular inequality (|l2-l3| <= l1 <= l2+l3). 
+  pwb->integral_over_k1 is recycled by the different iterations in the L1 loop and Z-field loop, hence we allocate
+  it only at the first iteration (offset_L1==0, pwb->Y==pwb->first_Y and pwb->Z==pwb->first_Z) */
+  
+  if ((offset_L1 == 0) && (pwb->Y == pwb->first_Y) && (pwb->Z == pwb->first_Z)) {
+
+    /* Initialize counter */
+    pwb->count_allocated_for_integral_over_k1 = 0;
+
+#ifdef _OPENMP
+    double alloc_start = omp_get_wtime();
+#endif
+
+    /* Number of (l3,l2,l1) configurations satisfying the triangular inequality */
+    long int l1_size_total = 0;
+    for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3)
+      for (int index_l2=0; index_l2<pbi->l_size; ++index_l2)
+        l1_size_total += pbi->l_triangular_size[index_l3][index_l2];
+
+    /* The values are stored in a single slab, with r as the fastest index. The pointer levels
+    are also contiguous, and point to the slab so that the array can be indexed as
+    [index_l3][index_l2][index_l1-index_l1_min][index_r]. Make sure to use calloc. */
+    double * slab;
+    double ** l1_level;
+    double *** l2_level;
+    int l3_block_size = pwb->index_l3_max - pwb->index_l3_min + 1;
+
+    class_call (bispectra2_slab_alloc (l1_size_total*pwb->r_size, &slab, pbi->error_message),
+      pbi->error_message,
+      pbi->error_message);
+    class_alloc (l1_level, l1_size_total*sizeof(double *), pbi->error_message);
+    class_alloc (l2_level, l3_block_size*pbi->l_size*sizeof(double **), pbi->error_message);
+    class_calloc (pwb->integral_over_k1, pbi->l_size, sizeof(double ***), pbi->error_message);
+    pwb->count_allocations_for_integral_arrays += 4;
+
+    /* Position of the current (l3,l2,l1) configuration in the l1 level */
+    long int index_l3_l2_l1 = 0;
+  
+    for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3) {
+  
+      pwb->integral_over_k1[index_l3] = l2_level + (index_l3-pwb->index_l3_min)*pbi->l_size;
+  
+      for (int index_l2=0; index_l2<pbi->l_size; ++index_l2) {
+  
+        /* Determine the limits for l1, which come from the triangular inequality |l3-l2| <= l1 <= l3+l2 */
+        int l1_size = pbi->l_triangular_size[index_l3][index_l2];
+  
+        pwb->integral_over_k1[index_l3][index_l2] = l1_level + index_l3_l2_l1;
+      
+        for (int index_l1=0; index_l1 < l1_size; ++index_l1)
+          pwb->integral_over_k1[index_l3][index_l2][index_l1] = slab + (index_l3_l2_l1 + index_l1)*pwb->r_size;
+
+        index_l3_l2_l1 += l1_size;
+        
+        /* Increase memory counter, excluding non-physical configurations where |M3|>l3 */
+        if (pwb->abs_M3 <= pbi->l[index_l3])
+          pwb->count_allocated_for_integral_over_k1 += l1_size*pwb->r_size;
+      
+      } // end of for(index_l2)
+    } // end of for(index_l3)
+
+#ifdef _OPENMP
+    pwb->time_for_integral_arrays += omp_get_wtime() - alloc_start;
+#endif
+    
+    if (pbi->bispectra_verbose > 2)
+      printf("     * allocated ~ %.3g MB (%ld doubles) for the k1-integral array (l_size=%d)\n",
+        pwb->count_allocated_for_integral_over_k1*sizeof(double)/1e6, pwb->count_allocated_for_integral_over_k1, pbi->l_size);
+  
+  } // end of if(offset_L1==0 and pwb->Z==0)
+  
+  
+  // ==============================================================================================================
+  // =                                   Compute the INT_l2_l3(r, k1) integral                                    =
+  // ==============================================================================================================
+  
+  /* Initialize counter for the number of integrals computed */
+  pwb->count_memorised_for_integral_over_k1 = 0;
+
+  /* We parallelize the loops over 'r' and 'l3', collapsed in a single loop as for the k2 integral */
+  abort = _FALSE_;
+  #pragma omp parallel              \
+    shared (ppt,ppt2,pbs,ptr,ptr2,ppm,pbi,pwb,abort)       \
+    private (thread)
+  {
+  
+    #ifdef _OPENMP
+    thread = omp_get_thread_num();
+    #endif
+  
+    #pragma omp for schedule (dynamic) collapse (2)
+    for (int index_r = 0; index_r < pwb->r_size; ++index_r) {
+      for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3) {
+
+        if ((pbi->bispectra_verbose > 2) && (index_l3 == pwb->index_l3_min))
+          printf("     * computing the k1 integral for r=%g, index_r=%d\n", pwb->r[index_r], index_r);
+
+        int l3 = pbi->l[index_l3];
+
+        /* The configurations with |M3|>l3 do not contribute to the bispectrum because
+        they would violate the 3j-symbol properties */
+        if (pwb->abs_M3 > pbi->l[index_l3])
+          continue;
+
+        /* Skip the l3 values without configurations to compute in this pass */
+        if (pwb->has_pending_l3[index_l3] == _FALSE_) {
+          long int l1_size_total = 0;
+          for (int index_l2 = 0; index_l2 < pbi->l_size; ++index_l2)
+            l1_size_total += pbi->l_triangular_size[index_l3][index_l2];
+          #pragma omp atomic
+          pwb->count_memorised_for_integral_over_k1 += l1_size_total;
+          continue;
+        }
+
+        if (pbi->bispectra_verbose > 3)
+          printf("      \\ computing the k1 integral for l3=%d, index_l3=%d, L1=%d, offset_L1=%d\n",
+            pbi->l[index_l3], index_l3, pbs2->l1[offset_L1], offset_L1);
+  
+        /* We compute the integral over k1 for all possible l3-values */
+        for (int index_l2 = 0; index_l2 < pbi->l_size; ++index_l2) {  
+
+          /* Determine the limits for l1, which come from the triangular inequality |l2-l2| <= l1 <= l2+l2 */
+          int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
+          int index_l1_max = pbi->index_l_triangular_max[index_l3][index_l2];
+          
+          /* DISABLED: see comment outside the outside the outermost loop. */
+          /* We compute only those l1's whereby l1 >= l2. The reason is that the k1<->k2 symmetry of the
+          second-order transfer functions enforces the l2<->l1 symmetry of I_l2_l3_l1(r). Note that
+          this is a different symmetry than the full (l2,l3,l1) symmetry of the bispectrum, which we shall
+          enforce later. If you comment out the following line together with the next one outside the
+          outermost loop, the result should not change. */
+          // index_l1_min = MAX (index_l2, index_l1_min);
+
+          /* Skip the (l3,l2) pairs without configurations to compute in this pass */
+          if (pwb->has_pending_l3_l2[index_l3][index_l2] == _FALSE_) {
+            #pragma omp atomic
+            pwb->count_memorised_for_integral_over_k1 += pbi->l_triangular_size[index_l3][index_l2];
+            continue;
+          }
+
+          /* Interpolate the integral I_l2_l3(k1,r) that we computed above in the integration grid of k1 */
+          if (index_l1_max >= index_l1_min) {
+            
+            class_call_parallel (bispectra2_interpolate_over_k1 (
+                          ppr,
+                          ppr2,
+                          ppt,
+                          ppt2,
+                          pbs,
+                          pbs2,
+                          ptr,
+                          ptr2,
+                          ppm,
+                          pbi,
+                          index_r,
+                          index_l3,
+                          index_l2,
+                          pwb->integral_splines[thread],
+                          pwb->interpolated_integral[thread],
+                          pwb->f[thread],
+                          pwb),
+              pbi->error_message,
+              pbi->error_message);
+              
+          }
+          else {
+            continue;
+          }
+
+
+          /* l1 is the index of the first transfer function that we are going to integrate,
+          while L1 is the order of the Bessel function */
+          for (int index_l1=index_l1_min; index_l1<=index_l1_max; ++index_l1) {
+            
+            int l1 = pbi->l[index_l1];
+            int L1 = abs(l1-pwb->abs_M3) + offset_L1;
+
+            /* Skip the configurations that are not computed in this pass */
+            if (pwb->l_sampling[index_l3][index_l2][index_l1-index_l1_min] != pending_configuration) {
+              #pragma omp atomic
+              ++pwb->count_memorised_for_integral_over_k1;
+              continue;
+            }
+
+            /* Skip the (L3,l3,M3) configurations forbidden by the triangular condition */
+            if (L1 > (l1+pwb->abs_M3)) {
+              #pragma omp atomic
+              ++pwb->count_memorised_for_integral_over_k1;
+              continue;
+            }  
+      
+            /* Find L1 inside pbs2->l1, the list of l's where we have computed the Bessel functions 
+            for the extended l-range that is necessary to compute the m!=0 bispectra. */
+            int index_L1 = pbs2->index_l1[L1];
+
+#ifdef DEBUG
+            /* Paranoid android */
+            class_test_parallel ((ppr2->m_max_song==0) && (l1!=L1),
+              pbi->error_message,
+              "inconsistency! for scalar modes, L1 must be equal to l1");
+              
+            class_test_parallel (pbs2->l1[index_L1]!=L1,
+              pbi->error_message,
+              "error in the indexing of pbs2->l1. Is the pbs2->extend_l1_using_m parameter true?");
+#endif // DEBUG
+
+            /* Define the pointer to the first-order transfer functions as a function of k */
+            double * transfer = &(ptr->transfer [ppt->index_md_scalars]
+                                                [((ppt->index_ic_ad * ptr->tt_size[ppt->index_md_scalars] + index_tt_k1)
+                                                * ptr->l_size[ppt->index_md_scalars] + index_l1) * k_tr_size]);
+  
+            /* It is important to note that the used Bessel here has order L1 rather than l1 */
+            class_call_parallel (bessel2_convolution (
+                                   ppr,
+                                   pbs2,
+                                   k_tr,
+                                   pbi->delta_k,
+                                   k_tr_size,
+                                   pwb->interpolated_integral[thread],
+                                   transfer,
+                                   index_L1,
+                                   pwb->r[index_r],
+                                   &(pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min][index_r]),
+                                   pbi->error_message
+                                   ),
+              pbi->error_message,
+              pbi->error_message);
+  
+  
+            /* Update the counter */
+            #pragma omp atomic
+            ++pwb->count_memorised_for_integral_over_k1;
+
+            /* Print the integral as a function of r */
+            // if ((pwb->abs_M3==0) && (pwb->offset_L3==0) && (offset_L1==0))
+            //   if ((pwb->X==pbi->index_bf_t) && (pwb->Y==pbi->index_bf_t) && (pwb->Z==pbi->index_bf_t))
+            //     if ((pbi->l[index_l1]==2) && (pbi->l[index_l2]==2) && (pbi->l[index_l3]==2))
+            //         fprintf (stderr, "%17.7g %17.7g\n",
+            //           pwb->r[index_r], pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min][index_r]);
+
+            #pragma omp flush(abort)
+  
+          } // end of for(index_l1)
+        } // end of for(index_l2)
+      } // end of for(index_l3)
+    } // end of for(index_r)
+  } if (abort == _TRUE_) return _FAILURE_;  // end of parallel region
+
+  /* DISABLED:  While the optimization makes sense, the way we implement it below leads to nan's. Investigate. */
+  /* Take care of the case when l1 < l2 */
+  // for (index_r = 0; index_r < pwb->r_size; ++index_r) {
+  //   for (index_l2=0; index_l2<pbi->l_size; ++index_l2) {
+  //     for (index_l3=0; index_l3<pbi->l_size; ++index_l3) {
+  //
+  //       if (pwb->abs_M3 > pbi->l[index_l3])
+  //        continue;
+  // 
+  //       int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
+  //       int index_l1_max = pbi->index_l_triangular_max[index_l3][index_l2];
+  // 
+  //       /* The following is equivalent to restrict the loop to l1<l2 */
+  //       index_l1_max = MIN (index_l2-1, index_l1_max);
+  // 
+  //       for (index_l1=index_l1_min; index_l1<=index_l1_max; ++index_l1) {
+  // 
+  //           int index_l2_min = pbi->index_l_triangular_min[index_l3][index_l1];
+  //         
+  //           pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min][index_r]
+  //             = pwb->integral_over_k1[index_l1][index_l3][index_l2-index_l2_min][index_r];
+  //         
+  //           /* Update the counter */
+  //           #pragma omp atomic
+  //           ++pwb->count_memorised_for_integral_over_k1;
+  //         
+  //       }
+  //     }
+  //   }
+  // }
+
+  if (pbi->bispectra_verbose > 2)
+    printf("     * memorised ~ %.3g MB (%ld doubles) for the k1-integral array (k1_size=%d)\n",
+      pwb->count_memorised_for_integral_over_k1*sizeof(double)/1e6, pwb->count_memorised_for_integral_over_k1,
+      k_tr_size);
+  
+  /* Check that we correctly filled the array */
+  class_test (pwb->count_memorised_for_integral_over_k1 != pwb->count_allocated_for_integral_over_k1,
+    pbi->error_message,
+    "there is a mismatch between allocated (%ld) and used (%ld) space!",
+    pwb->count_allocated_for_integral_over_k1, pwb->count_memorised_for_integral_over_k1);
+
+  /* Free the memory that was allocated for the integral over k2, but do that only when we are at
+  the last iteration of the loops on offset_L1 (which is always performed since 2*abs_M3 is always
+  even), Z and Y, that is for the last (Y,Z) pair that we integrate for this X. */
+  if ((offset_L1 == (2*pwb->abs_M3)) && (pwb->Y == pwb->last_Y) && (pwb->Z == pwb->last_Z)) {
+#ifdef _OPENMP
+    double free_start = omp_get_wtime();
+#endif
+    /* The first element of each level in the l3 block is the start of the corresponding slab */
+    bispectra2_slab_free (pwb->integral_over_k2[pwb->index_l3_min][0][0]);
+    free (pwb->integral_over_k2[pwb->index_l3_min][0]);
+    free (pwb->integral_over_k2[pwb->index_l3_min]);
+    free (pwb->integral_over_k2);
+#ifdef _OPENMP
+    pwb->time_for_integral_arrays += omp_get_wtime() - free_start;
+#endif
+  } // end of if last term in the L1, Y, Z sums
+  
+  return _SUCCESS_;
+}
+      
+
+
+
+
+int bispectra2_intrinsic_integrate_over_r(
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct perturbs * ppt,
+    struct perturbs2 * ppt2,
+    struct bessels * pbs,
+    struct bessels2 * pbs2,
+    struct transfers * ptr,
+    struct transfers2 * ptr2,
+    struct primordial * ppm,
+    struct bispectra * pbi,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+  
+  // ==========================================================================================================
+  // =                                    Allocate memory for INT_l1_l2_l3(r)                                 =
+  // ==========================================================================================================
+  
+  /* We shall allocate the array pwb->integral_over_r[index_l3][index_l2][index_l1-index_l_triangular_min]
+  so that the l1 level is the one satisfying the triangular inequality. 
+  pwb->integral_over_r is recycled by the different iterations in the L1 loop and in the Z-field loop, hence
+  we allocate it only at the first iteration (offset_L1==0, pwb->Y==pwb->first_Y and pwb->Z==pwb->first_Z) */
+
+  if ((pwb->offset_L1 == 0) && (pwb->Y == pwb->first_Y) && (pwb->Z == pwb->first_Z)) {
+  
+    /* Initialize counter */
+    pwb->count_allocated_for_integral_over_r = 0;
+
+#ifdef _OPENMP
+    double alloc_start = omp_get_wtime();
+#endif
+
+    /* Number of (l3,l2,l1) configurations satisfying the triangular inequality */
+    long int l1_size_total = 0;
+    for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3)
+      for (int index_l2=0; index_l2<pbi->l_size; ++index_l2)
+        l1_size_total += pbi->l_triangular_size[index_l3][index_l2];
+
+    /* The values are stored in a single slab, and the pointer levels point to it so that
+    the array can be indexed as [index_l3][index_l2][index_l1-index_l1_min] */
+    double * slab;
+    double ** l2_level;
+    int l3_block_size = pwb->index_l3_max - pwb->index_l3_min + 1;
+
+    class_call (bispectra2_slab_alloc (l1_size_total, &slab, pbi->error_message),
+      pbi->error_message,
+      pbi->error_message);
+    class_alloc (l2_level, l3_block_size*pbi->l_size*sizeof(double *), pbi->error_message);
+    class_calloc (pwb->integral_over_r, pbi->l_size, sizeof(double **), pbi->error_message);
+    pwb->count_allocations_for_integral_arrays += 3;
+
+    /* Position of the current (l3,l2) pair in the slab */
+    long int index_l3_l2_l1 = 0;
+
+    for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3) {
+
+      pwb->integral_over_r[index_l3] = l2_level + (index_l3-pwb->index_l3_min)*pbi->l_size;
+
+      for (int index_l2=0; index_l2<pbi->l_size; ++index_l2) {
+
+        int l1_size = pbi->l_triangular_size[index_l3][index_l2];
+        pwb->integral_over_r[index_l3][index_l2] = slab + index_l3_l2_l1;
+        index_l3_l2_l1 += l1_size;
+
+        /* Increase memory counter, excluding non-physical configurations where |M3|>l3 */
+        if (pwb->abs_M3 <= pbi->l[index_l3])
+          pwb->count_allocated_for_integral_over_r += l1_size;
+
+      } // end of for(index_l2)
+    } // end of for(index_l3)
+
+#ifdef _OPENMP
+    pwb->time_for_integral_arrays += omp_get_wtime() - alloc_start;
+#endif
+
+    if (pbi->bispectra_verbose > 2)
+      printf(" -> allocated ~ %.3g MB (%ld doubles) for the r-integral array\n",
+        pwb->count_allocated_for_integral_over_r*sizeof(double)/1e6, pwb->count_allocated_for_integral_over_r);
+
+  } // end of if(offset_L1==0 and pwb->Z == 0)
+  
+  
+  // ==========================================================================================================
+  // =                                    Compute  INT_l1_l2_l3(r)  integral                                  =
+  // ==========================================================================================================
+  
+  /* We now proceed to the to integrate I(l3,l2,l1,r) over r. The function also multiplies
+  the result by the appropriate coefficients.  */
+    
+  /* We parallelize the outer loops over 'l3' and 'l2', collapsed in a single loop so that
+  there are enough work items for all threads even when the l3 block is small. */
+  int abort = _FALSE_;
+  #pragma omp parallel shared (ppt,ppt2,pbs,ptr,ptr2,ppm,pbi,pwb,abort)
+  {
+  
+    #pragma omp for schedule (dynamic) collapse (2)
+    for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3) {
+      for (int index_l2 = 0; index_l2 < pbi->l_size; ++index_l2) {
+  
+        /* The configurations with |M3|>l3 do not contribute to the bispectrum because
+        they would violate the 3j-symbol properties */
+        if (pwb->abs_M3 > pbi->l[index_l3])
+          continue;
+  
+        if (pwb->has_pending_l3_l2[index_l3][index_l2] == _FALSE_)
+          continue;
+
+        if ((pbi->bispectra_verbose > 2) && (index_l2 == 0))
+          printf("     * computing the r-integral for l3=%d, index_l3=%d\n", pbi->l[index_l3], index_l3);
+  
+        /* Determine the limits for l1, which come from the triangular inequality |l2-l3| <= l1 <= l2+l3 */
+        int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
+        int index_l1_max = pbi->index_l_triangular_max[index_l3][index_l2];
+  
+        for (int index_l1=index_l1_min; index_l1<=index_l1_max; ++index_l1) {  
+
+          if (pwb->l_sampling[index_l3][index_l2][index_l1-index_l1_min] != pending_configuration)
+            continue;
+
+          if (pbi->bispectra_verbose > 4)
+            printf("     * now considering (index_l3,index_l2,index_l1) = (%d,%d,%d)\n", index_l3, index_l2, index_l1);
+        
+          /* Shortcut to the main part of the integrand function */
+          double * I = pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min];
+          double integral = 0;
+  
+          for (int index_r = 0; index_r < pwb->r_size; ++index_r) {
+      
+            double r = pwb->r[index_r];
+            double integrand = r*r * I[index_r];
+
+            if (integrand == 0.)
+              continue;
       
+            /* Increment the estimate of the integral */
+            integral += integrand * pwb->delta_r[index_r];
+    
+            /* Some debug - output intermediate results on stderr for a custom (l2,l3,l1) configuration */
+            // int index_l3 = pbi->l[index_l3];
+            // int index_l2 = pbi->l[index_l2];
+            // int index_l1 = pbi->l[index_l1];
+            // if ( (l3==100) && (l2==200) && (l1==300) ) {
+            //   if (index_r==0) {
+            //     fprintf(stderr, "##########    l3 = %d, l2 = %d, l1 = %d, n_rows = %d    ##########\n\n",
+            //       l3, l2, l1, r, pwb->r_size);
+            //     fprintf(stderr, "%12s %17s %17s %17s\n", "r", "r^2*I_l2_l3_l1(r)", "integral","delta_r");
+            //   }
+            //   else {
+            //     fprintf(stderr, "%12.7g %17.7g %17.7g %17.7g\n", r, integrand, integral, pwb->delta_r[index_r]);
+            //   }
+            // }
+   
+          } // end of for(index_r)
+  
+  
+          /* Fill the result array and include the factor 1/2 from trapezoidal rule */
+          pwb->integral_over_r[index_l3][index_l2][index_l1-index_l1_min] = 0.5 * integral;
+  
+          /* Some debug - output the integral as a function of r on stderr for a custom (l2,l3,l1) */
+          // if ( (l2==l3) && (l3==l1) ) {
+          //   fprintf(stderr, "%12d %17.7g\n", l2, pwb->integral_over_r[index_l3][index_l2][index_l1-index_l1_min]);
+          // }
+            
+        } // end of for(index_l1)
+
+        #pragma omp flush(abort)
+
+      } // end of for(index_l2)
+    } // end of for(index_l3)
+  } if (abort == _TRUE_) return _FAILURE_;  // end of parallel region
+  
+  /* We can free the memory that was allocated for the integral over k1, as it is no longer needed */
+  if ((pwb->offset_L1 == (2*pwb->abs_M3)) && (pwb->Y == pwb->last_Y) && (pwb->Z == pwb->last_Z)) {
+#ifdef _OPENMP
+    double free_start = omp_get_wtime();
+#endif
+    /* The first element of each level in the l3 block is the start of the corresponding slab */
+    bispectra2_slab_free (pwb->integral_over_k1[pwb->index_l3_min][0][0]);
+    free (pwb->integral_over_k1[pwb->index_l3_min][0]);
+    free (pwb->integral_over_k1[pwb->index_l3_min]);
+    free (pwb->integral_over_k1);
+#ifdef _OPENMP
+    pwb->time_for_integral_arrays += omp_get_wtime() - free_start;
+#endif
+  } // end of last term in the L1 and loop
+  
+  return _SUCCESS_; 
+}
+
+
+
+
+/**
+ * Compute the 3j symbols needed by bispectra2_intrinsic_geometrical_factors() that do not
+ * depend on both l2 and L3, and store them in the pwb workspace.
+ *
+ * The geometrical factors of the intrinsic bispectrum are computed for each bispectrum type
+ * and for each (M3, offset_L3, offset_L1) configuration. Of the five symbols that enter them,
+ * three are the same across these iterations:
+ *
+ *  - (l1,l2,l3)(F,0,-F), with F=0 for even bispectra and F=2 for odd ones, which does not
+ *    depend on M3, L3 or L1;
+ *  - (l1,L1,M3)(0,0,0) and (l3,L3,M3)(M3,0,-M3), which depend only on one multipole and on M3,
+ *    but were recomputed for each l2 and l3.
+ *
+ * Here we compute them once, for all the multipoles in pbi->l and the azimuthal numbers in
+ * ppr2->m. The remaining two symbols, (L1,l2,L3)(0,0,0) and {l1,l3,l2}{L3,L1,M3}, depend on
+ * too many indices to be tabulated, and are still computed on the fly.
+ *
+ * Since the table depends only on the l and m lists, it can be stored in the run directory
+ * and reused in later runs (ppr2->store_geometrical_factors). If the stored table was computed
+ * for different l or m lists, it is computed again.
+ */
+int bispectra2_geometrical_factors_cache_init (
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct bispectra * pbi,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  /* Index the (l1,l2,l3) configurations with the same ordering as pwb->integral_over_r */
+  class_alloc (pwb->threej_l1_l2_l3_offset, pbi->l_size*sizeof(long int *), pbi->error_message);
+
+  pwb->threej_l1_l2_l3_size = 0;
+
+  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3) {
+
+    class_alloc (pwb->threej_l1_l2_l3_offset[index_l3], pbi->l_size*sizeof(long int), pbi->error_message);
+
+    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2) {
+      pwb->threej_l1_l2_l3_offset[index_l3][index_l2] = pwb->threej_l1_l2_l3_size;
+      pwb->threej_l1_l2_l3_size += MAX (0, pbi->index_l_triangular_max[index_l3][index_l2]
+        - pbi->index_l_triangular_min[index_l3][index_l2] + 1);
+    }
+  }
+
+  /* For a given (l,M), L goes from |l-M| to l+M */
+  pwb->threej_L_size = 2*ppr2->m_max_song + 1;
+  pwb->threej_l_L_M_size = (long int)ppr2->m_size * pbi->l_size * pwb->threej_L_size;
+
+  for (int F=0; F < 2; ++F)
+    class_calloc (pwb->threej_l1_l2_l3[F], pwb->threej_l1_l2_l3_size, sizeof(double), pbi->error_message);
+
+  class_calloc (pwb->threej_l_L_M, pwb->threej_l_L_M_size, sizeof(double), pbi->error_message);
+  class_calloc (pwb->threej_L_M_l, pwb->threej_l_L_M_size, sizeof(double), pbi->error_message);
+
+  if (pbi->bispectra_verbose > 2)
+    printf (" -> allocated ~ %.3g MB for the 3j symbols of the geometrical factors\n",
+      (2*pwb->threej_l1_l2_l3_size + 2*pwb->threej_l_L_M_size)*sizeof(double)/1e6);
+
+
+  // ====================================================================================
+  // =                             Load the symbols from disk                           =
+  // ====================================================================================
+
+  if ((ppr2->store_geometrical_factors == _TRUE_) || (ppr->load_run == _TRUE_)) {
+
+    short found = _FALSE_;
+
+    class_call (bispectra2_load_geometrical_factors (ppr2, pbi, pwb, &found),
+      pbi->error_message,
+      pbi->error_message);
+
+    if (found == _TRUE_) {
+      if (pbi->bispectra_verbose > 1)
+        printf (" -> read the 3j symbols of the geometrical factors from '%s'\n",
+          ppr2->geometrical_factors_path);
+      return _SUCCESS_;
+    }
+  }
+
+
+  // ====================================================================================
+  // =                                Compute the symbols                               =
+  // ====================================================================================
+
+  /* Parallelization variables */
+  int number_of_threads = 1;
+  int thread = 0;
+  int abort = _FALSE_;
+  
+  #pragma omp parallel
+  {
+    #ifdef _OPENMP
+    number_of_threads = omp_get_num_threads();
+    #endif
+  }
+
+  /* Temporary arrays to store the output of the 3j routine, one for each thread */
+  int threej_max_size = 2*(pbi->l_max + ppr2->m_max_song) + 1;
+  double ** threej;
+  class_alloc (threej, number_of_threads*sizeof(double *), pbi->error_message);
+  for (int thread=0; thread < number_of_threads; ++thread)
+    class_alloc (threej[thread], threej_max_size*sizeof(double), pbi->error_message);
+
+  #pragma omp parallel for private (thread) schedule (dynamic)
+  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3) {
+
+    #ifdef _OPENMP
+    thread = omp_get_thread_num();
+    #endif
+
+    int l3 = pbi->l[index_l3];
+
+    /* Temporary variables to hold the limits of the 3j's in double precision format */
+    double min_D, max_D;
+
+    // ------------------------------------------------------------------------------
+    // -                          Symbols (l1,l2,l3)(F,0,-F)                        -
+    // ------------------------------------------------------------------------------
+
+    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2) {
+
+      int l2 = pbi->l[index_l2];
+      int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
+      int index_l1_max = pbi->index_l_triangular_max[index_l3][index_l2];
+
+      for (int F=0; F < 2; ++F) {
+
+        /* The symbols with F=2 vanish if either l2 or l3 is smaller than 2; they are
+        left to zero, as calloc'd */
+        if ((F==1) && ((l2 < 2) || (l3 < 2)))
+          continue;
+
+        class_call_parallel (drc3jj (
+                               l2, l3, 2*F, -2*F,
+                               &min_D, &max_D,
+                               threej[thread],
+                               threej_max_size,
+                               pbi->error_message
+                               ),
+          pbi->error_message,
+          pbi->error_message);
+
+        int l1_min = (int)(min_D + _EPS_);
+        int l1_max = (int)(max_D + _EPS_);
+
+        double * threej_l1 = pwb->threej_l1_l2_l3[F] + pwb->threej_l1_l2_l3_offset[index_l3][index_l2];
+
+        for (int index_l1=index_l1_min; index_l1<=index_l1_max; ++index_l1) {
+          int l1 = pbi->l[index_l1];
+          if ((l1 >= l1_min) && (l1 <= l1_max))
+            threej_l1[index_l1-index_l1_min] = threej[thread][l1-l1_min];
+        }
+      } // end of for(F)
+    } // end of for(index_l2)
+
+    // ------------------------------------------------------------------------------
+    // -                 Symbols (l,L,M)(0,0,0) and (L,M,l)(0,-M,M)                 -
+    // ------------------------------------------------------------------------------
+
+    for (int index_M=0; index_M < ppr2->m_size; ++index_M) {
+
+      int M = ppr2->m[index_M];
+
+      long int offset = ((long int)index_M*pbi->l_size + index_l3)*pwb->threej_L_size;
+
+      /* Symbol (l,L,M)(0,0,0) for all allowed values of L */
+      class_call_parallel (drc3jj (
+                             l3, M, 0, 0,
+                             &min_D, &max_D,
+                             threej[thread],
+                             threej_max_size,
+                             pbi->error_message
+                             ),
+        pbi->error_message,
+        pbi->error_message);
+
+      class_test_parallel ((int)(min_D + _EPS_) != abs(l3-M),
+        pbi->error_message,
+        "unexpected range of the 3j symbol (l,L,M)(0,0,0) for l=%d, M=%d", l3, M);
+
+      for (int L=abs(l3-M); L <= (int)(max_D + _EPS_); ++L)
+        pwb->threej_l_L_M[offset + L-abs(l3-M)] = threej[thread][L-abs(l3-M)];
+
+      /* The configurations with M>l3 do not contribute to the bispectrum, and the symbol
+      (L3,M3,l3)(0,-M3,M3) is not defined for them */
+      if (M > l3)
+        continue;
+
+      /* Symbol (L,M,l)(0,-M,M) for all allowed values of L. Mind the column positions! */
+      class_call_parallel (drc3jj (
+                             M, l3, -M, M,
+                             &min_D, &max_D,
+                             threej[thread],
+                             threej_max_size,
+                             pbi->error_message
+                             ),
+        pbi->error_message,
+        pbi->error_message);
+
+      class_test_parallel ((int)(min_D + _EPS_) != abs(l3-M),
+        pbi->error_message,
+        "unexpected range of the 3j symbol (L,M,l)(0,-M,M) for l=%d, M=%d", l3, M);
+
+      for (int L=abs(l3-M); L <= (int)(max_D + _EPS_); ++L)
+        pwb->threej_L_M_l[offset + L-abs(l3-M)] = threej[thread][L-abs(l3-M)];
+
+    } // end of for(index_M)
+
+    #pragma omp flush(abort)
+
+  } // end of for(index_l3)
+
+  /* Free the buffers before checking for errors, so that they do not leak */
+  for (int thread=0; thread < number_of_threads; ++thread)
+    free (threej[thread]);
+  free (threej);
+
+  if (abort == _TRUE_) return _FAILURE_;
+
+  if (pbi->bispectra_verbose > 1)
+    printf (" -> computed the 3j symbols of the geometrical factors for %ld (l1,l2,l3) configurations\n",
+      pwb->threej_l1_l2_l3_size);
+
+  /* Store the symbols for later runs */
+  if (ppr2->store_geometrical_factors == _TRUE_)
+    class_call (bispectra2_store_geometrical_factors (ppr2, pbi, pwb),
+      pbi->error_message,
+      pbi->error_message);
+
+  return _SUCCESS_;
+
+}
+
+
+
+int bispectra2_geometrical_factors_cache_free (
+    struct bispectra * pbi,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  for (int F=0; F < 2; ++F)
+    free (pwb->threej_l1_l2_l3[F]);
+
+  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3)
+    free (pwb->threej_l1_l2_l3_offset[index_l3]);
+  free (pwb->threej_l1_l2_l3_offset);
+
+  free (pwb->threej_l_L_M);
+  free (pwb->threej_L_M_l);
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Write the 3j symbols computed in bispectra2_geometrical_factors_cache_init() to the file
+ * ppr2->geometrical_factors_path.
+ *
+ * The file starts with the l and m lists the symbols were computed for, followed by the
+ * number of values in each table and by the tables themselves, in binary format.
+ */
+int bispectra2_store_geometrical_factors (
+    struct precision2 * ppr2,
+    struct bispectra * pbi,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  FILE * geometry_file;
+  class_open (geometry_file, ppr2->geometrical_factors_path, "wb", pbi->error_message);
+
+  long int n_written = 0;
+
+  /* Header with the l and m lists */
+  n_written += fwrite (&pbi->l_size, sizeof(int), 1, geometry_file);
+  n_written += fwrite (pbi->l, sizeof(int), pbi->l_size, geometry_file);
+  n_written += fwrite (&ppr2->m_size, sizeof(int), 1, geometry_file);
+  n_written += fwrite (ppr2->m, sizeof(int), ppr2->m_size, geometry_file);
+  n_written += fwrite (&pwb->threej_l1_l2_l3_size, sizeof(long int), 1, geometry_file);
+  n_written += fwrite (&pwb->threej_l_L_M_size, sizeof(long int), 1, geometry_file);
+
+  /* Tables */
+  for (int F=0; F < 2; ++F)
+    n_written += fwrite (pwb->threej_l1_l2_l3[F], sizeof(double), pwb->threej_l1_l2_l3_size, geometry_file);
+  n_written += fwrite (pwb->threej_l_L_M, sizeof(double), pwb->threej_l_L_M_size, geometry_file);
+  n_written += fwrite (pwb->threej_L_M_l, sizeof(double), pwb->threej_l_L_M_size, geometry_file);
+
+  long int n_expected = 4 + pbi->l_size + ppr2->m_size
+    + 2*(pwb->threej_l1_l2_l3_size + pwb->threej_l_L_M_size);
+
+  /* A short write would leave a corrupted file that later runs would read without
+  complaint, because the header could still match; remove it */
+  short failed = (fclose (geometry_file) != 0) || (n_written != n_expected);
+
+  if (failed == _TRUE_)
+    remove (ppr2->geometrical_factors_path);
+
+  class_test (failed == _TRUE_,
+    pbi->error_message,
+    "could not write the 3j symbols to '%s', wrote %ld values but expected %ld",
+    ppr2->geometrical_factors_path, n_written, n_expected);
+
+  if (pbi->bispectra_verbose > 1)
+    printf (" -> stored the 3j symbols of the geometrical factors to '%s'\n",
+      ppr2->geometrical_factors_path);
+
+  return _SUCCESS_;
 
+}
 
 
 
-int bispectra2_intrinsic_integrate_over_r(
-    struct precision * ppr,
+/**
+ * Read the 3j symbols of the geometrical factors from the file ppr2->geometrical_factors_path,
+ * if it exists and if it was written for the current l and m lists; set 'found' accordingly.
+ * The arrays in pwb must be already allocated.
+ */
+int bispectra2_load_geometrical_factors (
     struct precision2 * ppr2,
-    struct perturbs * ppt,
-    struct perturbs2 * ppt2,
-    struct bessels * pbs,
-    struct bessels2 * pbs2,
-    struct transfers * ptr,
-    struct transfers2 * ptr2,
-    struct primordial * ppm,
     struct bispectra * pbi,
-    struct bispectra_workspace_intrinsic * pwb
+    struct bispectra_workspace_intrinsic * pwb,
+    short * found
     )
 {
-  
-  // ==========================================================================================================
-  // =                                    Allocate memory for INT_l1_l2_l3(r)                                 =
-  // ==========================================================================================================
-  
-  /* We shall allocate the array pwb->integral_over_r[index_l3][index_l2][index_l1-index_l_triangular_min]
-  so that the l1 level is the one satisfying the triangular inequality. 
-  pwb->integral_over_r is recycled by the different iterations in the L1 loop and in the Z-field loop, hence
-  we allocate it only at the first iteration (offset_L1==0 and pwb->Z==0) */
 
-  if ((pwb->offset_L1 == 0) && (pwb->Y == 0) && (pwb->Z == 0)) {
-  
-    /* Initialize counter */
-    pwb->count_allocated_for_integral_over_r = 0;
-  
-    /* Allocate l3-level */
-    class_alloc (pwb->integral_over_r, pbi->l_size*sizeof(double **), pbi->error_message);
+  *found = _FALSE_;
 
-    for (int index_l3=0; index_l3<pbi->l_size; ++index_l3) {
+  FILE * geometry_file = fopen (ppr2->geometrical_factors_path, "rb");
 
-      /* Allocate l2-level */
-      class_alloc (pwb->integral_over_r[index_l3], pbi->l_size*sizeof(double *), pbi->error_message);
+  if (geometry_file == NULL)
+    return _SUCCESS_;
 
-      for (int index_l2=0; index_l2<pbi->l_size; ++index_l2) {
+  /* Compare the header with the current l and m lists */
+  short match = _TRUE_;
+  int size;
+  long int long_size;
 
-        /* Allocate l1-level */
-        int l1_size = pbi->l_triangular_size[index_l3][index_l2];
-        class_alloc (pwb->integral_over_r[index_l3][index_l2], l1_size*sizeof(double), pbi->error_message);
+  if ((fread (&size, sizeof(int), 1, geometry_file) != 1) || (size != pbi->l_size))
+    match = _FALSE_;
 
-        /* Increase memory counter, excluding non-physical configurations where |M3|>l3 */
-        if (pwb->abs_M3 <= pbi->l[index_l3])
-          pwb->count_allocated_for_integral_over_r += l1_size;
+  for (int index_l=0; (index_l < pbi->l_size) && (match == _TRUE_); ++index_l)
+    if ((fread (&size, sizeof(int), 1, geometry_file) != 1) || (size != pbi->l[index_l]))
+      match = _FALSE_;
 
-      } // end of for(index_l2)
-    } // end of for(index_l3)
+  if ((match == _TRUE_) && ((fread (&size, sizeof(int), 1, geometry_file) != 1) || (size != ppr2->m_size)))
+    match = _FALSE_;
 
-    if (pbi->bispectra_verbose > 2)
-      printf(" -> allocated ~ %.3g MB (%ld doubles) for the r-integral array\n",
-        pwb->count_allocated_for_integral_over_r*sizeof(double)/1e6, pwb->count_allocated_for_integral_over_r);
+  for (int index_M=0; (index_M < ppr2->m_size) && (match == _TRUE_); ++index_M)
+    if ((fread (&size, sizeof(int), 1, geometry_file) != 1) || (size != ppr2->m[index_M]))
+      match = _FALSE_;
 
-  } // end of if(offset_L1==0 and pwb->Z == 0)
-  
-  
-  // ==========================================================================================================
-  // =                                    Compute  INT_l1_l2_l3(r)  integral                                  =
-  // ==========================================================================================================
-  
-  /* We now proceed to the to integrate I(l3,l2,l1,r) over r. The function also multiplies
-  the result by the appropriate coefficients.  */
-    
-  /* We parallelize the outer loop over 'l3'. */
-  int abort = _FALSE_;
-  #pragma omp parallel shared (ppt,ppt2,pbs,ptr,ptr2,ppm,pbi,pwb,abort)
-  {
-  
-    #pragma omp for schedule (dynamic)
-    for (int index_l3 = 0; index_l3 < pbi->l_size; ++index_l3) {
-  
-      /* The configurations with |M3|>l3 do not contribute to the bispectrum because
-      they would violate the 3j-symbol properties */
-      if (pwb->abs_M3 > pbi->l[index_l3])
-        continue;
-  
-      if (pbi->bispectra_verbose > 2)
-        printf("     * computing the r-integral for l3=%d, index_l3=%d\n", pbi->l[index_l3], index_l3);
-  
-      /* We compute the integral over k2 for all possible l3-values */
-      for (int index_l2 = 0; index_l2 < pbi->l_size; ++index_l2) {
-  
-        /* Determine the limits for l1, which come from the triangular inequality |l2-l3| <= l1 <= l2+l3 */
-        int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
-        int index_l1_max = pbi->index_l_triangular_max[index_l3][index_l2];
-  
-        for (int index_l1=index_l1_min; index_l1<=index_l1_max; ++index_l1) {  
+  if ((match == _TRUE_) && ((fread (&long_size, sizeof(long int), 1, geometry_file) != 1)
+    || (long_size != pwb->threej_l1_l2_l3_size)))
+    match = _FALSE_;
 
-          if (pbi->bispectra_verbose > 4)
-            printf("     * now considering (index_l3,index_l2,index_l1) = (%d,%d,%d)\n", index_l3, index_l2, index_l1);
-        
-          /* Shortcut to the main part of the integrand function */
-          double * I = pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min];
-          double integral = 0;
-  
-          for (int index_r = 0; index_r < pwb->r_size; ++index_r) {
-      
-            double r = pwb->r[index_r];
-            double integrand = r*r * I[index_r];
+  if ((match == _TRUE_) && ((fread (&long_size, sizeof(long int), 1, geometry_file) != 1)
+    || (long_size != pwb->threej_l_L_M_size)))
+    match = _FALSE_;
+
+  if (match == _FALSE_) {
+    if (pbi->bispectra_verbose > 1)
+      printf (" -> the 3j symbols in '%s' were computed for different l or m lists, will compute them again\n",
+        ppr2->geometrical_factors_path);
+    fclose (geometry_file);
+    return _SUCCESS_;
+  }
+
+  /* Read the tables */
+  long int n_read = 0;
+  for (int F=0; F < 2; ++F)
+    n_read += fread (pwb->threej_l1_l2_l3[F], sizeof(double), pwb->threej_l1_l2_l3_size, geometry_file);
+  n_read += fread (pwb->threej_l_L_M, sizeof(double), pwb->threej_l_L_M_size, geometry_file);
+  n_read += fread (pwb->threej_L_M_l, sizeof(double), pwb->threej_l_L_M_size, geometry_file);
+
+  class_test (n_read != 2*(pwb->threej_l1_l2_l3_size + pwb->threej_l_L_M_size),
+    pbi->error_message,
+    "could not read the 3j symbols from '%s', read %ld values but expected %ld",
+    ppr2->geometrical_factors_path, n_read, 2*(pwb->threej_l1_l2_l3_size + pwb->threej_l_L_M_size));
+
+  fclose (geometry_file);
+
+  *found = _TRUE_;
+
+  return _SUCCESS_;
 
-            if (integrand == 0.)
-              continue;
-      
-            /* Increment the estimate of the integral */
-            integral += integrand * pwb->delta_r[index_r];
-    
-            /* Some debug - output intermediate results on stderr for a custom (l2,l3,l1) configuration */
-            // int index_l3 = pbi->l[index_l3];
-            // int index_l2 = pbi->l[index_l2];
-            // int index_l1 = pbi->l[index_l1];
-            // if ( (l3==100) && (l2==200) && (l1==300) ) {
-            //   if (index_r==0) {
-            //     fprintf(stderr, "##########    l3 = %d, l2 = %d, l1 = %d, n_rows = %d    ##########\n\n",
-            //       l3, l2, l1, r, pwb->r_size);
-            //     fprintf(stderr, "%12s %17s %17s %17s\n", "r", "r^2*I_l2_l3_l1(r)", "integral","delta_r");
-            //   }
-            //   else {
-            //     fprintf(stderr, "%12.7g %17.7g %17.7g %17.7g\n", r, integrand, integral, pwb->delta_r[index_r]);
-            //   }
-            // }
-   
-          } // end of for(index_r)
-  
-  
-          /* Fill the result array and include the factor 1/2 from trapezoidal rule */
-          pwb->integral_over_r[index_l3][index_l2][index_l1-index_l1_min] = 0.5 * integral;
-  
-          /* Some debug - output the integral as a function of r on stderr for a custom (l2,l3,l1) */
-          // if ( (l2==l3) && (l3==l1) ) {
-          //   fprintf(stderr, "%12d %17.7g\n", l2, pwb->integral_over_r[index_l3][index_l2][index_l1-index_l1_min]);
-          // }
-            
-        } // end of for(index_l1)
-      } // end of for(index_l2)
-      
-      #pragma omp flush(abort)
-      
-    } // end of for(index_l3)
-  } if (abort == _TRUE_) return _FAILURE_;  // end of parallel region
-  
-  /* We can free the memory that was allocated for the integral over k1, as it is no longer needed */
-  if ((pwb->offset_L1 == (2*pwb->abs_M3)) && (pwb->Y == (pbi->bf_size-1)) && (pwb->Z == (pbi->bf_size-1))) {
-    for (int index_l3 = 0; index_l3 < pbi->l_size; ++index_l3) {
-      for (int index_l2 = 0; index_l2 < pbi->l_size; ++index_l2) {
-        int index_l1_min = pbi->index_l_triangular_min[index_l3][index_l2];
-        int index_l1_max = pbi->index_l_triangular_max[index_l3][index_l2];
-        for (int index_l1=index_l1_min; index_l1<=index_l1_max; ++index_l1) {  
-          free (pwb->integral_over_k1[index_l3][index_l2][index_l1-index_l1_min]);
-        } // end of for(index_l1)
-        free (pwb->integral_over_k1[index_l3][index_l2]);
-      } // end of for(index_l3)
-      free (pwb->integral_over_k1[index_l3]);
-    } // end of for(index_l2)
-    free (pwb->integral_over_k1);
-  } // end of last term in the L1 and loop
-  
-  return _SUCCESS_; 
 }
 
 
@@ -2493,16 +4803,14 @@ int bispectra2_intrinsic_geometrical_factors (
   // =                    Allocate geometrical factors                     =
   // =======================================================================
 
-  /* We will need to compute 5 geometrical factors, which correspond to four 3j-symbols
-  and one 6j */
+  /* We will need 5 geometrical factors, which correspond to four 3j-symbols and one 6j. Three
+  of the 3j-symbols, (l3,L3,M3)(M3,0,-M3), (l1,L1,M3)(0,0,0) and (l1,l2,l3)(0,0,0), are read from
+  the cache filled by bispectra2_geometrical_factors_cache_init(); here we compute the other two. */
   enum geometrical_factors {
-    l3_L3_M3,             /* three-j symbol (l3,L3,M3)(M3,0,-M3) */
-    l1_L1_M3,             /* three-j symbol (l1,L1,M3)(0,0,0) */
     L1_l2_L3,             /* three-j symbol (L1,l2,L3)(0,0,0) */
-    l1_l2_l3,             /* three-j symbol (l1,l2,l3)(0,0,0) */
     l1_l3_l2_L3_L1_M3     /* six-j symbol {l1,l3,l2}{L3,L1,M2} */
   };
-  int n_geometrical_factors = 5;
+  int n_geometrical_factors = 2;
 
   /* Temporary arrays and values needed to store the results of the 3j and 6j computations */
   int size[number_of_threads][n_geometrical_factors];
@@ -2517,100 +4825,73 @@ int bispectra2_intrinsic_geometrical_factors (
   }
 
   // ========================================================================
-  // =                              Cycle on l3                             =
+  // =                          Cycle on l3 and l2                          =
   // ========================================================================
 
-  #pragma omp parallel for private (thread)  
-  for (int index_l3=0; index_l3 < pbi->l_size; ++index_l3) {
+  /* The loops over l3 and l2 are collapsed in a single parallel loop, so that there are enough
+  work items for all threads even when the l3 block is small. The factors that depend only on
+  l3 are read from the 3j cache, hence they can be evaluated inside the l2 loop. */
+  #pragma omp parallel for private (thread) schedule (dynamic) collapse (2)
+  for (int index_l3=pwb->index_l3_min; index_l3<=pwb->index_l3_max; ++index_l3) {
+    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2) {
 
-    #ifdef _OPENMP
-    thread = omp_get_thread_num();
-    #endif
+      #ifdef _OPENMP
+      thread = omp_get_thread_num();
+      #endif
   
-    int l3 = pbi->l[index_l3];
-    int L3 = abs(l3-abs_M3) + offset_L3;
+      int l3 = pbi->l[index_l3];
+      int L3 = abs(l3-abs_M3) + offset_L3;
 
-    /* Skip the (L3,l3,M3) configurations forbidden by the triangular condition */
-    if (L3 > (l3+abs_M3))
-      continue;
+      /* Skip the (L3,l3,M3) configurations forbidden by the triangular condition */
+      if (L3 > (l3+abs_M3))
+        continue;
 
-    /* The configurations with |M3|>l3 do not contribute to the bispectrum because
-    they would violate the 3j-symbol properties */
-    if (pwb->abs_M3 > pbi->l[index_l3])
-      continue;
-  
-    /* Temporary variables to hold the limits of the 3j's in double precision format */
-    double min_D, max_D;
-  
-    /* Compute the three-j symbol (l3,L3,M3)(M3,0,-M3) for all allowed values of L3.
-    Mind the column positions! */
-    class_call_parallel (drc3jj (
-                           abs_M3, l3, -M3, M3,
-                           &min_D, &max_D,
-                           value[thread][l3_L3_M3],
-                           (2*pbi->l_max+1),
-                           pbi->error_message       
-                           ),
-      pbi->error_message,
-      pbi->error_message);
+      /* The configurations with |M3|>l3 do not contribute to the bispectrum because
+      they would violate the 3j-symbol properties */
+      if (pwb->abs_M3 > pbi->l[index_l3])
+        continue;
+
+      /* Skip the (l3,l2) pairs without configurations to compute in this pass */
+      if (pwb->has_pending_l3_l2[index_l3][index_l2] == _FALSE_)
+        continue;
   
-    min[thread][l3_L3_M3] = (int)(min_D + _EPS_);
-    max[thread][l3_L3_M3] = (int)(max_D + _EPS_);
-    size[thread][l3_L3_M3] = max[thread][l3_L3_M3] - min[thread][l3_L3_M3] + 1;
+      /* Temporary variables to hold the limits of the 3j's in double precision format */
+      double min_D, max_D;
   
-    class_test_parallel ((L3 - min[thread][l3_L3_M3]) >= size[thread][l3_L3_M3],
-      pbi->error_message,
-      "error in the computation of the three-j symbol l3_L3_M3");
+      /* Value of the three-j symbol (l3,L3,M3)(M3,0,-M3) in L3, which is stored in the cache
+      as (L3,M3,l3)(0,-M3,M3) starting from L3=|l3-M3| */
+      double FACTOR_l3_L3_M3 =
+        pwb->threej_L_M_l[((long int)index_M3*pbi->l_size + index_l3)*pwb->threej_L_size + offset_L3];
 
-    /* Value of l3_L3_M3 in L3 */
-    double FACTOR_l3_L3_M3 = value[thread][l3_L3_M3][L3 - min[thread][l3_L3_M3]];
+      /* Debug (l3,L3,M3)(M3,0,-M3) */
+      // printf ("I(l3,L3,|M3|)(M3,0,-M3) = (%d,%d,%d)(%d,0,%d) = %g\n",
+      //     l3, L3, abs_M3, M3, -M3, FACTOR_l3_L3_M3);
 
-    /* Debug (l3,L3,M3)(M3,0,-M3) */
-    // printf ("I(l3,L3,|M3|)(M3,0,-M3) = (%d,%d,%d)(%d,0,%d) = %g\n",
-    //     l3, L3, abs_M3, M3, -M3, FACTOR_l3_L3_M3);
+      // ============================================================================
+      // =                         Sum over -|M3| and +|M3|                         =
+      // ============================================================================
 
-    // ============================================================================
-    // =                         Sum over -|M3| and +|M3|                         =
-    // ============================================================================
-
-    /* For a given value of |M3|, we need to sum over -|M3| and +|M3|. See the long
-    comment in bispectra2_intrinsic_init (inside the offset_L3 loop) for details
-    on what we do here.  */
-    double SUMMED_FACTOR_l3_L3_M3 = FACTOR_l3_L3_M3;
-    if (abs_M3 != 0) {
+      /* For a given value of |M3|, we need to sum over -|M3| and +|M3|. See the long
+      comment in bispectra2_intrinsic_init (inside the offset_L3 loop) for details
+      on what we do here.  */
+      double SUMMED_FACTOR_l3_L3_M3 = FACTOR_l3_L3_M3;
+      if (abs_M3 != 0) {
       
-      if (pwb->bispectrum_parity == _EVEN_)
-        SUMMED_FACTOR_l3_L3_M3 = FACTOR_l3_L3_M3 + ALTERNATING_SIGN(offset_L3)*FACTOR_l3_L3_M3;
+        if (pwb->bispectrum_parity == _EVEN_)
+          SUMMED_FACTOR_l3_L3_M3 = FACTOR_l3_L3_M3 + ALTERNATING_SIGN(offset_L3)*FACTOR_l3_L3_M3;
 
-      else
-        SUMMED_FACTOR_l3_L3_M3 = FACTOR_l3_L3_M3 - ALTERNATING_SIGN(offset_L3)*FACTOR_l3_L3_M3;
+        else
+          SUMMED_FACTOR_l3_L3_M3 = FACTOR_l3_L3_M3 - ALTERNATING_SIGN(offset_L3)*FACTOR_l3_L3_M3;
+
+      } // end of if(M3!=0)
 
-    } // end of if(M3!=0)
-  
-    // =========================================================================
-    // =                             Cycle on l2                             =
-    // =========================================================================
-    for (int index_l2=0; index_l2 < pbi->l_size; ++index_l2) {
-      
       int l2 = pbi->l[index_l2];
             
-      /* Compute the three-j symbol (l1,l2,l3)(0,0,0) for all allowed values of l1.
-      If we are dealing with an odd bispectrum, compute (l1,l2,l3)(2,0,-2) instead */      
+      /* Three-j symbol (l1,l2,l3)(0,0,0) for all allowed values of l1. If we are dealing
+      with an odd bispectrum, take (l1,l2,l3)(2,0,-2) instead */      
       int F = ((pwb->bispectrum_parity == _EVEN_) ? 0:2);
       
-      class_call_parallel (drc3jj (
-                             l2, l3, F, -F,
-                             &min_D, &max_D,
-                             value[thread][l1_l2_l3],
-                             (2*pbi->l_max+1),
-                             pbi->error_message       
-                             ),
-        pbi->error_message,
-        pbi->error_message);
-      
-      min[thread][l1_l2_l3] = (int)(min_D + _EPS_);
-      max[thread][l1_l2_l3] = (int)(max_D + _EPS_);
-      size[thread][l1_l2_l3] = max[thread][l1_l2_l3] - min[thread][l1_l2_l3] + 1;
+      double * threej_l1_l2_l3 = pwb->threej_l1_l2_l3[F/2] + pwb->threej_l1_l2_l3_offset[index_l3][index_l2];
 
       /* Compute the three-j symbol (L1,l2,L3)(0,0,0) for all allowed values of L1 */
       class_call_parallel (drc3jj (
@@ -2638,6 +4919,10 @@ int bispectra2_intrinsic_geometrical_factors (
   
         int l1 = pbi->l[index_l1];
         int L1 = abs(l1-abs_M3) + offset_L1;
+
+        /* Skip the configurations that are not computed in this pass */
+        if (pwb->l_sampling[index_l3][index_l2][index_l1-index_l1_min] != pending_configuration)
+          continue;
             
         /* Skip the (L1,l1,M3) configurations forbidden by the triangular condition */
         if (L1 > (l1+abs_M3))
@@ -2658,12 +4943,8 @@ int bispectra2_intrinsic_geometrical_factors (
         /* For an even/odd, the only non-vanishing contributions come from even/odd l1+l2+l3  */
         short is_even_configuration = ((l1+l2+l3)%2==0);
 
-        /* Value of l1_l2_l3 in L1 */
-        class_test_parallel ((l1 - min[thread][l1_l2_l3]) >= size[thread][l1_l2_l3],
-          pbi->error_message,
-          "error in the computation of the three-j symbol l1_l2_l3");
-        
-        double FACTOR_l1_l2_l3 = value[thread][l1_l2_l3][l1 - min[thread][l1_l2_l3]];
+        /* Value of l1_l2_l3 in l1 */
+        double FACTOR_l1_l2_l3 = threej_l1_l2_l3[index_l1-index_l1_min];
         
         /* Debug l1_l2_l3 */
         // printf ("L1=%d,L2=%d,M3=%d: I(l1,l2,l3)(%d,0,%d) = (%d,%d,%d)(%d,0,%d) = %g\n",
@@ -2705,27 +4986,10 @@ int bispectra2_intrinsic_geometrical_factors (
         //
         // FACTOR_l1_l2_l3 = 1;        
 
-        /* Compute the three-j symbol (l1,L1,M3)(0,0,0) for all allowed values of L1 */
-        class_call_parallel (drc3jj (
-                               l1, abs_M3, 0, 0,
-                               &min_D, &max_D,
-                               value[thread][l1_L1_M3],
-                               (2*pbi->l_max+1),
-                               pbi->error_message       
-                               ),
-          pbi->error_message,
-          pbi->error_message);        
-        
-        min[thread][l1_L1_M3] = (int)(min_D + _EPS_);
-        max[thread][l1_L1_M3] = (int)(max_D + _EPS_);
-        size[thread][l1_L1_M3] = max[thread][l1_L1_M3] - min[thread][l1_L1_M3] + 1;
-        
-        /* Value of l1_L1_M3 in L1 */
-        class_test_parallel ((L1 - min[thread][l1_L1_M3]) >= size[thread][l1_L1_M3],
-          pbi->error_message,
-          "error in the computation of the three-j symbol l1_L1_M3");
-          
-        double FACTOR_l1_L1_M3 = value[thread][l1_L1_M3][L1 - min[thread][l1_L1_M3]];
+        /* Value of the three-j symbol (l1,L1,M3)(0,0,0) in L1, which is stored in the cache
+        starting from L1=|l1-M3| */
+        double FACTOR_l1_L1_M3 =
+          pwb->threej_l_L_M[((long int)index_M3*pbi->l_size + index_l1)*pwb->threej_L_size + offset_L1];
 
         /* Debug (l1,L1,M3)(0,0,0) */
         // printf ("I(l1,L1,M3)(0,0,0) = (%d,%d,%d)(0,0,0) = %g\n",
@@ -2978,38 +5242,193 @@ int bispectra2_intrinsic_geometrical_factors (
   
       } // end of for(index_l1)
     } // end of for(index_l2)
-  } // end of for(index_l3) and of parallel region
-  if (abort == _TRUE_) return _FAILURE_;
+  } // end of for(index_l3) and of parallel region
+  if (abort == _TRUE_) return _FAILURE_;
+
+  /* We can free the memory that was allocated for the integral over r, as it is no longer needed */
+  if ((offset_L1 == (2*pwb->abs_M3)) && (pwb->Y == pwb->last_Y) && (pwb->Z == pwb->last_Z)) {
+#ifdef _OPENMP
+    double free_start = omp_get_wtime();
+#endif
+    /* The first element of each level in the l3 block is the start of the corresponding slab */
+    bispectra2_slab_free (pwb->integral_over_r[pwb->index_l3_min][0]);
+    free (pwb->integral_over_r[pwb->index_l3_min]);
+    free (pwb->integral_over_r);
+#ifdef _OPENMP
+    pwb->time_for_integral_arrays += omp_get_wtime() - free_start;
+#endif
+  } // end of last term in the L1 loop
+
+  /* Free 3j values array */
+  for (thread=0; thread < number_of_threads; ++thread) {
+    for (int ii=0; ii < n_geometrical_factors; ++ii)
+      free (value[thread][ii]);
+    free (value[thread]);
+  }
+  free (value);
+
+  return _SUCCESS_;
+
+}
+
+
+/**
+ * Build the intrinsic bispectrum pbi->bispectra[index_bt] from the unsymmetrised one, add the
+ * quadratic corrections and check the result for nan's, in a single sweep over the (l1,l2,l3)
+ * configurations.
+ *
+ * At second-order, the bispectrum < X_l1 Y_l2 Z_l3 > is approximated by:
+ *   < X^(2)_l1 Y^(1)_l2 Z^(1)_l3 >
+ * + < X^(1)_l1 Y^(2)_l2 Z^(1)_l3 >
+ * + < X^(1)_l1 Y^(1)_l2 Z^(2)_l3 >.
+ * Here, we build this object from pwb->unsymmetrised_bispectrum. The ordering of its 6 levels is
+ * such that:
+ * < X^(2)_l1 Y^(1)_l2 Z^(1)_l3 > = pwb->unsymmetrised_bispectrum[X][Y][Z][l1][l2][l3]
+ * that is, the second-order transfer function always corresponds to the first field and to the
+ * the first multipole index of the unsymmetrised bispectrum array.
+ * We store the bispectrum for each combination of XYZ and only for those configurations where
+ * l1>=l2>=l3 and the triangular condition is satisfied.
+ *
+ * To the symmetrised bispectrum we add pwb->quadratic_correction times the quadratic bispectrum
+ * pbi->bispectra[pbi->index_bt_quadratic] (see bispectra2_quadratic_correction()). The field
+ * combinations read from disk (pwb->loaded_bispectrum) already include the correction, and
+ * are only checked.
+ *
+ * The sweep is parallelised over l1. For each (l1,l2) pair, we process all the fields and l3
+ * values at once, so that the rows of the unsymmetrised bispectrum and of pbi->bispectra are
+ * read and written only once. Each thread has its own counters, which are summed at the end.
+ */
+int bispectra2_intrinsic_postprocess (
+    struct bispectra * pbi,
+    int index_bt,
+    struct bispectra_workspace_intrinsic * pwb
+    )
+{
+
+  if ((pbi->bispectra_verbose > 0) && (pwb->quadratic_correction != 0))
+    printf (" -> adding temperature & redshift corrections to the intrinsic bispectrum\n");
+
+#ifdef _OPENMP
+  double postprocess_start = omp_get_wtime();
+#endif
+
+  /* Parallelization variables */
+  int number_of_threads = 1;
+  int thread = 0;
+
+  #pragma omp parallel
+  {
+    #ifdef _OPENMP
+    number_of_threads = omp_get_num_threads();
+    #endif
+  }
+
+  long int * count_memorised;
+  long int * count_warnings;
+  class_calloc (count_memorised, number_of_threads, sizeof(long int), pbi->error_message);
+  class_calloc (count_warnings, number_of_threads, sizeof(long int), pbi->error_message);
+
+  #pragma omp parallel for private (thread) schedule (dynamic)
+  for (int index_l1 = 0; index_l1 < pbi->l_size; ++index_l1) {
+
+    #ifdef _OPENMP
+    thread = omp_get_thread_num();
+    #endif
+
+    for (int index_l2 = 0; index_l2 <= index_l1; ++index_l2) {
+
+      /* Determine the limits for l3, which come from the triangular inequality |l1-l2| <= l3 <= l1+l2 */
+      int index_l3_min = pbi->index_l_triangular_min[index_l1][index_l2];
+      int index_l3_max = MIN (index_l2, pbi->index_l_triangular_max[index_l1][index_l2]);
+
+      /* Indices of the (l1,l2,l3) configurations, as index_l1_l2_l3[index_l3_max-index_l3] */
+      long int * index_l1_l2_l3 = pbi->index_l1_l2_l3[index_l1][index_l1-index_l2];
+
+      for (int X=0; X < pbi->bf_size; ++X) {
+        for (int Y=0; Y < pbi->bf_size; ++Y) {
+          for (int Z=0; Z < pbi->bf_size; ++Z) {
+
+            double * b = pbi->bispectra[index_bt][X][Y][Z];
+
+            /* Symmetrise and correct the field combinations that we have just integrated */
+            if (pwb->loaded_bispectrum[X][Y][Z] == _FALSE_) {
+
+              double * b_XYZ = pwb->unsymmetrised_bispectrum[X][Y][Z][index_l1][index_l2];
+              double * b_YXZ = pwb->unsymmetrised_bispectrum[Y][X][Z][index_l2][index_l1];
+              double *** b_ZYX = pwb->unsymmetrised_bispectrum[Z][Y][X];
+
+              for (int index_l3=index_l3_min; index_l3<=index_l3_max; ++index_l3) {
+                int index_l1_min = pbi->index_l_triangular_min[index_l2][index_l3];
+                b[index_l1_l2_l3[index_l3_max-index_l3]] = b_XYZ[index_l3-index_l3_min]
+                  + b_YXZ[index_l3-index_l3_min] + b_ZYX[index_l3][index_l2][index_l1-index_l1_min];
+              }
+
+              if (pwb->quadratic_correction != 0) {
+                double * b_quadratic = pbi->bispectra[pbi->index_bt_quadratic][X][Y][Z];
+                for (int index_l3=index_l3_min; index_l3<=index_l3_max; ++index_l3) {
+                  long int index = index_l1_l2_l3[index_l3_max-index_l3];
+                  b[index] += pwb->quadratic_correction * b_quadratic[index];
+                }
+              }
+            }
+
+            /* Check for nan's and crazy values. A value is crazy when it is much larger than
+            the characteristic scale for a bispectrum, A_s*A_s~1e-20 */
+            for (int index_l3=index_l3_min; index_l3<=index_l3_max; ++index_l3) {
+
+              double bispectrum = b[index_l1_l2_l3[index_l3_max-index_l3]];
+
+              if ((isnan(bispectrum)) || (fabs(bispectrum)>1)) {
+                printf ("@@@ WARNING: b(%d,%d,%d) = %g for bispectrum '%s_%s'.\n",
+                  pbi->l[index_l1], pbi->l[index_l2], pbi->l[index_l3], bispectrum,
+                  pbi->bt_labels[index_bt], pbi->bfff_labels[X][Y][Z]);
+                count_warnings[thread]++;
+              }
+            }
+
+            count_memorised[thread] += MAX (0, index_l3_max-index_l3_min+1);
+
+          } // end of for(Z)
+        } // end of for(Y)
+      } // end of for(X)
+
+    } // end of for(index_l2)
+  } // end of for(index_l1)
 
-  /* We can free the memory that was allocated for the integral over r, as it is no longer needed */
-  if ((offset_L1 == (2*pwb->abs_M3)) && (pwb->Y == (pbi->bf_size-1)) && (pwb->Z == (pbi->bf_size-1))) {
-    for (int index_l3 = 0; index_l3 < pbi->l_size; ++index_l3) {
-      for (int index_l2 = 0; index_l2 < pbi->l_size; ++index_l2) {
-        free (pwb->integral_over_r[index_l3][index_l2]);
-      } // end of for(index_l2)
-      free (pwb->integral_over_r[index_l3]);
-    } // end of for(index_l3)
-    free (pwb->integral_over_r);
-  } // end of last term in the L1 loop
+  /* Sum the counters of the threads */
+  long int n_warnings = 0;
 
-  /* Free 3j values array */
-  for (thread=0; thread < number_of_threads; ++thread) {
-    for (int ii=0; ii < n_geometrical_factors; ++ii)
-      free (value[thread][ii]);
-    free (value[thread]);
+  for (int thread=0; thread < number_of_threads; ++thread) {
+    pbi->count_memorised_for_bispectra += count_memorised[thread];
+    n_warnings += count_warnings[thread];
   }
-  free (value);
+
+  free (count_memorised);
+  free (count_warnings);
+
+  class_test_permissive (n_warnings > 0,
+    pbi->error_message,
+    "found %ld nan's or crazy values in the %s bispectrum", n_warnings, pbi->bt_labels[index_bt]);
+
+#ifdef _OPENMP
+  if (pbi->bispectra_verbose > 1)
+    printf (" -> symmetrised, corrected and checked the %s bispectrum in %g seconds\n",
+      pbi->bt_labels[index_bt], omp_get_wtime() - postprocess_start);
+#endif
 
   return _SUCCESS_;
 
 }
 
 
+
 /**
- * Add to the intrinsic bispectrum a quadratic term in C_l to account for various
- * corrections.
+ * Compute the coefficient of the quadratic term in C_l that we add to the intrinsic bispectrum
+ * to account for various corrections. The quadratic term is the coefficient times the
+ * quadratic bispectrum pbi->bispectra[pbi->index_bt_quadratic], and it is added in
+ * bispectra2_intrinsic_postprocess().
  * 
- * In detail, the quadratic term we add here is intended to:
+ * In detail, the quadratic term is intended to:
  *
  * -# Turn the brightness temperature bispectrum, which we have computed so far, into the
  * bolometric temperature bispectrum. For details on this transformation, see sec. 6.3.1
@@ -3019,89 +5438,565 @@ int bispectra2_intrinsic_geometrical_factors (
  * module in order to absorb the redshift term of the Boltzmann equation. For details, see
  * sec. 6.3.1 of http://arxiv.org/abs/1405.2280 and sec. 3.1 of http://arxiv.org/abs/1401.3296.
  *
- * The two contributions partially cancel. The loop will run only for the intrinsic bispectra,
+ * The two contributions partially cancel. The correction applies only to the intrinsic bispectra,
  * because for any other bispectrum computed by SONG there is no difference between brightness
  * and bolometric temperature, and there is no need to absorb the (linear) redshift term.
  * 
  * If you would rather ignore these corrections, set the flag 'add_quadratic_correction = no' or 
- * 'quadratic_sources = no' in the parameter file. Note that the latter will also turn off all
- * quadratic sources in the perturbations2.c module, effectively turning SONG in a first-order
- * code.
+ * 'quadratic_sources = no' in the parameter file; the coefficient is then zero. Note that the
+ * latter will also turn off all quadratic sources in the perturbations2.c module, effectively
+ * turning SONG in a first-order code.
  */
-int bispectra2_add_quadratic_corrections (
-    struct precision * ppr,
-    struct precision2 * ppr2,
-    struct background * pba,
-    struct perturbs * ppt,
+int bispectra2_quadratic_correction (
     struct perturbs2 * ppt2,
-    struct bessels * pbs,
-    struct bessels2 * pbs2,
-    struct transfers * ptr,
-    struct transfers2 * ptr2,
-    struct primordial * ppm,
-    struct spectra * psp,
-    struct bispectra * pbi
+    struct bispectra * pbi,
+    double * coefficient
     )
 {
 
+  *coefficient = 0;
+
    /* We assume that when the quadratic sources are not considered at all
   (ppt2->has_quadratic_sources==_FALSE), then the user is trying to run SONG as a
   first-order code, and we turn off the quadratic corrections. */
   if ((pbi->add_quadratic_correction == _FALSE_) || (ppt2->has_quadratic_sources == _FALSE_))
     return _SUCCESS_;
 
-  if (pbi->bispectra_verbose > 0)
-    printf (" -> adding temperature & redshift corrections to the intrinsic bispectrum\n");
-  
+  /* Bolometric temperature correction (sec. 6.3.1 of http://arxiv.org/abs/1405.2280 or
+  sec. 3.2 of http://arxiv.org/abs/1401.3296) */
+  *coefficient += - 3/8.;
+
+  /* Redshift term correction (see sec. 6.3.1 of http://arxiv.org/abs/1405.2280 or
+  sec. 3.1 of http://arxiv.org/abs/1401.3296) */
+  if (ppt2->use_delta_tilde_in_los == _TRUE_)
+    *coefficient += + 4/8.;
+
+  return _SUCCESS_;
+
+}
+
+
+
+
+/**
+ * Expand the intrinsic bispectra on a basis of separable modes, and store the coefficients
+ * in the pmo structure (see the documentation of struct bispectra_modes in bispectra2.h).
+ *
+ * The coefficients are obtained by a least-squares fit of the rescaled bispectrum on the
+ * (l1>=l2>=l3) configurations in pbi->bispectra. We build the matrix of the scalar products
+ * between the modes, gamma_nm = sum_l1l2l3 Q_n*Q_m with Q_n = q_p(l1)*q_r(l2)*q_s(l3), and
+ * the projections beta_n = sum_l1l2l3 Q_n*S. The Cholesky decomposition gamma = L*L^T turns
+ * the modes into an orthonormal basis on the l-grid, where the coefficients are y = L^-1*beta.
+ * Since the modes are ordered by total degree, the first modes of the orthonormal basis span
+ * the modes up to a given degree, and the residual of the truncated expansion follows from
+ * the partial sums of y^2. The coefficients of the separable modes are alpha = L^-T*y.
+ *
+ * The expansion is computed only if ppr2->modal_max_order is positive. If the bispectra are
+ * stored to disk, the coefficients are also written to the run directory by
+ * bispectra2_modes_store().
+ */
+int bispectra2_modes_init (
+    struct precision * ppr,
+    struct precision2 * ppr2,
+    struct perturbs2 * ppt2,
+    struct bispectra * pbi,
+    struct bispectra_modes * pmo
+    )
+{
+
+  pmo->has_modes = _FALSE_;
+  pmo->modes_verbose = pbi->bispectra_verbose;
+
+  /* Skip the expansion if it was not requested, or if there are no intrinsic bispectra */
+  if ((ppr2->modal_max_order <= 0)
+     || (ppt2->has_cmb_bispectra == _FALSE_)
+     || (pbi->has_bispectra == _FALSE_)
+     || (pbi->n[intrinsic_bispectrum] < 1))
+    return _SUCCESS_;
+
+  pmo->has_modes = _TRUE_;
+  pmo->max_order = ppr2->modal_max_order;
+  pmo->l_min = pbi->l[0];
+  pmo->l_max = pbi->l[pbi->l_size-1];
+  pmo->bt_size = pbi->bt_size;
+  pmo->bf_size = pbi->bf_size;
+
+  class_test (pmo->l_min < 1,
+    pmo->error_message,
+    "the modal expansion needs l_min>0, found l_min=%d", pmo->l_min);
+
+  class_test (pmo->l_max <= pmo->l_min,
+    pmo->error_message,
+    "the modal expansion needs at least two multipoles");
+
+  if (pmo->modes_verbose > 0)
+    printf ("Computing the separable modal expansion of the intrinsic bispectrum\n");
+
+
+  // ====================================================================================
+  // =                                   Build the modes                                =
+  // ====================================================================================
+
+  /* Number of modes with p+r+s <= max_order */
+  int N_max = pmo->max_order;
+  pmo->n_modes = (N_max+1)*(N_max+2)*(N_max+3)/6;
+  int n_modes = pmo->n_modes;
+
+  class_alloc (pmo->mode_p, n_modes*sizeof(int), pmo->error_message);
+  class_alloc (pmo->mode_r, n_modes*sizeof(int), pmo->error_message);
+  class_alloc (pmo->mode_s, n_modes*sizeof(int), pmo->error_message);
+
+  /* Order the modes by total degree. last_mode_of_order[N] is the index of the last mode
+  with p+r+s=N. */
+  int last_mode_of_order[N_max+1];
+  int index_mode = 0;
+
+  for (int N=0; N <= N_max; ++N) {
+    for (int p=N; p >= 0; --p) {
+      for (int r=N-p; r >= 0; --r) {
+        pmo->mode_p[index_mode] = p;
+        pmo->mode_r[index_mode] = r;
+        pmo->mode_s[index_mode] = N-p-r;
+        index_mode++;
+      }
+    }
+    last_mode_of_order[N] = index_mode-1;
+  }
+
+  class_test (index_mode != n_modes,
+    pmo->error_message,
+    "error in the enumeration of the modes (%d != %d)", index_mode, n_modes);
+
+  /* Legendre polynomials for all the integer l in [l_min,l_max], from the recurrence relation
+  (p+1)*P_{p+1}(x) = (2p+1)*x*P_p(x) - p*P_{p-1}(x). We use log(l) as variable because the
+  bispectrum varies on logarithmic scales and the l-grid is denser at low l; with a linear
+  variable, the modes are nearly degenerate already at moderate degrees. */
+  int l_range = pmo->l_max - pmo->l_min + 1;
+  class_alloc (pmo->q, (N_max+1)*l_range*sizeof(double), pmo->error_message);
+
+  for (int l=pmo->l_min; l <= pmo->l_max; ++l) {
+
+    double x = 2*log((double)l/pmo->l_min)/log((double)pmo->l_max/pmo->l_min) - 1;
+
+    pmo->q[l-pmo->l_min] = 1;
+    if (N_max > 0)
+      pmo->q[l_range + l-pmo->l_min] = x;
+
+    for (int p=1; p < N_max; ++p)
+      pmo->q[(p+1)*l_range + l-pmo->l_min] =
+        ((2*p+1)*x*pmo->q[p*l_range + l-pmo->l_min] - p*pmo->q[(p-1)*l_range + l-pmo->l_min])/(p+1);
+  }
+
+
+  // ====================================================================================
+  // =                               Project the bispectra                              =
+  // ====================================================================================
+
+  /* List of the bispectra to expand; each is identified by its type and fields (X,Y,Z) */
+  int n_fields = pbi->bf_size*pbi->bf_size*pbi->bf_size;
+  int n_bispectra = pbi->n[intrinsic_bispectrum]*n_fields;
+  int index_bt_of_b[n_bispectra];
+  int index_b = 0;
+
+  for (int index_bt = 0; index_bt < pbi->bt_size; ++index_bt)
+    if (pbi->bispectrum_type[index_bt] == intrinsic_bispectrum)
+      for (int index_xyz = 0; index_xyz < n_fields; ++index_xyz)
+        index_bt_of_b[index_b++] = index_bt;
+
+  class_test (index_b != n_bispectra,
+    pmo->error_message,
+    "error in the counting of the intrinsic bispectra");
+
+  /* Parallelization variables */
+  int number_of_threads = 1;
+  int thread = 0;
+  int abort = _FALSE_;
+
+  #pragma omp parallel
+  {
+    #ifdef _OPENMP
+    number_of_threads = omp_get_num_threads();
+    #endif
+  }
+
+  /* Each thread accumulates its own scalar products, which are summed at the end */
+  double ** gamma, ** beta, ** norm, ** Q;
+  long int * n_configurations;
+  class_alloc (gamma, number_of_threads*sizeof(double *), pmo->error_message);
+  class_alloc (beta, number_of_threads*sizeof(double *), pmo->error_message);
+  class_alloc (norm, number_of_threads*sizeof(double *), pmo->error_message);
+  class_alloc (Q, number_of_threads*sizeof(double *), pmo->error_message);
+  class_calloc (n_configurations, number_of_threads, sizeof(long int), pmo->error_message);
+
+  for (int thread=0; thread < number_of_threads; ++thread) {
+    class_calloc (gamma[thread], n_modes*n_modes, sizeof(double), pmo->error_message);
+    class_calloc (beta[thread], n_bispectra*n_modes, sizeof(double), pmo->error_message);
+    class_calloc (norm[thread], n_bispectra, sizeof(double), pmo->error_message);
+    class_alloc (Q[thread], n_modes*sizeof(double), pmo->error_message);
+  }
+
+  #pragma omp parallel for private (thread) schedule (dynamic)
+  for (int index_l1 = 0; index_l1 < pbi->l_size; ++index_l1) {
+
+    #ifdef _OPENMP
+    thread = omp_get_thread_num();
+    #endif
+
+    int l1 = pbi->l[index_l1];
+
+    for (int index_l2 = 0; index_l2 <= index_l1; ++index_l2) {
+
+      int l2 = pbi->l[index_l2];
+
+      /* Determine the limits for l3, which come from the triangular inequality |l1-l2| <= l3 <= l1+l2 */
+      int index_l3_min = pbi->index_l_triangular_min[index_l1][index_l2];
+      int index_l3_max = MIN (index_l2, pbi->index_l_triangular_max[index_l1][index_l2]);
+
+      for (int index_l3=index_l3_min; index_l3<=index_l3_max; ++index_l3) {
+
+        int l3 = pbi->l[index_l3];
+
+        long int index_l1_l2_l3 = pbi->index_l1_l2_l3[index_l1][index_l1-index_l2][index_l3_max-index_l3];
+
+        /* Value of the modes in (l1,l2,l3) */
+        for (int n=0; n < n_modes; ++n)
+          Q[thread][n] = pmo->q[pmo->mode_p[n]*l_range + l1-pmo->l_min]
+                       * pmo->q[pmo->mode_r[n]*l_range + l2-pmo->l_min]
+                       * pmo->q[pmo->mode_s[n]*l_range + l3-pmo->l_min];
+
+        /* Scalar products between the modes; we only need the lower triangle */
+        for (int n=0; n < n_modes; ++n)
+          for (int m=0; m <= n; ++m)
+            gamma[thread][n*n_modes + m] += Q[thread][n]*Q[thread][m];
+
+        /* Projection of the rescaled bispectra on the modes */
+        double weight = pow ((double)l1*l2*l3, 4/3.);
+
+        for (int index_b=0; index_b < n_bispectra; ++index_b) {
+
+          int index_xyz = index_b%n_fields;
+          int X = index_xyz/(pbi->bf_size*pbi->bf_size);
+          int Y = (index_xyz/pbi->bf_size)%pbi->bf_size;
+          int Z = index_xyz%pbi->bf_size;
+
+          double S = weight * pbi->bispectra[index_bt_of_b[index_b]][X][Y][Z][index_l1_l2_l3];
+
+          for (int n=0; n < n_modes; ++n)
+            beta[thread][index_b*n_modes + n] += Q[thread][n]*S;
+
+          norm[thread][index_b] += S*S;
+        }
+
+        n_configurations[thread]++;
+
+      } // end of for(index_l3)
+    } // end of for(index_l2)
+  } // end of for(index_l1)
+
+  /* Sum the contributions from the different threads into those of the first thread */
+  for (int thread=1; thread < number_of_threads; ++thread) {
+    for (int i=0; i < n_modes*n_modes; ++i)
+      gamma[0][i] += gamma[thread][i];
+    for (int i=0; i < n_bispectra*n_modes; ++i)
+      beta[0][i] += beta[thread][i];
+    for (int i=0; i < n_bispectra; ++i)
+      norm[0][i] += norm[thread][i];
+    n_configurations[0] += n_configurations[thread];
+  }
+
+  class_test (n_configurations[0] < n_modes,
+    pmo->error_message,
+    "cannot fit %d modes with %ld (l1,l2,l3) configurations; reduce modal_max_order or sample more l",
+    n_modes, n_configurations[0]);
+
+
+  // ====================================================================================
+  // =                                 Solve for the modes                              =
+  // ====================================================================================
+
+  /* Cholesky decomposition of gamma, in place in its lower triangle */
+  double * L = gamma[0];
+
+  /* The modes are far from orthogonal on the (l1>=l2>=l3) domain, and for large degrees some of
+  them become numerically degenerate with the previous ones on the l-grid. We drop them from the
+  fit by zeroing their column in L, which is equivalent to decomposing the scalar products of the
+  remaining modes only. */
+  short * is_dropped;
+  class_calloc (is_dropped, n_modes, sizeof(short), pmo->error_message);
+  pmo->n_dropped_modes = 0;
+
+  for (int j=0; j < n_modes; ++j) {
+
+    double diagonal = L[j*n_modes + j];
+    for (int k=0; k < j; ++k)
+      diagonal -= L[j*n_modes + k]*L[j*n_modes + k];
+
+    if (diagonal <= _MODES_PIVOT_TOLERANCE_*L[j*n_modes + j]) {
+      is_dropped[j] = _TRUE_;
+      pmo->n_dropped_modes++;
+      L[j*n_modes + j] = 1;
+      for (int i=j+1; i < n_modes; ++i)
+        L[i*n_modes + j] = 0;
+      continue;
+    }
+
+    L[j*n_modes + j] = sqrt (diagonal);
+
+    for (int i=j+1; i < n_modes; ++i) {
+      double sum = L[i*n_modes + j];
+      for (int k=0; k < j; ++k)
+        sum -= L[i*n_modes + k]*L[j*n_modes + k];
+      L[i*n_modes + j] = sum/L[j*n_modes + j];
+    }
+  }
+
+  if ((pmo->modes_verbose > 0) && (pmo->n_dropped_modes > 0))
+    printf (" -> dropped %d of %d modes that are degenerate on the l-grid\n",
+      pmo->n_dropped_modes, n_modes);
+
+  /* Allocate the coefficients and the residuals */
+  class_calloc (pmo->coefficients, pbi->bt_size, sizeof(double *), pmo->error_message);
+  class_calloc (pmo->residual, pbi->bt_size, sizeof(double *), pmo->error_message);
+
   for (int index_bt = 0; index_bt < pbi->bt_size; ++index_bt) {
+    if (pbi->bispectrum_type[index_bt] == intrinsic_bispectrum) {
+      class_calloc (pmo->coefficients[index_bt], n_fields*n_modes, sizeof(double), pmo->error_message);
+      class_calloc (pmo->residual[index_bt], n_fields*(N_max+1), sizeof(double), pmo->error_message);
+    }
+  }
 
-    if (pbi->bispectrum_type[index_bt] != intrinsic_bispectrum)
+  for (int index_b=0; index_b < n_bispectra; ++index_b) {
+
+    int index_bt = index_bt_of_b[index_b];
+    int index_xyz = index_b%n_fields;
+    double * y = beta[0] + index_b*n_modes;
+    double * alpha = pmo->coefficients[index_bt] + index_xyz*n_modes;
+    double * residual = pmo->residual[index_bt] + index_xyz*(N_max+1);
+
+    /* Coefficients in the orthonormal basis, y = L^-1 * beta */
+    for (int i=0; i < n_modes; ++i) {
+      if (is_dropped[i] == _TRUE_) {
+        y[i] = 0;
+        continue;
+      }
+      for (int k=0; k < i; ++k)
+        y[i] -= L[i*n_modes + k]*y[k];
+      y[i] /= L[i*n_modes + i];
+    }
+
+    /* Residual of the expansion truncated at each total degree */
+    double sum_y2 = 0;
+
+    for (int N=0, n=0; N <= N_max; ++N) {
+      for (; n <= last_mode_of_order[N]; ++n)
+        sum_y2 += y[n]*y[n];
+      if (norm[0][index_b] > 0)
+        residual[N] = sqrt (MAX (0, 1 - sum_y2/norm[0][index_b]));
+    }
+
+    /* Coefficients of the separable modes, alpha = L^-T * y */
+    for (int i=n_modes-1; i >= 0; --i) {
+      alpha[i] = y[i];
+      if (is_dropped[i] == _TRUE_)
+        continue;
+      for (int k=i+1; k < n_modes; ++k)
+        alpha[i] -= L[k*n_modes + i]*alpha[k];
+      alpha[i] /= L[i*n_modes + i];
+    }
+
+    /* Report on the convergence of the expansion */
+    if (pmo->modes_verbose > 0) {
+      int X = index_xyz/(pbi->bf_size*pbi->bf_size);
+      int Y = (index_xyz/pbi->bf_size)%pbi->bf_size;
+      int Z = index_xyz%pbi->bf_size;
+      printf (" -> %s_%s: relative residual %g with %d modes",
+        pbi->bt_labels[index_bt], pbi->bfff_labels[X][Y][Z], residual[N_max], n_modes);
+      if (pmo->modes_verbose > 1) {
+        printf (" (by degree:");
+        for (int N=0; N <= N_max; ++N)
+          printf (" %.3g", residual[N]);
+        printf (")");
+      }
+      printf ("\n");
+    }
+
+  } // end of for(index_b)
+
+  if (pmo->modes_verbose > 1)
+    printf (" -> fitted %d modes of degree up to %d on %ld (l1,l2,l3) configurations\n",
+      n_modes, N_max, n_configurations[0]);
+
+  for (int thread=0; thread < number_of_threads; ++thread) {
+    free (gamma[thread]);
+    free (beta[thread]);
+    free (norm[thread]);
+    free (Q[thread]);
+  }
+  free (gamma);
+  free (beta);
+  free (norm);
+  free (Q);
+  free (n_configurations);
+  free (is_dropped);
+
+  /* Store the coefficients together with the bispectra */
+  if (ppr->store_bispectra_to_disk == _TRUE_)
+    class_call (bispectra2_modes_store (ppr, pbi, pmo),
+      pmo->error_message,
+      pmo->error_message);
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Evaluate the modal expansion of the intrinsic bispectrum b^XYZ(l1,l2,l3), with l1, l2 and l3
+ * in [pmo->l_min,pmo->l_max]. The cost is proportional to the number of modes.
+ *
+ * The expansion is fitted only on the l1>=l2>=l3 configurations, and it is not symmetric
+ * under the exchange of the l's. For any other ordering we use the symmetry of the
+ * bispectrum under the simultaneous permutation of (l1,l2,l3) and (X,Y,Z), and evaluate
+ * the expansion on the sorted multipoles.
+ */
+int bispectra2_modes_bispectrum (
+    struct bispectra_modes * pmo,
+    int index_bt,
+    int X,
+    int Y,
+    int Z,
+    int l1,
+    int l2,
+    int l3,
+    double * result
+    )
+{
+
+  class_test (pmo->has_modes == _FALSE_,
+    pmo->error_message,
+    "the modal expansion was not computed; set modal_max_order > 0");
+
+  class_test ((index_bt < 0) || (index_bt >= pmo->bt_size) || (pmo->coefficients[index_bt] == NULL),
+    pmo->error_message,
+    "index_bt=%d is not an intrinsic bispectrum", index_bt);
+
+  class_test ((MIN(l1,MIN(l2,l3)) < pmo->l_min) || (MAX(l1,MAX(l2,l3)) > pmo->l_max),
+    pmo->error_message,
+    "(l1,l2,l3)=(%d,%d,%d) outside the range of the expansion [%d,%d]",
+    l1, l2, l3, pmo->l_min, pmo->l_max);
+
+  /* Sort the multipoles so that l[0]>=l[1]>=l[2], permuting the fields alongside */
+  int l[3] = {l1, l2, l3};
+  int field[3] = {X, Y, Z};
+
+  for (int i=0; i < 2; ++i) {
+    for (int j=0; j < 2-i; ++j) {
+      if (l[j] < l[j+1]) {
+        int temp = l[j]; l[j] = l[j+1]; l[j+1] = temp;
+        temp = field[j]; field[j] = field[j+1]; field[j+1] = temp;
+      }
+    }
+  }
+
+  int l_range = pmo->l_max - pmo->l_min + 1;
+  double * alpha = pmo->coefficients[index_bt]
+    + ((field[0]*pmo->bf_size+field[1])*pmo->bf_size+field[2])*pmo->n_modes;
+  double S = 0;
+
+  for (int n=0; n < pmo->n_modes; ++n)
+    S += alpha[n] * pmo->q[pmo->mode_p[n]*l_range + l[0]-pmo->l_min]
+                  * pmo->q[pmo->mode_r[n]*l_range + l[1]-pmo->l_min]
+                  * pmo->q[pmo->mode_s[n]*l_range + l[2]-pmo->l_min];
+
+  /* Undo the rescaling of the bispectrum */
+  *result = S / pow ((double)l1*l2*l3, 4/3.);
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Write the coefficients of the modal expansion to the file bispectrum_modes.txt in the run
+ * directory. Each row contains the bispectrum type and fields, the degrees (p,r,s) of the mode
+ * and its coefficient.
+ */
+int bispectra2_modes_store (
+    struct precision * ppr,
+    struct bispectra * pbi,
+    struct bispectra_modes * pmo
+    )
+{
+
+  char modes_path[_FILENAMESIZE_];
+  sprintf (modes_path, "%s/bispectrum_modes.txt", ppr->data_dir);
+
+  FILE * modes_file;
+  class_open (modes_file, modes_path, "w", pmo->error_message);
+
+  fprintf (modes_file, "# Separable modal expansion of the intrinsic bispectrum:\n");
+  fprintf (modes_file, "#   (l1*l2*l3)^(4/3) * b(l1,l2,l3) = sum alpha * q_p(l1) * q_r(l2) * q_s(l3)\n");
+  fprintf (modes_file, "# where q_p is the Legendre polynomial of degree p in x = 2*log(l/l_min)/log(l_max/l_min) - 1\n");
+  fprintf (modes_file, "# l_min = %d\n", pmo->l_min);
+  fprintf (modes_file, "# l_max = %d\n", pmo->l_max);
+  fprintf (modes_file, "# max_order = %d\n", pmo->max_order);
+  fprintf (modes_file, "# %-10s %4s %4s %4s %24s\n", "bispectrum", "p", "r", "s", "alpha");
+
+  for (int index_bt = 0; index_bt < pbi->bt_size; ++index_bt) {
+
+    if (pmo->coefficients[index_bt] == NULL)
       continue;
 
-    for (int X=0; X < pbi->bf_size; ++X) {
-      for (int Y=0; Y < pbi->bf_size; ++Y) {
-        for (int Z=0; Z < pbi->bf_size; ++Z) {
+    for (int X = 0; X < pbi->bf_size; ++X) {
+      for (int Y = 0; Y < pbi->bf_size; ++Y) {
+        for (int Z = 0; Z < pbi->bf_size; ++Z) {
 
-          for (int index_l1 = 0; index_l1 < pbi->l_size; ++index_l1) {
-    
-            for (int index_l2 = 0; index_l2 <= index_l1; ++index_l2) {
+          char label[_MAX_LENGTH_LABEL_*2];
+          sprintf (label, "%s_%s", pbi->bt_labels[index_bt], pbi->bfff_labels[X][Y][Z]);
+
+          double * alpha = pmo->coefficients[index_bt] + ((X*pbi->bf_size+Y)*pbi->bf_size+Z)*pmo->n_modes;
+
+          for (int n=0; n < pmo->n_modes; ++n)
+            fprintf (modes_file, "%-12s %4d %4d %4d %24.16e\n",
+              label, pmo->mode_p[n], pmo->mode_r[n], pmo->mode_s[n], alpha[n]);
+        }
+      }
+    }
+  }
+
+  fclose (modes_file);
+
+  if (pmo->modes_verbose > 1)
+    printf (" -> wrote the coefficients of the modal expansion to '%s'\n", modes_path);
 
-              /* Determine the limits for l3, which come from the triangular inequality |l1-l2| <= l3 <= l1+l2 */
-              int index_l3_min = pbi->index_l_triangular_min[index_l1][index_l2];
-              int index_l3_max = MIN (index_l2, pbi->index_l_triangular_max[index_l1][index_l2]);
-                 
-              for (int index_l3=index_l3_min; index_l3<=index_l3_max; ++index_l3) {
-                  
-                long int index_l1_l2_l3 = pbi->index_l1_l2_l3[index_l1][index_l1-index_l2][index_l3_max-index_l3];
-              
-                /* Bolometric temperature correction (sec. 6.3.1 of http://arxiv.org/abs/1405.2280 or
-                sec. 3.2 of http://arxiv.org/abs/1401.3296) */
-                double bolometric_correction = - 3/8. * pbi->bispectra[pbi->index_bt_quadratic][X][Y][Z][index_l1_l2_l3];
-              
-                /* Redshift term correction (see sec. 6.3.1 of http://arxiv.org/abs/1405.2280 or
-                sec. 3.1 of http://arxiv.org/abs/1401.3296) */
-                double delta_tilde_correction = 0;
-                        
-                if (ppt2->use_delta_tilde_in_los == _TRUE_)
-                  delta_tilde_correction = + 4/8. * pbi->bispectra[pbi->index_bt_quadratic][X][Y][Z][index_l1_l2_l3];
-
-                /* Add the correction */
-                pbi->bispectra[index_bt][X][Y][Z][index_l1_l2_l3] += bolometric_correction + delta_tilde_correction;
-            
-                /* Debug - check against nan's */
-                // if (isnan(pbi->bispectra[index_bt][X][Y][Z][index_l1_l2_l3]))
-                //   printf ("\n### WARNING ###\nb(%d,%d,%d) = %g!!!\n\n",
-                //   pbi->l[index_l1], pbi->l[index_l2], pbi->l[index_l3],
-                //   pbi->bispectra[index_bt][X][Y][Z][index_l1_l2_l3]);
-
-              } // end of for(index_l3)
-            } // end of for(index_l2)
-          } // end of for(index_l1)
-        } // end of for(field X)
-      } // end of for(field Y)
-    } // end of for(field X) 
-  } // end of for(index_bt)
-  
   return _SUCCESS_;
-  
-} // end of bispectra2_add_quadratic_corrections
+
+}
+
+
+
+int bispectra2_modes_free (
+    struct bispectra_modes * pmo
+    )
+{
+
+  if (pmo->has_modes == _FALSE_)
+    return _SUCCESS_;
+
+  for (int index_bt = 0; index_bt < pmo->bt_size; ++index_bt) {
+    free (pmo->coefficients[index_bt]);
+    free (pmo->residual[index_bt]);
+  }
+  free (pmo->coefficients);
+  free (pmo->residual);
+
+  free (pmo->mode_p);
+  free (pmo->mode_r);
+  free (pmo->mode_s);
+  free (pmo->q);
+
+  return _SUCCESS_;
+
+}
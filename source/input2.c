@@ -375,6 +375,13 @@ int input2_init (
 
   class_read_double("perturb_sampling_late_time_boost",
     ppr2->perturb_sampling_late_time_boost);
+
+  /* Threshold for the range compression of the line of sight sources */
+  class_read_double("sources_tau_cut_song", ppr2->sources_tau_cut_song);
+
+  class_test ((ppr2->sources_tau_cut_song < 0) || (ppr2->sources_tau_cut_song >= 1),
+    errmsg,
+    "sources_tau_cut_song must be between zero and one");
     
 
   // ===========================================================================
@@ -1441,6 +1448,68 @@ int input2_init (
   /* Linear step dx where we are going to sample the j_l1(x) and J_Llm(x) */
   class_read_double("bessel_x_step_2nd_order", ppr2->bessel_x_step_song); /* obsolete */
   class_read_double("bessel_x_step_song", ppr2->bessel_x_step_song);
+
+  /* Tolerance for the adaptive sampling of j_l1(x) and J_Llm(x) */
+  class_read_double("bessel_x_tol_song", ppr2->bessel_x_tol_song);
+
+  class_test (ppr2->bessel_x_tol_song < 0,
+    errmsg,
+    "bessel_x_tol_song must be positive or zero");
+
+  /* Multipole above which the projection functions are computed in the flat-sky limit */
+  class_read_int("l_flat_sky_song", ppr2->l_flat_sky_song);
+
+  class_test (ppr2->l_flat_sky_song < 0,
+    errmsg,
+    "l_flat_sky_song must be positive or zero");
+
+  /* Memory budget for the table of j_L(k3*r) used in the bispectrum integration */
+  class_read_double("bessel_k3_cache_mb", ppr2->bessel_k3_cache_mb);
+
+  class_test (ppr2->bessel_k3_cache_mb < 0,
+    errmsg,
+    "bessel_k3_cache_mb must be positive or zero");
+
+  /* Memory budget for the intermediate arrays of the intrinsic bispectrum */
+  class_read_double("intrinsic_memory_mb", ppr2->intrinsic_memory_mb);
+
+  class_test (ppr2->intrinsic_memory_mb < 0,
+    errmsg,
+    "intrinsic_memory_mb must be positive or zero");
+
+  /* Should we just print the memory plan of the intrinsic bispectrum? */
+  class_call(parser_read_string(pfc,"intrinsic_dry_run",&string1,&flag1,errmsg),
+    errmsg,
+    errmsg);
+
+  if ((flag1 == _TRUE_) && ((strstr(string1,"y") != NULL) || (strstr(string1,"Y") != NULL)))
+    ppr2->intrinsic_dry_run = _TRUE_;
+
+  /* Adaptive sampling of the intrinsic bispectrum */
+  class_read_int("intrinsic_adaptive_stride", ppr2->intrinsic_adaptive_stride);
+  class_read_double("intrinsic_adaptive_tolerance", ppr2->intrinsic_adaptive_tolerance);
+
+  class_test (ppr2->intrinsic_adaptive_stride < 1,
+    errmsg,
+    "intrinsic_adaptive_stride must be at least 1");
+
+  class_test (ppr2->intrinsic_adaptive_tolerance <= 0,
+    errmsg,
+    "intrinsic_adaptive_tolerance must be positive");
+
+  /* Accuracy of the adaptive r-grid of the intrinsic bispectrum */
+  class_read_double("intrinsic_r_tolerance", ppr2->intrinsic_r_tolerance);
+
+  class_test (ppr2->intrinsic_r_tolerance < 0,
+    errmsg,
+    "intrinsic_r_tolerance must be positive or zero");
+
+  /* Largest degree of the modal expansion of the intrinsic bispectrum */
+  class_read_int("modal_max_order", ppr2->modal_max_order);
+
+  class_test (ppr2->modal_max_order < 0,
+    errmsg,
+    "modal_max_order must be positive or zero");
   
 
   // =========================================================================================
@@ -1526,6 +1595,36 @@ int input2_init (
         "transfer2_tau_sampling=%s not supported, choose between 'bessel', 'smart' or 'custom'.", string1);
   }
 
+  /* - method for the line of sight integral */
+  class_call(parser_read_string(pfc,"transfer2_los_method",&string1,&flag1,errmsg),
+       errmsg,
+       errmsg);
+
+  if (flag1 == _TRUE_) {
+
+    if (strstr(string1,"scalar") != NULL)
+      ptr2->los_method = scalar_los_method;
+
+    else if (strstr(string1,"matrix") != NULL)
+      ptr2->los_method = matrix_los_method;
+
+    else if (strstr(string1,"filon") != NULL)
+      ptr2->los_method = filon_los_method;
+    
+    else
+      class_stop(errmsg,
+        "transfer2_los_method=%s not supported, choose between 'scalar', 'matrix' and 'filon'.", string1);
+  }
+
+  /* The Filon quadrature needs the integrals of the projection functions in x */
+  if (ptr2->los_method == filon_los_method)
+    pbs2->has_J_moments = _TRUE_;
+
+  /* The flat-sky limit uses the tables of j_l(x), which do not include the integrals in x */
+  class_test ((ptr2->los_method == filon_los_method) && (ppr2->l_flat_sky_song > 0),
+    errmsg,
+    "the flat-sky limit (l_flat_sky_song>0) is not compatible with transfer2_los_method=filon");
+
   /* Specify the density for the time sampling of the transfer function integral. Used only
   if If transfer2_tau_sampling=smart. Older versions of SONG used the parameter tau_step_trans_song,
   which is related to the new one by a 2*pi factor. */
@@ -1645,6 +1744,7 @@ int input2_init (
     ppr2->store_transfers_to_disk = _TRUE_;
 
   sprintf(ptr2->transfers_dir, "%s/transfers", ppr->data_dir);
+  sprintf(ptr2->transfers_status_path, "%s/transfers_status.txt", ptr2->transfers_dir);
 
   /* If we are not loading from disk, just create the transfer directory */
   if ((ppr2->store_transfers_to_disk == _TRUE_) && (ppr->load_run == _FALSE_)) {
@@ -1665,6 +1765,33 @@ int input2_init (
       ppr2->load_transfers_from_disk = _TRUE_;
       if (ptr2->transfer2_verbose > 1)
         printf (" -> found transfer functions folder in run directory.\n");
+
+      /* If the stored transfer functions do not reach the l_max requested now, compute
+      only the missing ones and add them to the folder. The largest stored l is read from
+      the status file; runs without it can only be loaded as they are. */
+      FILE * status_file = fopen (ptr2->transfers_status_path, "r");
+
+      if (status_file != NULL) {
+
+        int l_max_stored;
+        class_call (transfer2_status_file_l_max (status_file, &l_max_stored),
+          errmsg,
+          errmsg);
+        fclose (status_file);
+
+        class_test (l_max_stored < 0,
+          errmsg,
+          "could not read l_max from '%s'", ptr2->transfers_status_path);
+
+        if (pbs->l_max > l_max_stored) {
+          ppr2->store_transfers_to_disk = _TRUE_;
+          ppr2->load_transfers_from_disk = _FALSE_;
+          ppr2->extend_transfers_on_disk = _TRUE_;
+          if (ptr2->transfer2_verbose > 1)
+            printf (" -> stored transfer functions reach l=%d; will compute those up to l=%d\n",
+              l_max_stored, pbs->l_max);
+        }
+      }
     }
     /* Otherwise, create it */
     else if (ppr2->store_transfers_to_disk == _TRUE_) {
@@ -1680,16 +1807,64 @@ int input2_init (
     }
   }
 
-  /* Create/open the status file. The 'a+' mode means that if the file does not exist it will be created,
-  but if it exist it won't be erased (append mode) */
-  // if (ppr2->store_transfers_to_disk == _TRUE_) {
-  //   sprintf(ptr2->transfers_status_path, "%s/transfers_status_file.txt", ppr->data_dir);
-  //   class_open(ptr2->transfers_status_file, ptr2->transfers_status_path, "a+", errmsg);
-  // }
-
   class_test ((ppr2->store_transfers_to_disk == _TRUE_) && (ppr2->load_transfers_from_disk == _TRUE_),
     errmsg,
     "cannot load and save transfers at the same time!");
+
+  /* Layout of the transfer functions in memory and on disk. When loading the transfers
+  from a run directory, this must match the layout used to store them. */
+  class_call(parser_read_string(pfc,"transfers_layout",&string1,&flag1,errmsg),
+       errmsg,
+       errmsg);
+
+  if (flag1 == _TRUE_) {
+
+    if (strstr(string1,"type") != NULL)
+      ptr2->transfers_layout = type_transfers_layout;
+
+    else if (strstr(string1,"tile") != NULL)
+      ptr2->transfers_layout = tile_transfers_layout;
+
+    else
+      class_stop(errmsg,
+        "transfers_layout=%s not supported, choose between 'types' and 'tiles'.", string1);
+  }
+
+
+  // ----------------------------------------------------------------------------------------
+  // -                         Disk storage of geometrical factors                          -
+  // ----------------------------------------------------------------------------------------
+
+  /* Store to disk the 3j symbols needed by the intrinsic bispectrum? The file is also read
+  when loading a run directory, and it is reused only if it was computed for the same l and
+  m lists (see bispectra2_geometrical_factors_cache_init) */
+  class_call(parser_read_string(pfc,"store_geometrical_factors",&(string1),&(flag1),errmsg),
+      errmsg,
+      errmsg);
+      
+  if ((flag1 == _TRUE_) && ((strstr(string1,"y") != NULL) || (strstr(string1,"Y") != NULL)))
+    ppr2->store_geometrical_factors = _TRUE_;
+
+  sprintf(ppr2->geometrical_factors_path, "%s/geometrical_factors.dat", ppr->data_dir);
+
+  /* The file lives in the run directory, which exists only if we are storing or loading a run */
+  class_test ((ppr2->store_geometrical_factors == _TRUE_) && (ppr->store_run == _FALSE_) && (ppr->load_run == _FALSE_),
+    errmsg,
+    "store_geometrical_factors=yes needs a run directory; set store_run=yes or load a run");
+
+  /* Read the intrinsic bispectra already computed in the run directory, and compute only the
+  field combinations (TTE, EEE...) that are missing there? */
+  class_call(parser_read_string(pfc,"intrinsic_incremental",&(string1),&(flag1),errmsg),
+      errmsg,
+      errmsg);
+
+  if ((flag1 == _TRUE_) && ((strstr(string1,"y") != NULL) || (strstr(string1,"Y") != NULL)))
+    ppr2->intrinsic_incremental = _TRUE_;
+
+  /* The blocks file lives in the run directory, too */
+  class_test ((ppr2->intrinsic_incremental == _TRUE_) && (ppr->store_run == _FALSE_) && (ppr->load_run == _FALSE_),
+    errmsg,
+    "intrinsic_incremental=yes needs a run directory; set store_run=yes or load a run");
     
 
   // =============================================================================================
@@ -1949,6 +2124,14 @@ int input2_init (
       errmsg,
       "careful, your choice of parity is wrong!");
   }
+
+  /* For m>0, the bispectrum vanishes for odd l1+l2+l3, so that it cannot be interpolated in l
+  unless the l-grid has a single parity */
+  class_test ((ppr2->intrinsic_adaptive_stride > 1) && (pbi->has_intrinsic == _TRUE_) && (ppr2->m_max_song > 0)
+    && (ppr->compute_only_even_ls == _FALSE_) && (ppr->compute_only_odd_ls == _FALSE_),
+    errmsg,
+    "the adaptive l-sampling of the intrinsic bispectrum (intrinsic_adaptive_stride>1) needs a grid of only even or\
+ only odd l's (compute_only_even_ls or compute_only_odd_ls) when m_max_song>0");
   
   
   // ====================================================================================
@@ -1999,6 +2182,7 @@ int input2_init (
 
   /* Copy the step size in xx to the bessel2 structure */
   pbs2->xx_step = ppr2->bessel_x_step_song;
+  pbs2->x_tol = ppr2->bessel_x_tol_song;
 
   /* Extend pbs2->xx_max to avoid potential out-of-bounds errors in the interpolation
   of J_Llm(x) */
@@ -2196,6 +2380,7 @@ int input2_default_params (
 
   pbs2->bessels2_verbose = 0;
   pbs2->extend_l1_using_m = _FALSE_;
+  pbs2->has_J_moments = _FALSE_;
 
   
   // ============================================================
@@ -2205,6 +2390,8 @@ int input2_default_params (
   ptr2->transfer2_verbose = 0;
   ptr2->k_sampling = class_transfer2_k3_sampling;
   ptr2->tau_sampling = sources_tau_sampling;
+  ptr2->los_method = scalar_los_method;
+  ptr2->transfers_layout = type_transfers_layout;
   ptr2->stop_at_transfers2 = _FALSE_;
 
 
@@ -2277,6 +2464,7 @@ int input2_default_precision ( struct precision2 * ppr2 ) {
   ppr2->custom_tau_start_evolution = 0;
   ppr2->perturb_sampling_stepsize_song = 0.4;
   ppr2->perturb_sampling_late_time_boost = 1;
+  ppr2->sources_tau_cut_song = 0;
   ppr2->start_small_k_at_tau_c_over_tau_h_song = 0.0015;  /* decrease to start earlier in time */
   ppr2->start_large_k_at_tau_h_over_tau_k_song = 0.07;    /* decrease to start earlier in time */
 
@@ -2321,6 +2509,14 @@ int input2_default_precision ( struct precision2 * ppr2 ) {
   ppr2->bessel_j_cut_song = 1e-12;
   ppr2->bessel_J_cut_song = 1e-6;
   ppr2->bessel_x_step_song = 0.2;
+  ppr2->bessel_x_tol_song = 0;
+  ppr2->l_flat_sky_song = 0;
+  ppr2->bessel_k3_cache_mb = 512;
+  ppr2->intrinsic_memory_mb = 0;
+  ppr2->intrinsic_adaptive_stride = 1;
+  ppr2->intrinsic_adaptive_tolerance = 1e-3;
+  ppr2->intrinsic_r_tolerance = 0;
+  ppr2->modal_max_order = 0;
 
 
 
@@ -2341,6 +2537,10 @@ int input2_default_precision ( struct precision2 * ppr2 ) {
   ppr2->load_sources_from_disk = _FALSE_;
   ppr2->store_transfers_to_disk = _FALSE_;
   ppr2->load_transfers_from_disk = _FALSE_;
+  ppr2->extend_transfers_on_disk = _FALSE_;
+  ppr2->intrinsic_dry_run = _FALSE_;
+  ppr2->store_geometrical_factors = _FALSE_;
+  ppr2->intrinsic_incremental = _FALSE_;
 
   return _SUCCESS_;
 
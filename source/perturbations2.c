@@ -333,6 +333,18 @@ int perturb2_init (
     } // for k2
 
 
+    /* Drop the rows in time where the sources are negligible, before they are
+    stored to disk or passed to the transfer module */
+
+    if (ppt2->compress_sources == _TRUE_)
+      class_call_parallel (perturb2_compress_k1_level (
+                             ppr2,
+                             ppt2,
+                             index_k1),
+        ppt2->error_message,
+        ppt2->error_message);
+
+
     /* Dump to file the source function for the considered value of index_k1 and
     free the associated memory, if requested. The next time we'll need the source
     function, we shall load it from disk. Note that this kind of output is meant
@@ -371,6 +383,14 @@ int perturb2_init (
 
   if (ppt2->perturbations2_verbose > 1)
     printf(" -> filled ppt2->sources with %ld values\n", ppt2->count_memorised_sources);
+
+  if ((ppt2->perturbations2_verbose > 1) && (ppt2->compress_sources == _TRUE_)) {
+    long int count_stored = ppt2->count_allocated_sources - ppt2->count_compressed_sources;
+    printf(" -> range compression kept %ld values (%g MB) out of %ld (%g MB), %.3g%% of the full array\n",
+      count_stored, count_stored*sizeof(song_storage)/1e6,
+      ppt2->count_allocated_sources, ppt2->count_allocated_sources*sizeof(song_storage)/1e6,
+      100.*count_stored/MAX(1,ppt2->count_allocated_sources));
+  }
     
 
 
@@ -476,16 +496,23 @@ int perturb2_allocate_k1_level(
 
     class_alloc (
       ppt2->sources[index_type][index_k1],
-      (index_k1+1) * sizeof(double *),
+      (index_k1+1) * sizeof(song_storage *),
       ppt2->error_message);
 
+    class_alloc (ppt2->sources_tau_min[index_type][index_k1], (index_k1+1) * sizeof(int), ppt2->error_message);
+    class_alloc (ppt2->sources_tau_size[index_type][index_k1], (index_k1+1) * sizeof(int), ppt2->error_message);
+
     for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
 
+      /* All the rows in time are allocated; perturb2_compress_k1_level() might drop some of them later */
+      ppt2->sources_tau_min[index_type][index_k1][index_k2] = 0;
+      ppt2->sources_tau_size[index_type][index_k1][index_k2] = ppt2->tau_size;
+
       /* Allocate k3-tau level. Use calloc as we rely on the array to be initialised to zero. */
       class_calloc (
         ppt2->sources[index_type][index_k1][index_k2],
         ppt2->tau_size*ppt2->k3_size[index_k1][index_k2],
-        sizeof(double),
+        sizeof(song_storage),
         ppt2->error_message);
     
       #pragma omp atomic
@@ -497,8 +524,8 @@ int perturb2_allocate_k1_level(
 
   /* Print some debug information on memory consumption */
   if (ppt2->perturbations2_verbose > 2)
-    printf(" -> allocated ~ %.3g MB (%ld doubles) for index_k1=%d; the size of ppt2->sources so far is ~ %.3g MB;\n",
-      count*sizeof(double)/1e6, count, index_k1, ppt2->count_allocated_sources*sizeof(double)/1e6);
+    printf(" -> allocated ~ %.3g MB (%ld %ss) for index_k1=%d; the size of ppt2->sources so far is ~ %.3g MB;\n",
+      count*sizeof(song_storage)/1e6, count, _SONG_STORAGE_TYPE_, index_k1, ppt2->count_allocated_sources*sizeof(song_storage)/1e6);
 
   /* We succesfully allocated the k1 level of ppt2->sources */
   ppt2->has_allocated_sources[index_k1] = _TRUE_;
@@ -533,6 +560,34 @@ int perturb2_load_sources_from_disk(
     ppt2->sources_paths[index_k1],
     "rb", ppt2->error_message);
 
+  /* Check the format tag and the floating point type of the file. The files stored by
+  older versions of SONG have no tag, and their first bytes are already sources values. */
+  char tag[sizeof(_SOURCES_FILE_TAG_)];
+  int storage_size;
+
+  short has_tag = (fread (tag, sizeof(char), sizeof(_SOURCES_FILE_TAG_), ppt2->sources_files[index_k1])
+    == sizeof(_SOURCES_FILE_TAG_)) && (memcmp (tag, _SOURCES_FILE_TAG_, sizeof(_SOURCES_FILE_TAG_)) == 0);
+
+  if (has_tag == _FALSE_)
+    fclose (ppt2->sources_files[index_k1]);
+
+  class_test (has_tag == _FALSE_,
+    ppt2->error_message,
+    "'%s' does not start with the format tag '%s'; it was stored by an older version of SONG, whose\
+ sources files cannot be read anymore. Compute the sources again in a new run directory.",
+    ppt2->sources_paths[index_k1], _SOURCES_FILE_TAG_);
+
+  short has_storage = (fread (&storage_size, sizeof(int), 1, ppt2->sources_files[index_k1]) == 1);
+
+  if ((has_storage == _FALSE_) || (storage_size != sizeof(song_storage)))
+    fclose (ppt2->sources_files[index_k1]);
+
+  class_test ((has_storage == _FALSE_) || (storage_size != sizeof(song_storage)),
+    ppt2->error_message,
+    "'%s' stores values of %d bytes, while this build uses %s (%d bytes); was it stored by a build of SONG\
+ with a different SONG_FLOAT_STORAGE flag?",
+    ppt2->sources_paths[index_k1], has_storage ? storage_size : -1, _SONG_STORAGE_TYPE_, (int)sizeof(song_storage));
+
   for (int index_tp2 = 0; index_tp2 < ppt2->tp2_size; ++index_tp2) {
   
     for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
@@ -554,6 +609,13 @@ int perturb2_load_sources_from_disk(
     }
     
   }
+
+  /* The file should have been read completely. The floating point type was checked above,
+  so if not, it was probably written with different parameters. */
+  class_test (fgetc (ppt2->sources_files[index_k1]) != EOF,
+    ppt2->error_message,
+    "'%s' is longer than expected for values of type %s; was it stored with different parameters?",
+    ppt2->sources_paths[index_k1], _SONG_STORAGE_TYPE_);
   
   /* Close file */
   fclose(ppt2->sources_files[index_k1]);
@@ -570,6 +632,12 @@ int perturb2_load_sources_from_disk(
  * This function will load the k3 and tau levels of the source function from disk
  * into ppt2->sources, for fixed indices of type (index_tp2), k1 (index_k1) and
  * k2 (index_k2).
+ *
+ * On disk, the block is preceded by the range of stored time rows (see
+ * perturb2_store_sources_k3_tau()). If ppt2->compress_sources is true, the block
+ * allocated by perturb2_allocate_k1_level() is replaced by one with just the stored
+ * rows; otherwise, the rows are copied in the full block, where the missing ones
+ * are already zero.
  */
 
 int perturb2_load_sources_k3_tau(
@@ -584,13 +652,52 @@ int perturb2_load_sources_k3_tau(
    
   int k3_size = ppt2->k3_size[index_k1][index_k2];
 
-  int n_to_read = ppt2->tau_size*k3_size;
+  /* Read the range of stored time rows */
+  int tau_range[2];
+
+  class_test (fread (tau_range, sizeof(int), 2, input_stream) != 2,
+    ppt2->error_message,
+    "Error reading the time range from %s", filepath);
+
+  int tau_min = tau_range[0];
+  int tau_size = tau_range[1];
+
+  class_test ((tau_min < 0) || (tau_size < 0) || (tau_min + tau_size > ppt2->tau_size),
+    ppt2->error_message,
+    "%s has an invalid time range (tau_min=%d, tau_size=%d) for tau_size=%d; was it stored with\
+ different parameters?",
+    filepath, tau_min, tau_size, ppt2->tau_size);
+
+  song_storage * block = ppt2->sources[index_tp2][index_k1][index_k2];
+
+  if (ppt2->compress_sources == _TRUE_) {
+
+    if (tau_size < ppt2->tau_size) {
+      free (block);
+      block = NULL;
+      if (tau_size*k3_size > 0)
+        class_alloc (block, tau_size*k3_size*sizeof(song_storage), ppt2->error_message);
+      ppt2->sources[index_tp2][index_k1][index_k2] = block;
+      ppt2->sources_tau_min[index_tp2][index_k1][index_k2] = tau_min;
+      ppt2->sources_tau_size[index_tp2][index_k1][index_k2] = tau_size;
+      #pragma omp atomic
+      ppt2->count_compressed_sources += (long int)(ppt2->tau_size-tau_size)*k3_size;
+    }
+  }
+  else {
+    block += tau_min*k3_size;
+  }
+
+  int n_to_read = tau_size*k3_size;
 
-  int n_read = fread(
-                 ppt2->sources[index_tp2][index_k1][index_k2],
-                 sizeof(double),
-                 n_to_read,
-                 input_stream);
+  int n_read = 0;
+  
+  if (n_to_read > 0)
+    n_read = fread(
+               block,
+               sizeof(song_storage),
+               n_to_read,
+               input_stream);
  
   class_test(n_read != n_to_read,
     ppt2->error_message,
@@ -624,6 +731,8 @@ int perturb2_free_k1_level(
         free(ppt2->sources[index_type][index_k1][index_k2]);
   
     free(ppt2->sources[index_type][index_k1]);
+    free(ppt2->sources_tau_min[index_type][index_k1]);
+    free(ppt2->sources_tau_size[index_type][index_k1]);
   
   } // end of for (index_type)
 
@@ -637,6 +746,95 @@ int perturb2_free_k1_level(
 
 
 
+/**
+ * Drop the rows in time where the line of sight sources are negligible, for all
+ * types and k2 values of the k1 level of ppt2->sources.
+ *
+ * The sources are usually zero or tiny over large parts of the time sampling, for
+ * example before recombination, where the visibility function vanishes. For each
+ * (k3,tau) block, we find the first and last rows in time where at least one value
+ * is larger than ppr2->sources_tau_cut_song times the largest value of the block,
+ * and we replace the block with a smaller one containing only the rows in between.
+ * Their range is stored in ppt2->sources_tau_min and ppt2->sources_tau_size; the
+ * dropped rows are treated as zero by the transfer module.
+ *
+ * With ppr2->sources_tau_cut_song=0, only the rows that vanish exactly are dropped,
+ * so that the compression does not change the results.
+ */
+int perturb2_compress_k1_level(
+     struct precision2 * ppr2,
+     struct perturbs2 * ppt2,
+     int index_k1
+     )
+{
+
+  long int count_compressed = 0;
+
+  for (int index_type = 0; index_type < ppt2->tp2_size; index_type++) {
+
+    for (int index_k2 = 0; index_k2 <= index_k1; index_k2++) {
+
+      int k3_size = ppt2->k3_size[index_k1][index_k2];
+      song_storage * block = ppt2->sources[index_type][index_k1][index_k2];
+
+      /* Skip blocks that were already compressed */
+      if (ppt2->sources_tau_size[index_type][index_k1][index_k2] != ppt2->tau_size)
+        continue;
+
+      /* Threshold below which the source is considered negligible */
+      double source_max = 0;
+      for (long int i=0; i < (long int)ppt2->tau_size*k3_size; ++i)
+        source_max = MAX (source_max, fabs(block[i]));
+
+      double threshold = ppr2->sources_tau_cut_song * source_max;
+
+      /* Find the first and last non-negligible rows */
+      int tau_first = ppt2->tau_size;
+      int tau_last = -1;
+
+      for (int index_tau = 0; index_tau < ppt2->tau_size; ++index_tau) {
+        for (int index_k3 = 0; index_k3 < k3_size; ++index_k3) {
+          if (fabs(block[index_tau*k3_size + index_k3]) > threshold) {
+            tau_first = MIN (tau_first, index_tau);
+            tau_last = index_tau;
+            break;
+          }
+        }
+      }
+
+      int tau_size = MAX (0, tau_last - tau_first + 1);
+
+      if (tau_size == ppt2->tau_size)
+        continue;
+
+      /* Move the non-negligible rows to a smaller block */
+      song_storage * compressed = NULL;
+
+      if (tau_size*k3_size > 0) {
+        class_alloc (compressed, tau_size*k3_size*sizeof(song_storage), ppt2->error_message);
+        memcpy (compressed, block + tau_first*k3_size, tau_size*k3_size*sizeof(song_storage));
+      }
+
+      free (block);
+      ppt2->sources[index_type][index_k1][index_k2] = compressed;
+      ppt2->sources_tau_min[index_type][index_k1][index_k2] = (tau_size > 0 ? tau_first : 0);
+      ppt2->sources_tau_size[index_type][index_k1][index_k2] = tau_size;
+
+      count_compressed += (long int)(ppt2->tau_size - tau_size)*k3_size;
+
+    } // for k2
+
+  } // for type
+
+  #pragma omp atomic
+  ppt2->count_compressed_sources += count_compressed;
+
+  return _SUCCESS_;
+
+}
+
+
+
 
 
 
@@ -989,8 +1187,10 @@ int perturb2_indices_of_perturbs(
     printf ("\n");
   }  
   
-  /* Allocate the first level of the ppt2->sources array */
-  class_alloc (ppt2->sources, ppt2->tp2_size * sizeof(double ***), ppt2->error_message);
+  /* Allocate the first level of the ppt2->sources array, and of the arrays with the stored time range */
+  class_alloc (ppt2->sources, ppt2->tp2_size * sizeof(song_storage ***), ppt2->error_message);
+  class_alloc (ppt2->sources_tau_min, ppt2->tp2_size * sizeof(int **), ppt2->error_message);
+  class_alloc (ppt2->sources_tau_size, ppt2->tp2_size * sizeof(int **), ppt2->error_message);
 
 
   // --------------------------------------------------------------------
@@ -3093,8 +3293,16 @@ int perturb2_timesampling_for_sources (
   ppt2->count_allocated_sources = 0;
   
   /* Allocate k1 level.  The further levels (k2, k3 and time) will be allocated when needed */
-  for (int index_type = 0; index_type < ppt2->tp2_size; index_type++)
-    class_alloc (ppt2->sources[index_type], ppt2->k_size * sizeof(double **), ppt2->error_message);
+  for (int index_type = 0; index_type < ppt2->tp2_size; index_type++) {
+    class_alloc (ppt2->sources[index_type], ppt2->k_size * sizeof(song_storage **), ppt2->error_message);
+    class_alloc (ppt2->sources_tau_min[index_type], ppt2->k_size * sizeof(int *), ppt2->error_message);
+    class_alloc (ppt2->sources_tau_size[index_type], ppt2->k_size * sizeof(int *), ppt2->error_message);
+  }
+
+  /* The sources are compressed in time once they are computed, unless they are going
+  to be written to the binary output files, which expect the full (k3,tau) blocks */
+  ppt2->compress_sources = (ppt2->k_out_size == 0) && (ppt2->tau_out_size == 0);
+  ppt2->count_compressed_sources = 0;
   
   /* Allocate and initialize the logical array that keeps track of the memory state of ppt2->sources */
   class_calloc (ppt2->has_allocated_sources, ppt2->k_size, sizeof(short), ppt2->error_message);
@@ -7455,8 +7663,11 @@ int perturb2_free(
 
     free (ppt2->has_allocated_sources);
 
-    for (int index_type = 0; index_type < ppt2->tp2_size; index_type++)
+    for (int index_type = 0; index_type < ppt2->tp2_size; index_type++) {
       free(ppt2->sources[index_type]);
+      free(ppt2->sources_tau_min[index_type]);
+      free(ppt2->sources_tau_size[index_type]);
+    }
 
     for (int index_k1 = 0; index_k1 < k1_size; ++index_k1) {
       for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2)
@@ -7468,6 +7679,8 @@ int perturb2_free(
     }
 
     free(ppt2->sources);
+    free(ppt2->sources_tau_min);
+    free(ppt2->sources_tau_size);
     
     free(ppt2->tau_sampling);
            
@@ -14969,7 +15182,15 @@ int perturb2_output(
 
       sprintf (name, "ppt2->sources[index_tp2=%d][index_k1=%d][index_k2=%d]", index_tp2, index_k1, index_k2);
       sprintf (desc, "source function %s for all values of k3 and tau", ppt2->tp2_labels[index_tp2]);
-      class_call (binary_append_double (file, ppt2->sources[index_tp2][index_k1][index_k2], k3_tau_block_size, desc, name),
+      class_call (binary_add_block (
+                    file,
+                    ppt2->sources[index_tp2][index_k1][index_k2],
+                    k3_tau_block_size,
+                    sizeof (song_storage),
+                    desc,
+                    _SONG_STORAGE_TYPE_,
+                    name,
+                    file->n_blocks),
         file->error_message,
         ppt2->error_message);
     
@@ -15270,9 +15491,9 @@ int perturb2_output(
                         file,
                         &ppt2->sources[index_tp2][index_k1][index_k2][index_tau*k3_size],
                         k3_size,
-                        sizeof (double),
+                        sizeof (song_storage),
                         desc,
-                        "double",
+                        _SONG_STORAGE_TYPE_,
                         name,
                         index_sources),
             file->error_message,
@@ -15341,7 +15562,8 @@ int perturb2_output(
  * source function in ppt2->sources for the input value of index_k1.
  *
  * The path of the files is stored in ppt2->sources_paths[index_k1], while
- * their file reference is in ppt2->sources_files[index_k1].
+ * their file reference is in ppt2->sources_files[index_k1]. Each file starts
+ * with the format tag _SOURCES_FILE_TAG_ and the size in bytes of song_storage.
  */
 
 int perturb2_store_sources_to_disk(
@@ -15358,6 +15580,11 @@ int perturb2_store_sources_to_disk(
     ppt2->sources_paths[index_k1],
     "wb", ppt2->error_message);
 
+  /* Format tag and size of the stored values, checked by perturb2_load_sources_from_disk() */
+  int storage_size = sizeof(song_storage);
+  fwrite (_SOURCES_FILE_TAG_, sizeof(char), sizeof(_SOURCES_FILE_TAG_), ppt2->sources_files[index_k1]);
+  fwrite (&storage_size, sizeof(int), 1, ppt2->sources_files[index_k1]);
+
   /* For each type and k2, write the (k3, tau) level to file */
   for (int index_tp2 = 0; index_tp2 < ppt2->tp2_size; ++index_tp2) {
 
@@ -15406,11 +15633,19 @@ int perturb2_store_sources_k3_tau(
 
   int k3_size = ppt2->k3_size[index_k1][index_k2];
 
-  if (k3_size > 0)
+  /* Write the range of stored time rows, followed by the rows themselves */
+  int tau_range[2] = {
+    ppt2->sources_tau_min[index_tp2][index_k1][index_k2],
+    ppt2->sources_tau_size[index_tp2][index_k1][index_k2]
+  };
+
+  fwrite (tau_range, sizeof(int), 2, output_stream);
+
+  if (k3_size*tau_range[1] > 0)
     fwrite(
       ppt2->sources[index_tp2][index_k1][index_k2],
-      sizeof(double),
-      ppt2->tau_size*k3_size,
+      sizeof(song_storage),
+      tau_range[1]*k3_size,
       output_stream
       );
 
@@ -310,10 +310,6 @@ int spectra2_cls (
 
       int l = psp->l_song[index_l];
 
-      /* Generate grid for k3 integration. We do it inside the l-loop
-      to avoid race conditions */
-      double * k3_grid = malloc (ptr2->k3_size_max*sizeof(double));
-
       /* Initialise spectrum */
       double * result = &psp->cl[index_md][index_l * psp->ct_size + index_ct];
       *result = 0;
@@ -447,21 +443,7 @@ int spectra2_cls (
 
             /* Integration grid in k3 */
 
-            int dump;
-            class_call_parallel (transfer2_get_k3_list (
-                                   ppr,
-                                   ppr2,
-                                   ppt2,
-                                   pbs,
-                                   pbs2,
-                                   ptr2,
-                                   index_k1,
-                                   index_k2,
-                                   k3_grid,
-                                   &dump
-                                   ),
-              ptr2->error_message,
-              psp->error_message);
+            double * k3_grid = ptr2->k3_grid[index_k1][index_k2];
 
             int k3_size = ptr2->k_size_k1k2[index_k1][index_k2];
 
@@ -474,8 +456,8 @@ int spectra2_cls (
             Note that this transfer function has already been rescaled according to eq. 6.26
             of http://arxiv.org/abs/1405.2280 in the perturbations.c module.  */
 
-            double * transfer_1 = ptr2->transfer[index_tt_1][index_k1][index_k2];
-            double * transfer_2 = ptr2->transfer[index_tt_2][index_k1][index_k2];
+            song_storage * transfer_1 = ptr2->transfer[index_tt_1][index_k1][index_k2];
+            song_storage * transfer_2 = ptr2->transfer[index_tt_2][index_k1][index_k2];
 
             int triangular_first = 0;
             int triangular_last = 0;
@@ -576,8 +558,6 @@ int spectra2_cls (
 
       } // sum over M
     
-      free (k3_grid);
-      
       #pragma omp flush(abort)
       
     } // loop over l
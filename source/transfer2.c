@@ -27,7 +27,10 @@
  * transfer functions to disk after computing them, and then free the associated 
  * memory. To reload them from disk, use transfer2_load_transfers_from_disk().
  * To free again the memory associated to the sources, call
- * transfer2_free_type_level().
+ * transfer2_free_type_level(). When a run stored to disk is loaded with a larger
+ * l_max, only the transfer functions for the new l-values are computed; the
+ * content of the transfers directory is tracked by the status file written in
+ * transfer2_write_status_file().
  * 
  * Created by Guido W. Pettinari on 04.06.2012 based on transfer.c by the CLASS
  * team (http://class-code.net/).
@@ -156,6 +159,29 @@ int transfer2_init(
     return _SUCCESS_;
   }
 
+  /* If we are extending a previous run to larger l, we only need to compute the transfer
+  types that are not already on disk. The matrix method computes all of them at once, so
+  we solve the line of sight integral separately for each type instead. */
+
+  int tt2_size_to_compute = ptr2->tt2_size;
+
+  if (ppr2->extend_transfers_on_disk == _TRUE_) {
+
+    for (int index_tt = 0; index_tt < ptr2->tt2_size; ++index_tt)
+      if (ptr2->transfers_on_disk[index_tt] == _TRUE_)
+        --tt2_size_to_compute;
+
+    if (ptr2->transfer2_verbose > 0)
+      printf(" -> found %d transfer functions on disk, will compute the remaining %d\n",
+        ptr2->tt2_size - tt2_size_to_compute, tt2_size_to_compute);
+
+    if (ptr2->los_method == matrix_los_method) {
+      ptr2->los_method = scalar_los_method;
+      if (ptr2->transfer2_verbose > 1)
+        printf(" -> switching to the scalar line of sight method to compute only the missing types\n");
+    }
+  }
+
 
   // ==================================================================================
   // =                               Allocate workspaces                              =
@@ -182,7 +208,10 @@ int transfer2_init(
   int tau_size_max;
 
   /* In the sources time sampling, the integration grid matches the sources time sampling */
-  if (ptr2->tau_sampling == sources_tau_sampling) {
+  /* The Filon quadrature does not need extra points to follow the oscillations of the
+  projection functions, so we use the sources time sampling also in that case. */
+
+  if ((ptr2->tau_sampling == sources_tau_sampling) || (ptr2->los_method == filon_los_method)) {
     tau_size_max = ppt2->tau_size;
   }
 
@@ -206,6 +235,12 @@ int transfer2_init(
   if (ptr2->transfer2_verbose > 0)
     printf (" -> maximum number of time steps in the LOS integration = %d\n", tau_size_max);
   
+  /* Maximum number of k3 values where the sources are sampled */
+  int k3_size_max_sources = 0;
+  for (int index_k1 = 0; index_k1 < ppt2->k_size; ++index_k1)
+    for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2)
+      k3_size_max_sources = MAX (k3_size_max_sources, ppt2->k3_size[index_k1][index_k2]);
+
   /* Allocate arrays in the workspace */
   abort = _FALSE_;
   #pragma omp parallel shared(ppw,ptr2) private(thread)
@@ -221,11 +256,24 @@ int transfer2_init(
       sizeof(struct transfer2_workspace),
       ptr2->error_message);
 
-    /* Allocate the k-grid with the maximum possible number of k3-values  */
-    class_alloc_parallel(
-      ppw[thread]->k_grid,
-      ptr2->k3_size_max*sizeof(double),
-      ptr2->error_message);
+    /* Allocate the arrays that will contain the transposed sources and their second derivatives
+    with respect to k3, in view of spline interpolation. They are filled by one source type and one
+    (k1,k2) pair at a time, so we give them the size of the largest k3 grid of the sources. */
+    ppw[thread]->sources_k = NULL;
+    ppw[thread]->sources_k_spline = NULL;
+
+    if (ppr2->sources_k3_interpolation == cubic_interpolation) {
+
+      class_alloc_parallel(
+        ppw[thread]->sources_k,
+        k3_size_max_sources*ppt2->tau_size*sizeof(double),
+        ptr2->error_message);
+
+      class_alloc_parallel(
+        ppw[thread]->sources_k_spline,
+        k3_size_max_sources*ppt2->tau_size*sizeof(double),
+        ptr2->error_message);
+    }
 
     /* Allocate the integration grid array. */
     class_alloc_parallel(
@@ -247,6 +295,69 @@ int transfer2_init(
       tau_size_max*sizeof(double),
       ptr2->error_message);
     
+    /* Allocate the arrays with the position of x=k*(tau0-tau) inside the sampling of the
+    projection functions, and the relative interpolation weights (see header file) */
+    class_alloc_parallel(
+      ppw[thread]->index_x,
+      tau_size_max*sizeof(int),
+      ptr2->error_message);
+
+    class_alloc_parallel(
+      ppw[thread]->index_x_block,
+      tau_size_max*sizeof(int),
+      ptr2->error_message);
+
+    class_alloc_parallel(
+      ppw[thread]->a_x,
+      tau_size_max*(_BESSEL2_X_BLOCK_SHIFT_+1)*sizeof(double),
+      ptr2->error_message);
+
+    /* Allocate the list of L-terms of the line of sight integral, with room for both
+    the direct and mixing contributions */
+    class_alloc_parallel(
+      ppw[thread]->los_terms,
+      2*pbs2->L_size*sizeof(struct transfer2_los_term),
+      ptr2->error_message);
+
+    /* Initialise the error estimate of the Filon quadrature */
+    ppw[thread]->los_error_max = 0;
+
+    /* Initialise the statistics on the flat-sky limit */
+    ppw[thread]->flat_sky_diff2 = 0;
+    ppw[thread]->flat_sky_norm2 = 0;
+    ppw[thread]->flat_sky_time_exact = 0;
+    ppw[thread]->flat_sky_time_flat = 0;
+    ppw[thread]->flat_sky_count_overlap = 0;
+    ppw[thread]->flat_sky_count = 0;
+
+    /* The time grid will be computed in transfer2_get_time_grid() */
+    ppw[thread]->has_sources_tau_grid = _FALSE_;
+
+    /* Allocate the blocks of the projection, source and result matrices for the matrix
+    method of the line of sight integral */
+    ppw[thread]->los_projection = NULL;
+    ppw[thread]->los_sources = NULL;
+    ppw[thread]->los_result = NULL;
+    ppw[thread]->los_check = NULL;
+
+    if (ptr2->los_method == matrix_los_method) {
+
+      class_alloc_parallel(
+        ppw[thread]->los_projection,
+        ptr2->l_size*_TRANSFER2_TAU_BLOCK_*pbs2->L_size*sizeof(double),
+        ptr2->error_message);
+
+      class_alloc_parallel(
+        ppw[thread]->los_sources,
+        _TRANSFER2_TAU_BLOCK_*pbs2->L_size*2*sizeof(double),
+        ptr2->error_message);
+
+      class_alloc_parallel(
+        ppw[thread]->los_result,
+        3*ptr2->l_size*2*sizeof(double),
+        ptr2->error_message);
+    }
+
     /* Allocate index_tau_left, an array useful for the time interpolation of the sources (see header file) */
     class_alloc_parallel(
       ppw[thread]->index_tau_left,
@@ -288,15 +399,54 @@ int transfer2_init(
      __func__,number_of_threads);
   #endif
 
-  /* Array that will contain the second derivative of the sources with respect to k3,
-  in view of spline interpolation */
-  double ** sources_k_spline;
-  class_alloc (sources_k_spline, ppt2->tp2_size*sizeof(double *), ptr2->error_message);
-  
   /* Array that will contain the interpolated sources at the exact k3-values needed
-  of the intergration grid */
-  double ** interpolated_sources_in_k;
-  class_alloc (interpolated_sources_in_k, ppt2->tp2_size*sizeof(double *), ptr2->error_message);
+  of the intergration grid, for each k2 in the chunk currently being processed (see
+  below) and for each source type. The buffers are reused for all the chunks and k1
+  values, and are enlarged only when a chunk needs more space than the previous ones;
+  interpolated_sources_in_k_size keeps track of their current size. */
+  double *** interpolated_sources_in_k;
+  class_calloc (interpolated_sources_in_k, ppt2->k_size, sizeof(double **), ptr2->error_message);
+
+  long int * interpolated_sources_in_k_size;
+  class_calloc (interpolated_sources_in_k_size, ppt2->k_size, sizeof(long int), ptr2->error_message);
+
+  /* Integration grid in k3 for each k2 in the current chunk; points to ptr2->k3_grid */
+  double ** k3_grid;
+  class_alloc (k3_grid, ppt2->k_size*sizeof(double *), ptr2->error_message);
+
+  /* Coefficients for the interpolation of the sources in k3, for each k2 in the current chunk */
+  struct transfer2_k3_spline * k3_splines;
+  class_alloc (k3_splines, ppt2->k_size*sizeof(struct transfer2_k3_spline), ptr2->error_message);
+
+  /* Position of the first k3 value of each k2 in the flattened (k2,k3) loop of the
+  current chunk */
+  int * first_index_k2_k;
+  class_alloc (first_index_k2_k, (ppt2->k_size+1)*sizeof(int), ptr2->error_message);
+
+  /* Minimum number of (k2,k3) pairs to be processed in a single parallel region. For
+  small k1 and k2, the k3 grid can have fewer points than the number of threads; in
+  that case, we process several k2 values together so that all threads are busy. */
+  int chunk_k2_k_size_min = 4*number_of_threads;
+
+  /* Keep track of the time spent by the threads doing actual work, to estimate the CPU
+  utilisation of the module */
+  double time_busy = 0;
+
+  /* Time spent by the threads solving the line of sight integral, and number of
+  integrals solved, to estimate the throughput of transfer2_compute() */
+  double time_los = 0;
+  long count_los = 0;
+
+  /* Number of parallel regions opened in the main loop, and number of buffers for the
+  interpolated sources that were allocated or reused, with the time spent allocating them */
+  long int count_regions = 0;
+  long int count_buffer_allocations = 0;
+  long int count_buffer_reuses = 0;
+  double time_alloc = 0;
+
+#ifdef _OPENMP
+  double time_start = omp_get_wtime();
+#endif
   
 
 
@@ -307,11 +457,19 @@ int transfer2_init(
   /* We shall now compute the transfer function array (ptr2->transfer) by calling the
   transfer2_compute() function in a loop over its levels. The order of the loops is
   index_k1, index_k2 and index_tt2. The latter includes the transfer type (T,E,B) and
-  the multipole indices (l,m). */
+  the multipole indices (l,m). For a given k1, the (k2,k3) pairs are processed in chunks
+  of consecutive k2 values, each in a single parallel region: first we interpolate the
+  sources in k3 in parallel over the (k2,type) pairs, and then we solve the line of sight
+  integral in parallel over the (k2,k3) pairs. */
 
   if (ptr2->transfer2_verbose > 0)
     printf(" -> starting actual computation of second-order transfer functions\n");
 
+  /* With the matrix method, the transfer functions of the first (k1,k2) pair are also
+  computed with the scalar method, as a check (see transfer2_check_matrix()) */
+  short has_los_check = (ptr2->los_method == matrix_los_method);
+  double * los_check = NULL;
+
   for (int index_k1 = 0; index_k1 < ppt2->k_size; ++index_k1) {
 
     if (ptr2->transfer2_verbose > 1)
@@ -344,95 +502,96 @@ int transfer2_init(
     }
 
     /* We only need to consider those k2's that are equal to or larger than k1,
-    as the quadratic sources were symmetrised in the perturbation2.c module */
-    for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
+    as the quadratic sources were symmetrised in the perturbation2.c module. We
+    group them in chunks containing at least chunk_k2_k_size_min k3 values. */
+    int index_k2_end;
 
-      if (ptr2->transfer2_verbose > 2)
-        printf(" -> computing transfer function for (k1,k2) = (%.3g,%.3g)\n", ppt2->k[index_k1], ppt2->k[index_k2]);
+    for (int index_k2_start = 0; index_k2_start <= index_k1; index_k2_start = index_k2_end) {
 
       // -----------------------------------------------------------------------------
-      // -                        Interpolate sources in k3                          -
+      // -                           Collect the k3 grids                            -
       // -----------------------------------------------------------------------------
 
-      /* Find the integration grid in k3 for the current (k1,k2) pair */
-      int last_used_index_pt;
-      double * k_grid_temp;
-      class_alloc(k_grid_temp, ptr2->k3_size_max*sizeof(double), ptr2->error_message);
+      /* Number of (k2,k3) pairs in this chunk */
+      int chunk_k2_k_size = 0;
 
-      class_call_parallel (transfer2_get_k3_list(
-                    ppr,
-                    ppr2,
-                    ppt2,
-                    pbs,
-                    pbs2,
-                    ptr2,
-                    index_k1,
-                    index_k2,
-                    k_grid_temp,  /* output */
-                    &last_used_index_pt
-                    ),
-        ptr2->error_message,
-        ptr2->error_message);
+      for (index_k2_end = index_k2_start;
+           (index_k2_end <= index_k1) && (chunk_k2_k_size < chunk_k2_k_size_min);
+           ++index_k2_end) {
 
-      /* Copy the k3 grid in the pwb workspace. We do so in a parallel region because
-      we have as many pwb[thread] workspaces as the number of threads */
-      for (int thread=0; thread < number_of_threads; ++thread)
-        for (int index_k=0; index_k < ptr2->k_size_k1k2[index_k1][index_k2]; ++index_k)
-          ppw[thread]->k_grid[index_k] = k_grid_temp[index_k];
-      
-      /* Print some information */
-      if (ptr2->transfer2_verbose > 3)
-        printf("     * (k1,k2)=(%.3g,%.3g): the k3-grid comprises sources+transfer+left+right=%d+%d+%d+%d points from %g to %g\n",
-          ppt2->k[index_k1], ppt2->k[index_k2],
-          last_used_index_pt,
-          ptr2->k_physical_size_k1k2[index_k1][index_k2] - last_used_index_pt,
-          ptr2->k_physical_start_k1k2[index_k1][index_k2],
-          ptr2->k_size_k1k2[index_k1][index_k2]
-            - ptr2->k_physical_size_k1k2[index_k1][index_k2] - ptr2->k_physical_start_k1k2[index_k1][index_k2],
-          ppw[thread]->k_grid[0], ppw[thread]->k_grid[ptr2->k_size_k1k2[index_k1][index_k2]-1]);
+        int index_k2 = index_k2_end;
+        int index_chunk = index_k2 - index_k2_start;
 
-      free (k_grid_temp);
-      
+        if (ptr2->transfer2_verbose > 2)
+          printf(" -> computing transfer function for (k1,k2) = (%.3g,%.3g)\n", ppt2->k[index_k1], ppt2->k[index_k2]);
 
-      // -----------------------------------------------------------------------------
-      // -                          Interpolate sources in k                         -
-      // -----------------------------------------------------------------------------
+        /* Integration grid in k3 for the current (k1,k2) pair, computed in
+        transfer2_indices_of_transfers() */
+        k3_grid[index_chunk] = ptr2->k3_grid[index_k1][index_k2];
 
-      for (int index_tp=0; index_tp<ppt2->tp2_size; ++index_tp) {
-      
-        class_alloc(
-          sources_k_spline[index_tp],
-          ppt2->k3_size[index_k1][index_k2]*ppt2->tau_size*sizeof(double),
-          ptr2->error_message);
-      
-        class_alloc(
-          interpolated_sources_in_k[index_tp],
-          ptr2->k_size_k1k2[index_k1][index_k2]*ppt2->tau_size*sizeof(double),
-          ptr2->error_message);
-      
-        class_call (transfer2_interpolate_sources_in_k(
-                      ppr,
+        /* Decompose the spline system in k3 and find the position of the k3 grid in the
+        sources sampling; this is done once for all source types and times */
+        class_call (transfer2_k3_spline_init(
                       ppr2,
-                      ppt,
                       ppt2,
-                      pbs,
-                      pbs2,
                       ptr2,
                       index_k1,
                       index_k2,
-                      index_tp,
-                      ppw[0]->k_grid, /* Grid of desired k-values for integration; all ppw->[thread]->k_grid are filled with the same values */
-                      sources_k_spline[index_tp], /* Will be filled with second-order derivatives */
-                      interpolated_sources_in_k[index_tp] /* Will be filled with interpolated values in ptr2->k(k1,k2) */
+                      k3_grid[index_chunk],
+                      &k3_splines[index_chunk]
                       ),
           ptr2->error_message,
           ptr2->error_message);
-      
-      } // end of for (index_tp)
+
+        /* Make room for the sources interpolated in k3, unless the buffer used by the
+        previous chunks is large enough */
+        long int interpolated_size = (long int)ptr2->k_size_k1k2[index_k1][index_k2]*ppt2->tau_size;
+
+        if (interpolated_size > interpolated_sources_in_k_size[index_chunk]) {
+
+#ifdef _OPENMP
+          double alloc_start = omp_get_wtime();
+#endif
+
+          if (interpolated_sources_in_k[index_chunk] == NULL)
+            class_calloc (interpolated_sources_in_k[index_chunk], ppt2->tp2_size, sizeof(double *), ptr2->error_message);
+
+          for (int index_tp=0; index_tp<ppt2->tp2_size; ++index_tp) {
+            free (interpolated_sources_in_k[index_chunk][index_tp]);
+            class_alloc(
+              interpolated_sources_in_k[index_chunk][index_tp],
+              interpolated_size*sizeof(double),
+              ptr2->error_message);
+          }
+
+          interpolated_sources_in_k_size[index_chunk] = interpolated_size;
+          count_buffer_allocations += ppt2->tp2_size;
+
+#ifdef _OPENMP
+          time_alloc += omp_get_wtime() - alloc_start;
+#endif
+        }
+        else {
+          count_buffer_reuses += ppt2->tp2_size;
+        }
+
+        /* Update the (k2,k3) counter */
+        first_index_k2_k[index_chunk] = chunk_k2_k_size;
+        chunk_k2_k_size += ptr2->k_size_k1k2[index_k1][index_k2];
+        first_index_k2_k[index_chunk+1] = chunk_k2_k_size;
+
+      } // end of for(index_k2_end)
+
+      int chunk_size = index_k2_end - index_k2_start;
+      count_los += (long)chunk_k2_k_size * tt2_size_to_compute;
+
+      if ((has_los_check == _TRUE_) && (index_k2_start == 0))
+        class_calloc (los_check, ptr2->tt2_size*ptr2->k_size_k1k2[index_k1][0], sizeof(double), ptr2->error_message);
 
                     
       /* Beginning of parallel region */
       abort = _FALSE_;    
+      ++count_regions;
       #pragma omp parallel shared (ppw,ppr,ppt2,pbs,ptr2,abort) private (thread)
       {
 
@@ -440,19 +599,77 @@ int transfer2_init(
         thread = omp_get_thread_num();
         #endif
 
-        /* Update workspace */
-        ppw[thread]->thread = thread;
-        ppw[thread]->index_k1 = index_k1;
-        ppw[thread]->k1 = ppt2->k[index_k1];
-        ppw[thread]->index_k2 = index_k2;
-        ppw[thread]->k2 = ppt2->k[index_k2];
 
-        #pragma omp for schedule (static)
-        for (int index_k = 0; index_k < ptr2->k_size_k1k2[index_k1][index_k2]; ++index_k) { 
+        // -----------------------------------------------------------------------------
+        // -                          Interpolate sources in k                         -
+        // -----------------------------------------------------------------------------
+
+        #pragma omp for schedule (dynamic)
+        for (int index_k2_tp = 0; index_k2_tp < chunk_size*ppt2->tp2_size; ++index_k2_tp) {
+
+          int index_chunk = index_k2_tp / ppt2->tp2_size;
+          int index_tp = index_k2_tp % ppt2->tp2_size;
+
+#ifdef _OPENMP
+          double task_start = omp_get_wtime();
+#endif
+
+          class_call_parallel (transfer2_interpolate_sources_in_k(
+                                 ppr,
+                                 ppr2,
+                                 ppt,
+                                 ppt2,
+                                 pbs,
+                                 pbs2,
+                                 ptr2,
+                                 index_k1,
+                                 index_k2_start + index_chunk,
+                                 index_tp,
+                                 &k3_splines[index_chunk], /* Coefficients of the interpolation in k3 */
+                                 ppw[thread]->sources_k, /* Will be filled with the transposed sources */
+                                 ppw[thread]->sources_k_spline, /* Will be filled with second-order derivatives */
+                                 interpolated_sources_in_k[index_chunk][index_tp] /* Will be filled with interpolated values in ptr2->k(k1,k2) */
+                                 ),
+            ptr2->error_message,
+            ptr2->error_message);
+
+#ifdef _OPENMP
+          #pragma omp atomic
+          time_busy += omp_get_wtime() - task_start;
+#endif
+
+          #pragma omp flush(abort)
+
+        } // end of for (index_k2_tp)
+
+        /* The implicit barrier at the end of the above loop ensures that the sources
+        have been interpolated for all the k2 values in the chunk */
+
+        #pragma omp for schedule (dynamic)
+        for (int index_k2_k = 0; index_k2_k < chunk_k2_k_size; ++index_k2_k) { 
+
+          /* Find the (k2,k3) pair corresponding to index_k2_k */
+          int index_chunk = 0;
+          while (index_k2_k >= first_index_k2_k[index_chunk+1])
+            ++index_chunk;
+
+          int index_k2 = index_k2_start + index_chunk;
+          int index_k = index_k2_k - first_index_k2_k[index_chunk];
+
+#ifdef _OPENMP
+          double task_start = omp_get_wtime();
+#endif
 
           /* Update workspace */
+          ppw[thread]->thread = thread;
+          ppw[thread]->index_k1 = index_k1;
+          ppw[thread]->k1 = ppt2->k[index_k1];
+          ppw[thread]->index_k2 = index_k2;
+          ppw[thread]->k2 = ppt2->k[index_k2];
+          ppw[thread]->k_grid = k3_grid[index_chunk];
           ppw[thread]->index_k = index_k;
           ppw[thread]->k = ppw[thread]->k_grid[index_k];
+          ppw[thread]->los_check = ((los_check != NULL) && (index_k2 == 0)) ? los_check : NULL;
 
 
           // -----------------------------------------------------------------------
@@ -476,6 +693,17 @@ int transfer2_init(
             ptr2->error_message,
             ptr2->error_message);
 
+          /* Find the position of x=k*(tau0-tau) in the sampling of the projection functions,
+          and the relative interpolation weights; they are the same for all transfer types */
+          class_call_parallel (transfer2_get_x_grid(
+                                 ppr,
+                                 pbs2,
+                                 ptr2,
+                                 ppw[thread]
+                                 ),
+            ptr2->error_message,
+            ptr2->error_message);
+
           /* Interpolate the sources at the right value of time */
             
           for (int index_tp=0; index_tp<ppt2->tp2_size; ++index_tp) {
@@ -489,7 +717,7 @@ int transfer2_init(
                           pbs2,
                           ptr2,
                           index_tp,
-                          interpolated_sources_in_k[index_tp], /* Must be already filled by transfer2_interpolate_sources_in_k() */
+                          interpolated_sources_in_k[index_chunk][index_tp], /* Must be already filled by transfer2_interpolate_sources_in_k() */
                           ppw[thread]->sources_time_spline[index_tp], /* Will be filled with second-order derivatives */
                           ppw[thread]->interpolated_sources_in_time[index_tp], /* Will be filled with interpolated values in pw->tau_grid */
                           ppw[thread]
@@ -509,9 +737,14 @@ int transfer2_init(
           transfer functions. We do so by looping over index_tt, the composite index that
           includes both the field (T,E,B) and multipole (l,m) dependences. */
 
-          for (int index_tt = 0; index_tt < ptr2->tt2_size; index_tt++) {
-  
-            class_call_parallel (transfer2_compute (
+#ifdef _OPENMP
+          double los_start = omp_get_wtime();
+#endif
+
+          /* With the matrix method, all the transfer types are computed at once */
+          if (ptr2->los_method == matrix_los_method) {
+
+            class_call_parallel (transfer2_compute_matrix (
                                    ppr,
                                    ppr2,
                                    ppt2,
@@ -521,30 +754,88 @@ int transfer2_init(
                                    index_k1,
                                    index_k2,
                                    index_k,
-                                   ptr2->corresponding_index_l[index_tt],
-                                   ptr2->corresponding_index_m[index_tt],
-                                   index_tt,
                                    ppw[thread]->interpolated_sources_in_time,
                                    ppw[thread]
                                    ),
               ptr2->error_message,
               ptr2->error_message);
+          }
+
+          /* Otherwise, solve the line of sight integral separately for each transfer type */
+          else {
+
+            for (int index_tt = 0; index_tt < ptr2->tt2_size; index_tt++) {
 
-          } // end of for(index_tt)
+              /* Skip the transfer types that were computed in a previous run */
+              if ((ppr2->extend_transfers_on_disk == _TRUE_) && (ptr2->transfers_on_disk[index_tt] == _TRUE_))
+                continue;
+  
+              class_call_parallel (transfer2_compute (
+                                     ppr,
+                                     ppr2,
+                                     ppt2,
+                                     pbs,
+                                     pbs2,
+                                     ptr2,
+                                     index_k1,
+                                     index_k2,
+                                     index_k,
+                                     ptr2->corresponding_index_l[index_tt],
+                                     ptr2->corresponding_index_m[index_tt],
+                                     index_tt,
+                                     ppw[thread]->interpolated_sources_in_time,
+                                     ppw[thread]
+                                     ),
+                ptr2->error_message,
+                ptr2->error_message);
+
+            } // end of for(index_tt)
+
+          } // end of scalar method
+
+#ifdef _OPENMP
+          #pragma omp atomic
+          time_los += omp_get_wtime() - los_start;
+          #pragma omp atomic
+          time_busy += omp_get_wtime() - task_start;
+#endif
 
           #pragma omp flush(abort)
 
-        } // end of for(index_k) 
+        } // end of for(index_k2_k) 
 
       } if (abort == _TRUE_) return _FAILURE_; /* end of parallel region */
 
-      /* Free the memory for the interpolated sources */
-      for (int index_tp=0; index_tp<ppt2->tp2_size; ++index_tp) {
-        free(sources_k_spline[index_tp]);
-        free(interpolated_sources_in_k[index_tp]);
+      /* Compare the matrix and scalar methods for the first (k1,k2) pair */
+      if (los_check != NULL) {
+
+        double max_difference;
+        int index_tt_max;
+
+        class_call (transfer2_check_matrix (ptr2, index_k1, 0, los_check, &max_difference, &index_tt_max),
+          ptr2->error_message,
+          ptr2->error_message);
+
+        free (los_check);
+        los_check = NULL;
+        has_los_check = _FALSE_;
+
+        class_test (max_difference > _TRANSFER2_MATRIX_TOL_,
+          ptr2->error_message,
+          "matrix and scalar methods differ by %g (relative to the largest value in the k3 row) for %s, k1=%g, k2=%g",
+          max_difference, ptr2->tt2_labels[index_tt_max], ppt2->k[index_k1], ppt2->k[0]);
+
+        if (ptr2->transfer2_verbose > 1)
+          printf ("     * matrix and scalar methods agree to %g for (k1,k2)=(%g,%g)\n",
+            max_difference, ppt2->k[index_k1], ppt2->k[0]);
       }
 
-    } // end of for(index_k2)
+      /* Free the interpolation coefficients; the buffers for the interpolated sources
+      are kept for the next chunk */
+      for (int index_chunk=0; index_chunk < chunk_size; ++index_chunk)
+        transfer2_k3_spline_free (&k3_splines[index_chunk]);
+
+    } // end of for(index_k2_start)
 
     /* Free the memory associated with the line-of-sight sources for the considered k1.
     We won't need them anymore because the different k1 modes are independent. Note that
@@ -568,8 +859,79 @@ int transfer2_init(
 
   } // end of for(index_k1)
 
-  free (sources_k_spline);
+#ifdef _OPENMP
+  /* The CPU utilisation is the fraction of the available thread time that was spent
+  interpolating the sources and solving the line of sight integral. Time spent loading
+  or storing data to disk, and threads waiting at the end of the parallel regions, count
+  as idle time. */
+  double time_wall = omp_get_wtime() - time_start;
+  if ((ptr2->transfer2_verbose > 1) && (time_wall > 0))
+    printf (" -> transfer functions computed in %g s with %d threads; CPU utilisation = %.1f%%\n",
+      time_wall, number_of_threads, 100*time_busy/(time_wall*number_of_threads));
+
+  /* Number of line of sight integrals solved per second by a single thread */
+  if ((ptr2->transfer2_verbose > 1) && (time_los > 0))
+    printf (" -> solved %ld line of sight integrals at %.3g transfers/s per thread\n",
+      count_los, count_los/time_los);
+
+  /* Parallel regions and memory allocations in the main loop */
+  if (ptr2->transfer2_verbose > 1) {
+    printf (" -> opened %ld parallel regions in the main loop\n", count_regions);
+    printf (" -> interpolation buffers: %ld allocated in %.3g s, %ld reused\n",
+      count_buffer_allocations, time_alloc, count_buffer_reuses);
+  }
+#endif
+
+  /* Largest error estimated by the Filon quadrature */
+  if ((ptr2->los_method == filon_los_method) && (ptr2->transfer2_verbose > 1)) {
+    double los_error_max = 0;
+    for (int thread=0; thread < number_of_threads; ++thread)
+      los_error_max = MAX (los_error_max, ppw[thread]->los_error_max);
+    printf (" -> Filon quadrature of the line of sight integral: estimated relative error < %g\n",
+      los_error_max);
+  }
+
+  /* Accuracy of the flat-sky limit on the overlap range of multipoles, and time saved by
+  using it instead of the exact projection functions */
+  if ((pbs2->J_flat_sky != NULL) && (ptr2->transfer2_verbose > 1)) {
+
+    double diff2 = 0, norm2 = 0, time_exact = 0, time_flat = 0;
+    long int count_overlap = 0, count_flat = 0;
+
+    for (int thread=0; thread < number_of_threads; ++thread) {
+      diff2 += ppw[thread]->flat_sky_diff2;
+      norm2 += ppw[thread]->flat_sky_norm2;
+      time_exact += ppw[thread]->flat_sky_time_exact;
+      time_flat += ppw[thread]->flat_sky_time_flat;
+      count_overlap += ppw[thread]->flat_sky_count_overlap;
+      count_flat += ppw[thread]->flat_sky_count;
+    }
+
+    if (count_overlap > 0)
+      printf (" -> flat-sky limit for l >= %d: RMS relative difference with the exact integrals = %g (l=%d to %d, %ld integrals)\n",
+        ppr2->l_flat_sky_song, sqrt(diff2/norm2), ptr2->l[pbs2->index_l_flat_sky_min],
+        ptr2->l[MIN(pbs2->l_size_J,ptr2->l_size)-1], count_overlap);
+
+#ifdef _OPENMP
+    if ((count_overlap > 0) && (time_flat > 0))
+      printf (" -> flat-sky limit: %.3g s per integral instead of %.3g s; estimated wall time saved on %ld integrals = %g s\n",
+        time_flat/count_overlap, time_exact/count_overlap, count_flat,
+        count_flat*(time_exact-time_flat)/count_overlap/number_of_threads);
+#endif
+  }
+
+  for (int index_chunk=0; index_chunk < ppt2->k_size; ++index_chunk) {
+    if (interpolated_sources_in_k[index_chunk] != NULL) {
+      for (int index_tp=0; index_tp<ppt2->tp2_size; ++index_tp)
+        free (interpolated_sources_in_k[index_chunk][index_tp]);
+      free (interpolated_sources_in_k[index_chunk]);
+    }
+  }
   free (interpolated_sources_in_k);
+  free (interpolated_sources_in_k_size);
+  free (k3_grid);
+  free (k3_splines);
+  free (first_index_k2_k);
   
   #pragma omp parallel shared(ppw) private(thread)
   {
@@ -577,11 +939,19 @@ int transfer2_init(
     thread = omp_get_thread_num();
     #endif
 
-    free(ppw[thread]->k_grid);
+    free(ppw[thread]->sources_k);
+    free(ppw[thread]->sources_k_spline);
     free(ppw[thread]->tau_grid);
     free(ppw[thread]->tau0_minus_tau);
     free(ppw[thread]->delta_tau);
     free(ppw[thread]->index_tau_left);    
+    free(ppw[thread]->index_x);
+    free(ppw[thread]->index_x_block);
+    free(ppw[thread]->a_x);
+    free(ppw[thread]->los_terms);
+    free(ppw[thread]->los_projection);
+    free(ppw[thread]->los_sources);
+    free(ppw[thread]->los_result);
     int index_tp;
     for (index_tp=0; index_tp<ppt2->tp2_size; ++index_tp) {
       free(ppw[thread]->sources_time_spline[index_tp]);
@@ -594,14 +964,22 @@ int transfer2_init(
     
   free(ppw);
   
-  /* We are finished filling the transfer function files, so close them */
-  if (ppr2->store_transfers_to_disk == _TRUE_)
-    for (int index_tt = 0; index_tt < ptr2->tt2_size; index_tt++)
-      fclose (ptr2->transfers_files[index_tt]);
+  /* We are finished filling the transfer function files, so close them and describe
+  their content in the status file */
+  if (ppr2->store_transfers_to_disk == _TRUE_) {
+
+    for (int index_file = 0; index_file < ptr2->transfers_files_size; index_file++)
+      if (ptr2->transfers_files[index_file] != NULL)
+        fclose (ptr2->transfers_files[index_file]);
+
+    class_call (transfer2_write_status_file (ppr2, ppt2, ptr2),
+      ptr2->error_message,
+      ptr2->error_message);
+  }
 
   if (ptr2->transfer2_verbose > 1)
     printf (" -> filled ptr2->transfer with %ld values (%g MB)\n",
-      ptr2->count_memorised_transfers, ptr2->count_memorised_transfers/1e6*8);
+      ptr2->count_memorised_transfers, ptr2->count_memorised_transfers*sizeof(song_storage)/1e6);
   
   /* Check that the number of filled values corresponds to the number of allocated space */
   if (ppr2->load_transfers_from_disk == _FALSE_)
@@ -645,7 +1023,7 @@ int transfer2_allocate_type_level(
 
   class_alloc(
     ptr2->transfer[index_tt],
-    k1_size * sizeof(double **),
+    k1_size * sizeof(song_storage **),
     ptr2->error_message);
 
   for (int index_k1=0; index_k1<k1_size; ++index_k1) {
@@ -658,7 +1036,7 @@ int transfer2_allocate_type_level(
   
     class_alloc(
       ptr2->transfer[index_tt][index_k1],
-      k2_size * sizeof(double *),
+      k2_size * sizeof(song_storage *),
       ptr2->error_message);
   
     for (int index_k2=0; index_k2<=index_k1; ++index_k2) {
@@ -670,7 +1048,7 @@ int transfer2_allocate_type_level(
       transfer2_get_k3_sizes() for further details. */
       class_alloc(
         ptr2->transfer[index_tt][index_k1][index_k2],
-        ptr2->k_size_k1k2[index_k1][index_k2] * sizeof(double),
+        ptr2->k_size_k1k2[index_k1][index_k2] * sizeof(song_storage),
         ptr2->error_message);
 
       #pragma omp atomic
@@ -682,8 +1060,8 @@ int transfer2_allocate_type_level(
   
   /* Print some debug information on memory consumption */
   if (ptr2->transfer2_verbose > 2) {
-    printf("     * allocated ~ %.2f MB in ptr2->transfer (%ld doubles) for index_tt=%d; it's size is now ~ %.3g MB;\n",
-      count*sizeof(double)/1e6, count, index_tt, ptr2->count_allocated_transfers*sizeof(double)/1e6);
+    printf("     * allocated ~ %.2f MB in ptr2->transfer (%ld %ss) for index_tt=%d; it's size is now ~ %.3g MB;\n",
+      count*sizeof(song_storage)/1e6, count, _SONG_STORAGE_TYPE_, index_tt, ptr2->count_allocated_transfers*sizeof(song_storage)/1e6);
   }
 
   return _SUCCESS_;
@@ -700,6 +1078,10 @@ int transfer2_allocate_type_level(
  * The type level of ptr2->transfer is automatically allocated inside this function via the
  * function transfer2_allocate_type_level().
  *
+ * In the tiles layout, the transfer functions are read from the file of the group of
+ * the requested type, skipping the other types in the group. To read all the types in
+ * a group at once, use transfer2_load_tile_from_disk() instead.
+ *
  * This function is used in the bispectra2.c module and in the print_transfers2.c file.
  */
 int transfer2_load_transfers_from_disk(
@@ -713,6 +1095,84 @@ int transfer2_load_transfers_from_disk(
   class_call (transfer2_allocate_type_level(ppt2, ptr2, index_tt),
     ptr2->error_message, ptr2->error_message);
 
+
+  // ====================================================================================
+  // =                                   Tiles layout                                   =
+  // ====================================================================================
+
+  if (ptr2->transfers_layout == tile_transfers_layout) {
+
+    /* Find the group of the transfer type and its position in the group */
+    int index_tile = (index_tt/ptr2->n_transfers)*ptr2->m_size + ptr2->corresponding_index_m[index_tt];
+    int index_tt_in_tile = 0;
+    while ((index_tt_in_tile < ptr2->tile_tt_size[index_tile])
+      && (ptr2->tile_tt[index_tile][index_tt_in_tile] != index_tt))
+      ++index_tt_in_tile;
+
+    class_test (index_tt_in_tile == ptr2->tile_tt_size[index_tile],
+      ptr2->error_message,
+      "index_tt=%d not found in the group index_tile=%d", index_tt, index_tile);
+
+    /* Print some debug */
+    if (ptr2->transfer2_verbose > 2)
+      printf("     * transfer2_load_transfers_from_disk: reading results for index_tt=%d from '%s' ...",
+        index_tt, ptr2->transfers_paths[index_tile]);
+
+    /* Open the file with a local stream, because other threads might be reading
+    other types in the same group */
+    FILE * tile_file;
+    class_open (tile_file, ptr2->transfers_paths[index_tile], "rb", ptr2->error_message);
+
+    /* Position of the current tile in the file */
+    long int offset = 0;
+
+    for (int index_k1 = 0; index_k1 < ppt2->k_size; ++index_k1) {
+
+      for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
+
+        int n_to_read = ptr2->k_size_k1k2[index_k1][index_k2];
+
+        class_test (fseek (tile_file, (offset + index_tt_in_tile*n_to_read)*sizeof(song_storage), SEEK_SET) != 0,
+          ptr2->error_message,
+          "could not seek in '%s' (index_tt=%d,index_k1=%d,index_k2=%d)",
+          ptr2->transfers_paths[index_tile], index_tt, index_k1, index_k2);
+
+        /* Read the k-values of the requested type in the (k1,k2) tile */
+        int n_read = fread(
+                ptr2->transfer[index_tt][index_k1][index_k2],
+                sizeof(song_storage),
+                n_to_read,
+                tile_file);
+
+        class_test(n_read != n_to_read,
+          ptr2->error_message,
+          "Could not read in '%s' file, read %d entries but expected %d (index_tt=%d,index_k1=%d,index_k2=%d)",
+            ptr2->transfers_paths[index_tile], n_read, n_to_read, index_tt, index_k1, index_k2);
+
+        offset += ptr2->tile_tt_size[index_tile]*n_to_read;
+
+        /* Update the counter for the values stored in ptr2->transfers */
+        #pragma omp atomic
+        ptr2->count_memorised_transfers += n_to_read;
+
+      } // end of for(index_k2)
+
+    } // end of for(index_k1)
+
+    fclose(tile_file);
+
+    if (ptr2->transfer2_verbose > 2)
+      printf ("Done.\n");
+
+    return _SUCCESS_;
+
+  }
+
+
+  // ====================================================================================
+  // =                                   Types layout                                   =
+  // ====================================================================================
+
   /* Print some debug */
   if (ptr2->transfer2_verbose > 2)
     printf("     * transfer2_load_transfers_from_disk: reading results for index_tt=%d from '%s' ...",
@@ -735,7 +1195,7 @@ int transfer2_load_transfers_from_disk(
       /* Read a chunk with all the k-values for this set of (type,k1,k2) */
       int n_read = fread(
               ptr2->transfer[index_tt][index_k1][index_k2],
-              sizeof(double),
+              sizeof(song_storage),
               n_to_read,
               ptr2->transfers_files[index_tt]);
   
@@ -764,303 +1224,337 @@ int transfer2_load_transfers_from_disk(
 
 
 /**
- * Free all the memory space allocated by transfer2_init().
- */ 
-int transfer2_free(
-      struct precision2 * ppr2,
-      struct perturbs2 * ppt2,
-      struct transfers2 * ptr2
-      )
+ * Load the transfer functions from disk for all the transfer types in a group.
+ *
+ * Only for the tiles layout. The transfer functions of all the types with the same
+ * field and m (ptr2->tile_tt[index_tile]) are read in a single sequential pass from the
+ * file ptr2->transfers_paths[index_tile], one (k1,k2) tile at a time, and stored in
+ * ptr2->transfer with the same tiled layout used by transfer2_allocate_k1_level().
+ *
+ * The type level of ptr2->transfer is allocated here for all the types in the group;
+ * free it with transfer2_free_tile_level().
+ */
+int transfer2_load_tile_from_disk(
+        struct perturbs2 * ppt2,
+        struct transfers2 * ptr2,
+        int index_tile
+        )
 {
 
-  if (ptr2->has_cls == _TRUE_) {
-  
-    free (ptr2->tt2_labels);
-  
-    int k1_size = ppt2->k_size;
+  class_test (ptr2->transfers_layout != tile_transfers_layout,
+    ptr2->error_message,
+    "the transfer functions are not stored in tiles");
 
-    /* Free the k1 level of ptr2->transfer only if we are neither loading nor storing the transfers to disk.
-    The memory management in those two cases is handled separately via the transfer_store and transfer_load
-    functions  */
-    if ((ppr2->store_transfers_to_disk==_FALSE_) && (ppr2->load_transfers_from_disk==_FALSE_)) {
-      for (int index_k1 = 0; index_k1 < k1_size; ++index_k1)
-        if (ptr2->has_allocated_transfers[index_k1] == _TRUE_)
-          class_call(transfer2_free_k1_level(ppt2, ptr2, index_k1), ptr2->error_message, ptr2->error_message);
-      for (int index_tt = 0; index_tt < ptr2->tt2_size; ++index_tt)
-        free (ptr2->transfer[index_tt]);
-    }
+  int tt_size = ptr2->tile_tt_size[index_tile];
+  int * tile_tt = ptr2->tile_tt[index_tile];
+  long int count = 0;
 
-    free (ptr2->transfer);
+  /* Nothing to do if no l is compatible with the m of the group */
+  if (tt_size == 0)
+    return _SUCCESS_;
 
-    free (ptr2->has_allocated_transfers);
+  /* Print some debug */
+  if (ptr2->transfer2_verbose > 2)
+    printf("     * transfer2_load_tile_from_disk: reading results for %d transfer types from '%s' ...",
+      tt_size, ptr2->transfers_paths[index_tile]);
 
-    for(int index_k1=0; index_k1<ppt2->k_size; ++index_k1) {
-      free (ptr2->k_size_k1k2[index_k1]);
-      free (ptr2->k_physical_start_k1k2[index_k1]);
-      free (ptr2->k_physical_size_k1k2[index_k1]);
-      free (ptr2->k_min_k1k2[index_k1]);
-      free (ptr2->k_max_k1k2[index_k1]);
-    }
-    free (ptr2->k_size_k1k2);
-    free (ptr2->k_physical_start_k1k2);
-    free (ptr2->k_physical_size_k1k2);
-    free (ptr2->k_min_k1k2);
-    free (ptr2->k_max_k1k2);
-      
-    free (ptr2->l);
-    free (ptr2->m);
+  /* Allocate the k1 and k2 levels for all the types in the group */
+  for (int index_tt_in_tile=0; index_tt_in_tile < tt_size; ++index_tt_in_tile) {
 
-    free (ptr2->corresponding_index_l);
-    free (ptr2->corresponding_index_m);
-    free (ptr2->index_tt2_monopole);
-    free (ptr2->index_pt2_monopole);
-  
-    for (int index_l=0; index_l<ptr2->l_size; ++index_l)
-      free (ptr2->lm_array[index_l]);
-    free (ptr2->lm_array);
+    int index_tt = tile_tt[index_tt_in_tile];
 
-    /* Free file arrays */
-    if ((ppr2->store_transfers_to_disk == _TRUE_) || (ppr2->load_transfers_from_disk == _TRUE_)) {
+    class_alloc (ptr2->transfer[index_tt], ppt2->k_size*sizeof(song_storage **), ptr2->error_message);
 
-      // fclose(ptr2->transfers_status_file);
+    for (int index_k1=0; index_k1 < ppt2->k_size; ++index_k1)
+      class_alloc (ptr2->transfer[index_tt][index_k1], (index_k1+1)*sizeof(song_storage *), ptr2->error_message);
+  }
 
-      for(int index_tt=0; index_tt<ptr2->tt2_size; ++index_tt)
-        free (ptr2->transfers_paths[index_tt]);
+  /* Open file for reading */
+  class_open (ptr2->transfers_files[index_tile], ptr2->transfers_paths[index_tile], "rb", ptr2->error_message);
 
-      free (ptr2->transfers_files);
-      free (ptr2->transfers_paths);
-    }
+  for (int index_k1 = 0; index_k1 < ppt2->k_size; ++index_k1) {
 
-  } // end of if(has_cls)
+    for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
+
+      int k_size = ptr2->k_size_k1k2[index_k1][index_k2];
+      int n_to_read = tt_size*k_size;
+      song_storage * tile;
+
+      class_alloc (tile, n_to_read*sizeof(song_storage), ptr2->error_message);
+
+      /* Read the k-values of all the types in the group for this (k1,k2) */
+      int n_read = fread(
+              tile,
+              sizeof(song_storage),
+              n_to_read,
+              ptr2->transfers_files[index_tile]);
+
+      class_test(n_read != n_to_read,
+        ptr2->error_message,
+        "Could not read in '%s' file, read %d entries but expected %d (index_tile=%d,index_k1=%d,index_k2=%d)",
+          ptr2->transfers_paths[index_tile], n_read, n_to_read, index_tile, index_k1, index_k2);
+
+      for (int index_tt_in_tile=0; index_tt_in_tile < tt_size; ++index_tt_in_tile)
+        ptr2->transfer[tile_tt[index_tt_in_tile]][index_k1][index_k2] = tile + index_tt_in_tile*k_size;
+
+      count += n_to_read;
+
+    } // end of for(index_k2)
+
+  } // end of for(index_k1)
+
+  /* Close file */
+  fclose(ptr2->transfers_files[index_tile]);
+
+  /* Update the counters for the values stored in ptr2->transfers */
+  #pragma omp atomic
+  ptr2->count_allocated_transfers += count;
+  #pragma omp atomic
+  ptr2->count_memorised_transfers += count;
+
+  if (ptr2->transfer2_verbose > 2)
+    printf ("Done (%.3g MB).\n", count*sizeof(song_storage)/1e6);
 
   return _SUCCESS_;
-  
+
 }
 
 
 /**
+ * Compute a signature of the k-sampling of the transfer functions.
  *
- * Initialize indices and arrays in the second-order transfer functions structure.
- *
- * In detail, this function does:
- *
- *  -# Computes the list of multipoles where to compute the transfer functions via
- *     transfer2_get_l_list().    
- *
- *  -# Determine which transfer functions to compute based on the previous modules, and
- *     assign them the ptr2->index_tt2_XXX indices.
- *
- *  -# Define the indexing strategy of the transfer functions array (ptr2->transfer)
- *     and establish a correspondence between line of sight sources and transfer 
- *     functions, via transfer2_get_lm_lists().
- *
- *  -# In transfer2_get_k3_sizes(), fill the array ptr2->k_size_k1k2 which, for each
- *     (k1,k2) pair, determines the size of the k3 grid of the transfer functions, based
- *     on the triangular condition.
+ * The signature consists of the total number of k3 values over all (k1,k2) pairs,
+ * and of the sums of the k1 and k3 values. It is written in the status file of the
+ * transfers directory, so that we can check whether the transfer functions on disk
+ * were computed on the same k-sampling as the current run.
+ */
+int transfer2_get_k_checksum(
+        struct perturbs2 * ppt2,
+        struct transfers2 * ptr2,
+        long int * k3_size,
+        double * k_checksum,
+        double * k3_checksum
+        )
+{
+
+  *k3_size = 0;
+  *k_checksum = 0;
+  *k3_checksum = 0;
+
+  for (int index_k1 = 0; index_k1 < ppt2->k_size; ++index_k1) {
+
+    *k_checksum += ppt2->k[index_k1];
+
+    for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
+      for (int index_k = 0; index_k < ptr2->k_size_k1k2[index_k1][index_k2]; ++index_k)
+        *k3_checksum += ptr2->k3_grid[index_k1][index_k2][index_k];
+      *k3_size += ptr2->k_size_k1k2[index_k1][index_k2];
+    }
+  }
+
+  return _SUCCESS_;
+
+}
+
+
+
+
+/**
+ * Read the status file of the transfers directory and find the transfer types
+ * that are already stored on disk.
  *
- *  -# Allocate the type level of the transfer array, ptr2->transfer[index_tt].
+ * The status file, written by transfer2_write_status_file(), starts with a header
+ * with the layout, the floating point type of the stored values, the signature of the k-sampling and the largest l of the stored
+ * transfer functions. Each of the following lines contains the label of a transfer
+ * type (or of a group of types, in the tiles layout) and the name of the file where
+ * it is stored.
  *
- *  -# Open the files where we will store the transfer functions at the end of the computation.
+ * In the types layout, the transfer types are matched by their label, rather than by
+ * their index, so that a run with a larger l_max can reuse the transfer functions
+ * computed for a smaller one. For each type found on disk, this function sets
+ * ptr2->transfers_on_disk[index_tt2] to _TRUE_ and ptr2->transfers_paths[index_tt2]
+ * to the file that contains it. The types that are not on disk are given new file
+ * names that do not overlap with the existing ones.
  *
+ * Runs stored before the status file was introduced are loaded using the default
+ * file names, without any check.
  */
-int transfer2_indices_of_transfers(
-          struct precision * ppr,
-          struct precision2 * ppr2,
-          struct perturbs2 * ppt2,
-          struct bessels * pbs,
-          struct bessels2 * pbs2,
-          struct transfers * ptr,
-          struct transfers2 * ptr2
-          )
+int transfer2_read_status_file(
+        struct precision2 * ppr2,
+        struct perturbs2 * ppt2,
+        struct transfers2 * ptr2
+        )
 {
 
-  /* Get l values where to compute the transfer functions */
-  class_call (transfer2_get_l_list(ppr,ppr2,ppt2,pbs,pbs2,ptr2),
-    ptr2->error_message,
-    ptr2->error_message);
-  
-  /* Get the m values where to compute the transfer functions, copying them
-  from ppr2->m. */
-  ptr2->m_size = ppr2->m_size;
-  class_alloc (ptr2->m, ptr2->m_size*sizeof(int), ptr2->error_message);
-  for (int index_m=0; index_m<ptr2->m_size; ++index_m)
-    ptr2->m[index_m] = ppr2->m[index_m];
-
+  FILE * status_file = fopen (ptr2->transfers_status_path, "r");
 
-  // ======================================================================================
-  // =                            What transfers to compute?                              =
-  // ======================================================================================
+  if (status_file == NULL) {
 
-  /* Index that will keep track of the trasfer-function type to compute */
-  int index_tt = 0;
+    class_test (ppr2->extend_transfers_on_disk == _TRUE_,
+      ptr2->error_message,
+      "cannot extend the transfer functions in '%s' without the status file '%s'",
+      ptr2->transfers_dir, ptr2->transfers_status_path);
 
-  /* Number of transfer functions that need to be computed for each source type (temperature,
-  polarisation...). This is given by all the possible (l,m) combinations contained in ptr2->l
-  and ppr2->m */
-  ptr2->n_transfers = size_indexl_indexm (ptr2->l, ptr2->l_size, ppr2->m, ppr2->m_size);
-  
-  /* Number of non-vanishing E-mode transfer functions, for debug purposes */
-  ptr2->n_nonzero_transfers_E = ptr2->n_transfers;
-  if (ppr2->compute_m[0])
-    ptr2->n_nonzero_transfers_E -= 2;
-  if (ppr2->compute_m[1])
-    ptr2->n_nonzero_transfers_E -= 1;
+    if (ptr2->transfer2_verbose > 1)
+      printf (" -> status file not found in '%s', will assume default file names\n", ptr2->transfers_dir);
 
-  /* Number of non-vanishing B-mode transfer functions, for debug purposes */
-  ptr2->n_nonzero_transfers_B = ptr2->n_transfers;
-  if (ppr2->compute_m[0])
-    ptr2->n_nonzero_transfers_B -= ptr2->l_size;
-  if (ppr2->compute_m[1])
-    ptr2->n_nonzero_transfers_B -= 1;
+    return _SUCCESS_;
+  }
 
-  /* Photon temperature transfer functions */
-  if (ppt2->has_source_T) {
 
-    ptr2->index_tt2_T = index_tt;
-    index_tt += ptr2->n_transfers; 
-  }
+  // -------------------------------------------------------------------------------
+  // -                                 Read header                                 -
+  // -------------------------------------------------------------------------------
 
-  /* Photon E-mode polarisation transfer functions */
-  if (ppt2->has_source_E) {
-  
-    ptr2->index_tt2_E = index_tt;
-    index_tt += ptr2->n_transfers;    
-  }
+  char line[_FILENAMESIZE_];
+  char layout[32];
+  char storage[32];
+  int k_size, l_max;
+  long int k3_size;
+  double k_checksum, k3_checksum;
 
-  /* Photon B-mode polarisation transfer functions. They will be computed
-  only for non scalar modes, otherwise they just vanish. */
-  if (ppt2->has_source_B) {
+  /* Comment line and layout */
+  class_test ((fgets (line, _FILENAMESIZE_, status_file) == NULL)
+           || (fgets (line, _FILENAMESIZE_, status_file) == NULL)
+           || (sscanf (line, "layout = %31s", layout) != 1),
+    ptr2->error_message,
+    "could not read the layout from the header of '%s'", ptr2->transfers_status_path);
 
-    ptr2->index_tt2_B = index_tt;
-    index_tt += ptr2->n_transfers;
-  }
+  /* Floating point type of the stored values. Status files written before it was
+  introduced lack this line, and their values are always double. */
+  class_test (fgets (line, _FILENAMESIZE_, status_file) == NULL,
+    ptr2->error_message,
+    "could not read the header of '%s'", ptr2->transfers_status_path);
 
+  short has_storage = (sscanf (line, "storage = %31s", storage) == 1);
 
-  /* Total number of transfer functions to compute */
-  ptr2->tt2_size = index_tt;
+  if (has_storage == _TRUE_)
+    class_test (fgets (line, _FILENAMESIZE_, status_file) == NULL,
+      ptr2->error_message,
+      "could not read the header of '%s'", ptr2->transfers_status_path);
+  else
+    strcpy (storage, "double");
+
+  /* Signature of the k-sampling; the first line is already in the buffer */
+  class_test ((sscanf (line, "k_size = %d", &k_size) != 1)
+           || (fgets (line, _FILENAMESIZE_, status_file) == NULL)
+           || (sscanf (line, "k3_size = %ld", &k3_size) != 1)
+           || (fgets (line, _FILENAMESIZE_, status_file) == NULL)
+           || (sscanf (line, "k_checksum = %lg", &k_checksum) != 1)
+           || (fgets (line, _FILENAMESIZE_, status_file) == NULL)
+           || (sscanf (line, "k3_checksum = %lg", &k3_checksum) != 1),
+    ptr2->error_message,
+    "could not read the k-sampling from the header of '%s'", ptr2->transfers_status_path);
 
-  /* Initialise the labels of the transfer types */
-  class_calloc (ptr2->tt2_labels,
-    ptr2->tt2_size*_MAX_LENGTH_LABEL_,
-    sizeof(char),
+  /* Largest l on disk; this is the last line of the header */
+  class_call (transfer2_status_file_l_max (status_file, &l_max),
+    ptr2->error_message,
     ptr2->error_message);
 
-  if (ptr2->transfer2_verbose > 1) {
-    printf (" -> will compute tt2_size=%d transfer functions: ", ptr2->tt2_size);
-    if (ppt2->has_source_B == _TRUE_) printf ("T=%d ", ptr2->n_transfers);
-    if (ppt2->has_source_E == _TRUE_) printf ("E=%d (%d non-zero) ",
-      ptr2->n_transfers, ptr2->n_nonzero_transfers_E);
-    if (ppt2->has_source_B == _TRUE_) printf ("B=%d (%d non-zero) ",
-      ptr2->n_transfers, ptr2->n_nonzero_transfers_B);
-    printf ("\n");
-  }  
+  class_test (l_max < 0,
+    ptr2->error_message,
+    "could not read l_max from '%s'", ptr2->transfers_status_path);
 
-  
-  // ==============================================================================
-  // =                            Fill (l,m) arrays                               =
-  // ==============================================================================
+  /* The layout on disk must match the one requested */
+  char * current_layout = (ptr2->transfers_layout == tile_transfers_layout) ? "tiles" : "types";
 
-  class_call (transfer2_get_lm_lists (
-                ppr,
-                ppr2,
-                ppt2,
-                pbs,
-                pbs2,
-                ptr2),
+  class_test (strcmp (layout, current_layout) != 0,
     ptr2->error_message,
-    ptr2->error_message);
+    "the transfer functions in '%s' were stored with transfers_layout=%s, set it in the parameter file",
+    ptr2->transfers_dir, layout);
 
+  /* The floating point type on disk must match the one used by this build of SONG. Old
+  status files without the storage line pass the test in the default, double build. */
+  class_test (strcmp (storage, _SONG_STORAGE_TYPE_) != 0,
+    ptr2->error_message,
+    "the transfer functions in '%s' were stored as %s, but SONG was compiled to store them as %s;\
+ check the SONG_FLOAT_STORAGE flag in the makefile",
+    ptr2->transfers_dir, storage, _SONG_STORAGE_TYPE_);
 
+  /* New transfer types can be added to disk only in the types layout, where each of
+  them has its own file */
+  class_test ((ppr2->extend_transfers_on_disk == _TRUE_) && (ptr2->transfers_layout == tile_transfers_layout),
+    ptr2->error_message,
+    "the transfer functions in '%s' reach l=%d; extending them to larger l is supported only for transfers_layout=types",
+    ptr2->transfers_dir, l_max);
 
-  // ==================================================================================
-  // =                       Determine range of k3(k1,k2)                             =
-  // ==================================================================================
+  /* The k-sampling on disk must match the current one */
+  long int k3_size_run;
+  double k_checksum_run, k3_checksum_run;
 
-  class_call (transfer2_get_k3_sizes (
-                ppr,
-                ppr2,
-                ppt2,
-                pbs,
-                pbs2,
-                ptr,
-                ptr2),
+  class_call (transfer2_get_k_checksum (ppt2, ptr2, &k3_size_run, &k_checksum_run, &k3_checksum_run),
     ptr2->error_message,
     ptr2->error_message);
 
+  class_test ((k_size != ppt2->k_size) || (k3_size != k3_size_run)
+           || (fabs (1-k_checksum/k_checksum_run) > _TRANSFER2_K_CHECKSUM_TOL_)
+           || (fabs (1-k3_checksum/k3_checksum_run) > _TRANSFER2_K_CHECKSUM_TOL_),
+    ptr2->error_message,
+    "the k-sampling of the transfer functions in '%s' (k_size=%d, k3_size=%ld) differs from the current one\
+ (k_size=%d, k3_size=%ld); cannot reuse them",
+    ptr2->transfers_dir, k_size, k3_size, ppt2->k_size, k3_size_run);
 
 
-  // =======================================================================================
-  // =                      Allocate first levels of ptr2->transfer                        =
-  // =======================================================================================
-  
-  /* The array where we shall store the second-order transfer function, ptr2->transfer, has
-  five levels that should be indexed in the following way:
-    
-        ptr2->transfer [index_tt]
-                       [index_k1]
-                       [index_k2]
-                       [index_k]
-    
-  index_tt includes both the transfer type (T,E,B) and the multipole indices (l,m).
-  index_k1 goes from 0 to ppt2->k_size.    
-  index_k2 goes from 0 to ppt2->k_size-index_k1.
-  index_k3 goes from 0 to ppt2->k3_size[index_k1][index_k2]. */
+  // -------------------------------------------------------------------------------
+  // -                                 Read files                                  -
+  // -------------------------------------------------------------------------------
 
-  /* Counter to keep track of the memory usage of ptr2->transfer */
-  ptr2->count_memorised_transfers = 0;
-  ptr2->count_allocated_transfers = 0;
-    
-  /* Allocate transfer-type (tt2) level */  
-  class_alloc (
-    ptr2->transfer,
-    ptr2->tt2_size * sizeof(double ***),
-    ptr2->error_message);
+  char label[_FILENAMESIZE_];
+  char filename[_FILENAMESIZE_];
+  int files_size = 0;
 
-  /* Allocate the index_tt level. The remaining k1, k2 and k levels will be allocated later
-  using the function transfer2_allocate_k1_level(). */
-  for (int index_tt = 0; index_tt < ptr2->tt2_size; ++index_tt) {
-  
-    int k1_size = ppt2->k_size;
-    
-    class_alloc (
-      ptr2->transfer[index_tt],
-      k1_size * sizeof(double **),
-      ptr2->error_message);
-  
-  } // end of for(index_type)
-  
-  /* Allocate and initialize the logical array that keeps track of the memory state of ptr2->transfers */
-  class_calloc(ptr2->has_allocated_transfers, ppt2->k_size, sizeof(short), ptr2->error_message);
+  while (fgets (line, _FILENAMESIZE_, status_file) != NULL) {
 
+    if (sscanf (line, "%s %s", label, filename) != 2)
+      continue;
 
+    ++files_size;
 
-  // ==================================================================================
-  // =                             Create transfers files                             =
-  // ==================================================================================  
+    /* In the tiles layout, the files are named after the tile index */
+    if (ptr2->transfers_layout == tile_transfers_layout)
+      continue;
 
-  /* Create the files to store the transfer functions in */
-  
-  if ((ppr2->store_transfers_to_disk == _TRUE_) || (ppr2->load_transfers_from_disk == _TRUE_)) {
+    for (int index_tt = 0; index_tt < ptr2->tt2_size; ++index_tt) {
+      if (strcmp (ptr2->tt2_labels[index_tt], label) == 0) {
+        sprintf (ptr2->transfers_paths[index_tt], "%s/%s", ptr2->transfers_dir, filename);
+        ptr2->transfers_on_disk[index_tt] = _TRUE_;
+        break;
+      }
+    }
+  }
 
-    /* We are going to store the transfers in n=k_size files, one for each requested k1 */
-    class_alloc (ptr2->transfers_files, ptr2->tt2_size*sizeof(FILE *), ptr2->error_message);
-    class_alloc (ptr2->transfers_paths, ptr2->tt2_size*sizeof(char *), ptr2->error_message);
+  fclose (status_file);
 
-    for(int index_tt=0; index_tt<ptr2->tt2_size; ++index_tt) {
-      
-      /* The name of each transfers file will have the tt index in it */
-      class_alloc (ptr2->transfers_paths[index_tt], _FILENAMESIZE_*sizeof(char), ptr2->error_message);
-      sprintf (ptr2->transfers_paths[index_tt], "%s/transfers_%03d.dat", ptr2->transfers_dir, index_tt);
-      if (ppr2->store_transfers_to_disk == _TRUE_)
-        class_open (ptr2->transfers_files[index_tt], ptr2->transfers_paths[index_tt], "wb", ptr2->error_message);
-      
+  if (ptr2->transfers_layout == tile_transfers_layout) {
+
+    class_test (files_size != ptr2->tiles_size,
+      ptr2->error_message,
+      "'%s' lists %d files, but there are %d groups of transfer types",
+      ptr2->transfers_status_path, files_size, ptr2->tiles_size);
+
+    return _SUCCESS_;
+  }
+
+  /* Give the types that are not on disk new file names, numbered after the existing ones */
+  int count_on_disk = 0;
+
+  for (int index_tt = 0; index_tt < ptr2->tt2_size; ++index_tt) {
+
+    if (ptr2->transfers_on_disk[index_tt] == _TRUE_) {
+      ++count_on_disk;
+      continue;
     }
 
-    if (ptr2->transfer2_verbose > 2)
-      printf ("     * created %d files to store transfer functions\n", ptr2->tt2_size);
+    class_test (ppr2->load_transfers_from_disk == _TRUE_,
+      ptr2->error_message,
+      "transfer type %s not found in '%s'", ptr2->tt2_labels[index_tt], ptr2->transfers_dir);
 
+    sprintf (ptr2->transfers_paths[index_tt], "%s/transfers_%03d.dat", ptr2->transfers_dir, files_size++);
   }
-  
+
+  if (ptr2->transfer2_verbose > 1)
+    printf (" -> found %d of %d transfer types in '%s' (l_max=%d)\n",
+      count_on_disk, ptr2->tt2_size, ptr2->transfers_dir, l_max);
 
   return _SUCCESS_;
 
@@ -1070,34 +1564,25 @@ int transfer2_indices_of_transfers(
 
 
 /**
- * Determine the l-values where the transfer functions will be computed.
- * 
- * This function basically copies the l-sampling of the first-order transfer
- * functions (ptr->l, which coincides with pbs->l) into ptr2->l.  This original
- * sampling was computed in transfer_get_l_list(), and it is just a log + linear
- * sampling.
+ * Read the largest l of the transfer functions stored on disk from the status file of the
+ * transfers directory, which must be already open. The file is read up to the l_max line
+ * of the header, so that the next line read is the first of the list of files. If the
+ * line is not found, l_max is set to -1.
  */
-
-int transfer2_get_l_list (
-      struct precision * ppr,
-      struct precision2 * ppr2,
-      struct perturbs2 * ppt2,
-      struct bessels * pbs,
-      struct bessels2 * pbs2,
-      struct transfers2 * ptr2
-      )
+int transfer2_status_file_l_max(
+        FILE * status_file,
+        int * l_max
+        )
 {
 
-  /* Just consider all l's in pbs->l regardless of the mode */
-  ptr2->l_size = pbs->l_size; 
-  
-  /* Copy the l's from pbs->l into ptr2->l */
-  class_alloc(ptr2->l, ptr2->l_size*sizeof(int), ptr2->error_message);
+  char line[_FILENAMESIZE_];
+
+  *l_max = -1;
+
+  while (fgets (line, _FILENAMESIZE_, status_file) != NULL)
+    if (sscanf (line, "l_max = %d", l_max) == 1)
+      break;
 
-  for (int index_l=0; index_l < ptr2->l_size; index_l++) {
-    ptr2->l[index_l] = pbs->l[index_l];
-  }
-  
   return _SUCCESS_;
 
 }
@@ -1106,530 +1591,1151 @@ int transfer2_get_l_list (
 
 
 /**
- * Fill the arrays that deal with the (l,m) indexing of the ptr2->transfer
- * array, and create a correspondence between source and transfer functions.
- * 
- * The following arrays will be filled:
+ * Write the status file of the transfers directory.
  *
- * - ptr2->lm_array[index_l][index_m], which contains the index associated with a given (l,m) couple
- *   and is used to access the ptr2->transfer array.
- * - ptr2->corresponding_index_l[index_tt2], which gives the index in ptr2->l for the 
- *   considered transfer type.
- * - ptr2->corresponding_index_m[index_tt2], which gives the index in ptr2->m for the 
- *   considered transfer type.
+ * The file describes the transfer functions stored on disk, so that they can be loaded
+ * or extended to larger l by a later run; see transfer2_read_status_file() for its
+ * format. When extending a previous run, the entries of the old status file are kept,
+ * including those of the transfer types that are not needed by the current run.
+ *
+ * The file is first written to a temporary path and then renamed, so that an interrupted
+ * run does not leave behind a corrupted status file.
  */
-int transfer2_get_lm_lists (
-        struct precision * ppr,
+int transfer2_write_status_file(
         struct precision2 * ppr2,
         struct perturbs2 * ppt2,
-        struct bessels * pbs,
-        struct bessels2 * pbs2,
         struct transfers2 * ptr2
         )
-{ 
+{
 
-  // =========================================================================================
-  // =                                (l,m) indexing of arrays                               =
-  // =========================================================================================
+  char status_path_tmp[_FILENAMESIZE_];
+  sprintf (status_path_tmp, "%s.tmp", ptr2->transfers_status_path);
 
-  /* Fill ptr2->lm_array, which contains the index associated with a given (l,m) couple.
-  lm_array is useful every time you need a specific (l,m) value from the transfer
-  function array: ptr2->transfer[index_type + ptr2->lm_array[index_l][index_m]]. */
+  class_open (ptr2->transfers_status_file, status_path_tmp, "w", ptr2->error_message);
 
-  class_alloc(ptr2->lm_array, ptr2->l_size*sizeof(int*), ptr2->error_message);    
-  
-  for (int index_l=0; index_l<ptr2->l_size; ++index_l) {
-  
-    int l = ptr2->l[index_l];
-  
-    class_calloc (ptr2->lm_array[index_l],
-                  ppr2->index_m_max[l]+1,
-                  sizeof(int),
-                  ptr2->error_message);
+  long int k3_size;
+  double k_checksum, k3_checksum;
 
-    /* We enter the loop only if index_m_max >= 0. This is false if l<ptr2->m[0],
-    for example for l=2 and m_min=3 */
-    for (int index_m=0; index_m <= ppr2->index_m_max[l]; ++index_m) {
+  class_call (transfer2_get_k_checksum (ppt2, ptr2, &k3_size, &k_checksum, &k3_checksum),
+    ptr2->error_message,
+    ptr2->error_message);
 
-      ptr2->lm_array[index_l][index_m] = multipole2offset_indexl_indexm (
-                                           ptr2->l[index_l],
-                                           ptr2->m[index_m],
-                                           ptr2->l, ptr2->l_size,
-                                           ptr2->m, ptr2->m_size
-                                           );
-                                                           
-      /* Debug - Print the lm_array */
-      // printf ("(l,m) = (%d,%d) corresponds to an offset of %d\n",
-      //   ptr2->l[index_l], ptr2->m[index_m], ptr2->lm_array[index_l][index_m]);
+  /* When extending a previous run, the old status file gives the largest stored l
+  and the list of the stored files */
+  FILE * old_status_file = NULL;
+  char line[_FILENAMESIZE_];
+  int l_max = ptr2->l[ptr2->l_size-1];
 
-    } // end of for(index_m)
-  } // end of for(index_l)
+  if (ppr2->extend_transfers_on_disk == _TRUE_) {
 
+    class_open (old_status_file, ptr2->transfers_status_path, "r", ptr2->error_message);
 
+    /* Read the header up to l_max, so that only the list of files is left */
+    int l_max_old;
+    class_call (transfer2_status_file_l_max (old_status_file, &l_max_old),
+      ptr2->error_message,
+      ptr2->error_message);
 
-  // ======================================================================================
-  // =                            Transfer-source correspondence                          =
-  // ======================================================================================
+    class_test (l_max_old < 0,
+      ptr2->error_message,
+      "could not read l_max from '%s'", ptr2->transfers_status_path);
 
-  /* In the transfer2.c module, a transfer type (index_tt2) encloses both the multipole
-  (l,m) and the source type (temperature, polarization, etc). The lm_array we
-  have defined above serve the purpose of generating an univocal index_tt2 given the
-  (l,m) multipole. Here, we do the inverse operation by univocally associating to index_tt2
-  the multipole indices (l,m) */
+    l_max = MAX (l_max, l_max_old);
+  }
 
-  /* For a given transfer type index index_tt, these arrays contain the corresponding
-  indices in ptr2->l and ptr2->m */
-  class_alloc (ptr2->corresponding_index_l, ptr2->tt2_size*sizeof(int), ptr2->error_message);
-  class_alloc (ptr2->corresponding_index_m, ptr2->tt2_size*sizeof(int), ptr2->error_message);
+  /* Header */
+  fprintf (ptr2->transfers_status_file, "# Second-order transfer functions in %s; do not edit.\n", ptr2->transfers_dir);
+  fprintf (ptr2->transfers_status_file, "layout = %s\n",
+    (ptr2->transfers_layout == tile_transfers_layout) ? "tiles" : "types");
+  fprintf (ptr2->transfers_status_file, "storage = %s\n", _SONG_STORAGE_TYPE_);
+  fprintf (ptr2->transfers_status_file, "k_size = %d\n", ppt2->k_size);
+  fprintf (ptr2->transfers_status_file, "k3_size = %ld\n", k3_size);
+  fprintf (ptr2->transfers_status_file, "k_checksum = %.17e\n", k_checksum);
+  fprintf (ptr2->transfers_status_file, "k3_checksum = %.17e\n", k3_checksum);
+  fprintf (ptr2->transfers_status_file, "l_max = %d\n", l_max);
+
+  /* Files already on disk */
+  if (old_status_file != NULL) {
+    while (fgets (line, _FILENAMESIZE_, old_status_file) != NULL)
+      fputs (line, ptr2->transfers_status_file);
+    fclose (old_status_file);
+  }
 
-  /* For a given transfer type index index_tt, these arrays contain the indices corresponding
-  to the monopole of index_tt in ptr2->transfers and ppt2->sources, respectively. */
-  class_alloc (ptr2->index_tt2_monopole, ptr2->tt2_size*sizeof(int), ptr2->error_message);
-  class_alloc (ptr2->index_pt2_monopole, ptr2->tt2_size*sizeof(int), ptr2->error_message);
+  /* Files written by this run; only their name, relative to the transfers directory */
+  for (int index_file = 0; index_file < ptr2->transfers_files_size; ++index_file) {
 
-  for (int index_tt = 0; index_tt < ptr2->tt2_size; index_tt++) {
-    
-    /* Initialise the current indices to -1 */
-    int index_l = -1;
-    int index_m = -1;
+    char * filename = strrchr (ptr2->transfers_paths[index_file], '/') + 1;
 
+    if (ptr2->transfers_layout == tile_transfers_layout) {
+      char field = (ptr2->tile_tt_size[index_file] > 0) ? ptr2->tt2_labels[ptr2->tile_tt[index_file][0]][0] : '-';
+      fprintf (ptr2->transfers_status_file, "%c_m%d %s\n",
+        field, ptr2->m[index_file % ptr2->m_size], filename);
+    }
+    else if (ptr2->transfers_on_disk[index_file] == _FALSE_) {
+      fprintf (ptr2->transfers_status_file, "%s %s\n", ptr2->tt2_labels[index_file], filename);
+    }
+  }
 
-    /* - Photon temperature */
-    if ((ppt2->has_source_T==_TRUE_)
-    && (index_tt >= ptr2->index_tt2_T) && (index_tt < ptr2->index_tt2_T+ptr2->n_transfers)) {
+  fclose (ptr2->transfers_status_file);
 
-      /* Store the position of the temperature monopole in ppt2->sources and ptr2->transfer */
-      ptr2->index_pt2_monopole[index_tt] = ppt2->index_tp2_T;
-      ptr2->index_tt2_monopole[index_tt] = ptr2->index_tt2_T;
+  class_test (rename (status_path_tmp, ptr2->transfers_status_path) != 0,
+    ptr2->error_message,
+    "could not rename '%s' to '%s'", status_path_tmp, ptr2->transfers_status_path);
 
-      /* Find (l,m) associated with index_tt */
-      int lm_offset = index_tt - ptr2->index_tt2_monopole[index_tt];
-      offset2multipole_indexl_indexm (lm_offset, ptr2->l, ptr2->l_size, ptr2->m, ptr2->m_size,
-        &index_l, &index_m);
+  if (ptr2->transfer2_verbose > 2)
+    printf ("     * wrote the content of the transfers directory to '%s'\n", ptr2->transfers_status_path);
 
-      /* Set the labels of the transfer types */
-      sprintf(ptr2->tt2_labels[index_tt], "T_%d_%d",ptr2->l[index_l],ptr2->m[index_m]);
+  return _SUCCESS_;
 
-      /* Some debug */
-      // printf("T, index_tt=%d: lm_offset=%d -> (%d,%d), label=%s, monopole_tr=%d, monopole_pt=%d\n",
-      //   index_tt, lm_offset, ptr2->l[index_l], ptr2->m[index_m],
-      //   ptr2->tt2_labels[index_tt],
-      //   ptr2->index_tt2_monopole[index_tt], ptr2->index_pt2_monopole[index_tt]);
-    }
+}
 
 
-    /* - Photon E-mode polarization */
-    
-    else if ((ppt2->has_source_E==_TRUE_)
-    && (index_tt >= ptr2->index_tt2_E) && (index_tt < ptr2->index_tt2_E+ptr2->n_transfers)) {
 
-      /* Store the position of the E-modes monopole in ppt2->sources and ptr2->transfer */
-      ptr2->index_pt2_monopole[index_tt] = ppt2->index_tp2_E;
-      ptr2->index_tt2_monopole[index_tt] = ptr2->index_tt2_E;
 
-      /* Find (l,m) associated with index_tt */
-      int lm_offset = index_tt - ptr2->index_tt2_monopole[index_tt];
-      offset2multipole_indexl_indexm (lm_offset, ptr2->l, ptr2->l_size, ptr2->m, ptr2->m_size,
-        &index_l, &index_m);
+/**
+ * Free all the memory space allocated by transfer2_init().
+ */ 
+int transfer2_free(
+      struct precision2 * ppr2,
+      struct perturbs2 * ppt2,
+      struct transfers2 * ptr2
+      )
+{
 
-      /* Set the labels of the transfer types */
-      sprintf(ptr2->tt2_labels[index_tt], "E_%d_%d",ptr2->l[index_l],ptr2->m[index_m]);
+  if (ptr2->has_cls == _TRUE_) {
+  
+    free (ptr2->tt2_labels);
+  
+    int k1_size = ppt2->k_size;
 
-      /* Some debug */
-      // printf("E, index_tt=%d: lm_offset=%d -> (%d,%d), label=%s, monopole_tr=%d, monopole_pt=%d\n",
-      //   index_tt, lm_offset, ptr2->l[index_l], ptr2->m[index_m],
-      //   ptr2->tt2_labels[index_tt],
-      //   ptr2->index_tt2_monopole[index_tt], ptr2->index_pt2_monopole[index_tt]);
+    /* Free the k1 level of ptr2->transfer only if we are neither loading nor storing the transfers to disk.
+    The memory management in those two cases is handled separately via the transfer_store and transfer_load
+    functions  */
+    if ((ppr2->store_transfers_to_disk==_FALSE_) && (ppr2->load_transfers_from_disk==_FALSE_)) {
+      for (int index_k1 = 0; index_k1 < k1_size; ++index_k1)
+        if (ptr2->has_allocated_transfers[index_k1] == _TRUE_)
+          class_call(transfer2_free_k1_level(ppt2, ptr2, index_k1), ptr2->error_message, ptr2->error_message);
+      for (int index_tt = 0; index_tt < ptr2->tt2_size; ++index_tt)
+        free (ptr2->transfer[index_tt]);
     }
 
+    free (ptr2->transfer);
 
-    /* - Photon B-mode polarization */
+    free (ptr2->has_allocated_transfers);
 
-    else if ((ppt2->has_source_B==_TRUE_)
-    && (index_tt >= ptr2->index_tt2_B) && (index_tt < ptr2->index_tt2_B+ptr2->n_transfers)) {
+    for(int index_k1=0; index_k1<ppt2->k_size; ++index_k1) {
+      free (ptr2->k_size_k1k2[index_k1]);
+      free (ptr2->k_physical_start_k1k2[index_k1]);
+      free (ptr2->k_physical_size_k1k2[index_k1]);
+      free (ptr2->k_min_k1k2[index_k1]);
+      free (ptr2->k_max_k1k2[index_k1]);
+    }
+    free (ptr2->k_size_k1k2);
+    for(int index_k1=0; index_k1<ppt2->k_size; ++index_k1) {
+      free (ptr2->k3_grid[index_k1]);
+      free (ptr2->delta_k3[index_k1]);
+    }
+    free (ptr2->k3_grid);
+    free (ptr2->delta_k3);
+    free (ptr2->k3_grid_buffer);
+    free (ptr2->k_physical_start_k1k2);
+    free (ptr2->k_physical_size_k1k2);
+    free (ptr2->k_min_k1k2);
+    free (ptr2->k_max_k1k2);
+      
+    free (ptr2->l);
+    free (ptr2->m);
 
-      /* Store the position of the B-modes monopole in ppt2->sources and ptr2->transfer */
-      ptr2->index_pt2_monopole[index_tt] = ppt2->index_tp2_B;
-      ptr2->index_tt2_monopole[index_tt] = ptr2->index_tt2_B;
+    free (ptr2->corresponding_index_l);
+    free (ptr2->corresponding_index_m);
+    free (ptr2->index_tt2_monopole);
+    free (ptr2->index_pt2_monopole);
+  
+    for (int index_l=0; index_l<ptr2->l_size; ++index_l)
+      free (ptr2->lm_array[index_l]);
+    free (ptr2->lm_array);
 
-      /* Find (l,m) associated with index_tt */
-      int lm_offset = index_tt - ptr2->index_tt2_monopole[index_tt];
-      offset2multipole_indexl_indexm (lm_offset, ptr2->l, ptr2->l_size, ptr2->m, ptr2->m_size,
-        &index_l, &index_m);
+    /* Free file arrays */
+    if ((ppr2->store_transfers_to_disk == _TRUE_) || (ppr2->load_transfers_from_disk == _TRUE_)) {
 
-      /* Set the labels of the transfer types */
-      sprintf(ptr2->tt2_labels[index_tt], "B_%d_%d",ptr2->l[index_l],ptr2->m[index_m]);
+      // fclose(ptr2->transfers_status_file);
 
-      /* Some debug */
-      // printf("B, index_tt=%d: lm_offset=%d -> (%d,%d), label=%s, monopole_tr=%d, monopole_pt=%d\n",
-      //   index_tt, lm_offset, ptr2->l[index_l], ptr2->m[index_m],
-      //   ptr2->tt2_labels[index_tt],
-      //   ptr2->index_tt2_monopole[index_tt], ptr2->index_pt2_monopole[index_tt]);
-    }
+      for(int index_file=0; index_file<ptr2->transfers_files_size; ++index_file)
+        free (ptr2->transfers_paths[index_file]);
 
-    /* Check the result */
-    class_test ((index_l>=ptr2->l_size) || (index_m>=ptr2->m_size) || (index_l<0) || (index_m<0),
-      ptr2->error_message,
-      "index_tt=%d: result (index_l,index_m)=(%d,%d) is out of bounds index_l=[%d,%d], index_m=[%d,%d]\n",
-      index_tt, index_l, index_m, 0, ptr2->l_size-1, 0, ptr2->m_size-1);
+      free (ptr2->transfers_files);
+      free (ptr2->transfers_paths);
+      free (ptr2->transfers_on_disk);
+    }
 
-    /* Write the result */
-    ptr2->corresponding_index_l[index_tt] = index_l;
-    ptr2->corresponding_index_m[index_tt] = index_m;
-    
-  } // end of for(index_tt)
+    for (int index_tile=0; index_tile<ptr2->tiles_size; ++index_tile)
+      free (ptr2->tile_tt[index_tile]);
+    free (ptr2->tile_tt);
+    free (ptr2->tile_tt_size);
 
+  } // end of if(has_cls)
 
   return _SUCCESS_;
-
+  
 }
-    
-
-
-
-
-
 
 
 /**
- * For a given (k1,k2) pair, find the size of the corresponding k3 grid.
  *
- * At second order, the transfer functions are sampled in a 3D Fourier space (k1,k2,k3).
- * The k3 direction is special because in the line of sight integral (see eq. 5.95 of
- * http://arxiv.org/abs/1405.2280) it is convolved with a high frequency projection function
- * J_Llm(k3*tau). Therefore, the k3 direction requires a special sampling that can catch the
- * oscillations of J_Llm. Here we find the size of such sampling for a given (k1,k2) pair and
- * store it in the array ptr2->k_size_k1k2[index_k1][index_k2].
- * 
- * More in detail, the oscillation frequency of the transfer function T(k1,k2,k3) in the k3
- * direction is dictated by the Bessel functions in the line of sight integral. These have
- * argument k3*(tau_0-tau); since most of the sources are localised at recombination, it results
- * that k3 oscillates with a frequency of tau_0-tau_rec~tau_0. The other directions, k1 and
- * k2, inherit the oscillation frequency of the sources at recombination, which is roughly
- * tau_rec/sqrt(3) because of tight coupling. Therefore, the k3 direction has a frequency
- * tau_0/tau_rec~80 times larger than the k1 and k2 directions. On the other hand, for the
- * k1 and k2 directions we keep the same sampling as in the sources, that is, ppt2->k.
- * 
- * Extrapolation: to solve the bispectrum integral (eq. 6.36) it is useful to extrapolate
- * the transfer functions in the k3 direction beyond their physical limits, that is, beyond
- * k3_min = |k1-k2| and k3_max = k1+k2. The reason is purely numerical: eventually, the
- * contributions from the extrapolated regions will cancel. The extrapolation has the purpose
- * of stabilizing an problematic integration.
+ * Initialize indices and arrays in the second-order transfer functions structure.
  *
- * TODO: For later times in the line-of-sight integration, where the frequency tau0-tau is
- * small, one can think of using a less dense k3-grid.
+ * In detail, this function does:
+ *
+ *  -# Computes the list of multipoles where to compute the transfer functions via
+ *     transfer2_get_l_list().    
+ *
+ *  -# Determine which transfer functions to compute based on the previous modules, and
+ *     assign them the ptr2->index_tt2_XXX indices.
+ *
+ *  -# Define the indexing strategy of the transfer functions array (ptr2->transfer)
+ *     and establish a correspondence between line of sight sources and transfer 
+ *     functions, via transfer2_get_lm_lists().
+ *
+ *  -# In transfer2_get_k3_sizes(), fill the array ptr2->k_size_k1k2 which, for each
+ *     (k1,k2) pair, determines the size of the k3 grid of the transfer functions, based
+ *     on the triangular condition.
+ *
+ *  -# Allocate the type level of the transfer array, ptr2->transfer[index_tt].
+ *
+ *  -# Open the files where we will store the transfer functions at the end of the computation.
  *
- * The following arrays are filled in this function:
- *  - ptr2->k_min_k1k2[index_k1][index_k2]
- *  - ptr2->k_max_k1k2[index_k1][index_k2]
- *  - ptr2->k_size_k1k2[index_k1][index_k2]
- *  - ptr2->k_physical_start_k1k2[index_k1][index_k2]
- *  - ptr2->k_physical_size_k1k2[index_k1][index_k2]
  */
-int transfer2_get_k3_size (
-      struct precision * ppr,
-      struct precision2 * ppr2,
-      struct perturbs2 * ppt2,
-      struct bessels * pbs,
-      struct bessels2 * pbs2,
-      struct transfers2 * ptr2,
-      int index_k1,
-      int index_k2
-      )
+int transfer2_indices_of_transfers(
+          struct precision * ppr,
+          struct precision2 * ppr2,
+          struct perturbs2 * ppt2,
+          struct bessels * pbs,
+          struct bessels2 * pbs2,
+          struct transfers * ptr,
+          struct transfers2 * ptr2
+          )
 {
 
-  class_test (index_k2 > index_k1,
+  /* Get l values where to compute the transfer functions */
+  class_call (transfer2_get_l_list(ppr,ppr2,ppt2,pbs,pbs2,ptr2),
     ptr2->error_message,
-    "stop to avoid segmentation fault, as we always require k1 >= k2.");
+    ptr2->error_message);
+  
+  /* Get the m values where to compute the transfer functions, copying them
+  from ppr2->m. */
+  ptr2->m_size = ppr2->m_size;
+  class_alloc (ptr2->m, ptr2->m_size*sizeof(int), ptr2->error_message);
+  for (int index_m=0; index_m<ptr2->m_size; ++index_m)
+    ptr2->m[index_m] = ppr2->m[index_m];
 
 
-  // ====================================================================================
-  // =                               Determine k3 limits                                =
-  // ====================================================================================
+  // ======================================================================================
+  // =                            What transfers to compute?                              =
+  // ======================================================================================
 
-  /* Extract the minimum and maximum values of k3 computed in the perturbations2.c module.
-  They are computed taking into consideration the triangular condition, whereby
-  \vec{k3} = \vec{k1} + \vec{k2}, and the overall minimum and maximum k-values
-  (ppt2->k[0] and ppt2->k[ppt2->k_size-1], respectively). */
-  int k_pt_size = ppt2->k3_size[index_k1][index_k2];
-  double k_min_pt = ppt2->k3[index_k1][index_k2][0];
-  double k_max_pt = ppt2->k3[index_k1][index_k2][k_pt_size-1];
+  /* Index that will keep track of the trasfer-function type to compute */
+  int index_tt = 0;
 
-  /* By default, for the transfer functions we take the same k-limits used for the sources */
-  double k_min_tr = k_min_pt;
-  double k_max_tr = k_max_pt;
+  /* Number of transfer functions that need to be computed for each source type (temperature,
+  polarisation...). This is given by all the possible (l,m) combinations contained in ptr2->l
+  and ppr2->m */
+  ptr2->n_transfers = size_indexl_indexm (ptr2->l, ptr2->l_size, ppr2->m, ppr2->m_size);
+  
+  /* Number of non-vanishing E-mode transfer functions, for debug purposes */
+  ptr2->n_nonzero_transfers_E = ptr2->n_transfers;
+  if (ppr2->compute_m[0])
+    ptr2->n_nonzero_transfers_E -= 2;
+  if (ppr2->compute_m[1])
+    ptr2->n_nonzero_transfers_E -= 1;
 
-  /* When computing spectra and bispectra, it is convenient to extend the k-grid beyond the
-  physical limits dictated by the triangular condition in order to make the successive
-  integrations numerically stabler. Here we do such extension of k_min_tr and k_max_tr. */
-  if (ppr->bispectra_k3_extrapolation != no_k3_extrapolation) {
+  /* Number of non-vanishing B-mode transfer functions, for debug purposes */
+  ptr2->n_nonzero_transfers_B = ptr2->n_transfers;
+  if (ppr2->compute_m[0])
+    ptr2->n_nonzero_transfers_B -= ptr2->l_size;
+  if (ppr2->compute_m[1])
+    ptr2->n_nonzero_transfers_B -= 1;
 
-    /* The physical range is the one dictated by the triangular condition: k1 + k2 = k3 */
-    double physical_k3_range = k_max_pt - k_min_pt;
-    
-    /* The extended range allows for the Bessel function j(k3*(tau0 - tau_rec)) to develop at least
-    ppr->extra_k3_oscillations oscillations in k3 in order to stabilize the bispectrum integral. */
-    double extended_k3_range_right = 2.*_PI_*ppr->extra_k3_oscillations_right/(ptr2->tau0 - ptr2->tau_rec);
-    double extended_k3_range_left  = 2.*_PI_*ppr->extra_k3_oscillations_left/(ptr2->tau0 - ptr2->tau_rec);
+  /* Photon temperature transfer functions */
+  if (ppt2->has_source_T) {
 
-    if (physical_k3_range < extended_k3_range_right)
-      k_max_tr += (extended_k3_range_right - physical_k3_range);    
+    ptr2->index_tt2_T = index_tt;
+    index_tt += ptr2->n_transfers; 
+  }
 
-    /* Never go beyond the maximum allowed value for k1 and k2 */
-    k_max_tr = MIN (k_max_tr, ppt2->k[ppt2->k_size-1]);
+  /* Photon E-mode polarisation transfer functions */
+  if (ppt2->has_source_E) {
+  
+    ptr2->index_tt2_E = index_tt;
+    index_tt += ptr2->n_transfers;    
+  }
 
-    if (physical_k3_range < extended_k3_range_left)
-      k_min_tr -= (extended_k3_range_left - physical_k3_range);
+  /* Photon B-mode polarisation transfer functions. They will be computed
+  only for non scalar modes, otherwise they just vanish. */
+  if (ppt2->has_source_B) {
 
-    /* Never go below the smallest between the usual k-range and the physical bound. */
-    k_min_tr = MAX (k_min_tr, MIN(ppt2->k[0], k_min_pt));
+    ptr2->index_tt2_B = index_tt;
+    index_tt += ptr2->n_transfers;
+  }
 
-    /* If the user specifies a negative number of oscillations, then extend the integration
-    range all the way to the minimum and maximum k's considered in the code */    
-    if (ppr->extra_k3_oscillations_left < 0)
-      k_min_tr = ppt2->k[0];
 
-    if (ppr->extra_k3_oscillations_right < 0)
-      k_max_tr = ppt2->k[ppt2->k_size-1];
+  /* Total number of transfer functions to compute */
+  ptr2->tt2_size = index_tt;
 
-    /* Debug - Print the change in the k3-range */
-    // printf("physical_k3_range=%g, extended_k3_range_right=%g\n", physical_k3_range, extended_k3_range_right);
-    // printf("PRE:  k_max_tr = %g\n", k_max_pt);
-    // printf("POST: k_max_tr = %g\n", k_max_tr);
+  /* Initialise the labels of the transfer types */
+  class_calloc (ptr2->tt2_labels,
+    ptr2->tt2_size*_MAX_LENGTH_LABEL_,
+    sizeof(char),
+    ptr2->error_message);
 
-  }
+  if (ptr2->transfer2_verbose > 1) {
+    printf (" -> will compute tt2_size=%d transfer functions: ", ptr2->tt2_size);
+    if (ppt2->has_source_B == _TRUE_) printf ("T=%d ", ptr2->n_transfers);
+    if (ppt2->has_source_E == _TRUE_) printf ("E=%d (%d non-zero) ",
+      ptr2->n_transfers, ptr2->n_nonzero_transfers_E);
+    if (ppt2->has_source_B == _TRUE_) printf ("B=%d (%d non-zero) ",
+      ptr2->n_transfers, ptr2->n_nonzero_transfers_B);
+    printf ("\n");
+  }  
 
-  /* Update the transfer structure with the k3 limits */
-  ptr2->k_min_k1k2[index_k1][index_k2] = k_min_tr;
-  ptr2->k_max_k1k2[index_k1][index_k2] = k_max_tr;
   
-  /* Check that we the grid where we sampled the the projection functions J can accomodate for the required
-  values of k3. We do not need to test the lower limit as the Bessel grid always starts from zero. */
-  class_test (k_max_tr > pbs2->xx_max/ptr2->tau0,
+  // ==============================================================================
+  // =                            Fill (l,m) arrays                               =
+  // ==============================================================================
+
+  class_call (transfer2_get_lm_lists (
+                ppr,
+                ppr2,
+                ppt2,
+                pbs,
+                pbs2,
+                ptr2),
     ptr2->error_message,
-    "xx_max is not large enough. The projection functions J(k*(tau0-tau)) do not cover the needed k-range\
- (k_max=%g,tau0=%g,xx_max=%g). Maybe you are using too much extrapolation.", k_max_tr, ptr2->tau0, pbs2->xx_max);
+    ptr2->error_message);
 
 
 
-  // ====================================================================================
-  // =                            Determine linear step                                 =
-  // ====================================================================================
+  // ==============================================================================
+  // =                         Group transfer types in tiles                      =
+  // ==============================================================================
 
-  /* Find the linear step to use for the k3 sampling, based on the requested type of
-  k-sampling. */
-  double k_step_max;
+  /* Group together the transfer types with the same field and the same m, in the order
+  of ptr2->l. In the tiles layout, the k3 arrays of each group are contiguous for a given
+  (k1,k2) pair, so that a consumer that needs many l's at once, like the bispectrum, can
+  read them from disk in a single pass. The groups are built for both layouts, but they
+  are used only in the tiles layout. */
 
-  /* In the CLASS-type sampling, we reason in terms of oscillations. We know that, for sources
-  peaked at recombination, the transfer function oscillates in k3 with a frequency of 
-  roughly tau0-tau_rec. Here we choose a linear step in k3 which is proportional to such
-  frequency, via the parameter q_linstep_song. */
+  int field_size = ptr2->tt2_size/ptr2->n_transfers;
+  ptr2->tiles_size = field_size*ptr2->m_size;
 
-  if (ptr2->k_sampling == class_transfer2_k3_sampling) {
+  class_calloc (ptr2->tile_tt_size, ptr2->tiles_size, sizeof(int), ptr2->error_message);
+  class_alloc (ptr2->tile_tt, ptr2->tiles_size*sizeof(int *), ptr2->error_message);
 
-    k_step_max = 2.*_PI_/(ptr2->tau0-ptr2->tau_rec)*ppr2->q_linstep_song;
-    
-    /* In older versions, the step was determined with respect to the comoving sound horizon
-    at recombination. */
-    if ((ppr->load_run == _TRUE_) && (ppr2->old_run == _TRUE_))
-      k_step_max = 2.*_PI_/ptr2->rs_rec*ppr2->q_linstep_song;
+  for (int index_tile=0; index_tile < ptr2->tiles_size; ++index_tile)
+    class_alloc (ptr2->tile_tt[index_tile], ptr2->l_size*sizeof(int), ptr2->error_message);
 
+  for (int index_field=0; index_field < field_size; ++index_field) {
+    for (int index_l=0; index_l < ptr2->l_size; ++index_l) {
+      for (int index_m=0; index_m <= ppr2->index_m_max[ptr2->l[index_l]]; ++index_m) {
+        int index_tile = index_field*ptr2->m_size + index_m;
+        ptr2->tile_tt[index_tile][ptr2->tile_tt_size[index_tile]++] =
+          index_field*ptr2->n_transfers + ptr2->lm_array[index_l][index_m];
+      }
+    }
   }
 
-  /* In the Bessel-type sampling, we require the maximum step between two points to be
-  determined by the sampling of the projection functions J, which in turn is controlled
-  by the user via the parameter bessel_x_step_song. The argument of J is x=k*(tau0-tau)
-  and is linearly sampled in x. Hence, the maximum step in k is given by the x/tau0. */
 
-  else if (ptr2->k_sampling == bessel_k3_sampling) {
-    
-    k_step_max = pbs2->xx_step/ptr2->tau0;
 
-  }
+  // ==================================================================================
+  // =                       Determine range of k3(k1,k2)                             =
+  // ==================================================================================
 
-  class_test(k_step_max == 0,
+  class_call (transfer2_get_k3_sizes (
+                ppr,
+                ppr2,
+                ppt2,
+                pbs,
+                pbs2,
+                ptr,
+                ptr2),
     ptr2->error_message,
-    "stop to avoid infinite loop");
+    ptr2->error_message);
 
 
-  // ====================================================================================
-  // =                              Determine k3 size                                   =
-  // ====================================================================================
 
-  /* We shall sample k3 in all the points that were used for the line of sight sources,
-  plus all the points from a linear sampling with a step of k_step_max. */
-  
-  int index_k_pt = 0;
-  int index_k_tr = 0;  
-  double k = k_min_tr;
-  index_k_tr++;
+  // ==================================================================================
+  // =                              Compute the k3 grids                              =
+  // ==================================================================================
 
+  /* Compute the k3 grid and its trapezoidal measure for all (k1,k2) pairs, and store them
+  in ptr2->k3_grid and ptr2->delta_k3. The grids are needed by this module to compute the
+  transfer functions, and by the spectra2 and bispectra2 modules to integrate them in k3;
+  computing them here once avoids rebuilding them in each of those loops. All grids are
+  stored contiguously in ptr2->k3_grid_buffer. */
 
-  /* If the user requested for extrapolation, add unphysical points to the left of the
-  physical limit */
-  
-  if (ppr->bispectra_k3_extrapolation != no_k3_extrapolation) {
+#ifdef _OPENMP
+  double k3_grid_start = omp_get_wtime();
+#endif
 
-    /* We space the extra points linearly with the same step used for the physical regime */
-    double k_step = k_step_max;
-    
-    /* Uncomment to use the same step separating the first two points in the sources, instead.
-    This step can be very small, so we use an extra parameter to increase it. */
-    // double n = 1;
-    // double first_physical_step = ppt2->k3[index_k1][index_k2][1] - ppt2->k3[index_k1][index_k2][0];
-    // k_step = MIN (k_step_max, n*first_physical_step);
-    
-    class_test (k_step < ppr->smallest_allowed_variation,
-      ptr2->error_message,
-      "stopping to avoid segmentation fault, step=%g", k_step);
+  long k3_grid_buffer_size = 0;
+  for (int index_k1 = 0; index_k1 < ppt2->k_size; ++index_k1)
+    for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2)
+      k3_grid_buffer_size += 2*ptr2->k_size_k1k2[index_k1][index_k2];
 
-    while (k < k_min_pt) {
-      k += k_step;
-      index_k_tr++;
-    }
+  class_alloc (ptr2->k3_grid_buffer, k3_grid_buffer_size*sizeof(double), ptr2->error_message);
+  class_alloc (ptr2->k3_grid, ppt2->k_size*sizeof(double **), ptr2->error_message);
+  class_alloc (ptr2->delta_k3, ppt2->k_size*sizeof(double **), ptr2->error_message);
 
-    if (k != k_min_pt)
-      k = k_min_pt;
+  double * k3_grid_position = ptr2->k3_grid_buffer;
+
+  for (int index_k1 = 0; index_k1 < ppt2->k_size; ++index_k1) {
+
+    class_alloc (ptr2->k3_grid[index_k1], (index_k1+1)*sizeof(double *), ptr2->error_message);
+    class_alloc (ptr2->delta_k3[index_k1], (index_k1+1)*sizeof(double *), ptr2->error_message);
+
+    for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
+      int k3_size = ptr2->k_size_k1k2[index_k1][index_k2];
+      ptr2->k3_grid[index_k1][index_k2] = k3_grid_position;
+      ptr2->delta_k3[index_k1][index_k2] = k3_grid_position + k3_size;
+      k3_grid_position += 2*k3_size;
+    }
   }
-  
-  index_k_pt++;
 
-  /* The regime where the triangular condition is satisfied starts here */
-  ptr2->k_physical_start_k1k2[index_k1][index_k2] = index_k_tr-1;
+  int abort = _FALSE_;
+  #pragma omp parallel for schedule (dynamic)
+  for (int index_k1 = 0; index_k1 < ppt2->k_size; ++index_k1) {
 
-  /* Take the next points from the sources sampling as long as the step is small enough.
-  This assumes that ppt->k3 is a growing array. */
-  while ((index_k_pt < k_pt_size) && ((ppt2->k3[index_k1][index_k2][index_k_pt] - k) < k_step_max)) {
-    k = ppt2->k3[index_k1][index_k2][index_k_pt];
-    index_k_pt++;
-    index_k_tr++;
+    for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
+
+      int k3_size = ptr2->k_size_k1k2[index_k1][index_k2];
+      double * k3 = ptr2->k3_grid[index_k1][index_k2];
+      double * delta_k3 = ptr2->delta_k3[index_k1][index_k2];
+      int last_used_index_pt;
+
+      class_call_parallel (transfer2_get_k3_list(
+                             ppr,
+                             ppr2,
+                             ppt2,
+                             pbs,
+                             pbs2,
+                             ptr2,
+                             index_k1,
+                             index_k2,
+                             k3,  /* output */
+                             &last_used_index_pt
+                             ),
+        ptr2->error_message,
+        ptr2->error_message);
+
+      /* Print some information */
+      if (ptr2->transfer2_verbose > 3)
+        printf("     * (k1,k2)=(%.3g,%.3g): the k3-grid comprises sources+transfer+left+right=%d+%d+%d+%d points from %g to %g\n",
+          ppt2->k[index_k1], ppt2->k[index_k2],
+          last_used_index_pt,
+          ptr2->k_physical_size_k1k2[index_k1][index_k2] - last_used_index_pt,
+          ptr2->k_physical_start_k1k2[index_k1][index_k2],
+          k3_size - ptr2->k_physical_size_k1k2[index_k1][index_k2] - ptr2->k_physical_start_k1k2[index_k1][index_k2],
+          k3[0], k3[k3_size-1]);
+
+      /* Trapezoidal measure; the grids with less than two points, if any, get a zero measure */
+      for (int index_k3=0; index_k3 < k3_size; ++index_k3)
+        delta_k3[index_k3] = 0;
+
+      if (k3_size > 1) {
+        delta_k3[0] = k3[1] - k3[0];
+        for (int index_k3=1; index_k3 < k3_size-1; ++index_k3)
+          delta_k3[index_k3] = k3[index_k3+1] - k3[index_k3-1];
+        delta_k3[k3_size-1] = k3[k3_size-1] - k3[k3_size-2];
+      }
+    }
+
+    #pragma omp flush(abort)
+
+  } if (abort == _TRUE_) return _FAILURE_;
+
+  /* Print information on the memory and time used for the k3 grids */
+  if (ptr2->transfer2_verbose > 1) {
+    printf (" -> stored the k3 grids and trapezoidal weights for all (k1,k2) pairs: ~ %.3g MB", 
+      k3_grid_buffer_size*sizeof(double)/1e6);
+#ifdef _OPENMP
+    printf (", computed in %g s", omp_get_wtime() - k3_grid_start);
+#endif
+    printf ("\n");
   }
 
-  /* All the points that we added in the above while-loop satisfy the triangular condition */
-  ptr2->k_physical_size_k1k2[index_k1][index_k2] = index_k_pt;
 
-  /* Then, points spaced linearily with step k_step_max. Note that if the user asked for k3-extrapolation,
-  here we also add points beyond the physical limit dictated by the triangular condition. */
-  while (k < k_max_tr) {
 
-    k += k_step_max;
-    index_k_tr++;
+  // =======================================================================================
+  // =                      Allocate first levels of ptr2->transfer                        =
+  // =======================================================================================
+  
+  /* The array where we shall store the second-order transfer function, ptr2->transfer, has
+  five levels that should be indexed in the following way:
     
-    /* Take note of where the physical regime ends */
-    if ((k <= k_max_pt) && (k >= k_min_pt))
-      ptr2->k_physical_size_k1k2[index_k1][index_k2]++;
+        ptr2->transfer [index_tt]
+                       [index_k1]
+                       [index_k2]
+                       [index_k]
     
-  }
-  
-  /* Get number of points and allocate list */
-  if (k > k_max_tr)
-    ptr2->k_size_k1k2[index_k1][index_k2] = index_k_tr-1;
-  else
-    ptr2->k_size_k1k2[index_k1][index_k2] = index_k_tr;
+  index_tt includes both the transfer type (T,E,B) and the multipole indices (l,m).
+  index_k1 goes from 0 to ppt2->k_size.    
+  index_k2 goes from 0 to ppt2->k_size-index_k1.
+  index_k3 goes from 0 to ppt2->k3_size[index_k1][index_k2]. */
+
+  /* Counter to keep track of the memory usage of ptr2->transfer */
+  ptr2->count_memorised_transfers = 0;
+  ptr2->count_allocated_transfers = 0;
+    
+  /* Allocate transfer-type (tt2) level */  
+  class_alloc (
+    ptr2->transfer,
+    ptr2->tt2_size * sizeof(song_storage ***),
+    ptr2->error_message);
 
+  /* Allocate the index_tt level. The remaining k1, k2 and k levels will be allocated later
+  using the function transfer2_allocate_k1_level(). */
+  for (int index_tt = 0; index_tt < ptr2->tt2_size; ++index_tt) {
   
-  class_test (ptr2->k_size_k1k2[index_k1][index_k2] < 2,
-    ptr2->error_message,
-    "found less than 2 valid values for the k-grid of modes k1=%f, k2=%f. This should not happen\
- unless you set k3_size_min to a value lower than 2, which is not allowed as you need at least 2 points\
- to do linear interpolation.\n",
-    ppt2->k[index_k1], ppt2->k[index_k2])
+    int k1_size = ppt2->k_size;
+    
+    class_alloc (
+      ptr2->transfer[index_tt],
+      k1_size * sizeof(song_storage **),
+      ptr2->error_message);
   
-  class_test ((ptr2->k_physical_size_k1k2[index_k1][index_k2] != ptr2->k_size_k1k2[index_k1][index_k2])
-    && (ppr->bispectra_k3_extrapolation == no_k3_extrapolation),
-    ptr2->error_message,
-    "when no extrapolation is requested, all k's should be physical, i.e. satisfy the triangular condition.");
+  } // end of for(index_type)
   
-  class_test ((ptr2->k_physical_start_k1k2[index_k1][index_k2] != 0)
-    && (ppr->bispectra_k3_extrapolation == no_k3_extrapolation),
-    ptr2->error_message,
-    "when no extrapolation is requested, all k's should be physical, i.e. satisfy the triangular condition.");
-        
-  return _SUCCESS_;
+  /* Allocate and initialize the logical array that keeps track of the memory state of ptr2->transfers */
+  class_calloc(ptr2->has_allocated_transfers, ppt2->k_size, sizeof(short), ptr2->error_message);
+
+
+
+  // ==================================================================================
+  // =                             Create transfers files                             =
+  // ==================================================================================  
+
+  /* Create the files to store the transfer functions in */
+
+  ptr2->transfers_on_disk = NULL;
   
+  if ((ppr2->store_transfers_to_disk == _TRUE_) || (ppr2->load_transfers_from_disk == _TRUE_)) {
+
+    /* We are going to store the transfers in one file for each transfer type, or in one
+    file for each group of transfer types in the tiles layout */
+    if (ptr2->transfers_layout == tile_transfers_layout)
+      ptr2->transfers_files_size = ptr2->tiles_size;
+    else
+      ptr2->transfers_files_size = ptr2->tt2_size;
+
+    class_alloc (ptr2->transfers_files, ptr2->transfers_files_size*sizeof(FILE *), ptr2->error_message);
+    class_alloc (ptr2->transfers_paths, ptr2->transfers_files_size*sizeof(char *), ptr2->error_message);
+
+    for(int index_file=0; index_file<ptr2->transfers_files_size; ++index_file) {
+      
+      /* The name of each transfers file will have the tt index (or the tile index) in it */
+      class_alloc (ptr2->transfers_paths[index_file], _FILENAMESIZE_*sizeof(char), ptr2->error_message);
+      if (ptr2->transfers_layout == tile_transfers_layout)
+        sprintf (ptr2->transfers_paths[index_file], "%s/transfers_tile_%03d.dat", ptr2->transfers_dir, index_file);
+      else
+        sprintf (ptr2->transfers_paths[index_file], "%s/transfers_%03d.dat", ptr2->transfers_dir, index_file);
+      ptr2->transfers_files[index_file] = NULL;
+      
+    }
+
+    /* Find the transfer types that are already on disk, and the files that contain them */
+    class_calloc (ptr2->transfers_on_disk, ptr2->tt2_size, sizeof(short), ptr2->error_message);
+
+    if ((ppr2->load_transfers_from_disk == _TRUE_) || (ppr2->extend_transfers_on_disk == _TRUE_))
+      class_call (transfer2_read_status_file (ppr2, ppt2, ptr2),
+        ptr2->error_message,
+        ptr2->error_message);
+
+    /* Open the files for the transfer types that we are going to compute */
+    if (ppr2->store_transfers_to_disk == _TRUE_) {
+
+      int count_files = 0;
+
+      for(int index_file=0; index_file<ptr2->transfers_files_size; ++index_file) {
+        if ((ptr2->transfers_layout == type_transfers_layout) && (ptr2->transfers_on_disk[index_file] == _TRUE_))
+          continue;
+        class_open (ptr2->transfers_files[index_file], ptr2->transfers_paths[index_file], "wb", ptr2->error_message);
+        ++count_files;
+      }
+
+      if (ptr2->transfer2_verbose > 2)
+        printf ("     * created %d files to store transfer functions\n", count_files);
+    }
+
+  }
   
-} // end of transfer2_get_k3_size
+
+  return _SUCCESS_;
+
+}
 
 
 
 
 /**
- * For a given (k1,k2) pair, find the size of the corresponding k3 grid.
+ * Determine the l-values where the transfer functions will be computed.
  * 
- * This function relies on transfer2_get_k3_sizes() being called beforehand to compute
- * the array ptr2->k_size_k1k2[index_k1][index_k2].
- *
- * To understand what this function does, please refer to the documentation of
- * transfer2_get_k3_size(), of which this function is largely a copy.
+ * This function basically copies the l-sampling of the first-order transfer
+ * functions (ptr->l, which coincides with pbs->l) into ptr2->l.  This original
+ * sampling was computed in transfer_get_l_list(), and it is just a log + linear
+ * sampling.
  */
 
-int transfer2_get_k3_list (
+int transfer2_get_l_list (
       struct precision * ppr,
       struct precision2 * ppr2,
       struct perturbs2 * ppt2,
       struct bessels * pbs,
       struct bessels2 * pbs2,
-      struct transfers2 * ptr2,
-      int index_k1,
-      int index_k2,
-      double * k3, /**< output, array of size ptr2->k_size_k1k2[index_k1][index_k2] with
-                   the k3 sampling-points of the transfer function in (k1,k2) */
-      int * last_used_index_pt /**< output, last point in ppt2->k3 that appears in the
-                               transfer function k3 sampling; for debug purposes only. */
+      struct transfers2 * ptr2
       )
 {
 
-  /* Limits of k3 from the perturbations2.c module */
-
-  int k_pt_size = ppt2->k3_size[index_k1][index_k2];  
-  double k_min_pt = ppt2->k3[index_k1][index_k2][0];
-  double k_max_pt = ppt2->k3[index_k1][index_k2][k_pt_size-1];
-
-  /* The limits for the current k3-grid were already computed in transfer2_get_k3_sizes() */
+  /* Just consider all l's in pbs->l regardless of the mode */
+  ptr2->l_size = pbs->l_size; 
+  
+  /* Copy the l's from pbs->l into ptr2->l */
+  class_alloc(ptr2->l, ptr2->l_size*sizeof(int), ptr2->error_message);
 
-  int k_tr_size = ptr2->k_size_k1k2[index_k1][index_k2];
-  double k_min_tr = ptr2->k_min_k1k2[index_k1][index_k2];
-  double k_max_tr = ptr2->k_max_k1k2[index_k1][index_k2];
+  for (int index_l=0; index_l < ptr2->l_size; index_l++) {
+    ptr2->l[index_l] = pbs->l[index_l];
+  }
   
-  /* Find the linear step to use for the k3 sampling */
+  return _SUCCESS_;
 
-  double k_step_max;
+}
 
-  if (ptr2->k_sampling == class_transfer2_k3_sampling) {
 
-    k_step_max = 2.*_PI_/(ptr2->tau0-ptr2->tau_rec)*ppr2->q_linstep_song;
-    
-    if ((ppr->load_run == _TRUE_) && (ppr2->old_run == _TRUE_))
-      k_step_max = 2.*_PI_/ptr2->rs_rec*ppr2->q_linstep_song;
-  }
 
-  else if (ptr2->k_sampling == bessel_k3_sampling) {
-    k_step_max = pbs2->xx_step/ptr2->tau0;
-  }
 
-  class_test(k_step_max == 0,
-    ptr2->error_message,
-    "stop to avoid infinite loop");
+/**
+ * Fill the arrays that deal with the (l,m) indexing of the ptr2->transfer
+ * array, and create a correspondence between source and transfer functions.
+ * 
+ * The following arrays will be filled:
+ *
+ * - ptr2->lm_array[index_l][index_m], which contains the index associated with a given (l,m) couple
+ *   and is used to access the ptr2->transfer array.
+ * - ptr2->corresponding_index_l[index_tt2], which gives the index in ptr2->l for the 
+ *   considered transfer type.
+ * - ptr2->corresponding_index_m[index_tt2], which gives the index in ptr2->m for the 
+ *   considered transfer type.
+ */
+int transfer2_get_lm_lists (
+        struct precision * ppr,
+        struct precision2 * ppr2,
+        struct perturbs2 * ppt2,
+        struct bessels * pbs,
+        struct bessels2 * pbs2,
+        struct transfers2 * ptr2
+        )
+{ 
 
-  /* First point in the k-sampling */
-    
-  int index_k_pt = 0;
-  int index_k_tr = 0;
-  double k = k_min_tr;
-  k3[0] = k_min_tr;
-  index_k_tr++;
+  // =========================================================================================
+  // =                                (l,m) indexing of arrays                               =
+  // =========================================================================================
 
-  /* Add points to the left */
+  /* Fill ptr2->lm_array, which contains the index associated with a given (l,m) couple.
+  lm_array is useful every time you need a specific (l,m) value from the transfer
+  function array: ptr2->transfer[index_type + ptr2->lm_array[index_l][index_m]]. */
+
+  class_alloc(ptr2->lm_array, ptr2->l_size*sizeof(int*), ptr2->error_message);    
   
-  if (ppr->bispectra_k3_extrapolation != no_k3_extrapolation) {
+  for (int index_l=0; index_l<ptr2->l_size; ++index_l) {
+  
+    int l = ptr2->l[index_l];
+  
+    class_calloc (ptr2->lm_array[index_l],
+                  ppr2->index_m_max[l]+1,
+                  sizeof(int),
+                  ptr2->error_message);
 
-    double k_step = k_step_max;
+    /* We enter the loop only if index_m_max >= 0. This is false if l<ptr2->m[0],
+    for example for l=2 and m_min=3 */
+    for (int index_m=0; index_m <= ppr2->index_m_max[l]; ++index_m) {
 
-    /* Uncomment to use the same step separating the first two points in the sources, instead.
-    This step can be very small, so we use an extra parameter to increase it. */
-    // double n = 1;
-    // double first_physical_step = ppt2->k3[index_k1][index_k2][1] - ppt2->k3[index_k1][index_k2][0];
-    // k_step = MIN (k_step_max, n*first_physical_step);
+      ptr2->lm_array[index_l][index_m] = multipole2offset_indexl_indexm (
+                                           ptr2->l[index_l],
+                                           ptr2->m[index_m],
+                                           ptr2->l, ptr2->l_size,
+                                           ptr2->m, ptr2->m_size
+                                           );
+                                                           
+      /* Debug - Print the lm_array */
+      // printf ("(l,m) = (%d,%d) corresponds to an offset of %d\n",
+      //   ptr2->l[index_l], ptr2->m[index_m], ptr2->lm_array[index_l][index_m]);
+
+    } // end of for(index_m)
+  } // end of for(index_l)
+
+
+
+  // ======================================================================================
+  // =                            Transfer-source correspondence                          =
+  // ======================================================================================
+
+  /* In the transfer2.c module, a transfer type (index_tt2) encloses both the multipole
+  (l,m) and the source type (temperature, polarization, etc). The lm_array we
+  have defined above serve the purpose of generating an univocal index_tt2 given the
+  (l,m) multipole. Here, we do the inverse operation by univocally associating to index_tt2
+  the multipole indices (l,m) */
+
+  /* For a given transfer type index index_tt, these arrays contain the corresponding
+  indices in ptr2->l and ptr2->m */
+  class_alloc (ptr2->corresponding_index_l, ptr2->tt2_size*sizeof(int), ptr2->error_message);
+  class_alloc (ptr2->corresponding_index_m, ptr2->tt2_size*sizeof(int), ptr2->error_message);
+
+  /* For a given transfer type index index_tt, these arrays contain the indices corresponding
+  to the monopole of index_tt in ptr2->transfers and ppt2->sources, respectively. */
+  class_alloc (ptr2->index_tt2_monopole, ptr2->tt2_size*sizeof(int), ptr2->error_message);
+  class_alloc (ptr2->index_pt2_monopole, ptr2->tt2_size*sizeof(int), ptr2->error_message);
+
+  for (int index_tt = 0; index_tt < ptr2->tt2_size; index_tt++) {
+    
+    /* Initialise the current indices to -1 */
+    int index_l = -1;
+    int index_m = -1;
+
+
+    /* - Photon temperature */
+    if ((ppt2->has_source_T==_TRUE_)
+    && (index_tt >= ptr2->index_tt2_T) && (index_tt < ptr2->index_tt2_T+ptr2->n_transfers)) {
+
+      /* Store the position of the temperature monopole in ppt2->sources and ptr2->transfer */
+      ptr2->index_pt2_monopole[index_tt] = ppt2->index_tp2_T;
+      ptr2->index_tt2_monopole[index_tt] = ptr2->index_tt2_T;
+
+      /* Find (l,m) associated with index_tt */
+      int lm_offset = index_tt - ptr2->index_tt2_monopole[index_tt];
+      offset2multipole_indexl_indexm (lm_offset, ptr2->l, ptr2->l_size, ptr2->m, ptr2->m_size,
+        &index_l, &index_m);
+
+      /* Set the labels of the transfer types */
+      sprintf(ptr2->tt2_labels[index_tt], "T_%d_%d",ptr2->l[index_l],ptr2->m[index_m]);
+
+      /* Some debug */
+      // printf("T, index_tt=%d: lm_offset=%d -> (%d,%d), label=%s, monopole_tr=%d, monopole_pt=%d\n",
+      //   index_tt, lm_offset, ptr2->l[index_l], ptr2->m[index_m],
+      //   ptr2->tt2_labels[index_tt],
+      //   ptr2->index_tt2_monopole[index_tt], ptr2->index_pt2_monopole[index_tt]);
+    }
+
+
+    /* - Photon E-mode polarization */
+    
+    else if ((ppt2->has_source_E==_TRUE_)
+    && (index_tt >= ptr2->index_tt2_E) && (index_tt < ptr2->index_tt2_E+ptr2->n_transfers)) {
+
+      /* Store the position of the E-modes monopole in ppt2->sources and ptr2->transfer */
+      ptr2->index_pt2_monopole[index_tt] = ppt2->index_tp2_E;
+      ptr2->index_tt2_monopole[index_tt] = ptr2->index_tt2_E;
+
+      /* Find (l,m) associated with index_tt */
+      int lm_offset = index_tt - ptr2->index_tt2_monopole[index_tt];
+      offset2multipole_indexl_indexm (lm_offset, ptr2->l, ptr2->l_size, ptr2->m, ptr2->m_size,
+        &index_l, &index_m);
+
+      /* Set the labels of the transfer types */
+      sprintf(ptr2->tt2_labels[index_tt], "E_%d_%d",ptr2->l[index_l],ptr2->m[index_m]);
+
+      /* Some debug */
+      // printf("E, index_tt=%d: lm_offset=%d -> (%d,%d), label=%s, monopole_tr=%d, monopole_pt=%d\n",
+      //   index_tt, lm_offset, ptr2->l[index_l], ptr2->m[index_m],
+      //   ptr2->tt2_labels[index_tt],
+      //   ptr2->index_tt2_monopole[index_tt], ptr2->index_pt2_monopole[index_tt]);
+    }
+
+
+    /* - Photon B-mode polarization */
+
+    else if ((ppt2->has_source_B==_TRUE_)
+    && (index_tt >= ptr2->index_tt2_B) && (index_tt < ptr2->index_tt2_B+ptr2->n_transfers)) {
+
+      /* Store the position of the B-modes monopole in ppt2->sources and ptr2->transfer */
+      ptr2->index_pt2_monopole[index_tt] = ppt2->index_tp2_B;
+      ptr2->index_tt2_monopole[index_tt] = ptr2->index_tt2_B;
+
+      /* Find (l,m) associated with index_tt */
+      int lm_offset = index_tt - ptr2->index_tt2_monopole[index_tt];
+      offset2multipole_indexl_indexm (lm_offset, ptr2->l, ptr2->l_size, ptr2->m, ptr2->m_size,
+        &index_l, &index_m);
+
+      /* Set the labels of the transfer types */
+      sprintf(ptr2->tt2_labels[index_tt], "B_%d_%d",ptr2->l[index_l],ptr2->m[index_m]);
+
+      /* Some debug */
+      // printf("B, index_tt=%d: lm_offset=%d -> (%d,%d), label=%s, monopole_tr=%d, monopole_pt=%d\n",
+      //   index_tt, lm_offset, ptr2->l[index_l], ptr2->m[index_m],
+      //   ptr2->tt2_labels[index_tt],
+      //   ptr2->index_tt2_monopole[index_tt], ptr2->index_pt2_monopole[index_tt]);
+    }
+
+    /* Check the result */
+    class_test ((index_l>=ptr2->l_size) || (index_m>=ptr2->m_size) || (index_l<0) || (index_m<0),
+      ptr2->error_message,
+      "index_tt=%d: result (index_l,index_m)=(%d,%d) is out of bounds index_l=[%d,%d], index_m=[%d,%d]\n",
+      index_tt, index_l, index_m, 0, ptr2->l_size-1, 0, ptr2->m_size-1);
+
+    /* Write the result */
+    ptr2->corresponding_index_l[index_tt] = index_l;
+    ptr2->corresponding_index_m[index_tt] = index_m;
+    
+  } // end of for(index_tt)
+
+
+  return _SUCCESS_;
+
+}
+    
+
+
+
+
+
+
+
+/**
+ * For a given (k1,k2) pair, find the size of the corresponding k3 grid.
+ *
+ * At second order, the transfer functions are sampled in a 3D Fourier space (k1,k2,k3).
+ * The k3 direction is special because in the line of sight integral (see eq. 5.95 of
+ * http://arxiv.org/abs/1405.2280) it is convolved with a high frequency projection function
+ * J_Llm(k3*tau). Therefore, the k3 direction requires a special sampling that can catch the
+ * oscillations of J_Llm. Here we find the size of such sampling for a given (k1,k2) pair and
+ * store it in the array ptr2->k_size_k1k2[index_k1][index_k2].
+ * 
+ * More in detail, the oscillation frequency of the transfer function T(k1,k2,k3) in the k3
+ * direction is dictated by the Bessel functions in the line of sight integral. These have
+ * argument k3*(tau_0-tau); since most of the sources are localised at recombination, it results
+ * that k3 oscillates with a frequency of tau_0-tau_rec~tau_0. The other directions, k1 and
+ * k2, inherit the oscillation frequency of the sources at recombination, which is roughly
+ * tau_rec/sqrt(3) because of tight coupling. Therefore, the k3 direction has a frequency
+ * tau_0/tau_rec~80 times larger than the k1 and k2 directions. On the other hand, for the
+ * k1 and k2 directions we keep the same sampling as in the sources, that is, ppt2->k.
+ * 
+ * Extrapolation: to solve the bispectrum integral (eq. 6.36) it is useful to extrapolate
+ * the transfer functions in the k3 direction beyond their physical limits, that is, beyond
+ * k3_min = |k1-k2| and k3_max = k1+k2. The reason is purely numerical: eventually, the
+ * contributions from the extrapolated regions will cancel. The extrapolation has the purpose
+ * of stabilizing an problematic integration.
+ *
+ * TODO: For later times in the line-of-sight integration, where the frequency tau0-tau is
+ * small, one can think of using a less dense k3-grid.
+ *
+ * The following arrays are filled in this function:
+ *  - ptr2->k_min_k1k2[index_k1][index_k2]
+ *  - ptr2->k_max_k1k2[index_k1][index_k2]
+ *  - ptr2->k_size_k1k2[index_k1][index_k2]
+ *  - ptr2->k_physical_start_k1k2[index_k1][index_k2]
+ *  - ptr2->k_physical_size_k1k2[index_k1][index_k2]
+ */
+int transfer2_get_k3_size (
+      struct precision * ppr,
+      struct precision2 * ppr2,
+      struct perturbs2 * ppt2,
+      struct bessels * pbs,
+      struct bessels2 * pbs2,
+      struct transfers2 * ptr2,
+      int index_k1,
+      int index_k2
+      )
+{
+
+  class_test (index_k2 > index_k1,
+    ptr2->error_message,
+    "stop to avoid segmentation fault, as we always require k1 >= k2.");
+
+
+  // ====================================================================================
+  // =                               Determine k3 limits                                =
+  // ====================================================================================
+
+  /* Extract the minimum and maximum values of k3 computed in the perturbations2.c module.
+  They are computed taking into consideration the triangular condition, whereby
+  \vec{k3} = \vec{k1} + \vec{k2}, and the overall minimum and maximum k-values
+  (ppt2->k[0] and ppt2->k[ppt2->k_size-1], respectively). */
+  int k_pt_size = ppt2->k3_size[index_k1][index_k2];
+  double k_min_pt = ppt2->k3[index_k1][index_k2][0];
+  double k_max_pt = ppt2->k3[index_k1][index_k2][k_pt_size-1];
+
+  /* By default, for the transfer functions we take the same k-limits used for the sources */
+  double k_min_tr = k_min_pt;
+  double k_max_tr = k_max_pt;
+
+  /* When computing spectra and bispectra, it is convenient to extend the k-grid beyond the
+  physical limits dictated by the triangular condition in order to make the successive
+  integrations numerically stabler. Here we do such extension of k_min_tr and k_max_tr. */
+  if (ppr->bispectra_k3_extrapolation != no_k3_extrapolation) {
+
+    /* The physical range is the one dictated by the triangular condition: k1 + k2 = k3 */
+    double physical_k3_range = k_max_pt - k_min_pt;
+    
+    /* The extended range allows for the Bessel function j(k3*(tau0 - tau_rec)) to develop at least
+    ppr->extra_k3_oscillations oscillations in k3 in order to stabilize the bispectrum integral. */
+    double extended_k3_range_right = 2.*_PI_*ppr->extra_k3_oscillations_right/(ptr2->tau0 - ptr2->tau_rec);
+    double extended_k3_range_left  = 2.*_PI_*ppr->extra_k3_oscillations_left/(ptr2->tau0 - ptr2->tau_rec);
+
+    if (physical_k3_range < extended_k3_range_right)
+      k_max_tr += (extended_k3_range_right - physical_k3_range);    
+
+    /* Never go beyond the maximum allowed value for k1 and k2 */
+    k_max_tr = MIN (k_max_tr, ppt2->k[ppt2->k_size-1]);
+
+    if (physical_k3_range < extended_k3_range_left)
+      k_min_tr -= (extended_k3_range_left - physical_k3_range);
+
+    /* Never go below the smallest between the usual k-range and the physical bound. */
+    k_min_tr = MAX (k_min_tr, MIN(ppt2->k[0], k_min_pt));
+
+    /* If the user specifies a negative number of oscillations, then extend the integration
+    range all the way to the minimum and maximum k's considered in the code */    
+    if (ppr->extra_k3_oscillations_left < 0)
+      k_min_tr = ppt2->k[0];
+
+    if (ppr->extra_k3_oscillations_right < 0)
+      k_max_tr = ppt2->k[ppt2->k_size-1];
+
+    /* Debug - Print the change in the k3-range */
+    // printf("physical_k3_range=%g, extended_k3_range_right=%g\n", physical_k3_range, extended_k3_range_right);
+    // printf("PRE:  k_max_tr = %g\n", k_max_pt);
+    // printf("POST: k_max_tr = %g\n", k_max_tr);
+
+  }
+
+  /* Update the transfer structure with the k3 limits */
+  ptr2->k_min_k1k2[index_k1][index_k2] = k_min_tr;
+  ptr2->k_max_k1k2[index_k1][index_k2] = k_max_tr;
+  
+  /* Check that we the grid where we sampled the the projection functions J can accomodate for the required
+  values of k3. We do not need to test the lower limit as the Bessel grid always starts from zero. */
+  class_test (k_max_tr > pbs2->xx_max/ptr2->tau0,
+    ptr2->error_message,
+    "xx_max is not large enough. The projection functions J(k*(tau0-tau)) do not cover the needed k-range\
+ (k_max=%g,tau0=%g,xx_max=%g). Maybe you are using too much extrapolation.", k_max_tr, ptr2->tau0, pbs2->xx_max);
+
+
+
+  // ====================================================================================
+  // =                            Determine linear step                                 =
+  // ====================================================================================
+
+  /* Find the linear step to use for the k3 sampling, based on the requested type of
+  k-sampling. */
+  double k_step_max;
+
+  /* In the CLASS-type sampling, we reason in terms of oscillations. We know that, for sources
+  peaked at recombination, the transfer function oscillates in k3 with a frequency of 
+  roughly tau0-tau_rec. Here we choose a linear step in k3 which is proportional to such
+  frequency, via the parameter q_linstep_song. */
+
+  if (ptr2->k_sampling == class_transfer2_k3_sampling) {
+
+    k_step_max = 2.*_PI_/(ptr2->tau0-ptr2->tau_rec)*ppr2->q_linstep_song;
+    
+    /* In older versions, the step was determined with respect to the comoving sound horizon
+    at recombination. */
+    if ((ppr->load_run == _TRUE_) && (ppr2->old_run == _TRUE_))
+      k_step_max = 2.*_PI_/ptr2->rs_rec*ppr2->q_linstep_song;
+
+  }
+
+  /* In the Bessel-type sampling, we require the maximum step between two points to be
+  determined by the sampling of the projection functions J, which in turn is controlled
+  by the user via the parameter bessel_x_step_song. The argument of J is x=k*(tau0-tau)
+  and is linearly sampled in x. Hence, the maximum step in k is given by the x/tau0. */
+
+  else if (ptr2->k_sampling == bessel_k3_sampling) {
+    
+    k_step_max = pbs2->xx_step/ptr2->tau0;
+
+  }
+
+  class_test(k_step_max == 0,
+    ptr2->error_message,
+    "stop to avoid infinite loop");
+
+
+  // ====================================================================================
+  // =                              Determine k3 size                                   =
+  // ====================================================================================
+
+  /* We shall sample k3 in all the points that were used for the line of sight sources,
+  plus all the points from a linear sampling with a step of k_step_max. */
+  
+  int index_k_pt = 0;
+  int index_k_tr = 0;  
+  double k = k_min_tr;
+  index_k_tr++;
+
+
+  /* If the user requested for extrapolation, add unphysical points to the left of the
+  physical limit */
+  
+  if (ppr->bispectra_k3_extrapolation != no_k3_extrapolation) {
+
+    /* We space the extra points linearly with the same step used for the physical regime */
+    double k_step = k_step_max;
+    
+    /* Uncomment to use the same step separating the first two points in the sources, instead.
+    This step can be very small, so we use an extra parameter to increase it. */
+    // double n = 1;
+    // double first_physical_step = ppt2->k3[index_k1][index_k2][1] - ppt2->k3[index_k1][index_k2][0];
+    // k_step = MIN (k_step_max, n*first_physical_step);
+    
+    class_test (k_step < ppr->smallest_allowed_variation,
+      ptr2->error_message,
+      "stopping to avoid segmentation fault, step=%g", k_step);
+
+    while (k < k_min_pt) {
+      k += k_step;
+      index_k_tr++;
+    }
+
+    if (k != k_min_pt)
+      k = k_min_pt;
+  }
+  
+  index_k_pt++;
+
+  /* The regime where the triangular condition is satisfied starts here */
+  ptr2->k_physical_start_k1k2[index_k1][index_k2] = index_k_tr-1;
+
+  /* Take the next points from the sources sampling as long as the step is small enough.
+  This assumes that ppt->k3 is a growing array. */
+  while ((index_k_pt < k_pt_size) && ((ppt2->k3[index_k1][index_k2][index_k_pt] - k) < k_step_max)) {
+    k = ppt2->k3[index_k1][index_k2][index_k_pt];
+    index_k_pt++;
+    index_k_tr++;
+  }
+
+  /* All the points that we added in the above while-loop satisfy the triangular condition */
+  ptr2->k_physical_size_k1k2[index_k1][index_k2] = index_k_pt;
+
+  /* Then, points spaced linearily with step k_step_max. Note that if the user asked for k3-extrapolation,
+  here we also add points beyond the physical limit dictated by the triangular condition. */
+  while (k < k_max_tr) {
+
+    k += k_step_max;
+    index_k_tr++;
+    
+    /* Take note of where the physical regime ends */
+    if ((k <= k_max_pt) && (k >= k_min_pt))
+      ptr2->k_physical_size_k1k2[index_k1][index_k2]++;
+    
+  }
+  
+  /* Get number of points and allocate list */
+  if (k > k_max_tr)
+    ptr2->k_size_k1k2[index_k1][index_k2] = index_k_tr-1;
+  else
+    ptr2->k_size_k1k2[index_k1][index_k2] = index_k_tr;
+
+  
+  class_test (ptr2->k_size_k1k2[index_k1][index_k2] < 2,
+    ptr2->error_message,
+    "found less than 2 valid values for the k-grid of modes k1=%f, k2=%f. This should not happen\
+ unless you set k3_size_min to a value lower than 2, which is not allowed as you need at least 2 points\
+ to do linear interpolation.\n",
+    ppt2->k[index_k1], ppt2->k[index_k2])
+  
+  class_test ((ptr2->k_physical_size_k1k2[index_k1][index_k2] != ptr2->k_size_k1k2[index_k1][index_k2])
+    && (ppr->bispectra_k3_extrapolation == no_k3_extrapolation),
+    ptr2->error_message,
+    "when no extrapolation is requested, all k's should be physical, i.e. satisfy the triangular condition.");
+  
+  class_test ((ptr2->k_physical_start_k1k2[index_k1][index_k2] != 0)
+    && (ppr->bispectra_k3_extrapolation == no_k3_extrapolation),
+    ptr2->error_message,
+    "when no extrapolation is requested, all k's should be physical, i.e. satisfy the triangular condition.");
+        
+  return _SUCCESS_;
+  
+  
+} // end of transfer2_get_k3_size
+
+
+
+
+/**
+ * For a given (k1,k2) pair, find the size of the corresponding k3 grid.
+ * 
+ * This function relies on transfer2_get_k3_sizes() being called beforehand to compute
+ * the array ptr2->k_size_k1k2[index_k1][index_k2].
+ *
+ * To understand what this function does, please refer to the documentation of
+ * transfer2_get_k3_size(), of which this function is largely a copy.
+ */
+
+int transfer2_get_k3_list (
+      struct precision * ppr,
+      struct precision2 * ppr2,
+      struct perturbs2 * ppt2,
+      struct bessels * pbs,
+      struct bessels2 * pbs2,
+      struct transfers2 * ptr2,
+      int index_k1,
+      int index_k2,
+      double * k3, /**< output, array of size ptr2->k_size_k1k2[index_k1][index_k2] with
+                   the k3 sampling-points of the transfer function in (k1,k2) */
+      int * last_used_index_pt /**< output, last point in ppt2->k3 that appears in the
+                               transfer function k3 sampling; for debug purposes only. */
+      )
+{
+
+  /* Limits of k3 from the perturbations2.c module */
+
+  int k_pt_size = ppt2->k3_size[index_k1][index_k2];  
+  double k_min_pt = ppt2->k3[index_k1][index_k2][0];
+  double k_max_pt = ppt2->k3[index_k1][index_k2][k_pt_size-1];
+
+  /* The limits for the current k3-grid were already computed in transfer2_get_k3_sizes() */
+
+  int k_tr_size = ptr2->k_size_k1k2[index_k1][index_k2];
+  double k_min_tr = ptr2->k_min_k1k2[index_k1][index_k2];
+  double k_max_tr = ptr2->k_max_k1k2[index_k1][index_k2];
+  
+  /* Find the linear step to use for the k3 sampling */
+
+  double k_step_max;
+
+  if (ptr2->k_sampling == class_transfer2_k3_sampling) {
+
+    k_step_max = 2.*_PI_/(ptr2->tau0-ptr2->tau_rec)*ppr2->q_linstep_song;
+    
+    if ((ppr->load_run == _TRUE_) && (ppr2->old_run == _TRUE_))
+      k_step_max = 2.*_PI_/ptr2->rs_rec*ppr2->q_linstep_song;
+  }
+
+  else if (ptr2->k_sampling == bessel_k3_sampling) {
+    k_step_max = pbs2->xx_step/ptr2->tau0;
+  }
+
+  class_test(k_step_max == 0,
+    ptr2->error_message,
+    "stop to avoid infinite loop");
+
+  /* First point in the k-sampling */
+    
+  int index_k_pt = 0;
+  int index_k_tr = 0;
+  double k = k_min_tr;
+  k3[0] = k_min_tr;
+  index_k_tr++;
+
+  /* Add points to the left */
+  
+  if (ppr->bispectra_k3_extrapolation != no_k3_extrapolation) {
+
+    double k_step = k_step_max;
+
+    /* Uncomment to use the same step separating the first two points in the sources, instead.
+    This step can be very small, so we use an extra parameter to increase it. */
+    // double n = 1;
+    // double first_physical_step = ppt2->k3[index_k1][index_k2][1] - ppt2->k3[index_k1][index_k2][0];
+    // k_step = MIN (k_step_max, n*first_physical_step);
     
     class_test (k_step < ppr->smallest_allowed_variation,
       ptr2->error_message,
@@ -1911,8 +3017,11 @@ int transfer2_compute (
                   interpolated_sources_in_time,
                   pbs2->index_J_TT,   /* Temperature projection function */
                   ppt2->index_tp2_T,  /* Temperature source function */
+                  -1,                 /* No mixing contribution */
+                  -1,
                   pw,
-                  &(pw->transfer)),
+                  &(pw->transfer),
+                  NULL),
       ptr2->error_message,
       ptr2->error_message);
       
@@ -1933,10 +3042,12 @@ int transfer2_compute (
     contribution (E->E), as for temperature, and a mixing one (B->E) that encodes the
     conversion of B-modes into E-modes as photons propagate. Each contribution has 
     a different source and projection function. See Sec. 5.5.1.4 of
-    http://arxiv.org/abs/1405.2280. */
+    http://arxiv.org/abs/1405.2280. Both contributions are computed in the same
+    loop over time by transfer2_integrate(). */
     double direct_contribution=0, mixing_contribution=0;
   
-    /* Direct contribution (E -> E) */
+    /* Direct contribution (E -> E) and mixing contribution (B -> E). The latter is
+    computed only for non-scalar modes. */
     class_call (transfer2_integrate(
                   ppr,
                   ppr2,
@@ -1952,35 +3063,13 @@ int transfer2_compute (
                   interpolated_sources_in_time,
                   pbs2->index_J_EE,   /* E-mode projection function */
                   ppt2->index_tp2_E,  /* E-mode source function */
+                  (ptr2->m[index_m] != 0 ? pbs2->index_J_EB : -1), /* EB mixing projection function, vanishes for m=0 */
+                  (ptr2->m[index_m] != 0 ? ppt2->index_tp2_B : -1), /* B-mode source function, vanishes for m=0 */
                   pw,
-                  &(direct_contribution)),
+                  &(direct_contribution),
+                  &(mixing_contribution)),
       ptr2->error_message,
       ptr2->error_message);
-
-    /* Mixing contribution (B -> E), only for non-scalar modes */
-    if (ptr2->m[index_m] != 0) {
-
-      class_call (transfer2_integrate(
-                    ppr,
-                    ppr2,
-                    ppt2,
-                    pbs,
-                    pbs2,
-                    ptr2,
-                    index_k1,
-                    index_k2,
-                    index_k,
-                    index_l,
-                    index_m,
-                    interpolated_sources_in_time,
-                    pbs2->index_J_EB,   /* EB mixing projection function, vanishes for m=0 */
-                    ppt2->index_tp2_B,  /* B-mode source function, vanishes for m=0 */
-                    pw,
-                    &(mixing_contribution)),
-        ptr2->error_message,
-        ptr2->error_message);
-      
-      }
       
       /* The integral is given by the sum of the E->E and B->E contributions. */
       pw->transfer = direct_contribution + mixing_contribution;
@@ -2006,8 +3095,10 @@ int transfer2_compute (
 
     double direct_contribution=0, mixing_contribution=0;
 
-    /* Direct contribution (B -> B). The projection function for this contribution (J_BB)
-    is equal to the one for E->E (J_EE). */
+    /* Direct contribution (B -> B) and mixing contribution (E->B). The projection function
+    for the direct contribution (J_BB) is equal to the one for E->E (J_EE). The projection
+    function for the mixing contribution (J_BE) is equal to minus the one for B->E (-J_EB);
+    we shall adjust for this sign below, when we sum the direct and mixed contributions. */
     class_call (transfer2_integrate(
                   ppr,
                   ppr2,
@@ -2023,31 +3114,11 @@ int transfer2_compute (
                   interpolated_sources_in_time,
                   pbs2->index_J_EE,   /* E-mode projection function (same as J_BB) */
                   ppt2->index_tp2_B,  /* B-mode source function, vanishes for m=0 */
-                  pw,
-                  &(direct_contribution)),
-      ptr2->error_message,
-      ptr2->error_message);
-
-    /* Mixing contribution (E->B). The projection function for this contribution (J_BE)
-    is equal to minus the one for B->E (-J_EB). We shall adjust for this sign below,
-    when we sum the direct and mixed contributions. */
-    class_call (transfer2_integrate(
-                  ppr,
-                  ppr2,
-                  ppt2,
-                  pbs,
-                  pbs2,
-                  ptr2,
-                  index_k1,
-                  index_k2,
-                  index_k,
-                  index_l,
-                  index_m,
-                  interpolated_sources_in_time,
                   pbs2->index_J_EB,   /* EB mixing projection function (equal to minus BE),
                                       vanishes for m=0 (see eq. 5.104 of http://arxiv.org/abs/1405.2280)*/
                   ppt2->index_tp2_E,  /* E-mode source function */
                   pw,
+                  &(direct_contribution),
                   &(mixing_contribution)),
       ptr2->error_message,
       ptr2->error_message);
@@ -2099,17 +3170,448 @@ int transfer2_compute (
 
 
 
-  // =====================================================================================
-  // =                              Store transfer function                              =
-  // =====================================================================================
+  // =====================================================================================
+  // =                              Store transfer function                              =
+  // =====================================================================================
+
+  /* Store transfer function in transfer structure */
+  ptr2->transfer[index_tt][index_k1][index_k2][index_k] = pw->transfer;
+
+  /* Counter to keep track of the number of values fit into ptr2->transfer */
+  #pragma omp atomic
+  ++ptr2->count_memorised_transfers;
+
+
+  return _SUCCESS_;
+
+}
+
+
+
+
+/**
+ * Solve the line of sight integral for the set of parameters (k1,k2,k,l,m)
+ * using the trapezoidal method.
+ *
+ * The line of sight integral is a convolution over time between the source
+ * function S_Lm(k1,k2,k,tau) and the projection function J_Llm(x), with
+ * x=k*(tau_0-tau) and L summed from 0 to L_max.
+ *
+ * The time grid for the integration was computed in the transfer2_get_time_grid()
+ * function, and is stored in pw->time_grid.
+ *
+ * The second-order source function is passed as an array of values 
+ * at the grid points, interpolated from the ppt2->sources array; the interpolation
+ * was performed in the functions transfer2_interpolate_sources_in_k() and
+ * transfer2_interpolate_sources_in_time().
+ *
+ * The projection function will be interpolated in x=k*(tau_0-tau) from the precomputed
+ * table stored in the bessel2 structure, using the position of x in the table
+ * and the interpolation weights computed by transfer2_get_x_grid().
+ *
+ * For the polarised transfer functions, the line of sight integral has both a
+ * direct and a mixing contribution (see transfer2_compute()). If index_J_mixing
+ * is non-negative, the mixing contribution is computed together with the direct
+ * one, in the same loop over time, and written to integral_mixing.
+ */
+int transfer2_integrate (
+      struct precision * ppr,
+      struct precision2 * ppr2,
+      struct perturbs2 * ppt2,
+      struct bessels * pbs,
+      struct bessels2 * pbs2,
+      struct transfers2 * ptr2,
+      int index_k1,
+      int index_k2,
+      int index_k,
+      int index_l,
+      int index_m,
+      double ** interpolated_sources_in_time,
+      int index_J,                          /**< input, projection function for the direct contribution */
+      int index_source_monopole,            /**< input, source function for the direct contribution */
+      int index_J_mixing,                   /**< input, projection function for the mixing contribution, or -1 to skip it */
+      int index_source_monopole_mixing,     /**< input, source function for the mixing contribution */
+      struct transfer2_workspace * pw,
+      double * integral,                    /**< output, direct contribution */
+      double * integral_mixing              /**< output, mixing contribution; unused if index_J_mixing is negative */
+      )
+{
+
+  /* Shortcuts */
+  int l = ptr2->l[index_l];
+  int m = ptr2->m[index_m];
+  
+  /* Initialise the output value of the transfer function */
+  double result[2] = {0, 0};
+
+  /* Beyond pbs2->l_size_J, the tables of J_Llm(x) were not computed and the line of sight
+  integral is solved in the flat-sky limit */
+  if (index_l >= pbs2->l_size_J) {
+
+    class_call (transfer2_integrate_flat_sky (
+                  ppr,
+                  pbs2,
+                  ptr2,
+                  index_l,
+                  index_m,
+                  interpolated_sources_in_time,
+                  index_J,
+                  index_source_monopole,
+                  index_J_mixing,
+                  index_source_monopole_mixing,
+                  pw,
+                  integral,
+                  integral_mixing),
+      ptr2->error_message,
+      ptr2->error_message);
+
+    pw->flat_sky_count++;
+
+    return _SUCCESS_;
+  }
+
+  /* On the overlap range, we shall compare the exact integral with the flat-sky one */
+  short is_overlap = (index_l >= pbs2->index_l_flat_sky_min);
+#ifdef _OPENMP
+  double time_start = (is_overlap ? omp_get_wtime() : 0);
+#endif
+
+
+  // =====================================================================================
+  // =                               Collect the L-terms                                 =
+  // =====================================================================================
+
+  /* Projection and source functions for the direct and mixing contributions */
+  int n_contributions = (index_J_mixing < 0 ? 1 : 2);
+  int J_list[2] = {index_J, index_J_mixing};
+  int source_list[2] = {index_source_monopole, index_source_monopole_mixing};
+
+  /* Gather the pointers to the projection and source functions for all the L-terms that
+  contribute to the integral, so that we do not need to address the pbs2 tables inside
+  the loop over time. The L-terms are stored in increasing L, with the direct and mixing
+  contributions of a given L next to each other. */
+  int los_terms_size = 0;
+
+  for (int index_L=0; index_L<=pw->L_max; ++index_L) {
+  
+    /* The 3j symbol in the definition of J forces the azimuthal number m to be smaller
+    than both l and L (see eq. 5.97 of http://arxiv.org/abs/1405.2280) */
+    int L = pbs2->L[index_L];
+    if (abs(m) > MIN(L,l))
+      continue;
+
+    for (int index_c=0; index_c < n_contributions; ++index_c) {
+
+      int J_type = J_list[index_c];
+      struct transfer2_los_term * term = &(pw->los_terms[los_terms_size++]);
+
+      term->J = pbs2->J_Llm_x[J_type][index_L][index_l][index_m];
+      term->ddJ = (ppr->bessels_interpolation == cubic_interpolation ?
+        pbs2->ddJ_Llm_x[J_type][index_L][index_l][index_m] : NULL);
+      term->x_offset = pbs2->x_offset_J[J_type][index_L][index_l][index_m];
+      term->x_shift = pbs2->x_shift_J[J_type][index_L][index_l][index_m];
+      term->index_x_min = pbs2->index_xmin_J[J_type][index_L][index_l][index_m];
+      term->source = interpolated_sources_in_time[source_list[index_c] + lm(L,m)];
+      term->index_integral = index_c;
+
+      if (pbs2->has_J_moments == _TRUE_) {
+        term->J_int_0 = pbs2->J_int_0[J_type][index_L][index_l][index_m];
+        term->J_int_1 = pbs2->J_int_1[J_type][index_L][index_l][index_m];
+      }
+
+    }
+  }
+
+
+  // =====================================================================================
+  // =                             Perform the integration                               =
+  // =====================================================================================
+  
+  /* With the Filon quadrature, the integration is done in a separate function */
+  if (ptr2->los_method == filon_los_method) {
+
+    class_call (transfer2_integrate_filon (
+                  pbs2,
+                  ptr2,
+                  los_terms_size,
+                  pw,
+                  result),
+      ptr2->error_message,
+      ptr2->error_message);
+
+    *integral = result[0];
+    if (n_contributions > 1)
+      *integral_mixing = result[1];
+
+    return _SUCCESS_;
+  }
+
+  /* Solve the line of sight integral by looping over time. The integral is in eq. 5.95
+  of http://arxiv.org/abs/1405.2280. The time grid is built in transfer2_get_time_grid()
+  to match the sampling of the line of sight sources (ppt2->tau_sampling), with the addition
+  of extra points to follow the oscillations of the projection functions J. We implement
+  the integration following the positive direction of time, which is the negative direction
+  of x=k(tau0-tau). */
+  
+  for (int index_tau=0; index_tau < pw->tau_grid_size; ++index_tau) {
+  
+    /* Position of x=k*(tau0-tau) inside pbs2->xx, the array that we used to sample the
+    projection functions, and of the block of pbs2->xx that contains it. The projection
+    functions are sampled with a different stride in each block; see the documentation
+    of the bessels2 structure. */
+    int index_x = pw->index_x[index_tau];
+    int index_block = pw->index_x_block[index_tau];
+    double * a_x = &(pw->a_x[index_tau*(_BESSEL2_X_BLOCK_SHIFT_+1)]);
+    
+    /* The integrand function is the sum over L of the product between the source
+    S_Lm(k1,k2,k,tau) and the projection functions J_Llm(k(tau0-tau)); therefore,
+    we shall increment the integrand function inside a loop over L from 0 to 
+    pw->L_max. In principle, pw->L_max should be of order O(2000), but in practice
+    it is O(few) at recombination due to tight-coupling suppression of higher-order
+    multipoles. */
+    double integrand[2] = {0, 0};
+
+    for (int index_term=0; index_term < los_terms_size; ++index_term) {
+  
+      struct transfer2_los_term * term = &(pw->los_terms[index_term]);
+
+      /* Skip the contribution to the integral from this L if the projection function is
+      negligible. The projection function J_Llm(x) is basically a Bessel function of order l,
+      so it vanishes when x<<l. Since its argument is x=k*(tau_0-tau), this means that J
+      vanishes when tau is much larger than tau_0-l/k; that is, high-l multipoles do not get
+      contributions from low-k modes. If you do not include this check, you will get random
+      segmentation faults, because you would end up addressing J_Llm_x with a negative x index.
+      Note that this check also ensures that we skip L<2 configurations for polarisation,
+      as it should be. */
+      if (index_x < term->index_x_min)
+        continue;
+  
+      /* Index needed to address the x-level of the projection function array, pbs2->J_Llm_x.
+      The above check ensures that the index is non-negative. */
+      int shift = term->x_shift[index_block];
+      int index_x_in_J = term->x_offset[index_block] + (index_x >> shift);
+
+      /* Interpolation weight assigned to x */
+      double a_J = a_x[shift];
+      
+      
+      // ---------------------------------------------------------------------------
+      // -                              Interpolate J(x)                           -
+      // ---------------------------------------------------------------------------
+
+      /* Interpolate J in x=k*(tau0-tau) */
+      double J_Llm;
+      double J_Llm_left = term->J[index_x_in_J];
+      double J_Llm_right = term->J[index_x_in_J+1];
+      
+      if (term->ddJ == NULL) {
+        J_Llm = a_J*J_Llm_left + (1-a_J)*J_Llm_right;
+      }
+      else {
+        double ddJ_Llm_left = term->ddJ[index_x_in_J];
+        double ddJ_Llm_right = term->ddJ[index_x_in_J+1];
+        J_Llm = (a_J * J_Llm_left +                                
+                 (1.-a_J) * (J_Llm_right
+               - a_J * ((a_J+1.) * ddJ_Llm_left
+                +(2.-a_J) * ddJ_Llm_right) 
+               * pbs2->x_spline_factor[shift]) );
+      }
+
+
+      // ---------------------------------------------------------------------------
+      // -                           Build the integrand                           -
+      // ---------------------------------------------------------------------------
+
+      /* Increment the integrand function by adding another L-multipole. The source
+      function was pre-interpolated in tau and k3 for the desired source type. */
+      integrand[term->index_integral] += J_Llm * term->source[index_tau];
+  
+    } // end of for(index_term)
+    
+    /* Increment the result with the contribution from the considered time-step */
+    result[0] += integrand[0] * pw->delta_tau[index_tau];
+    result[1] += integrand[1] * pw->delta_tau[index_tau];
+  
+  } // end of for(index_tau)
+
+  /* Correct for factor 1/2 from the trapezoidal rule */
+  *integral = 0.5 * result[0];
+  if (n_contributions > 1)
+    *integral_mixing = 0.5 * result[1];
+
+
+  // =====================================================================================
+  // =                            Check the flat-sky limit                               =
+  // =====================================================================================
+
+  /* On the overlap range, solve the integral also in the flat-sky limit, and keep track
+  of the difference and of the time spent by the two methods */
+  if (is_overlap) {
+
+#ifdef _OPENMP
+    double time_flat_start = omp_get_wtime();
+    pw->flat_sky_time_exact += time_flat_start - time_start;
+#endif
+
+    double integral_flat, integral_mixing_flat;
+
+    class_call (transfer2_integrate_flat_sky (
+                  ppr,
+                  pbs2,
+                  ptr2,
+                  index_l,
+                  index_m,
+                  interpolated_sources_in_time,
+                  index_J,
+                  index_source_monopole,
+                  index_J_mixing,
+                  index_source_monopole_mixing,
+                  pw,
+                  &integral_flat,
+                  &integral_mixing_flat),
+      ptr2->error_message,
+      ptr2->error_message);
+
+#ifdef _OPENMP
+    pw->flat_sky_time_flat += omp_get_wtime() - time_flat_start;
+#endif
+
+    pw->flat_sky_diff2 += (integral_flat - *integral)*(integral_flat - *integral);
+    pw->flat_sky_norm2 += (*integral)*(*integral);
+
+    if (n_contributions > 1) {
+      pw->flat_sky_diff2 += (integral_mixing_flat - *integral_mixing)*(integral_mixing_flat - *integral_mixing);
+      pw->flat_sky_norm2 += (*integral_mixing)*(*integral_mixing);
+    }
+
+    pw->flat_sky_count_overlap++;
+  }
+
+
+#ifdef DEBUG
+  /* Test for nans */
+  class_test (isnan(*integral),
+    ptr2->error_message,
+    "found nan in second-order transfer function");
+#endif // DEBUG
+
+
+  return _SUCCESS_;
+}
+
+
+
+/**
+ * Solve the line of sight integral for the set of parameters (k1,k2,k,l,m) in the
+ * flat-sky limit, using the trapezoidal method.
+ *
+ * In the flat-sky limit, the projection functions are approximated by
+ * J_Llm(x) ~ C_Llm j_l(x), where C_Llm is stored in pbs2->J_flat_sky (see
+ * bessel2_J_flat_sky()). The sum over L in the integrand can then be done on the
+ * sources alone, and the spherical Bessel function j_l(x) needs to be interpolated
+ * only once per time step, rather than once per L-term.
+ *
+ * The arguments and the output are the same as in transfer2_integrate(), which
+ * calls this function for the multipoles where the tables of J_Llm(x) were not
+ * computed, that is, for index_l >= pbs2->l_size_J.
+ */
+int transfer2_integrate_flat_sky (
+      struct precision * ppr,
+      struct bessels2 * pbs2,
+      struct transfers2 * ptr2,
+      int index_l,
+      int index_m,
+      double ** interpolated_sources_in_time,
+      int index_J,
+      int index_source_monopole,
+      int index_J_mixing,
+      int index_source_monopole_mixing,
+      struct transfer2_workspace * pw,
+      double * integral,
+      double * integral_mixing
+      )
+{
+
+  /* Shortcuts */
+  int l = ptr2->l[index_l];
+  int m = ptr2->m[index_m];
+  double result[2] = {0, 0};
+
+  /* Collect the L-terms with a non-vanishing flat-sky coefficient, as in transfer2_integrate() */
+  int n_contributions = (index_J_mixing < 0 ? 1 : 2);
+  int J_list[2] = {index_J, index_J_mixing};
+  int source_list[2] = {index_source_monopole, index_source_monopole_mixing};
+  int los_terms_size = 0;
+
+  for (int index_L=0; index_L<=pw->L_max; ++index_L) {
 
-  /* Store transfer function in transfer structure */
-  ptr2->transfer[index_tt][index_k1][index_k2][index_k] = pw->transfer;
+    int L = pbs2->L[index_L];
+    if (abs(m) > MIN(L,l))
+      continue;
 
-  /* Counter to keep track of the number of values fit into ptr2->transfer */
-  #pragma omp atomic
-  ++ptr2->count_memorised_transfers;
+    for (int index_c=0; index_c < n_contributions; ++index_c) {
+
+      double coefficient = pbs2->J_flat_sky[J_list[index_c]][index_L][index_l][index_m];
+      if (coefficient == 0)
+        continue;
+
+      struct transfer2_los_term * term = &(pw->los_terms[los_terms_size++]);
+      term->coefficient = coefficient;
+      term->source = interpolated_sources_in_time[source_list[index_c] + lm(L,m)];
+      term->index_integral = index_c;
+    }
+  }
+
+  /* Spherical Bessel function j_l(x), sampled as j_l1(x) */
+  int index_l1 = pbs2->index_l1[l];
+  double * j = pbs2->j_l1[index_l1];
+  double * ddj = (ppr->bessels_interpolation == cubic_interpolation ? pbs2->ddj_l1[index_l1] : NULL);
+  int * x_offset = pbs2->x_offset_l1[index_l1];
+  short * x_shift = pbs2->x_shift_l1[index_l1];
+  int index_x_min = pbs2->index_xmin_l1[index_l1];
+
+  for (int index_tau=0; index_tau < pw->tau_grid_size; ++index_tau) {
+
+    /* The Bessel function vanishes for x<<l */
+    int index_x = pw->index_x[index_tau];
+    if (index_x < index_x_min)
+      continue;
+
+    /* Interpolate j_l in x=k*(tau0-tau) */
+    int index_block = pw->index_x_block[index_tau];
+    int shift = x_shift[index_block];
+    int index_x_in_j = x_offset[index_block] + (index_x >> shift);
+    double a_j = pw->a_x[index_tau*(_BESSEL2_X_BLOCK_SHIFT_+1) + shift];
+    double j_l;
+
+    if (ddj == NULL) {
+      j_l = a_j*j[index_x_in_j] + (1-a_j)*j[index_x_in_j+1];
+    }
+    else {
+      j_l = (a_j * j[index_x_in_j] +
+             (1.-a_j) * (j[index_x_in_j+1]
+           - a_j * ((a_j+1.) * ddj[index_x_in_j]
+            +(2.-a_j) * ddj[index_x_in_j+1])
+           * pbs2->x_spline_factor[shift]) );
+    }
+
+    /* Effective source, sum_L C_Llm S_Lm(tau) */
+    double integrand[2] = {0, 0};
+
+    for (int index_term=0; index_term < los_terms_size; ++index_term) {
+      struct transfer2_los_term * term = &(pw->los_terms[index_term]);
+      integrand[term->index_integral] += term->coefficient * term->source[index_tau];
+    }
+
+    result[0] += j_l * integrand[0] * pw->delta_tau[index_tau];
+    result[1] += j_l * integrand[1] * pw->delta_tau[index_tau];
+
+  } // end of for(index_tau)
 
+  /* Correct for factor 1/2 from the trapezoidal rule */
+  *integral = 0.5 * result[0];
+  if (n_contributions > 1)
+    *integral_mixing = 0.5 * result[1];
 
   return _SUCCESS_;
 
@@ -2117,227 +3619,580 @@ int transfer2_compute (
 
 
 
-
 /**
- * Solve the line of sight integral for the set of parameters (k1,k2,k,l,m)
- * using the trapezoidal method.
+ * Solve the line of sight integral with a Filon-type quadrature on the time
+ * sampling of the sources.
  *
- * The line of sight integral is a convolution over time between the source
- * function S_Lm(k1,k2,k,tau) and the projection function J_Llm(x), with
- * x=k*(tau_0-tau) and L summed from 0 to L_max.
+ * With the trapezoidal rule of transfer2_integrate(), the time grid must follow the
+ * oscillations of the projection functions J_Llm(k*(tau0-tau)), so that its size
+ * grows linearly with k (see transfer2_get_time_grid()). Here, instead, we only
+ * assume that the source function is linear in each interval of the time grid, which
+ * is the sampling of the sources, and integrate its product with the projection
+ * function exactly. For the interval between tau_a and tau_b, with x_a = k*(tau0-tau_a)
+ * and x_b = k*(tau0-tau_b), this gives
  *
- * The time grid for the integration was computed in the transfer2_get_time_grid()
- * function, and is stored in pw->time_grid.
+ *   1/k * [S_b * (I_0(x_a)-I_0(x_b)) + (S_a-S_b)/(x_a-x_b) * (I_1(x_a)-I_1(x_b) - x_b*(I_0(x_a)-I_0(x_b)))],
  *
- * The second-order source function is passed as an array of values 
- * at the grid points, interpolated from the ppt2->sources array; the interpolation
- * was performed in the functions transfer2_interpolate_sources_in_k() and
- * transfer2_interpolate_sources_in_time().
+ * where I_0 and I_1 are the integrals of J(x) and x*J(x), precomputed in the bessel2
+ * module (pbs2->J_int_0 and pbs2->J_int_1) and interpolated here with the weights
+ * in pw->a_x.
  *
- * The projection function will be interpolated in x=k*(tau_0-tau) from the precomputed
- * table stored in the bessel2 structure.
+ * The error of the quadrature comes from the linear interpolation of the source, and
+ * scales as the square of the time step. We estimate it as one third of the difference
+ * with the same quadrature on a grid with every other point, and store the largest
+ * estimate, relative to the sum of the absolute values of the contributions of the
+ * intervals, in pw->los_error_max.
+ *
+ * The L-terms to be summed must be already collected in pw->los_terms by
+ * transfer2_integrate(). The direct and mixing contributions are written in
+ * result[0] and result[1], respectively.
  */
-int transfer2_integrate (
-      struct precision * ppr,
-      struct precision2 * ppr2,
-      struct perturbs2 * ppt2,
-      struct bessels * pbs,
+
+int transfer2_integrate_filon (
       struct bessels2 * pbs2,
       struct transfers2 * ptr2,
-      int index_k1,
-      int index_k2,
-      int index_k,
-      int index_l,
-      int index_m,
-      double ** interpolated_sources_in_time,
-      int index_J,
-      int index_source_monopole,
-      struct transfer2_workspace * pw,
-      double * integral
+      int los_terms_size,                   /**< input, number of L-terms in pw->los_terms */
+      struct transfer2_workspace * pw,      /**< input, workspace with the time grid, the x-grid and the L-terms */
+      double * result                       /**< output, direct and mixing contributions to the integral */
       )
 {
 
-  /* Shortcuts */
-  int l = ptr2->l[index_l];
-  int m = ptr2->m[index_m];
   double k = pw->k;
+  int tau_size = pw->tau_grid_size;
+
+  /* Integral on the coarser grid made of every other point, and scale of the integral */
+  double result_coarse[2] = {0, 0};
+  double scale[2] = {0, 0};
+
+  result[0] = result[1] = 0;
+
+  for (int index_term=0; index_term < los_terms_size; ++index_term) {
   
-  /* Initialise the output value of the transfer function */
-  *integral = 0;
+    struct transfer2_los_term * term = &(pw->los_terms[index_term]);
+    int c = term->index_integral;
+
+    /* Values of x, of the source and of the integrals of J at the previous two points */
+    double x_prev[2] = {0, 0}, S_prev[2] = {0, 0}, I0_prev[2] = {0, 0}, I1_prev[2] = {0, 0};
+
+    for (int index_tau=0; index_tau < tau_size; ++index_tau) {
+
+      double x = k * pw->tau0_minus_tau[index_tau];
+      double S = term->source[index_tau];
+      int index_x = pw->index_x[index_tau];
+
+      /* Integrals of J(x) and x*J(x) from x_min_J to x. They vanish below x_min_J, where
+      J is negligible. */
+      double I0 = 0, I1 = 0;
+
+      if (index_x >= term->index_x_min) {
+
+        int index_block = pw->index_x_block[index_tau];
+        int shift = term->x_shift[index_block];
+        int index_node = term->x_offset[index_block] + (index_x >> shift);
+        double a = pw->a_x[index_tau*(_BESSEL2_X_BLOCK_SHIFT_+1) + shift];
+
+        /* Add the contribution from the node to x, with J linear in between */
+        double J_node = term->J[index_node];
+        double J_x = a*J_node + (1-a)*term->J[index_node+1];
+        double dx = (1-a) * (1 << shift) * pbs2->xx_step;
+        double x_node = x - dx;
+
+        I0 = term->J_int_0[index_node] + dx/2 * (J_node + J_x);
+        I1 = term->J_int_1[index_node] + dx/6 * (J_node*(2*x_node + x) + J_x*(x_node + 2*x));
+      }
+
+      /* Contribution from the interval between the previous point and this one */
+      if (index_tau > 0) {
+
+        double delta_x = x_prev[0] - x;
+        double delta_I0 = I0_prev[0] - I0;
+        double delta_I1 = I1_prev[0] - I1;
+        double integral = S * delta_I0;
+        if (delta_x > 0)
+          integral += (S_prev[0] - S)/delta_x * (delta_I1 - x*delta_I0);
+        integral /= k;
+
+        result[c] += integral;
+        scale[c] += fabs(integral);
+
+        /* Same on the coarser grid, which has a point every two. If the number of intervals
+        is odd, the last one is the same on both grids. */
+        if (index_tau%2 == 0) {
+          double delta_x_coarse = x_prev[1] - x;
+          double delta_I0_coarse = I0_prev[1] - I0;
+          double delta_I1_coarse = I1_prev[1] - I1;
+          double integral_coarse = S * delta_I0_coarse;
+          if (delta_x_coarse > 0)
+            integral_coarse += (S_prev[1] - S)/delta_x_coarse * (delta_I1_coarse - x*delta_I0_coarse);
+          result_coarse[c] += integral_coarse/k;
+        }
+        else if (index_tau == tau_size-1) {
+          result_coarse[c] += integral;
+        }
+      }
+
+      /* Shift the previous points */
+      x_prev[1] = x_prev[0]; S_prev[1] = S_prev[0]; I0_prev[1] = I0_prev[0]; I1_prev[1] = I1_prev[0];
+      x_prev[0] = x; S_prev[0] = S; I0_prev[0] = I0; I1_prev[0] = I1;
+
+    } // end of for(index_tau)
+
+  } // end of for(index_term)
+
+  /* Estimate the error from the interpolation of the sources */
+  for (int c=0; c < 2; ++c)
+    if (scale[c] > 0)
+      pw->los_error_max = MAX (pw->los_error_max, fabs(result[c] - result_coarse[c])/3/scale[c]);
+
 
 #ifdef DEBUG
-  /* Check that we computed the projection functions J(x) for all the needed values of x.
-  Since x appears in the line of sight integral as x=k*(tau0-tau), here we check that x_max
-  is larger than k*(tau0-tau_min). */
-  class_test (k*pw->tau0_minus_tau[0] > pbs2->xx_max,
+  /* Test for nans */
+  class_test (isnan(result[0]) || isnan(result[1]),
     ptr2->error_message,
-    "not enough J's.  Increase l_max to %g or decrease k_max to %.3g.",
-    ceil(k*pw->tau0_minus_tau[0]/ppr->k_max_tau0_over_l_max),
-    pbs2->xx_max/pw->tau0_minus_tau[0]);
+    "found nan in second-order transfer function");
 #endif // DEBUG
-    
 
+  return _SUCCESS_;
 
-  // =====================================================================================
-  // =                             Perform the integration                               =
-  // =====================================================================================
-  
-  /* Solve the line of sight integral by looping over time. The integral is in eq. 5.95
-  of http://arxiv.org/abs/1405.2280. The time grid is built in transfer2_get_time_grid()
-  to match the sampling of the line of sight sources (ppt2->tau_sampling), with the addition
-  of extra points to follow the oscillations of the projection functions J. We implement
-  the integration following the positive direction of time, which is the negative direction
-  of x=k(tau0-tau). */
-  
-  for (int index_tau=0; index_tau < pw->tau_grid_size; ++index_tau) {
-  
-    /* Argument of the projection function at the considered time */
-    double x = k * pw->tau0_minus_tau[index_tau];
-      
-    /* Position of x inside pbs2->xx, the array that we used to sample the projection
-    functions */
-    int index_x = (int)(x/pbs2->xx_step);
-  
-    /* Interpolation weight assigned to x */
-    double a_J = (pbs2->xx[index_x+1] - x)/pbs2->xx_step;
-    
-    /* The integrand function is the sum over L of the product between the source
-    S_Lm(k1,k2,k,tau) and the projection functions J_Llm(k(tau0-tau)); therefore,
-    we shall increment the integrand function inside a loop over L from 0 to 
-    pw->L_max. In principle, pw->L_max should be of order O(2000), but in practice
-    it is O(few) at recombination due to tight-coupling suppression of higher-order
-    multipoles. */
-    double integrand = 0;
+}
 
-    for(int index_L=0; index_L<=pw->L_max; ++index_L) {
-  
-      /* The 3j symbol in the definition of J forces the azimuthal number m to be smaller
-      than both l and L (see eq. 5.97 of http://arxiv.org/abs/1405.2280) */
-      int L = pbs2->L[index_L];
-      if (abs(m) > MIN(L,l))
+
+
+/**
+ * Compute the transfer functions for all the transfer types (T,E,B) and all
+ * the (l,m) multipoles at a given (k1,k2,k), by expressing the line of sight
+ * integrals as a matrix multiplication.
+ *
+ * For a given m and projection function type, the line of sight integral in
+ * transfer2_integrate() can be written as
+ *
+ *   T_l = sum_(tau,L) P_l,(tau,L) * W_(tau,L),
+ *
+ * where P_l,(tau,L) = J_Llm(k*(tau0-tau)) is the projection matrix, with one row
+ * for each l and one column for each (tau,L) pair, and W_(tau,L) = S_Lm(tau) *
+ * delta_tau is the source matrix, with one row for each (tau,L) pair and one column
+ * for each source type that is convolved with the projection function. The E and
+ * B sources share the same projection functions (J_EE=J_BB and J_EB=-J_BE), so
+ * that each product gives both the direct and mixing contributions for all l.
+ *
+ * The matrices are built and multiplied in blocks of _TRANSFER2_TAU_BLOCK_ time
+ * steps, so that the source matrix stays in cache while the projection matrix is
+ * streamed. The result is stored in ptr2->transfer as in transfer2_compute(); it
+ * differs from the one of the scalar method only by the order of the sums. In
+ * debug mode, we check the result against transfer2_compute().
+ *
+ * This function is used when ptr2->los_method == matrix_los_method.
+ */
+
+int transfer2_compute_matrix (
+        struct precision * ppr,
+        struct precision2 * ppr2,
+        struct perturbs2 * ppt2,
+        struct bessels * pbs,
+        struct bessels2 * pbs2,
+        struct transfers2 * ptr2,
+        int index_k1,
+        int index_k2,
+        int index_k,
+        double ** interpolated_sources_in_time, /**< input, value of the source functions S_lm(k1,k2,k) at all times in pw->tau_grid */
+        struct transfer2_workspace * pw /**< input and output, workspace containing the time grid and the x-grid for the considered k */
+        )
+{
+
+  /* Matrix products to be computed: temperature (J_TT with the T sources), direct
+  polarisation (J_EE with the E and B sources) and mixing polarisation (J_EB with the E
+  and B sources). For polarisation, the first column of the source matrix contains the
+  E-mode sources and the second column the B-mode ones. */
+  enum {T_product, EE_product, EB_product, n_products};
+  int product_J[n_products] = {pbs2->index_J_TT, pbs2->index_J_EE, pbs2->index_J_EB};
+  int product_L_max[n_products] = {ppr2->l_max_los_t, ppr2->l_max_los_p, ppr2->l_max_los_p};
+  int product_columns[n_products] = {1, 2, 2};
+  int has_polarisation = ppt2->has_source_E || ppt2->has_source_B;
+
+  /* Shortcuts. The multipoles solved in the flat-sky limit, including those in the overlap
+  range, are left to the scalar method (see the storing loop below). */
+  int l_size = MIN (ptr2->l_size, pbs2->index_l_flat_sky_min);
+  int L_size = pbs2->L_size;
+  double * P = pw->los_projection;
+  double * W = pw->los_sources;
+  double * C = pw->los_result;
+
+  for (int index_m=0; index_m < ptr2->m_size; ++index_m) {
+
+    int m = ptr2->m[index_m];
+
+    /* Which products are needed for this m? The mixing contribution vanishes for m=0 */
+    short has_product[n_products] = {ppt2->has_source_T, has_polarisation, has_polarisation && (m != 0)};
+
+    /* Initialise the result matrices, C[(index_product*l_size + index_l)*2 + index_column] */
+    for (int i=0; i < n_products*l_size*2; ++i)
+      C[i] = 0;
+
+
+    // ==================================================================================
+    // =                            Loop over blocks of time                            =
+    // ==================================================================================
+
+    for (int index_tau_start=0; index_tau_start < pw->tau_grid_size; index_tau_start += _TRANSFER2_TAU_BLOCK_) {
+
+      int tau_block_size = MIN (_TRANSFER2_TAU_BLOCK_, pw->tau_grid_size - index_tau_start);
+
+      for (int index_product=0; index_product < n_products; ++index_product) {
+
+        if (!has_product[index_product])
+          continue;
+
+        int index_J = product_J[index_product];
+        int L_max = product_L_max[index_product];
+        int n_columns = product_columns[index_product];
+
+        /* Number of (tau,L) pairs in the block, that is, the number of columns of
+        the projection matrix and of rows of the source matrix */
+        int n_rows = tau_block_size*(L_max+1);
+
+
+        // ------------------------------------------------------------------------------
+        // -                            Build the source matrix                         -
+        // ------------------------------------------------------------------------------
+
+        /* The source matrix is W[index_row*2 + index_column], with index_row = index_tau*(L_max+1) + index_L,
+        including the trapezoidal measure. L-terms with L<|m| do not exist. */
+        for (int index_tau=0; index_tau < tau_block_size; ++index_tau) {
+
+          double delta_tau = pw->delta_tau[index_tau_start + index_tau];
+
+          for (int index_L=0; index_L <= L_max; ++index_L) {
+
+            int L = pbs2->L[index_L];
+            double * W_row = &(W[(index_tau*(L_max+1) + index_L)*2]);
+            W_row[0] = W_row[1] = 0;
+
+            if (abs(m) > L)
+              continue;
+
+            if (index_product == T_product) {
+              W_row[0] = interpolated_sources_in_time[ppt2->index_tp2_T + lm(L,m)][index_tau_start + index_tau] * delta_tau;
+            }
+            else {
+              if (ppt2->has_source_E)
+                W_row[0] = interpolated_sources_in_time[ppt2->index_tp2_E + lm(L,m)][index_tau_start + index_tau] * delta_tau;
+              if (ppt2->has_source_B)
+                W_row[1] = interpolated_sources_in_time[ppt2->index_tp2_B + lm(L,m)][index_tau_start + index_tau] * delta_tau;
+            }
+          }
+        }
+
+
+        // ------------------------------------------------------------------------------
+        // -                          Build the projection matrix                       -
+        // ------------------------------------------------------------------------------
+
+        /* The projection matrix is P[index_l*n_rows + index_row]. As in transfer2_integrate(),
+        the entries where J_Llm(x) is not defined or is negligible are set to zero. */
+        for (int index_l=0; index_l < l_size; ++index_l) {
+
+          int l = ptr2->l[index_l];
+          double * P_row = &(P[index_l*n_rows]);
+
+          for (int index_tau=0; index_tau < tau_block_size; ++index_tau) {
+
+            int index_x = pw->index_x[index_tau_start + index_tau];
+            int index_block = pw->index_x_block[index_tau_start + index_tau];
+            double * a_x = &(pw->a_x[(index_tau_start + index_tau)*(_BESSEL2_X_BLOCK_SHIFT_+1)]);
+
+            for (int index_L=0; index_L <= L_max; ++index_L) {
+
+              int L = pbs2->L[index_L];
+              double * P_entry = &(P_row[index_tau*(L_max+1) + index_L]);
+              *P_entry = 0;
+
+              if (abs(m) > MIN(L,l))
+                continue;
+
+              if (index_x < pbs2->index_xmin_J[index_J][index_L][index_l][index_m])
+                continue;
+
+              /* Interpolate J in x=k*(tau0-tau) */
+              int shift = pbs2->x_shift_J[index_J][index_L][index_l][index_m][index_block];
+              int index_x_in_J = pbs2->x_offset_J[index_J][index_L][index_l][index_m][index_block] + (index_x >> shift);
+              double a_J = a_x[shift];
+              double * J = &(pbs2->J_Llm_x[index_J][index_L][index_l][index_m][index_x_in_J]);
+
+              if (ppr->bessels_interpolation == linear_interpolation) {
+                *P_entry = a_J*J[0] + (1-a_J)*J[1];
+              }
+              else if (ppr->bessels_interpolation == cubic_interpolation) {
+                double * ddJ = &(pbs2->ddJ_Llm_x[index_J][index_L][index_l][index_m][index_x_in_J]);
+                *P_entry = (a_J * J[0] +
+                            (1.-a_J) * (J[1]
+                          - a_J * ((a_J+1.) * ddJ[0]
+                           +(2.-a_J) * ddJ[1])
+                          * pbs2->x_spline_factor[shift]) );
+              }
+            }
+          }
+        }
+
+
+        // ------------------------------------------------------------------------------
+        // -                              Multiply the matrices                         -
+        // ------------------------------------------------------------------------------
+
+        /* C += P * W. The source matrix has at most two columns and fits in cache, so we
+        stream each row of the projection matrix only once. */
+        for (int index_l=0; index_l < l_size; ++index_l) {
+
+          double * P_row = &(P[index_l*n_rows]);
+          double * C_row = &(C[(index_product*l_size + index_l)*2]);
+          double sum_0 = 0, sum_1 = 0;
+
+          if (n_columns == 1) {
+            for (int index_row=0; index_row < n_rows; ++index_row)
+              sum_0 += P_row[index_row] * W[index_row*2];
+          }
+          else {
+            for (int index_row=0; index_row < n_rows; ++index_row) {
+              sum_0 += P_row[index_row] * W[index_row*2];
+              sum_1 += P_row[index_row] * W[index_row*2 + 1];
+            }
+          }
+
+          C_row[0] += sum_0;
+          C_row[1] += sum_1;
+        }
+
+      } // end of for(index_product)
+
+    } // end of for(index_tau_start)
+
+
+    // ==================================================================================
+    // =                          Store the transfer functions                          =
+    // ==================================================================================
+
+    for (int index_tt=0; index_tt < ptr2->tt2_size; ++index_tt) {
+
+      if (ptr2->corresponding_index_m[index_tt] != index_m)
         continue;
-            
-      /* The projection function J_Llm is negligible when x is too small; index_x_min is the first
-      value in pbs2->xx where J_Llm(x) is non-negligible */
-      int index_x_min = pbs2->index_xmin_J[index_J][index_L][index_l][index_m];
 
-      /* Skip the contribution to the integral from this L if the projection function is
-      negligible. The projection function J_Llm(x) is basically a Bessel function of order l,
-      so it vanishes when x<<l. Since its argument is x=k*(tau_0-tau), this means that J
-      vanishes when tau is much larger than tau_0-l/k; that is, high-l multipoles do not get
-      contributions from low-k modes. If you do not include this check, you will get random
-      segmentation faults, because you would end up addressing J_Llm_x with a negative x index.
-      Note that this check also ensures that we skip L<2 configurations for polarisation,
-      as it should be. */
-      if (index_x < index_x_min)
+      int index_l = ptr2->corresponding_index_l[index_tt];
+
+      /* Flat-sky limit: the scalar method stores the transfer function and updates
+      the counter of memorised transfers */
+      if (index_l >= l_size) {
+        class_call (transfer2_compute (
+                      ppr,
+                      ppr2,
+                      ppt2,
+                      pbs,
+                      pbs2,
+                      ptr2,
+                      index_k1,
+                      index_k2,
+                      index_k,
+                      index_l,
+                      index_m,
+                      index_tt,
+                      interpolated_sources_in_time,
+                      pw),
+          ptr2->error_message,
+          ptr2->error_message);
+
+        if (pw->los_check != NULL)
+          pw->los_check[index_tt*ptr2->k_size_k1k2[index_k1][index_k2] + index_k] = pw->transfer;
+
         continue;
-  
-      /* Index needed to address the x-level of the projection function array, pbs2->J_Llm_x.
-      The above check ensures that the index is non-negative. */
-      int index_x_in_J = index_x - index_x_min;
-      
-#ifdef DEBUG
-      /* Check that index_x is within the limits for which we have computed the projection functions */
-      int x_size = pbs2->x_size_J[index_J][index_L][index_l][index_m];
-      class_test ((index_x_in_J >= x_size) || (index_x_in_J < 0),
-        ptr2->error_message,
-        "L=%d, l=%d, m=%d, x=%g: wrong indexing for pbs2->J_Llm_x; index_x_in_J=%d, x_size=%d, index_x_min=%d",
-        L, l, m, x, index_x_in_J, x_size, index_x_min);
-#endif // DEBUG
-  
-  
-      // ---------------------------------------------------------------------------
-      // -                              Interpolate J(x)                           -
-      // ---------------------------------------------------------------------------
+      }
+
+      int transfer_type = ptr2->index_tt2_monopole[index_tt];
+      double * C_T = &(C[(T_product*l_size + index_l)*2]);
+      double * C_EE = &(C[(EE_product*l_size + index_l)*2]);
+      double * C_EB = &(C[(EB_product*l_size + index_l)*2]);
+      double transfer;
+
+      /* Temperature: single contribution, as in eq. 5.95 of http://arxiv.org/abs/1405.2280 */
+      if (ppt2->has_source_T && transfer_type==ptr2->index_tt2_T)
+        transfer = C_T[0];
+
+      /* E-modes: direct (E->E) plus mixing (B->E) contribution */
+      else if (ppt2->has_source_E && transfer_type==ptr2->index_tt2_E)
+        transfer = C_EE[0] + C_EB[1];
+
+      /* B-modes: direct (B->B) minus mixing (E->B) contribution, because J_BE=-J_EB;
+      see transfer2_compute() */
+      else if (ppt2->has_source_B && transfer_type==ptr2->index_tt2_B)
+        transfer = C_EE[1] - C_EB[0];
+
+      else
+        continue;
+
+      /* Correct for factor 1/2 from the trapezoidal rule */
+      transfer *= 0.5;
+
+      /* Apply the same factors as in transfer2_compute(): brightness -> brightness temperature,
+      Y_lm expansion -> Legendre expansion, full second-order part of the perturbation */
+      transfer /= 4.;
+      transfer /= (2.*ptr2->l[index_l] + 1);
+      transfer /= 2.;
+
+      /* Check the result against the scalar method, for the pair selected in transfer2_init().
+      Note that transfer2_compute() also stores the transfer function, which is overwritten
+      below, and updates the counter of memorised transfers. */
+      if (pw->los_check != NULL) {
+
+        class_call (transfer2_compute (
+                      ppr,
+                      ppr2,
+                      ppt2,
+                      pbs,
+                      pbs2,
+                      ptr2,
+                      index_k1,
+                      index_k2,
+                      index_k,
+                      index_l,
+                      index_m,
+                      index_tt,
+                      interpolated_sources_in_time,
+                      pw),
+          ptr2->error_message,
+          ptr2->error_message);
+
+        pw->los_check[index_tt*ptr2->k_size_k1k2[index_k1][index_k2] + index_k] = pw->transfer;
+      }
+      else {
+        #pragma omp atomic
+        ++ptr2->count_memorised_transfers;
+      }
+
+      /* Store transfer function in transfer structure */
+      ptr2->transfer[index_tt][index_k1][index_k2][index_k] = transfer;
+
+    } // end of for(index_tt)
+
+  } // end of for(index_m)
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Compare the transfer functions computed with the matrix method for the pair (k1,k2) with
+ * those computed with the scalar method, stored in los_check[index_tt*k_size + index_k].
+ *
+ * The difference is measured relative to the largest value of the transfer function in
+ * the k3 row, so that transfer functions crossing zero do not trigger false alarms. The
+ * largest difference among all transfer types is returned in max_difference, and the
+ * corresponding transfer type in index_tt_max.
+ */
+int transfer2_check_matrix (
+        struct transfers2 * ptr2,
+        int index_k1,
+        int index_k2,
+        double * los_check,
+        double * max_difference,
+        int * index_tt_max
+        )
+{
+
+  int k_size = ptr2->k_size_k1k2[index_k1][index_k2];
+
+  *max_difference = 0;
+  *index_tt_max = 0;
 
-      /* Interpolate J in x=k*(tau0-tau) */
-      double J_Llm;
-      double * J = &(pbs2->J_Llm_x[index_J][index_L][index_l][index_m][index_x_in_J]);
-      double J_Llm_left = *J;
-      double J_Llm_right = *(J+1);
-      
-      if (ppr->bessels_interpolation == linear_interpolation) {
-        J_Llm = a_J*J_Llm_left + (1-a_J)*J_Llm_right;
-      }
-      else if (ppr->bessels_interpolation == cubic_interpolation) {
-        double * ddJ = &(pbs2->ddJ_Llm_x[index_J][index_L][index_l][index_m][index_x_in_J]);
-        double ddJ_Llm_left = *ddJ;
-        double ddJ_Llm_right = *(ddJ+1);
-        J_Llm = (a_J * J_Llm_left +                                
-                 (1.-a_J) * (J_Llm_right
-               - a_J * ((a_J+1.) * ddJ_Llm_left
-                +(2.-a_J) * ddJ_Llm_right) 
-               * pbs2->xx_step * pbs2->xx_step / 6.0) );
-      }
+  for (int index_tt=0; index_tt < ptr2->tt2_size; ++index_tt) {
 
-      /* Debug - Check the interpolation of the projection function */
-      // if ((index_tau == ppt2->index_tau_rec) && (pw->index_k1==1) && (pw->index_k2==0)) {
-      //
-      //   int index_xmin_J = pbs2->index_xmin_J[index_J][index_L][index_l][index_m];
-      //   double x_left = pbs2->xx[index_x-index_xmin_J];
-      //   double x_right = pbs2->xx[index_x-index_xmin_J+1];
-      //
-      //   if ((L == 2) && (l==4) && (m==0)) {
-      //     if (x_left > -1) {
-      //       double J_Llm_linear = a_J*J_Llm_left + (1-a_J)*J_Llm_right;
-      //       fprintf(stderr, "%.17f %.17f %.17f %.17f %.17f\n",
-      //         x, J_Llm, J_Llm_linear, J_Llm_left, J_Llm_right);
-      //       fprintf(stderr, "JL(%d,%d,%d,x=%10.6g[%d]) = %10.6g\n",
-      //         L, l, m, x_left, index_x-index_xmin_J, J_Llm_left);
-      //       fprintf(stderr, "J(%d,%d,%d,x=%10.6g) = %10.6g\n",
-      //         L, l, m, x, J_Llm);
-      //       fprintf(stderr, "JR(%d,%d,%d,x=%10.6g[%d]) = %10.6g\n",
-      //         L, l, m, x_right, index_x-index_xmin_J+1, J_Llm_right);
-      //       fprintf(stderr, "\n");
-      //     }
-      //   }
-      // }
+    double * scalar = &(los_check[index_tt*k_size]);
+    double row_max = 0;
+    double difference = 0;
 
+    for (int index_k=0; index_k < k_size; ++index_k) {
+      row_max = MAX (row_max, fabs(scalar[index_k]));
+      difference = MAX (difference, fabs(ptr2->transfer[index_tt][index_k1][index_k2][index_k] - scalar[index_k]));
+    }
 
-      // ---------------------------------------------------------------------------
-      // -                           Build the integrand                           -
-      // ---------------------------------------------------------------------------
+    /* A row that vanishes with the scalar method must vanish also with the matrix one */
+    double relative_difference;
 
-      /* Pre-interpolated source function in tau and k3 for the desired source type */
-      double source_Lm = interpolated_sources_in_time[index_source_monopole + lm(L,m)][index_tau];
+    if (row_max > 0)
+      relative_difference = difference/row_max;
+    else
+      relative_difference = ((difference > 0) ? 1 : 0);
 
-      /* Increment the integrand function by adding another L-multipole  */
-      integrand += J_Llm * source_Lm;
-  
-      /* Debug - Print the integrand function for a given set of (l,m,k1,k2,k) */
-      // if ( (l==100) && (m==0) ) {
-      //   if ( (pw->index_k1==0) && (pw->index_k2==1) && (pw->index_k==2500) ) {
-      //     fprintf (stderr, "%15f %15f\n", ptr2->tau0_minus_tau[index_tau], integrand);
-      //   }
-      // }
+    if (relative_difference > *max_difference) {
+      *max_difference = relative_difference;
+      *index_tt_max = index_tt;
+    }
+  }
 
-    } // end of for(index_L)    
-    
-    /* Increment the result with the contribution from the considered time-step */
-    *integral += integrand * pw->delta_tau[index_tau];
-  
-    /* Debug - Output the integrand as a function of time */
-    // if (l == 2) {
-    //   if (index_tau==0)
-    //     fprintf_k_debug (stderr, "# k1=%g, k2=%g, k=%g\n", ppt2->k[index_k1], ppt2->k[index_k2], k);
-    //   p2 (pw->tau_grid[index_tau], integrand);
-    // }
-  
-  } // end of for(index_tau)
+  return _SUCCESS_;
 
-  /* Correct for factor 1/2 from the trapezoidal rule */
-  *integral *= 0.5;
+}
+
+
+/**
+ * Find the position of x=k*(tau0-tau) inside the sampling of the projection
+ * functions, pbs2->xx, for all the times in the integration grid.
+ *
+ * The line of sight integral requires interpolating the projection functions
+ * J_Llm(x) at x=k*(tau0-tau) for each transfer type (T,E,B), each (l,m) and each
+ * L. The position of x inside pbs2->xx and the interpolation weights depend only
+ * on k and on the time grid, so we compute them here once per k, rather than
+ * in transfer2_integrate() for each transfer type.
+ *
+ * Since the projection functions are sampled with a different stride in each
+ * block of pbs2->xx (see the documentation of the bessels2 structure), we store
+ * the interpolation weight for all the possible strides.
+ *
+ * This function will fill the following arrays in the transfer workspace:
+ *
+ * - pw->index_x[index_tau]
+ * - pw->index_x_block[index_tau]
+ * - pw->a_x[index_tau*(_BESSEL2_X_BLOCK_SHIFT_+1) + shift]
+ *
+ */
 
+int transfer2_get_x_grid(
+      struct precision * ppr,
+      struct bessels2 * pbs2,
+      struct transfers2 * ptr2,
+      struct transfer2_workspace * pw /**< input and output, workspace containing the time grid (pw->tau0_minus_tau) and the value of k (pw->k)  */
+      )
+{
 
 #ifdef DEBUG
-  /* Test for nans */
-  class_test (isnan(*integral),
+  /* Check that we computed the projection functions J(x) for all the needed values of x.
+  Since x appears in the line of sight integral as x=k*(tau0-tau), here we check that x_max
+  is larger than k*(tau0-tau_min). */
+  class_test (pw->k*pw->tau0_minus_tau[0] > pbs2->xx_max,
     ptr2->error_message,
-    "found nan in second-order transfer function");
+    "not enough J's.  Increase l_max to %g or decrease k_max to %.3g.",
+    ceil(pw->k*pw->tau0_minus_tau[0]/ppr->k_max_tau0_over_l_max),
+    pbs2->xx_max/pw->tau0_minus_tau[0]);
 #endif // DEBUG
 
+  for (int index_tau=0; index_tau < pw->tau_grid_size; ++index_tau) {
+
+    /* Argument of the projection function at the considered time */
+    double x = pw->k * pw->tau0_minus_tau[index_tau];
+
+    /* Position of x inside pbs2->xx and of the block of pbs2->xx that contains it */
+    double u = x*pbs2->xx_step_inverse;
+    int index_x = (int)u;
+    pw->index_x[index_tau] = index_x;
+    pw->index_x_block[index_tau] = index_x >> _BESSEL2_X_BLOCK_SHIFT_;
+
+    /* Interpolation weight of the left node, for each stride */
+    for (int shift=0; shift <= _BESSEL2_X_BLOCK_SHIFT_; ++shift)
+      pw->a_x[index_tau*(_BESSEL2_X_BLOCK_SHIFT_+1) + shift] =
+        ((((index_x >> shift) + 1) << shift) - u) * pbs2->x_stride_inverse[shift];
+
+  }
 
   return _SUCCESS_;
+
 }
 
 
@@ -2402,7 +4257,17 @@ int transfer2_get_time_grid(
   the other options, but the execution will be faster because the sources will not need to
   be interpolated. */
 
-  if (ptr2->tau_sampling == sources_tau_sampling) {
+  /* The Filon quadrature does not need extra points to follow the oscillations of the
+  projection functions, so we use the sources time sampling also in that case. */
+
+  if ((ptr2->tau_sampling == sources_tau_sampling) || (ptr2->los_method == filon_los_method)) {
+
+      /* This grid does not depend on k, so that we need to build it only once for
+      each workspace */
+      if (pw->has_sources_tau_grid == _TRUE_)
+        return _SUCCESS_;
+
+      pw->has_sources_tau_grid = _TRUE_;
     
       pw->tau_grid_size = tau_size_pt;
       
@@ -2591,6 +4456,170 @@ int transfer2_get_time_grid(
 
 
 
+/**
+ * Compute the coefficients needed to interpolate the source functions S(k1,k2,k,tau)
+ * in k for a given (k1,k2) pair.
+ *
+ * All the source types and all the times share the same k3 sampling (ppt2->k3) and
+ * the same target grid (k_grid). Therefore, the position of each target point in the
+ * sampling and the decomposition of the tridiagonal system that gives the second
+ * derivatives of the cubic spline do not depend on the source type or on time. We
+ * compute them here once per (k1,k2) pair, so that transfer2_interpolate_sources_in_k()
+ * only needs to apply them to the ppt2->tau_size columns of each source type.
+ *
+ * The spline has the same boundary conditions as the one built by CLASS with
+ * array_spline_table_columns() in the _SPLINE_EST_DERIV_ mode.
+ *
+ * The arrays in k3_spline are allocated here and should be freed with
+ * transfer2_k3_spline_free().
+ */
+
+int transfer2_k3_spline_init(
+      struct precision2 * ppr2,
+      struct perturbs2 * ppt2,
+      struct transfers2 * ptr2,
+      int index_k1,
+      int index_k2,
+      double * k_grid, /**< input, list of k-values where to interpolate the source function */
+      struct transfer2_k3_spline * k3_spline /**< output, coefficients of the interpolation */
+      )
+{
+
+  /* Shortcuts */
+  int k_pt_size = ppt2->k3_size[index_k1][index_k2];
+  double * k_pt = ppt2->k3[index_k1][index_k2];
+  int k_tr_size = ptr2->k_size_k1k2[index_k1][index_k2];
+  double * k_tr = k_grid;
+
+  k3_spline->k_pt_size = k_pt_size;
+
+  /* Limits for which we shall interpolate the sources */
+  k3_spline->first_physical_index = ptr2->k_physical_start_k1k2[index_k1][index_k2];
+  k3_spline->last_physical_index = k3_spline->first_physical_index
+    + ptr2->k_physical_size_k1k2[index_k1][index_k2] - 1;
+
+
+  // ====================================================================================
+  // =                               Interpolation weights                              =
+  // ====================================================================================
+
+  class_alloc (k3_spline->index_k_left, k_tr_size*sizeof(int), ptr2->error_message);
+  class_alloc (k3_spline->weight, 4*k_tr_size*sizeof(double), ptr2->error_message);
+
+  /* Find the node to the left of each k value contained in k_grid, using the usual
+  spline interpolation algorithm */
+  int index_k = 0;
+
+  for (int index_k_tr = k3_spline->first_physical_index; index_k_tr <= k3_spline->last_physical_index; ++index_k_tr) {
+
+    while (((index_k+2) < k_pt_size) && (k_pt[index_k+1] < k_tr[index_k_tr]))
+      index_k++;
+
+    double h = k_pt[index_k+1] - k_pt[index_k];
+
+    class_test(h==0, ptr2->error_message, "stop to avoid division by zero");
+
+    double b = (k_tr[index_k_tr] - k_pt[index_k])/h;
+    double a = 1-b;
+
+    k3_spline->index_k_left[index_k_tr] = index_k;
+    k3_spline->weight[4*index_k_tr + 0] = a;
+    k3_spline->weight[4*index_k_tr + 1] = b;
+    k3_spline->weight[4*index_k_tr + 2] = (a*a*a-a)*h*h/6.0;
+    k3_spline->weight[4*index_k_tr + 3] = (b*b*b-b)*h*h/6.0;
+
+  }
+
+
+  // ====================================================================================
+  // =                            Decompose the spline system                           =
+  // ====================================================================================
+
+  k3_spline->alpha = NULL;
+  k3_spline->beta = NULL;
+  k3_spline->gamma = NULL;
+  k3_spline->factor = NULL;
+
+  if (ppr2->sources_k3_interpolation == cubic_interpolation) {
+
+    class_test (k_pt_size < 3,
+      ptr2->error_message,
+      "need at least 3 values of k3 to estimate the derivatives at the edges of the spline, found %d",
+      k_pt_size);
+
+    class_alloc (k3_spline->alpha, k_pt_size*sizeof(double), ptr2->error_message);
+    class_alloc (k3_spline->beta, k_pt_size*sizeof(double), ptr2->error_message);
+    class_alloc (k3_spline->gamma, k_pt_size*sizeof(double), ptr2->error_message);
+    class_alloc (k3_spline->factor, k_pt_size*sizeof(double), ptr2->error_message);
+
+    double * x = k_pt;
+    int n = k_pt_size;
+
+    /* First node. The first derivative is estimated with the parabola through the
+    first three nodes, dy = c[0]*y[0] + c[1]*y[1] + c[2]*y[2] */
+    double h = x[1] - x[0];
+    double c[3];
+    c[1] = (x[2]-x[0])*(x[2]-x[0]) / ((x[2]-x[0])*(x[1]-x[0])*(x[2]-x[1]));
+    c[2] = -(x[1]-x[0])*(x[1]-x[0]) / ((x[2]-x[0])*(x[1]-x[0])*(x[2]-x[1]));
+    c[0] = -c[1] - c[2];
+
+    k3_spline->first[0] = -3/(h*h) - 3*c[0]/h;
+    k3_spline->first[1] = 3/(h*h) - 3*c[1]/h;
+    k3_spline->first[2] = -3*c[2]/h;
+    k3_spline->factor[0] = -0.5;
+
+    /* Intermediate nodes */
+    for (int i=1; i < n-1; ++i) {
+      double sig = (x[i]-x[i-1])/(x[i+1]-x[i-1]);
+      double p = sig*k3_spline->factor[i-1] + 2;
+      k3_spline->factor[i] = (sig-1)/p;
+      k3_spline->alpha[i] = 6/((x[i+1]-x[i])*(x[i+1]-x[i-1])*p);
+      k3_spline->beta[i] = 6/((x[i]-x[i-1])*(x[i+1]-x[i-1])*p);
+      k3_spline->gamma[i] = sig/p;
+    }
+
+    /* Last node. Same as for the first node, using the last three nodes */
+    h = x[n-1] - x[n-2];
+    c[1] = (x[n-3]-x[n-1])*(x[n-3]-x[n-1]) / ((x[n-3]-x[n-1])*(x[n-2]-x[n-1])*(x[n-3]-x[n-2]));
+    c[0] = -(x[n-2]-x[n-1])*(x[n-2]-x[n-1]) / ((x[n-3]-x[n-1])*(x[n-2]-x[n-1])*(x[n-3]-x[n-2]));
+    c[2] = -c[0] - c[1];
+
+    k3_spline->last[0] = 3*c[0]/h;
+    k3_spline->last[1] = 3*c[1]/h + 3/(h*h);
+    k3_spline->last[2] = 3*c[2]/h - 3/(h*h);
+    k3_spline->last_pivot_inverse = 1/(0.5*k3_spline->factor[n-2] + 1);
+    k3_spline->factor[n-1] = 0;
+
+  }
+
+  return _SUCCESS_;
+
+}
+
+
+
+/**
+ * Free the arrays allocated by transfer2_k3_spline_init().
+ */
+
+int transfer2_k3_spline_free(
+      struct transfer2_k3_spline * k3_spline
+      )
+{
+
+  free (k3_spline->index_k_left);
+  free (k3_spline->weight);
+  free (k3_spline->alpha);
+  free (k3_spline->beta);
+  free (k3_spline->gamma);
+  free (k3_spline->factor);
+
+  return _SUCCESS_;
+
+}
+
+
+
 /**
  * Interpolate the source function S(k1, k2, k, tau) at the desired values of k, for
  * all values of time.
@@ -2599,10 +4628,21 @@ int transfer2_get_time_grid(
  * an array containing the same source function interpolated in the desired values
  * of k, for all times where the source function is sampled.
  *
- * The output arrays, sources_k_spline and interpolated_sources_in_k, are matrices of
- * size k3_size*tau_size, where k3_size = ptr2->k3_size[index_k1][index_k2] and
- * tau_size = ppt2->tau_sampling. They are addressed as:
+ * The interpolation coefficients, which do not depend on the source type or on time,
+ * must be computed beforehand with transfer2_k3_spline_init(). Here we first transpose
+ * the sources so that time is the fastest index, and then apply the spline to all
+ * the time columns at once: in all the loops of the cubic spline the inner loop runs
+ * on contiguous time values, which the compiler can vectorise.
+ *
+ * Only the time rows stored in ppt2->sources are interpolated (see
+ * perturb2_compress_k1_level()); the interpolated sources vanish outside them.
+ *
+ * The arrays sources_k, sources_k_spline and interpolated_sources_in_k are matrices of
+ * size k3_size*tau_size, where k3_size = ppt2->k3_size[index_k1][index_k2] for the first
+ * two and k3_size = ptr2->k_size_k1k2[index_k1][index_k2] for the third, and
+ * tau_size = ppt2->tau_size. They are addressed as:
  * 
+ *   sources_k[index_k3*ppt2->tau_size + index_tau]
  *   sources_k_spline[index_k3*ppt2->tau_size + index_tau]
  *   interpolated_sources_in_k[index_k3*ppt2->tau_size + index_tau]
  * 
@@ -2620,7 +4660,8 @@ int transfer2_interpolate_sources_in_k(
       int index_k1,
       int index_k2,
       int index_tp2, /**< input, type of the requested source function */
-      double * k_grid, /**< input, list of k-values where to interpolate the source function */
+      struct transfer2_k3_spline * k3_spline, /**< input, interpolation coefficients computed by transfer2_k3_spline_init() */
+      double * sources_k, /**< output, source function with time as the fastest index; only for cubic interpolation */
       double * sources_k_spline, /**< output, second derivative of the source function with respect to k, for all time values */
       double * interpolated_sources_in_k /**< output, source function at the desired k-values, for all time values */
       )
@@ -2629,39 +4670,12 @@ int transfer2_interpolate_sources_in_k(
 
   /* Shortcuts */
   int k_pt_size = ppt2->k3_size[index_k1][index_k2];
-  double * k_pt = ppt2->k3[index_k1][index_k2];
   int k_tr_size = ptr2->k_size_k1k2[index_k1][index_k2];
-  double * k_tr = k_grid;
-    
-  /* Find second derivative of original sources with respect to k in view of spline interpolation */
-  if (ppr2->sources_k3_interpolation == cubic_interpolation) {
-
-    class_call (array_spline_table_columns (
-                  ppt2->k3[index_k1][index_k2],
-                  ppt2->k3_size[index_k1][index_k2],
-                  ppt2->sources[index_tp2][index_k1][index_k2],
-                  ppt2->tau_size,
-                  sources_k_spline,
-                  _SPLINE_EST_DERIV_,
-                  ptr2->error_message),
-         ptr2->error_message,
-         ptr2->error_message);
-  }
-
-
-  // ====================================================================================
-  // =                                   Interpolation                                  =
-  // ====================================================================================
-
-  /* Limits for which we shall interpolate the sources */
-  int physical_size = ptr2->k_physical_size_k1k2[index_k1][index_k2];
-  int first_physical_index = ptr2->k_physical_start_k1k2[index_k1][index_k2];
-  int last_physical_index = first_physical_index + physical_size - 1;
+  int tau_size = ppt2->tau_size;
 
-  /* Interpolate the source function at each k value contained in k_grid, using the usual
-  spline interpolation algorithm */
-  int index_k = 0;
-  double h = k_pt[index_k+1] - k_pt[index_k];
+  /* Range of time rows stored in ppt2->sources; the sources vanish outside it */
+  int tau_min = ppt2->sources_tau_min[index_tp2][index_k1][index_k2];
+  int tau_end = tau_min + ppt2->sources_tau_size[index_tp2][index_k1][index_k2];
 
   /* Debug - Print the sources as a function of time */
   // index_K = 50;
@@ -2677,32 +4691,96 @@ int transfer2_interpolate_sources_in_k(
   //     for (int index_k=0; index_k < ppt2->k3_size[index_k1][index_k2]; ++index_k)
   //       printf ("%12g %12g\n", ppt2->k3[index_k1][index_k2][index_k], sources(index_tau,index_k));
 
+  // ====================================================================================
+  // =                                Spline coefficients                               =
+  // ====================================================================================
 
-  for (int index_k_tr = first_physical_index; index_k_tr <= last_physical_index; ++index_k_tr) {
-    
-    while (((index_k+1) < k_pt_size) && (k_pt[index_k+1] < k_tr[index_k_tr])) {
-      index_k++;
-      h = k_pt[index_k+1] - k_pt[index_k];
+  /* Find second derivative of original sources with respect to k in view of spline interpolation */
+  if (ppr2->sources_k3_interpolation == cubic_interpolation) {
+
+    /* Transpose the sources, so that the time columns are contiguous in memory */
+    for (int index_tau = tau_min; index_tau < tau_end; index_tau++)
+      for (int index_k = 0; index_k < k_pt_size; ++index_k)
+        sources_k[index_k*tau_size + index_tau] = sources(index_tau,index_k);
+
+    double * y = sources_k;
+    double * ddy = sources_k_spline;
+    int n = k_pt_size;
+
+    /* Forward sweep; the intermediate results are stored in ddy */
+    for (int index_tau = tau_min; index_tau < tau_end; index_tau++)
+      ddy[index_tau] = k3_spline->first[0] * y[index_tau]
+                     + k3_spline->first[1] * y[tau_size + index_tau]
+                     + k3_spline->first[2] * y[2*tau_size + index_tau];
+
+    for (int i=1; i < n-1; ++i) {
+
+      double alpha = k3_spline->alpha[i];
+      double beta = k3_spline->beta[i];
+      double gamma = k3_spline->gamma[i];
+      double * y_i = y + i*tau_size;
+      double * u_i = ddy + i*tau_size;
+
+      for (int index_tau = tau_min; index_tau < tau_end; index_tau++)
+        u_i[index_tau] = alpha * (y_i[tau_size + index_tau] - y_i[index_tau])
+                       - beta * (y_i[index_tau] - y_i[index_tau - tau_size])
+                       - gamma * u_i[index_tau - tau_size];
     }
-    
-    class_test(h==0, ptr2->error_message, "stop to avoid division by zero");
-    
-    double b = (k_tr[index_k_tr] - k_pt[index_k])/h;
-    double a = 1-b;
+
+    /* Last node */
+    for (int index_tau = tau_min; index_tau < tau_end; index_tau++)
+      ddy[(n-1)*tau_size + index_tau] = (k3_spline->last[0] * y[(n-3)*tau_size + index_tau]
+                                       + k3_spline->last[1] * y[(n-2)*tau_size + index_tau]
+                                       + k3_spline->last[2] * y[(n-1)*tau_size + index_tau]
+                                       - 0.5 * ddy[(n-2)*tau_size + index_tau]) * k3_spline->last_pivot_inverse;
+
+    /* Back substitution */
+    for (int i=n-2; i >= 0; --i) {
+
+      double factor = k3_spline->factor[i];
+      double * ddy_i = ddy + i*tau_size;
+
+      for (int index_tau = tau_min; index_tau < tau_end; index_tau++)
+        ddy_i[index_tau] = factor * ddy_i[tau_size + index_tau] + ddy_i[index_tau];
+    }
+  }
+
+
+  // ====================================================================================
+  // =                                   Interpolation                                  =
+  // ====================================================================================
+
+  /* Limits for which we shall interpolate the sources */
+  int first_physical_index = k3_spline->first_physical_index;
+  int last_physical_index = k3_spline->last_physical_index;
+
+  for (int index_k_tr = first_physical_index; index_k_tr <= last_physical_index; ++index_k_tr) {
+
+    int index_k = k3_spline->index_k_left[index_k_tr];
+    double * w = k3_spline->weight + 4*index_k_tr;
+    double * result = interpolated_sources_in_k + index_k_tr*tau_size;
+
+    /* The sources vanish outside the stored time rows */
+    for (int index_tau = 0; index_tau < tau_min; index_tau++)
+      result[index_tau] = 0;
+    for (int index_tau = tau_end; index_tau < tau_size; index_tau++)
+      result[index_tau] = 0;
 
     /* We shall interpolate for each value of conformal time, hence the loop
-    on index_tau */
+    on index_tau. The linear interpolation reads the sources directly, as
+    transposing them would cost more than the interpolation itself. */
     if (ppr2->sources_k3_interpolation == linear_interpolation) {
-      for (int index_tau = 0; index_tau < ppt2->tau_size; index_tau++)
-        interpolated_sources_in_k[index_k_tr*ppt2->tau_size + index_tau] = 
-          a * sources(index_tau,index_k) + b * sources(index_tau,index_k+1);
+      for (int index_tau = tau_min; index_tau < tau_end; index_tau++)
+        result[index_tau] = w[0] * sources(index_tau,index_k) + w[1] * sources(index_tau,index_k+1);
     }
     else if (ppr2->sources_k3_interpolation == cubic_interpolation) {
-      for (int index_tau = 0; index_tau < ppt2->tau_size; index_tau++)
-        interpolated_sources_in_k[index_k_tr*ppt2->tau_size + index_tau] = 
-          a * sources(index_tau,index_k) + b * sources(index_tau,index_k+1)
-          + ((a*a*a-a) * sources_k_spline[index_tau*k_pt_size + index_k]
-          +(b*b*b-b) * sources_k_spline[index_tau*k_pt_size + index_k+1])*h*h/6.0;
+      double * y_left = sources_k + index_k*tau_size;
+      double * y_right = y_left + tau_size;
+      double * ddy_left = sources_k_spline + index_k*tau_size;
+      double * ddy_right = ddy_left + tau_size;
+      for (int index_tau = tau_min; index_tau < tau_end; index_tau++)
+        result[index_tau] = w[0] * y_left[index_tau] + w[1] * y_right[index_tau]
+                          + w[2] * ddy_left[index_tau] + w[3] * ddy_right[index_tau];
     }
 
   } // end of for (index_k_tr)
@@ -2805,7 +4883,10 @@ int transfer2_interpolate_sources_in_time (
     
   /* If the integration grid matches the time sampling of the sources, there is no need for
   interpolation */
-  if (ptr2->tau_sampling == sources_tau_sampling) {
+  /* The Filon quadrature does not need extra points to follow the oscillations of the
+  projection functions, so we use the sources time sampling also in that case. */
+
+  if ((ptr2->tau_sampling == sources_tau_sampling) || (ptr2->los_method == filon_los_method)) {
     
     for (int index_tau = 0; index_tau < pw->tau_grid_size; ++index_tau)     
       interpolated_sources_in_time[index_tau]
@@ -2922,6 +5003,10 @@ int transfer2_interpolate_sources_in_time (
  * while their file reference is in ptr2->transfers_files[index_tt2]. All files
  * must be already open for writing.
  *
+ * In the tiles layout, there is a file for each group of transfer types,
+ * ptr2->transfers_files[index_tile], and we append to it the tiles relative
+ * to the considered index_k1.
+ *
  * This function will not free memory; if you are concerned about memory consumption
  * you will have to free it manually with transfer2_free_k1_level().
  * 
@@ -2937,7 +5022,42 @@ int transfer2_store_transfers_to_disk(
   if (ptr2->transfer2_verbose > 1)
     printf("     \\ writing transfer function for index_k1=%d ...\n", index_k1);
           
+  /* In the tiles layout, write a whole tile for each group of transfer types and for each k2 */
+  if (ptr2->transfers_layout == tile_transfers_layout) {
+
+    for (int index_tile = 0; index_tile < ptr2->tiles_size; index_tile++) {
+
+      /* Print some info */
+      if (ptr2->transfer2_verbose > 3)
+        printf("     * writing transfer function for (index_tile,index_k1)=(%d,%d) on '%s' ...\n",
+          index_tile, index_k1, ptr2->transfers_paths[index_tile]);
+
+      /* Nothing to write if no l is compatible with the m of the group */
+      if (ptr2->tile_tt_size[index_tile] == 0)
+        continue;
+
+      for (int index_k2 = 0; index_k2 <= index_k1; ++index_k2) {
+
+        /* The first type in the group points to the beginning of the tile */
+        fwrite(
+              ptr2->transfer[ptr2->tile_tt[index_tile][0]][index_k1][index_k2],
+              sizeof(song_storage),
+              ptr2->tile_tt_size[index_tile]*ptr2->k_size_k1k2[index_k1][index_k2],
+              ptr2->transfers_files[index_tile]
+              );
+
+      } // end of for(index_k2)
+
+    } // end of for(index_tile)
+
+    return _SUCCESS_;
+  }
+
   for (int index_tt = 0; index_tt < ptr2->tt2_size; index_tt++) {
+
+    /* The transfer types computed in a previous run are already on disk */
+    if (ptr2->transfers_on_disk[index_tt] == _TRUE_)
+      continue;
     
     /* Print some info */
     if (ptr2->transfer2_verbose > 3)
@@ -2949,7 +5069,7 @@ int transfer2_store_transfers_to_disk(
       /* Write a chunk with all the k-values for this set of (type,k1,k2) */
       fwrite(
             ptr2->transfer[index_tt][index_k1][index_k2],
-            sizeof(double),
+            sizeof(song_storage),
             ptr2->k_size_k1k2[index_k1][index_k2],
             ptr2->transfers_files[index_tt]
             );
@@ -2998,17 +5118,26 @@ int transfer2_allocate_k1_level(
     are symmetrised with respect to k1<->k2. */
     int k2_size = index_k1 + 1;
   
-    class_alloc(
+    class_calloc(
       ptr2->transfer[index_tt][index_k1],
-      k2_size * sizeof(double *),
+      k2_size,
+      sizeof(song_storage *),
       ptr2->error_message);
+
+    /* In the tiles layout, the k level is allocated below for a group of types at a time */
+    if (ptr2->transfers_layout == tile_transfers_layout)
+      continue;
+
+    /* The transfer types computed in a previous run are not needed in memory */
+    if ((ptr2->transfers_on_disk != NULL) && (ptr2->transfers_on_disk[index_tt] == _TRUE_))
+      continue;
   
     for(int index_k2=0; index_k2<=index_k1; ++index_k2) {      
 
       /* Allocate k level */
       class_alloc(
         ptr2->transfer[index_tt][index_k1][index_k2],
-        ptr2->k_size_k1k2[index_k1][index_k2] * sizeof(double),
+        ptr2->k_size_k1k2[index_k1][index_k2] * sizeof(song_storage),
         ptr2->error_message);
 
       #pragma omp atomic
@@ -3017,11 +5146,45 @@ int transfer2_allocate_k1_level(
 
     } // end of for(index_k2)
   } // end of for(index_tt)
+
+  /* In the tiles layout, allocate one tile for each group of transfer types and for each k2,
+  and let the k level of each type point inside it */
+  if (ptr2->transfers_layout == tile_transfers_layout) {
+
+    for (int index_tile=0; index_tile<ptr2->tiles_size; ++index_tile) {
+
+      int tt_size = ptr2->tile_tt_size[index_tile];
+
+      /* Nothing to allocate if no l is compatible with the m of the group */
+      if (tt_size == 0)
+        continue;
+
+      for(int index_k2=0; index_k2<=index_k1; ++index_k2) {
+
+        int k_size = ptr2->k_size_k1k2[index_k1][index_k2];
+        song_storage * tile;
+
+        class_alloc(
+          tile,
+          tt_size * k_size * sizeof(song_storage),
+          ptr2->error_message);
+
+        for (int index_tt_in_tile=0; index_tt_in_tile < tt_size; ++index_tt_in_tile)
+          ptr2->transfer[ptr2->tile_tt[index_tile][index_tt_in_tile]][index_k1][index_k2]
+            = tile + index_tt_in_tile*k_size;
+
+        #pragma omp atomic
+        ptr2->count_allocated_transfers += tt_size * k_size;
+        count += tt_size * k_size;
+
+      } // end of for(index_k2)
+    } // end of for(index_tile)
+  }
   
   /* Print some debug information on memory consumption */
   if (ptr2->transfer2_verbose > 2) {
-    printf("     * allocated ~ %.2f MB in ptr2->transfer (%ld doubles) for index_k1=%d; its size is now ~ %.3g MB;\n",
-      count*sizeof(double)/1e6, count, index_k1, ptr2->count_allocated_transfers*sizeof(double)/1e6);
+    printf("     * allocated ~ %.2f MB in ptr2->transfer (%ld %ss) for index_k1=%d; its size is now ~ %.3g MB;\n",
+      count*sizeof(song_storage)/1e6, count, _SONG_STORAGE_TYPE_, index_k1, ptr2->count_allocated_transfers*sizeof(song_storage)/1e6);
   }
 
   /* We succesfully allocated the k1 level of ptr2->transfer */
@@ -3062,6 +5225,43 @@ int transfer2_free_type_level(
 
 
 
+/**
+ * Free the transfer functions of a group of transfer types loaded with
+ * transfer2_load_tile_from_disk().
+ */
+int transfer2_free_tile_level(
+     struct perturbs2 * ppt2,
+     struct transfers2 * ptr2,
+     int index_tile
+     )
+{
+
+  int tt_size = ptr2->tile_tt_size[index_tile];
+  int * tile_tt = ptr2->tile_tt[index_tile];
+
+  if (tt_size == 0)
+    return _SUCCESS_;
+
+  /* The first type in the group points to the beginning of each tile */
+  for (int index_k1=0; index_k1<ppt2->k_size; ++index_k1)
+    for (int index_k2=0; index_k2<=index_k1; ++index_k2)
+      free(ptr2->transfer[tile_tt[0]][index_k1][index_k2]);
+
+  for (int index_tt_in_tile=0; index_tt_in_tile < tt_size; ++index_tt_in_tile) {
+
+    for (int index_k1=0; index_k1<ppt2->k_size; ++index_k1)
+      free(ptr2->transfer[tile_tt[index_tt_in_tile]][index_k1]);
+
+    free(ptr2->transfer[tile_tt[index_tt_in_tile]]);
+  }
+
+  return _SUCCESS_;
+
+}
+
+
+
+
 /**
  * Free all levels beyond the k1 level of the transfer functions array.
  */
@@ -3082,10 +5282,27 @@ int transfer2_free_k1_level(
 
   long int count = 0;
 
+  /* In the tiles layout, the k level of the first type of each group points to the beginning
+  of the tile */
+  if (ptr2->transfers_layout == tile_transfers_layout) {
+    for (int index_tile=0; index_tile<ptr2->tiles_size; ++index_tile) {
+      if (ptr2->tile_tt_size[index_tile] == 0)
+        continue;
+      for(int index_k2=0; index_k2<=index_k1; ++index_k2) {
+        free(ptr2->transfer[ptr2->tile_tt[index_tile][0]][index_k1][index_k2]);
+        count += ptr2->tile_tt_size[index_tile] * ptr2->k_size_k1k2[index_k1][index_k2];
+      }
+    }
+  }
+
   for (int index_tt = 0; index_tt < ptr2->tt2_size; index_tt++) {
-    for(int index_k2=0; index_k2<=index_k1; ++index_k2) {
-      free(ptr2->transfer[index_tt][index_k1][index_k2]);
-      count += ptr2->k_size_k1k2[index_k1][index_k2];
+
+    if ((ptr2->transfers_layout == type_transfers_layout)
+    && ((ptr2->transfers_on_disk == NULL) || (ptr2->transfers_on_disk[index_tt] == _FALSE_))) {
+      for(int index_k2=0; index_k2<=index_k1; ++index_k2) {
+        free(ptr2->transfer[index_tt][index_k1][index_k2]);
+        count += ptr2->k_size_k1k2[index_k1][index_k2];
+      }
     }
 
     free(ptr2->transfer[index_tt][index_k1]);
@@ -3093,8 +5310,8 @@ int transfer2_free_k1_level(
 
   /* Print some debug information on memory consumption */
   if (ptr2->transfer2_verbose > 2)
-    printf("     * freed ~ %.2f MB from ptr2->transfer (%ld doubles) for index_k1=%d\n",
-      count*sizeof(double)/1e6, count, index_k1);
+    printf("     * freed ~ %.2f MB from ptr2->transfer (%ld %ss) for index_k1=%d\n",
+      count*sizeof(song_storage)/1e6, count, _SONG_STORAGE_TYPE_, index_k1);
 
   /* We succesfully freed the k1 level of ptr2->transfer */
   ptr2->has_allocated_transfers[index_k1] = _FALSE_;